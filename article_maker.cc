@@ -776,7 +776,7 @@ ArticleRequest::ArticleRequest(
     word( phrase.phrase ), group( group_ ), contexts( contexts_ ),
     activeDicts( activeDicts_ ),
     altsDone( false ), bodyDone( false ), foundAnyDefinitions( false ),
-    closePrevSpan( false )
+    closePrevSpan( false ), fuzzySearchDone( false )
 ,   articleSizeLimit( sizeLimit )
 ,   needExpandOptionalParts( needExpandOptionalParts_ )
 ,   ignoreDiacritics( ignoreDiacritics_ )
@@ -1134,6 +1134,17 @@ void ArticleRequest::stemmedSearchFinished()
 
   WordFinder::SearchResults sr = stemmedWordFinder->getResults();
 
+  if ( sr.empty() && !fuzzySearchDone )
+  {
+    // No forms of the word were found, so it may be misspelled. Look for the
+    // headwords close to it, which finish here as well.
+    fuzzySearchDone = true;
+
+    stemmedWordFinder->fuzzyMatch( word, activeDicts );
+
+    return;
+  }
+
   string footer;
 
   bool continueMatching = false;
@@ -132,6 +132,8 @@ class ArticleRequest: public Dictionary::DataRequest
   bool closePrevSpan; // Indicates whether the last opened article span is to
                       // be closed after the article ends.
   sptr< WordFinder > stemmedWordFinder; // Used when there're no results
+  bool fuzzySearchDone; // The stemmed search found nothing, so it was
+                        // followed by the fuzzy one
 
   /// A sequence of words and spacings between them, including the initial
   /// spacing before the first word and the final spacing after the last word.
@@ -59,7 +59,7 @@ namespace
   enum
   {
     Signature = 0x584c4742, // BGLX on little-endian, XLGB on big-endian
-    CurrentFormatVersion = 19 + BtreeIndexing::FormatVersion
+    CurrentFormatVersion = 19 + BtreeIndexing::FormatVersion + ChunkedStorage::PreferredCodec
   };
 
   struct IdxHeader
@@ -332,15 +332,15 @@ namespace
 
         // Try loading icon now
 
-        vector< char > chunk;
+        QByteArray chunk;
 
         Mutex::Lock _( idxMutex );
 
-        char * iconData = chunks.getBlock( idxHeader.iconAddress, chunk );
+        char const * iconData = chunks.getBlock( idxHeader.iconAddress, chunk );
 
         QImage img;
 
-        if (img.loadFromData( ( unsigned char *) iconData, idxHeader.iconSize  ) )
+        if (img.loadFromData( ( unsigned char const *) iconData, idxHeader.iconSize  ) )
         {
           // Load successful
 
@@ -375,11 +375,11 @@ namespace
                                    string & displayedHeadword,
                                    string & articleText )
   {
-    vector< char > chunk;
+    QByteArray chunk;
 
     Mutex::Lock _( idxMutex );
 
-    char * articleData = chunks.getBlock( offset, chunk );
+    char const * articleData = chunks.getBlock( offset, chunk );
 
     headword = articleData;
 
@@ -400,8 +400,8 @@ namespace
     else
     {
       Mutex::Lock _( idxMutex );
-      vector< char > chunk;
-      char * dictDescription = chunks.getBlock( idxHeader.descriptionAddress, chunk );
+      QByteArray chunk;
+      char const * dictDescription = chunks.getBlock( idxHeader.descriptionAddress, chunk );
       string str( dictDescription );
       if( !str.empty() )
         dictionaryDescription += QString( QObject::tr( "Copyright: %1%2" ) )
@@ -757,19 +757,10 @@ void BglArticleRequest::run()
     return;
   }
 
-  vector< WordArticleLink > chain = dict.findArticles( word, ignoreDiacritics );
+  vector< WordArticleLink > chain = dict.findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   static Language::Id hebrew = LangCoder::code2toInt( "he" ); // Hebrew support
 
-  for( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-
-    vector< WordArticleLink > altChain = dict.findArticles( alts[ x ], ignoreDiacritics );
-
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
-
   multimap< wstring, pair< string, string > > mainArticles, alternateArticles;
 
   set< uint32_t > articlesIncluded; // Some synonims make it that the articles
@@ -1292,7 +1283,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
         // We use this buffer to decode utf8 into it.
         vector< wchar > wcharBuffer;
 
-        ChunkedStorage::Writer chunks( idx );
+        ChunkedStorage::Writer chunks( idx, ChunkedStorage::PreferredCodec );
 
         uint32_t articleCount = 0, wordCount = 0;
 
@@ -7,12 +7,24 @@
 #include <QRunnable>
 #include <QThreadPool>
 #include <QSemaphore>
+#include <QCache>
+#include <QHash>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QTemporaryFile>
+#include <QDir>
+#include <QMutex>
+#include <QWaitCondition>
+#include <deque>
+#include <iterator>
+#include <set>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
 #include "gddebug.hh"
 #include "wstring_qt.hh"
 #include "qt4x5.hh"
+#include "fsencoding.hh"
 
 #if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
 #include <QRegularExpression>
@@ -49,1391 +61,4995 @@ using std::pair;
 enum
 {
   BtreeMinElements = 64,
-  BtreeMaxElements = 8192
-};
+  BtreeMaxElements = 8192,
+  DefaultNodeCacheSize = 32 * 1024 * 1024,
 
-BtreeIndex::BtreeIndex():
-  idxFile( 0 ), rootNodeLoaded( false )
-{
-}
+  /// A chain won't get more middle matches (see isMiddleMatch()) once it has
+  /// this many links.
+  MaxMiddleMatches = 1024,
 
-BtreeDictionary::BtreeDictionary( string const & id,
-                                  vector< string > const & dictionaryFiles ):
-  Dictionary::Class( id, dictionaryFiles )
-{
-}
+  /// The first uint32_t of the leaves in the searchable format. For the
+  /// nodes it is 0xffffFFFF, and for the regular leaves, the entry count.
+  SearchableLeafMarker = 0xffffFFFE,
 
-string const & BtreeDictionary::ensureInitDone()
-{
-  static string empty;
+  /// Every this many entries, the searchable leaves, once read, have their
+  /// key in full and recorded in the slot directory.
+  SearchableLeafRestartInterval = 16,
 
-  return empty;
-}
+  /// The byte each link of a stored searchable leaf begins with holds the
+  /// shared prefix length, up to SearchableLeafMaxShared, and is flagged with
+  /// SearchableLeafFirstLink when the link starts a chain.
+  SearchableLeafMaxShared = 0x7F,
+  SearchableLeafFirstLink = 0x80,
 
-void BtreeIndex::openIndex( IndexInfo const & indexInfo,
-                            File::Class & file, Mutex & mutex )
-{
-  indexNodeSize = indexInfo.btreeMaxElements;
-  rootOffset = indexInfo.rootOffset;
+  /// The blocks stored along with the tree which are neither nodes nor leaves
+  /// start with a marker not lower than this one.
+  AuxBlockMarkerFirst = 0xffffFF00,
 
-  idxFile = &file;
-  idxFileMutex = &mutex;
+  /// The first uint32_t of the index directory. It is followed by the number
+  /// of the parts listed, then by their offsets, then by their tags.
+  IndexDirectoryMarker = 0xffffFFFD,
 
-  rootNodeLoaded = false;
-  rootNode.clear();
-}
+  /// The first uint32_t of the Bloom filter block. It is followed by the
+  /// number of hashes, the number of blocks, and then by the blocks.
+  BloomFilterMarker = 0xffffFFFC,
 
-vector< WordArticleLink > BtreeIndex::findArticles( wstring const & word, bool ignoreDiacritics )
-{
-  vector< WordArticleLink > result;
+  /// Each key sets this many bits within a single block of the filter
+  BloomFilterHashes = 7,
+  BloomFilterBitsPerKey = 10,
+  BloomFilterBlockSize = 64, // In bytes, a typical cache line
 
-  try
-  {
-    wstring folded = Folding::apply( word );
-    if( folded.empty() )
-      folded = Folding::applyWhitespaceOnly( word );
+  /// The first uint32_t of the trigram index block. See TrigramHeader.
+  TrigramIndexMarker = 0xffffFFFA,
 
-    bool exactMatch;
+  /// The first uint32_t of the blocks holding the trigrams' posting lists.
+  /// The lists follow it, each being the varint deltas between the
+  /// ordinals of the keys listed.
+  TrigramPostingsMarker = 0xffffFFF9,
 
-    vector< char > leaf;
-    uint32_t nextLeaf;
+  /// The posting lists are packed into the blocks of about this size. The
+  /// ones larger than that get a block of their own.
+  TrigramBlockSize = 64 * 1024,
 
-    char const * leafEnd;
+  /// The first uint32_t of the offset map block. See OffsetMapHeader.
+  OffsetMapMarker = 0xffffFFF8,
 
-    char const * chainOffset = findChainOffsetExactOrPrefix( folded, exactMatch,
-                                                             leaf, nextLeaf,
-                                                             leafEnd );
+  /// The first uint32_t of the blocks holding the OffsetMapEntry records
+  OffsetMapEntriesMarker = 0xffffFFF7,
 
-    if ( chainOffset && exactMatch )
-    {
-      result = readChain( chainOffset );
+  /// The first uint32_t of the blocks holding the pooled headwords. The
+  /// headwords follow it, utf8-encoded and zero-terminated.
+  OffsetMapHeadwordsMarker = 0xffffFFF6,
 
-      antialias( word, result, ignoreDiacritics );
-    }
-  }
-  catch( std::exception & e )
-  {
-    gdWarning( "Articles searching failed, error: %s\n", e.what() );
-    result.clear();
-  }
-  catch(...)
-  {
-    qWarning( "Articles searching failed\n" );
-    result.clear();
-  }
+  /// Each block of the offset map has this many entries, save for the last
+  /// one
+  OffsetMapBlockEntries = 4096,
 
-  return result;
-}
+  /// The headwords are packed into the blocks of about this size
+  OffsetMapBlockSize = 32 * 1024,
 
-class BtreeWordSearchRunnable: public QRunnable
+  /// The builders of the optional parts of the index keep about this much
+  /// of their data in memory each. The rest is spilled to temporary files.
+  ExtraPartMemoryLimit = 32 * 1024 * 1024
+};
+
+/// Tags of the parts of the index listed in its directory. Unknown parts
+/// are ignored.
+enum IndexPart
 {
-  BtreeWordSearchRequest & r;
-  QSemaphore & hasExited;
-  
-public:
+  RootNodePart = 1,
+  BloomFilterPart = 2,
+  TrigramIndexPart = 3,
+  OffsetMapPart = 4
+};
 
-  BtreeWordSearchRunnable( BtreeWordSearchRequest & r_,
-                           QSemaphore & hasExited_ ): r( r_ ),
-                                                      hasExited( hasExited_ )
-  {}
+/// The beginning of the trigram index block. It is followed by the offsets
+/// of all the leaves, then by the offsets of all the posting blocks, then by
+/// the ordinals of the leaves' first keys, and then by the TrigramEntry
+/// records, sorted by their trigrams.
+struct TrigramHeader
+{
+  uint32_t marker; // TrigramIndexMarker
+  uint32_t keys; // Number of the keys in the index
+  uint32_t leaves; // Number of the leaves
+  uint32_t blocks; // Number of the posting blocks
+  uint32_t trigrams; // Number of the trigrams
+};
 
-  ~BtreeWordSearchRunnable()
-  {
-    hasExited.release();
-  }
-  
-  virtual void run();
+/// Locates the posting list of a trigram, which lists the ordinals of the
+/// keys having it
+struct TrigramEntry
+{
+  uint32_t trigramHigh, trigramLow; // See makeTrigram()
+  uint32_t block; // Number of the posting block
+  uint32_t offset; // Offset of the list in that block
+  uint32_t count; // Number of the keys in the list
 };
 
-void BtreeWordSearchRunnable::run()
+/// The beginning of the offset map block. It is followed by the offsets of
+/// all the entry blocks, then by the offsets of all the headword blocks,
+/// then by the first article offset of each entry block, and then by the
+/// number of the first headword of each headword block.
+struct OffsetMapHeader
 {
-  r.run();
-}
+  uint32_t marker; // OffsetMapMarker
+  uint32_t entries; // Number of the articles mapped
+  uint32_t entryBlocks; // Number of the entry blocks
+  uint32_t headwords; // Number of the headwords pooled
+  uint32_t headwordBlocks; // Number of the headword blocks
+};
 
-BtreeWordSearchRequest::BtreeWordSearchRequest( BtreeDictionary & dict_,
-                                                wstring const & str_,
-                                                unsigned minLength_,
-                                                int maxSuffixVariation_,
-                                                bool allowMiddleMatches_,
-                                                unsigned long maxResults_,
-                                                bool startRunnable ):
-  dict( dict_ ), str( str_ ),
-  maxResults( maxResults_ ),
-  minLength( minLength_ ),
-  maxSuffixVariation( maxSuffixVariation_ ),
-  allowMiddleMatches( allowMiddleMatches_ )
+/// Maps an article to its headword. The entries are sorted by the article
+/// offsets. The headwords are numbered in the order the index lists them,
+/// and the articles listed one after another under the same headword share
+/// its number.
+struct OffsetMapEntry
 {
-  if( startRunnable )
+  uint32_t articleOffset;
+  uint32_t headword;
+};
+
+/// Hashes the folded utf8 key for the Bloom filter. Since the filters are
+/// stored in the index files, the hash must never change.
+static quint64 hashKey( char const * key, size_t size )
+{
+  // FNV-1a, followed by the splitmix64 finalizer to spread the bits
+  quint64 h = Q_UINT64_C( 14695981039346656037 );
+
+  for( size_t x = 0; x < size; ++x )
   {
-    QThreadPool::globalInstance()->start(
-      new BtreeWordSearchRunnable( *this, hasExited ) );
+    h ^= (unsigned char) key[ x ];
+    h *= Q_UINT64_C( 1099511628211 );
   }
+
+  h ^= h >> 30;
+  h *= Q_UINT64_C( 0xbf58476d1ce4e5b9 );
+  h ^= h >> 27;
+  h *= Q_UINT64_C( 0x94d049bb133111eb );
+  h ^= h >> 31;
+
+  return h;
 }
 
-void BtreeWordSearchRequest::findMatches()
+/// Calls op( byteIndex, bitMask ) for each of the bits the given hash
+/// corresponds to in the Bloom filter with the given number of blocks.
+/// The bits all fall in the same block, so a lookup touches a single
+/// cache line.
+template< class Op >
+static bool forEachBloomBit( quint64 hash, uint32_t hashes, uint32_t blocks, Op & op )
 {
-  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-  {
-    finish();
-    return;
-  }
+  size_t blockStart = (size_t)( hash % blocks ) * BloomFilterBlockSize;
 
-  if ( dict.ensureInitDone().size() )
+  for( uint32_t x = 0; x < hashes; ++x )
   {
-    setErrorString( QString::fromUtf8( dict.ensureInitDone().c_str() ) );
-    finish();
-    return;
+    // Derive further bits with a simple LCG step
+    hash = hash * Q_UINT64_C( 6364136223846793005 ) + Q_UINT64_C( 1442695040888963407 );
+
+    unsigned bit = (unsigned)( hash >> 55 ); // 0..511
+
+    if ( !op( blockStart + bit / 8, (unsigned char)( 1 << ( bit % 8 ) ) ) )
+      return false;
   }
-  
-#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
-  QRegularExpression regexp;
-#else
-  QRegExp regexp;
-#endif
-  bool useWildcards = false;
-  if( allowMiddleMatches )
-    useWildcards = ( str.find( '*' ) != wstring::npos ||
-                     str.find( '?' ) != wstring::npos ||
-                     str.find( '[' ) != wstring::npos ||
-                     str.find( ']' ) != wstring::npos );
 
-  wstring folded = Folding::apply( str );
+  return true;
+}
 
-  int minMatchLength = 0;
+/// A leaf in the searchable format is stored as SearchableLeafMarker, the
+/// number of the chains, and then the links of all the chains, one after
+/// another. Each link is as in the regular leaves, but its headword is
+/// front-coded: the link begins with a byte holding the prefix length shared
+/// with the previous headword, flagged with SearchableLeafFirstLink when the
+/// link starts a chain, and only the rest of the headword follows. Neither
+/// the chain sizes nor the keys are stored, since the keys are the folded
+/// first headwords of the chains.
+///
+/// Once read, the leaf is expanded by expandSearchableLeaf(), and then starts
+/// with this header. It is followed by the slot directory, which has one
+/// SearchableLeafSlot for each restart point, then by the front-coded keys,
+/// each being its prefix length shared with the previous key as a byte
+/// followed by the zero-terminated rest of it, and then by the chains, which
+/// are exactly the same as in the regular leaves.
+struct SearchableLeafHeader
+{
+  uint32_t marker; // SearchableLeafMarker
+  uint32_t entries;
+  uint32_t restartInterval;
+  uint32_t keysSize;
+};
 
-  if( useWildcards )
-  {
-#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
-    regexp.setPattern( wildcardsToRegexp( gd::toQString( Folding::applyDiacriticsOnly( Folding::applySimpleCaseOnly( str ) ) ) ) );
-    if( !regexp.isValid() )
-      regexp.setPattern( QRegularExpression::escape( regexp.pattern() ) );
-    regexp.setPatternOptions( QRegularExpression::CaseInsensitiveOption );
-#else
-    regexp.setPattern( gd::toQString( Folding::applyDiacriticsOnly( Folding::applySimpleCaseOnly( str ) ) ) );
-    regexp.setPatternSyntax( QRegExp::WildcardUnix );
-    regexp.setCaseSensitivity( Qt::CaseInsensitive );
-#endif
+struct SearchableLeafSlot
+{
+  uint32_t keyOffset; // Relative to the beginning of the keys
+  uint32_t chainOffset; // Relative to the beginning of the chains
+};
 
-    bool bNoLetters = folded.empty();
-    wstring foldedWithWildcards;
+/// Returns the number of chains in the given leaf, whichever format it is in.
+static uint32_t leafEntryCount( char const * leaf )
+{
+  uint32_t header[ 2 ];
 
-    if( bNoLetters )
-      foldedWithWildcards = Folding::applyWhitespaceOnly( str );
-    else
-      foldedWithWildcards = Folding::apply( str, useWildcards );
+  memcpy( header, leaf, sizeof( header[ 0 ] ) );
 
-    // Calculate minimum match length
+  if ( header[ 0 ] != SearchableLeafMarker )
+    return header[ 0 ];
 
-    bool insideSet = false;
-    bool escaped = false;
-    for( wstring::size_type x = 0; x < foldedWithWildcards.size(); x++ )
-    {
-      wchar ch = foldedWithWildcards[ x ];
+  memcpy( header, leaf, sizeof( header ) );
 
-      if( ch == L'\\' && !escaped )
-      {
-        escaped = true;
-        continue;
-      }
+  return header[ 1 ];
+}
 
-      if( ch == L']' && !escaped )
-      {
-        insideSet = false;
-        continue;
-      }
+/// Returns the pointer to the first chain of the given leaf, whichever format
+/// it is in.
+static char const * firstLeafChain( char const * leaf )
+{
+  uint32_t marker;
 
-      if( insideSet )
-      {
-        escaped = false;
-        continue;
-      }
+  memcpy( &marker, leaf, sizeof( marker ) );
 
-      if( ch == L'[' && !escaped )
-      {
-        minMatchLength += 1;
-        insideSet = true;
-        continue;
-      }
+  if ( marker != SearchableLeafMarker )
+    return leaf + sizeof( uint32_t );
 
-      if( ch == L'*' && !escaped )
-        continue;
+  SearchableLeafHeader header;
 
-      escaped = false;
-      minMatchLength += 1;
-    }
+  memcpy( &header, leaf, sizeof( header ) );
 
-    // Fill first match chars
+  uint32_t groups = ( header.entries + header.restartInterval - 1 ) / header.restartInterval;
 
-    folded.clear();
-    folded.reserve( foldedWithWildcards.size() );
-    escaped = false;
-    for( wstring::size_type x = 0; x < foldedWithWildcards.size(); x++ )
-    {
-      wchar ch = foldedWithWildcards[ x ];
+  return leaf + sizeof( header ) + groups * sizeof( SearchableLeafSlot ) + header.keysSize;
+}
 
-      if( escaped )
-      {
-        if( bNoLetters || ( ch != L'*' && ch != L'?' && ch != L'[' && ch != L']' ) )
-          folded.push_back( ch );
-        escaped = false;
-        continue;
-      }
+/// Looks the target up in a leaf stored in the searchable format. Returns the
+/// chain which matches the target, setting exactMatch, or the first chain
+/// larger than the target, or 0 if all the chains in the leaf are smaller.
+static char const * findInSearchableLeaf( string const & target,
+                                          char const * leaf,
+                                          bool & exactMatch )
+{
+  SearchableLeafHeader header;
 
-      if( ch == L'\\' )
-      {
-        if( bNoLetters || folded.empty() )
-        {
-          escaped = true;
-          continue;
-        }
-        else
-          break;
-      }
+  memcpy( &header, leaf, sizeof( header ) );
 
-      if( ch == '*' || ch == '?' || ch == '[' || ch == ']' )
-        break;
+  if ( !header.restartInterval )
+    throw exCorruptedChainData();
 
-      folded.push_back( ch );
-    }
-  }
-  else
-  {
-    if( folded.empty() )
-      folded = Folding::applyWhitespaceOnly( str );
-  }
+  uint32_t groups = ( header.entries + header.restartInterval - 1 ) / header.restartInterval;
 
-  int initialFoldedSize = folded.size();
+  char const * restartSlots = leaf + sizeof( header );
+  char const * keys = restartSlots + groups * sizeof( SearchableLeafSlot );
+  char const * chains = keys + header.keysSize;
 
-  int charsLeftToChop = 0;
+  SearchableLeafSlot slot;
 
-  if ( maxSuffixVariation >= 0 )
+  // Find the number of groups which begin with a key not larger than the
+  // target. The first key of each group is stored in full, after a zero
+  // shared prefix length byte.
+
+  uint32_t left = 0, right = groups;
+
+  while( left < right )
   {
-    charsLeftToChop = initialFoldedSize - (int)minLength;
+    uint32_t middle = left + ( right - left ) / 2;
 
-    if ( charsLeftToChop < 0 )
-      charsLeftToChop = 0;
+    memcpy( &slot, restartSlots + middle * sizeof( slot ), sizeof( slot ) );
+
+    if ( strcmp( keys + slot.keyOffset + 1, target.c_str() ) <= 0 )
+      left = middle + 1;
     else
-    if ( charsLeftToChop > maxSuffixVariation )
-      charsLeftToChop = maxSuffixVariation;
+      right = middle;
   }
 
-  try
+  if ( !left )
   {
-    for( ; ; )
-    {
-      bool exactMatch;
-      vector< char > leaf;
-      uint32_t nextLeaf;
-      char const * leafEnd;
+    // The target is smaller than any key here, so the first chain is the
+    // closest possible prefix match.
+    return chains;
+  }
 
-      char const * chainOffset = dict.findChainOffsetExactOrPrefix( folded, exactMatch,
-                                                                    leaf, nextLeaf,
-                                                                    leafEnd );
+  // Now scan the group the target falls into
 
-      if ( chainOffset )
-      for( ; ; )
-      {
-        if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-          break;
+  uint32_t group = left - 1;
 
-        //DPRINTF( "offset = %u, size = %u\n", chainOffset - &leaf.front(), leaf.size() );
+  memcpy( &slot, restartSlots + group * sizeof( slot ), sizeof( slot ) );
 
-        vector< WordArticleLink > chain = dict.readChain( chainOffset );
+  char const * keyPtr = keys + slot.keyOffset;
+  char const * chain = chains + slot.chainOffset;
 
-        wstring chainHead = Utf8::decode( chain[ 0 ].word );
+  uint32_t entry = group * header.restartInterval;
+  uint32_t groupEnd = entry + header.restartInterval;
 
-        wstring resultFolded = Folding::apply( chainHead );
-        if( resultFolded.empty() )
-          resultFolded = Folding::applyWhitespaceOnly( chainHead );
+  if ( groupEnd > header.entries )
+    groupEnd = header.entries;
 
-        if ( ( useWildcards && folded.empty() ) ||
-             ( resultFolded.size() >= folded.size()
-               && !resultFolded.compare( 0, folded.size(), folded ) ) )
-        {
-          // Exact or prefix match
+  string key;
 
-          Mutex::Lock _( dataMutex );
+  for( ; entry < groupEnd; ++entry )
+  {
+    unsigned shared = (unsigned char) *keyPtr++;
 
-          for( unsigned x = 0; x < chain.size(); ++x )
-          {
-            if( useWildcards )
-            {
-              wstring word = Utf8::decode( chain[ x ].prefix + chain[ x ].word );
-              wstring result = Folding::applyDiacriticsOnly( word );
-#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
-              if( result.size() >= (wstring::size_type)minMatchLength )
-              {
-                QRegularExpressionMatch match = regexp.match( gd::toQString( result ) );
-                if( match.hasMatch() && match.capturedStart() == 0 )
-                {
-                  addMatch( word );
-                }
-              }
-#else
-              if( result.size() >= (wstring::size_type)minMatchLength
-                  && regexp.indexIn( gd::toQString( result ) ) == 0
-                  && regexp.matchedLength() >= minMatchLength )
-              {
-                addMatch( word );
-              }
-#endif
-            }
-            else
-            {
-              // Skip middle matches, if requested. If suffix variation is specified,
-              // make sure the string isn't larger than requested.
-              if ( ( allowMiddleMatches || Folding::apply( Utf8::decode( chain[ x ].prefix ) ).empty() ) &&
-                   ( maxSuffixVariation < 0 || (int)resultFolded.size() - initialFoldedSize <= maxSuffixVariation ) )
-                  addMatch( Utf8::decode( chain[ x ].prefix + chain[ x ].word ) );
-            }
-          }
+    if ( shared > key.size() )
+      throw exCorruptedChainData();
 
-          if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-            break;
+    key.resize( shared );
+    key.append( keyPtr );
 
-          if ( matches.size() >= maxResults )
-          {
-            // For now we actually allow more than maxResults if the last
-            // chain yield more than one result. That's ok and maybe even more
-            // desirable.
-            break;
-          }
-        }
-        else
-          // Neither exact nor a prefix match, end this
-          break;
+    keyPtr += strlen( keyPtr ) + 1;
 
-        // Fetch new leaf if we're out of chains here
+    int compareResult = key.compare( target );
 
-        if ( chainOffset >= leafEnd )
-        {
-          // We're past the current leaf, fetch the next one
+    if ( !compareResult )
+    {
+      exactMatch = true;
+      return chain;
+    }
 
-          //DPRINTF( "advancing\n" );
+    if ( compareResult > 0 )
+      return chain;
 
-          if ( nextLeaf )
-          {
-            Mutex::Lock _( *dict.idxFileMutex );
+    uint32_t chainSize;
 
-            dict.readNode( nextLeaf, leaf );
-            leafEnd = &leaf.front() + leaf.size();
+    memcpy( &chainSize, chain, sizeof( uint32_t ) );
 
-            nextLeaf = dict.idxFile->read< uint32_t >();
-            chainOffset = &leaf.front() + sizeof( uint32_t );
+    chain += sizeof( uint32_t ) + chainSize;
+  }
 
-            uint32_t leafEntries = *(uint32_t *)&leaf.front();
+  // All the keys of the group are smaller. The next group begins with a
+  // larger key, so the next chain is the one, if there is any.
+  return entry < header.entries ? chain : 0;
+}
 
-            if ( leafEntries == 0xffffFFFF )
-            {
-              //DPRINTF( "bah!\n" );
-              exit( 1 );
-            }
-          }
-          else
-            break; // That was the last leaf
-        }
-      }
+/// Searches the non-empty leaf for the chain of the target given. Returns the
+/// chain matching exactly, or the first chain larger than the target, or 0 if
+/// the target is larger than anything in the leaf. The targetUtf8 is only
+/// needed for the searchable leaves and is filled in lazily.
+static char const * findChainInLeaf( wstring const & target, string & targetUtf8,
+                                     char const * leaf, bool & exactMatch,
+                                     vector< wchar > & wcharBuffer )
+{
+  exactMatch = false;
 
-      if ( charsLeftToChop && !Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-      {
-        --charsLeftToChop;
-        folded.resize( folded.size() - 1 );
-      }
-      else
-        break;
-    }
+  uint32_t leafEntries = *(uint32_t *)leaf;
+
+  if ( leafEntries == SearchableLeafMarker )
+  {
+    // The leaf stores its keys, so we binary search them directly,
+    // without folding each headword we test against.
+
+    if ( targetUtf8.empty() )
+      targetUtf8 = Utf8::encode( target );
+
+    return findInSearchableLeaf( targetUtf8, leaf, exactMatch );
   }
-  catch( std::exception & e )
+
+  // Build an array containing all chain pointers
+  char const * ptr = leaf + sizeof( uint32_t );
+
+  uint32_t chainSize;
+
+  vector< char const * > chainOffsets( leafEntries );
+
   {
-    qWarning( "Index searching failed: \"%s\", error: %s\n",
-              dict.getName().c_str(), e.what() );
+    char const ** nextOffset = &chainOffsets.front();
+
+    while( leafEntries-- )
+    {
+      *nextOffset++ = ptr;
+
+      memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+
+      ptr += sizeof( uint32_t ) + chainSize;
+    }
   }
-  catch(...)
+
+  // Now do a binary search in it, aiming to find where our target
+  // string lands.
+
+  char const ** window = &chainOffsets.front();
+  unsigned windowSize = chainOffsets.size();
+
+  for( ; ; )
   {
-    gdWarning( "Index searching failed: \"%s\"\n", dict.getName().c_str() );
+    char const ** chainToCheck = window + windowSize/2;
+    ptr = *chainToCheck;
+
+    memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+    ptr += sizeof( uint32_t );
+
+    size_t wordSize = strlen( ptr );
+
+    if ( wcharBuffer.size() <= wordSize )
+      wcharBuffer.resize( wordSize + 1 );
+
+    long result = Utf8::decode( ptr, wordSize, &wcharBuffer.front() );
+
+    if ( result < 0 )
+      throw Utf8::exCantDecode( ptr );
+
+    wcharBuffer[ result ] = 0;
+
+    wstring foldedWord = Folding::apply( &wcharBuffer.front() );
+    if( foldedWord.empty() )
+      foldedWord = Folding::applyWhitespaceOnly( &wcharBuffer.front() );
+
+    int compareResult = target.compare( foldedWord );
+
+    if ( !compareResult )
+    {
+      // Exact match -- return and be done
+      exactMatch = true;
+
+      return ptr - sizeof( uint32_t );
+    }
+    else
+    if ( compareResult < 0 )
+    {
+      // The target string is smaller than the current one.
+      // Go to the first half
+
+      windowSize /= 2;
+
+      if ( !windowSize )
+      {
+        // That finishes our search. Since our target string
+        // landed before the last tested chain, we return a possible
+        // prefix match against that chain.
+        return ptr - sizeof( uint32_t );
+      }
+    }
+    else
+    {
+      // The target string is larger than the current one.
+      // Go to the second half
+
+      windowSize -= windowSize/2 + 1;
+
+      if ( !windowSize )
+      {
+        // That finishes our search. Since our target string
+        // landed after the last tested chain, we return the next
+        // chain, if there's one in this leaf.
+        if ( chainToCheck == &chainOffsets.back() )
+          return 0;
+        else
+          return chainToCheck[ 1 ];
+      }
+
+      window = chainToCheck + 1;
+    }
   }
 }
 
-void BtreeWordSearchRequest::run()
+/// Reads a varint of a posting list, making sure it doesn't run past its end
+static uint32_t readVarint( unsigned char const * & ptr, unsigned char const * end )
 {
-  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-  {
-    finish();
-    return;
-  }
+  uint32_t result = 0;
 
-  if ( dict.ensureInitDone().size() )
+  for( unsigned shift = 0; ; shift += 7 )
   {
-    setErrorString( QString::fromUtf8( dict.ensureInitDone().c_str() ) );
-    finish();
-    return;
-  }
+    if ( ptr == end || shift > 28 )
+      throw exCorruptedChainData();
 
-  findMatches();
+    unsigned char byte = *ptr++;
 
-  finish();
+    result |= (uint32_t)( byte & 0x7F ) << shift;
+
+    if ( !( byte & 0x80 ) )
+      return result;
+  }
 }
 
-BtreeWordSearchRequest::~BtreeWordSearchRequest()
+/// Packs three characters into a trigram, 21 bits each
+static quint64 makeTrigram( wchar a, wchar b, wchar c )
 {
-  isCancelled.ref();
-  hasExited.acquire();
+  return ( (quint64)( a & 0x1FFFFF ) << 42 ) |
+         ( (quint64)( b & 0x1FFFFF ) << 21 ) |
+         (quint64)( c & 0x1FFFFF );
 }
 
-sptr< Dictionary::WordSearchRequest > BtreeDictionary::prefixMatch(
-  wstring const & str, unsigned long maxResults )
-  THROW_SPEC( std::exception )
+/// Appends all the trigrams of the given folded string, with repetitions
+static void appendTrigrams( wstring const & folded, vector< quint64 > & trigrams )
 {
-  return new BtreeWordSearchRequest( *this, str, 0, -1, true, maxResults );
+  for( size_t x = 2; x < folded.size(); ++x )
+    trigrams.push_back( makeTrigram( folded[ x - 2 ], folded[ x - 1 ], folded[ x ] ) );
 }
 
-sptr< Dictionary::WordSearchRequest > BtreeDictionary::stemmedMatch(
-  wstring const & str, unsigned minLength, unsigned maxSuffixVariation,
-  unsigned long maxResults )
-  THROW_SPEC( std::exception )
+static bool hasFewerPostings( TrigramEntry const & a, TrigramEntry const & b )
 {
-  return new BtreeWordSearchRequest( *this, str, minLength, (int)maxSuffixVariation,
-                                     false, maxResults );
+  return a.count < b.count;
 }
 
-void BtreeIndex::readNode( uint32_t offset, vector< char > & out )
+/// Skips the given number of chains, making sure none of them runs past the
+/// end of the leaf
+static char const * skipChains( char const * chain, char const * leafEnd,
+                                uint32_t count )
 {
-  idxFile->seek( offset );
+  while( count-- )
+  {
+    uint32_t size;
 
-  uint32_t uncompressedSize = idxFile->read< uint32_t >();
-  uint32_t compressedSize = idxFile->read< uint32_t >();
+    if ( chain + sizeof( uint32_t ) > leafEnd )
+      throw exCorruptedChainData();
 
-  //DPRINTF( "%x,%x\n", uncompressedSize, compressedSize );
+    memcpy( &size, chain, sizeof( uint32_t ) );
 
-  out.resize( uncompressedSize );
+    chain += sizeof( uint32_t ) + size;
+  }
+
+  return chain;
+}
 
-  vector< unsigned char > compressedData( compressedSize );
+namespace {
 
-  idxFile->read( &compressedData.front(), compressedData.size() );
+/// A cache of decompressed nodes and leaves, shared by all the indices in
+/// the process. The nodes are keyed by their index file and their offset
+/// in it, and are evicted in the least-recently-used order once the memory
+/// budget is exceeded. The cache is split into several independently locked
+/// shards, so that concurrent lookups rarely wait for each other.
+class NodeCache
+{
+public:
 
-  #ifdef __BTREE_USE_LZO
+  NodeCache()
+  { setMaxSize( DefaultNodeCacheSize ); }
 
-  lzo_uint decompressedLength = out.size();
+  /// Returns the id to be used for the file with the given identity string.
+  /// The same identity always yields the same id.
+  quint32 getFileId( QString const & identity );
 
-  if ( lzo1x_decompress( &compressedData.front(), compressedData.size(),
-                         (unsigned char *)&out.front(), &decompressedLength, 0 )
-       != LZO_E_OK || decompressedLength != out.size() )
-    throw exFailedToDecompressNode();
+  /// Looks the node up. Returns true and fills in the data if it was found.
+  bool find( quint32 fileId, uint32_t offset, QByteArray & data, uint32_t & nextLeaf );
 
-  #else
+  void insert( quint32 fileId, uint32_t offset, QByteArray const & data, uint32_t nextLeaf );
 
-  unsigned long decompressedLength = out.size();
+  void setMaxSize( int bytes );
 
-  if ( uncompress( (unsigned char *)&out.front(),
-                   &decompressedLength,
-                   &compressedData.front(),
-                   compressedData.size() ) != Z_OK ||
-       decompressedLength != out.size() )
-    throw exFailedToDecompressNode();
-  #endif
-}
+private:
 
-char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
-                                                       bool & exactMatch,
-                                                       vector< char > & extLeaf,
-                                                       uint32_t & nextLeaf,
-                                                       char const * & leafEnd )
+  enum
+  {
+    Shards = 16
+  };
+
+  struct Entry
+  {
+    QByteArray data; // Implicitly shared, so handing it out is cheap
+    uint32_t nextLeaf;
+  };
+
+  struct Shard
+  {
+    QMutex mutex;
+    QCache< quint64, Entry > cache;
+  };
+
+  static quint64 makeKey( quint32 fileId, uint32_t offset )
+  { return ( (quint64) fileId << 32 ) | offset; }
+
+  Shard & shardFor( quint64 key )
+  { return shards[ ( key ^ ( key >> 32 ) ^ ( key >> 12 ) ) % Shards ]; }
+
+  Shard shards[ Shards ];
+
+  QMutex fileIdsMutex;
+  QHash< QString, quint32 > fileIds;
+};
+
+quint32 NodeCache::getFileId( QString const & identity )
 {
-  if ( !idxFile )
-    throw exIndexWasNotOpened();
-  
-  Mutex::Lock _( *idxFileMutex );
-  
-  // Lookup the index by traversing the index btree
+  QMutexLocker _( &fileIdsMutex );
 
-  vector< wchar > wcharBuffer;
+  QHash< QString, quint32 >::const_iterator i = fileIds.constFind( identity );
 
-  exactMatch = false;
+  if ( i != fileIds.constEnd() )
+    return *i;
 
-  // Read a node
+  quint32 id = fileIds.size() + 1;
 
-  uint32_t currentNodeOffset = rootOffset;
+  fileIds.insert( identity, id );
 
-  if ( !rootNodeLoaded )
-  {
-    // Time to load our root node. We do it only once, at the first request.
-    readNode( rootOffset, rootNode );
-    rootNodeLoaded = true;
-  }
+  return id;
+}
 
-  char const * leaf = &rootNode.front();
-  leafEnd = leaf + rootNode.size();
+bool NodeCache::find( quint32 fileId, uint32_t offset, QByteArray & data, uint32_t & nextLeaf )
+{
+  quint64 key = makeKey( fileId, offset );
+  Shard & shard = shardFor( key );
 
-  if( target.empty() )
-  {
-    //For empty target string we return first chain in index
-    for( ; ; )
-    {
-      uint32_t leafEntries = *(uint32_t *)leaf;
+  QMutexLocker _( &shard.mutex );
 
-      if ( leafEntries == 0xffffFFFF )
-      {
-        // A node
-        currentNodeOffset = *( (uint32_t *)leaf + 1 );
-        readNode( currentNodeOffset, extLeaf );
-        leaf = &extLeaf.front();
-        leafEnd = leaf + extLeaf.size();
-        nextLeaf = idxFile->read< uint32_t >();
-      }
-      else
-      {
-        // A leaf
-        if( currentNodeOffset == rootOffset )
-        {
-          // Only one leaf in index, there's no next leaf
-          nextLeaf = 0;
-        }
-        if( !leafEntries )
-          return 0;
+  Entry * entry = shard.cache.object( key );
 
-        return leaf + sizeof( uint32_t );
-      }
-    }
-  }
+  if ( !entry )
+    return false;
 
-  for( ; ; )
-  {
-    // Is it a leaf or a node?
+  data = entry->data;
+  nextLeaf = entry->nextLeaf;
 
-    uint32_t leafEntries = *(uint32_t *)leaf;
+  return true;
+}
 
-    if ( leafEntries == 0xffffFFFF )
-    {
-      // A node
+void NodeCache::insert( quint32 fileId, uint32_t offset, QByteArray const & data, uint32_t nextLeaf )
+{
+  Entry * entry = new Entry;
 
-      //DPRINTF( "=>a node\n" );
+  entry->data = data;
+  entry->nextLeaf = nextLeaf;
 
-      uint32_t const * offsets = (uint32_t *)leaf + 1;
+  quint64 key = makeKey( fileId, offset );
+  Shard & shard = shardFor( key );
 
-      char const * ptr = leaf + sizeof( uint32_t ) +
-                         ( indexNodeSize + 1 ) * sizeof( uint32_t );
+  QMutexLocker _( &shard.mutex );
 
-      // ptr now points to a span of zero-separated strings, up to leafEnd.
-      // We find our match using a binary search.
+  // If the node is larger than the whole shard, the cache deletes it at once
+  shard.cache.insert( key, entry, data.size() + sizeof( Entry ) );
+}
 
-      char const * closestString;
+void NodeCache::setMaxSize( int bytes )
+{
+  for( int x = 0; x < Shards; ++x )
+  {
+    QMutexLocker _( &shards[ x ].mutex );
 
-      int compareResult;
+    shards[ x ].cache.setMaxCost( bytes / Shards );
+  }
+}
 
-      char const * window = ptr;
-      unsigned windowSize = leafEnd - ptr;
+NodeCache nodeCache;
 
-      for( ; ; )
-      {  
-        // We boldly shoot in the middle of the whole mess, and then adjust
-        // to the beginning of the string that we've hit.
-        char const * testPoint = window + windowSize/2;
-  
-        closestString = testPoint;
-  
-        while( closestString > ptr && closestString[ -1 ] )
-          --closestString;
-  
-        size_t wordSize = strlen( closestString );
-  
-        if ( wcharBuffer.size() <= wordSize )
-          wcharBuffer.resize( wordSize + 1 );
-  
-        long result = Utf8::decode( closestString, wordSize, &wcharBuffer.front() );
+}
 
-        if ( result < 0 )
-          throw Utf8::exCantDecode( closestString );
-  
-        wcharBuffer[ result ] = 0;
+void setNodeCacheSize( int bytes )
+{
+  nodeCache.setMaxSize( bytes );
+}
 
-        //DPRINTF( "Checking against %s\n", closestString );
+BtreeIndex::BtreeIndex():
+  idxFile( 0 ), idxFileMapping( 0 ), idxFileMappingSize( 0 ), idxFileId( 0 ),
+  trigramIndexOffset( 0 ), offsetMapOffset( 0 )
+{
+}
 
-        compareResult = target.compare( &wcharBuffer.front() );
-  
-        if ( !compareResult )
-        {
-          // The target string matches the current one. Finish the search.
-          break;
-        }
-        if ( compareResult < 0 )
-        {
-          // The target string is smaller than the current one.
-          // Go to the left.
-          windowSize = closestString - window;
+BtreeDictionary::BtreeDictionary( string const & id,
+                                  vector< string > const & dictionaryFiles ):
+  Dictionary::Class( id, dictionaryFiles )
+{
+}
 
-          if ( !windowSize )
-            break;
-        }
-        else
-        {
-          // The target string is larger than the current one.
-          // Go to the right.
-          windowSize -= ( closestString - window )  + wordSize + 1;
-          window = closestString + wordSize + 1;
+string const & BtreeDictionary::ensureInitDone()
+{
+  static string empty;
 
-          if ( !windowSize )
-            break;
-        }
-      }
+  return empty;
+}
 
-      #if 0
-      DPRINTF( "The winner is %s, compareResult = %d\n", closestString, compareResult );
+vector< WordArticleLink > BtreeDictionary::findArticlesWithAlts( wstring const & word,
+                                                                 vector< wstring > const & alts,
+                                                                 bool ignoreDiacritics )
+{
+  vector< wstring > words( 1, word );
+  words.insert( words.end(), alts.begin(), alts.end() );
 
-      if ( closestString != ptr )
-      {
-        char const * left = closestString -1;
+  return findAllArticles( words, ignoreDiacritics );
+}
 
-        while( left != ptr && left[ -1 ] )
-          --left;
+void BtreeIndex::openIndex( IndexInfo const & indexInfo,
+                            File::Class & file, Mutex & mutex, bool mapIndex )
+{
+  indexNodeSize = indexInfo.btreeMaxElements;
+  rootOffset = indexInfo.rootOffset;
 
-        DPRINTF( "To the left: %s\n", left );
-      }
-      else
-        DPRINTF( "To the lest -- nothing\n" );
+  idxFile = &file;
+  idxFileMutex = &mutex;
 
-      char const * right = closestString + strlen( closestString ) + 1;
+  idxFileMapping = 0;
+  idxFileMappingSize = 0;
 
-      if ( right != leafEnd )
-      {
-        DPRINTF( "To the right: %s\n", right );
-      }
-      else
-        DPRINTF( "To the right -- nothing\n" );
-      #endif
+  {
+    Mutex::Lock _( mutex );
 
-      // Now, whatever the outcome (compareResult) is, we need to find
-      // entry number for the closestMatch string.
-       
-      unsigned entry = 0;
+    if ( mapIndex )
+    {
+      idxFileMapping = file.mapAll();
 
-      for( char const * next = ptr; next != closestString;
-           next += strlen( next ) + 1, ++entry ) ;
+      if ( idxFileMapping )
+        idxFileMappingSize = file.mappedSize();
+    }
 
-      // Ok, now check the outcome
+    // The cached nodes are only valid for this very revision of the file,
+    // so the file's size and modification time are a part of its identity.
+    // The time may only have a second's resolution, though, so a rebuild
+    // within the same second is told apart by the hash of the stored root
+    // node, which is read first anyway and lists the keys of the whole tree.
+    QFileInfo fileInfo( file.file().fileName() );
 
-      if ( !compareResult )
-      {
-        // The target string matches the one found.
-        // Go to the right, since it's there where we store such results.
-        currentNodeOffset = offsets[ entry + 1 ];
-      }
-      if ( compareResult < 0 )
-      {
-        // The target string is smaller than the one found.
-        // Go to the left.
-        currentNodeOffset = offsets[ entry ];
-      }
-      else
-      {
-        // The target string is larger than the one found.
-        // Go to the right.
-        currentNodeOffset = offsets[ entry + 1 ];
-      }
+    quint64 rootHash = 0;
 
-      //DPRINTF( "reading node at %x\n", currentNodeOffset );
-      readNode( currentNodeOffset, extLeaf );
-      leaf = &extLeaf.front();
-      leafEnd = leaf + extLeaf.size();
-    }
-    else
+    if ( rootOffset && rootOffset + 2 * sizeof( uint32_t ) <= (quint64) fileInfo.size() )
     {
-      //DPRINTF( "=>a leaf\n" );
-      // A leaf
+      vector< char > stored( 2 * sizeof( uint32_t ) );
 
-      // If this leaf is the root, there's no next leaf, it just can't be.
-      // We do this check because the file's position indicator just won't
-      // be in the right place for root node anyway, since we precache it.
-      nextLeaf = ( currentNodeOffset != rootOffset ? idxFile->read< uint32_t >() : 0 );
+      file.seek( rootOffset );
+      file.read( &stored.front(), stored.size() );
 
-      if ( !leafEntries )
+      uint32_t compressedSize;
+      memcpy( &compressedSize, &stored.front() + sizeof( uint32_t ), sizeof( uint32_t ) );
+
+      if ( rootOffset + stored.size() + compressedSize <= (quint64) fileInfo.size() )
       {
-        // Empty leaf? This may only be possible for entirely empty trees only.
-        if ( currentNodeOffset != rootOffset )
-          throw exCorruptedChainData();
-        else
-          return 0; // No match
+        stored.resize( stored.size() + compressedSize );
+
+        if ( compressedSize )
+          file.read( &stored.front() + 2 * sizeof( uint32_t ), compressedSize );
+
+        rootHash = hashKey( &stored.front(), stored.size() );
       }
+    }
+
+    idxFileIdentity = fileInfo.canonicalFilePath() + "|" +
+                      QString::number( fileInfo.size() ) + "|" +
+                      QString::number( fileInfo.lastModified().toTime_t() ) + "|" +
+                      QString::number( rootOffset ) + "|" +
+                      QString::number( rootHash );
+
+    idxFileId = nodeCache.getFileId( idxFileIdentity );
+  }
+
+  Qt4x5::AtomicInt::storeRelease( rootNodeLoaded, 0 );
+  rootNode.clear();
+
+  Qt4x5::AtomicInt::storeRelease( trigramIndexLoaded, 0 );
+  trigramIndexOffset = 0;
+  trigramIndex.clear();
+
+  Qt4x5::AtomicInt::storeRelease( offsetMapLoaded, 0 );
+  offsetMapOffset = 0;
+  offsetMap.clear();
+}
+
+void BtreeIndex::loadRootNode()
+{
+  if ( Qt4x5::AtomicInt::loadAcquire( rootNodeLoaded ) )
+    return;
+
+  // Time to load our root node. We do it only once, at the first request,
+  // and this is the only time the lookups ever lock the mutex.
+  Mutex::Lock _( *idxFileMutex );
 
-      // Build an array containing all chain pointers
-      char const * ptr = leaf + sizeof( uint32_t );
+  if ( Qt4x5::AtomicInt::loadAcquire( rootNodeLoaded ) )
+    return;
+
+  QByteArray node;
+
+  readNode( rootOffset, node );
+
+  uint32_t marker = 0;
+
+  if ( (size_t) node.size() >= sizeof( uint32_t ) )
+    memcpy( &marker, node.constData(), sizeof( uint32_t ) );
+
+  if ( marker == IndexDirectoryMarker )
+  {
+    // Newer indices begin with a directory of their parts
+    uint32_t parts;
+
+    if ( (size_t) node.size() < 2 * sizeof( uint32_t ) )
+      throw exCorruptedChainData();
+
+    memcpy( &parts, node.constData() + sizeof( uint32_t ), sizeof( uint32_t ) );
+
+    if ( (size_t) node.size() < ( 2 + 2 * (size_t) parts ) * sizeof( uint32_t ) )
+      throw exCorruptedChainData();
 
-      uint32_t chainSize;
+    uint32_t const * offsets = (uint32_t const *) node.constData() + 2;
+    uint32_t const * tags = offsets + parts;
 
-      vector< char const * > chainOffsets( leafEntries );
+    uint32_t newRootOffset = 0;
 
+    for( uint32_t x = 0; x < parts; ++x )
+    {
+      switch( tags[ x ] )
       {
-        char const ** nextOffset = &chainOffsets.front();
+        case RootNodePart:
+          newRootOffset = offsets[ x ];
+          break;
 
-        while( leafEntries-- )
-        {
-          *nextOffset++ = ptr;
+        case BloomFilterPart:
+          readNodeUncached( offsets[ x ], bloomFilter );
+          break;
 
-          memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+        case TrigramIndexPart:
+          trigramIndexOffset = offsets[ x ];
+          break;
 
-          //DPRINTF( "%s + %s\n", ptr + sizeof( uint32_t ), ptr + sizeof( uint32_t ) + strlen( ptr + sizeof( uint32_t ) ) + 1 );
+        case OffsetMapPart:
+          offsetMapOffset = offsets[ x ];
+          break;
 
-          ptr += sizeof( uint32_t ) + chainSize;
-        }
+        default:
+          break; // Some newer part -- skip it
       }
+    }
 
-      // Now do a binary search in it, aiming to find where our target
-      // string lands.
+    if ( !newRootOffset )
+      throw exCorruptedChainData();
 
-      char const ** window = &chainOffsets.front();
-      unsigned windowSize = chainOffsets.size();
+    rootOffset = newRootOffset;
 
-      for( ; ; )
-      {
-        //DPRINTF( "window = %u, ws = %u\n", window - &chainOffsets.front(), windowSize );
+    readNode( rootOffset, rootNode );
+  }
+  else
+    rootNode = node;
 
-        char const ** chainToCheck = window + windowSize/2;
-        ptr = *chainToCheck;
-  
-        memcpy( &chainSize, ptr, sizeof( uint32_t ) );
-        ptr += sizeof( uint32_t );
-  
-        size_t wordSize = strlen( ptr );
-  
-        if ( wcharBuffer.size() <= wordSize )
-          wcharBuffer.resize( wordSize + 1 );
-  
-        //DPRINTF( "checking against word %s, left = %u\n", ptr, leafEntries );
-  
-        long result = Utf8::decode( ptr, wordSize, &wcharBuffer.front() );
-  
-        if ( result < 0 )
-          throw Utf8::exCantDecode( ptr );
-  
-        wcharBuffer[ result ] = 0;
-  
-        wstring foldedWord = Folding::apply( &wcharBuffer.front() );
-        if( foldedWord.empty() )
-          foldedWord = Folding::applyWhitespaceOnly( &wcharBuffer.front() );
-  
-        int compareResult = target.compare( foldedWord );
-  
-        if ( !compareResult )
-        {
-          // Exact match -- return and be done
-          exactMatch = true;
-  
-          return ptr - sizeof( uint32_t );
-        }
-        else
-        if ( compareResult < 0 )
-        {
-          // The target string is smaller than the current one.
-          // Go to the first half
-           
-          windowSize /= 2;
+  Qt4x5::AtomicInt::storeRelease( rootNodeLoaded, 1 );
+}
 
-          if ( !windowSize )
-          {
-            // That finishes our search. Since our target string
-            // landed before the last tested chain, we return a possible
-            // prefix match against that chain.
-            return ptr - sizeof( uint32_t );
-          }
-        }
-        else
-        {
-          // The target string is larger than the current one.
-          // Go to the second half
+namespace {
 
-          windowSize -= windowSize/2 + 1;
+/// Tests the bits of the Bloom filter
+class BloomBitTester
+{
+  unsigned char const * bits;
 
-          if ( !windowSize )
-          {
-            // That finishes our search. Since our target string
-            // landed after the last tested chain, we return the next
-            // chain. If there's no next chain in this leaf, this
-            // would mean the first element in the next leaf.
-            if ( chainToCheck == &chainOffsets.back() )
-            {
-              if ( nextLeaf )
-              {
-                readNode( nextLeaf, extLeaf );
-  
-                leafEnd = &extLeaf.front() + extLeaf.size();
-  
-                nextLeaf = idxFile->read< uint32_t >();
-  
-                return &extLeaf.front() + sizeof( uint32_t );
-              }
-              else
-                return 0; // This was the last leaf
-            }
-            else
-              return chainToCheck[ 1 ];
-          }
+public:
+
+  BloomBitTester( unsigned char const * bits_ ): bits( bits_ )
+  {}
+
+  bool operator () ( size_t byte, unsigned char mask ) const
+  { return bits[ byte ] & mask; }
+};
+
+}
+
+bool BtreeIndex::mayContainKey( wstring const & folded )
+{
+  loadRootNode();
+
+  if ( (size_t) bloomFilter.size() < 3 * sizeof( uint32_t ) )
+    return true;
+
+  uint32_t header[ 3 ];
+
+  memcpy( header, bloomFilter.constData(), sizeof( header ) );
+
+  if ( header[ 0 ] != BloomFilterMarker || !header[ 2 ] ||
+       (size_t) bloomFilter.size() < sizeof( header ) +
+                                     (size_t) header[ 2 ] * BloomFilterBlockSize )
+    return true; // Not a filter we understand
+
+  string key = Utf8::encode( folded );
+
+  BloomBitTester tester( (unsigned char const *) bloomFilter.constData() + sizeof( header ) );
+
+  return forEachBloomBit( hashKey( key.data(), key.size() ), header[ 1 ], header[ 2 ],
+                          tester );
+}
+
+bool BtreeIndex::loadTrigramIndex()
+{
+  loadRootNode();
+
+  if ( !trigramIndexOffset )
+    return false;
+
+  if ( Qt4x5::AtomicInt::loadAcquire( trigramIndexLoaded ) )
+    return true;
+
+  Mutex::Lock _( *idxFileMutex );
+
+  if ( Qt4x5::AtomicInt::loadAcquire( trigramIndexLoaded ) )
+    return true;
+
+  QByteArray data;
+
+  readNodeUncached( trigramIndexOffset, data );
+
+  TrigramHeader header;
+
+  if ( (size_t) data.size() < sizeof( header ) )
+    throw exCorruptedChainData();
+
+  memcpy( &header, data.constData(), sizeof( header ) );
+
+  if ( header.marker != TrigramIndexMarker ||
+       (size_t) data.size() < sizeof( header ) +
+                              ( 2 * (size_t) header.leaves + header.blocks ) * sizeof( uint32_t ) +
+                              (size_t) header.trigrams * sizeof( TrigramEntry ) )
+    throw exCorruptedChainData();
+
+  trigramIndex = data;
+
+  Qt4x5::AtomicInt::storeRelease( trigramIndexLoaded, 1 );
+
+  return true;
+}
+
+bool BtreeIndex::loadOffsetMap()
+{
+  loadRootNode();
+
+  if ( !offsetMapOffset )
+    return false;
+
+  if ( Qt4x5::AtomicInt::loadAcquire( offsetMapLoaded ) )
+    return true;
+
+  Mutex::Lock _( *idxFileMutex );
+
+  if ( Qt4x5::AtomicInt::loadAcquire( offsetMapLoaded ) )
+    return true;
+
+  QByteArray data;
+
+  readNodeUncached( offsetMapOffset, data );
+
+  OffsetMapHeader header;
+
+  if ( (size_t) data.size() < sizeof( header ) )
+    throw exCorruptedChainData();
+
+  memcpy( &header, data.constData(), sizeof( header ) );
+
+  if ( header.marker != OffsetMapMarker ||
+       (size_t) data.size() < sizeof( header ) +
+                              2 * ( (size_t) header.entryBlocks + header.headwordBlocks ) *
+                              sizeof( uint32_t ) )
+    throw exCorruptedChainData();
+
+  offsetMap = data;
+
+  Qt4x5::AtomicInt::storeRelease( offsetMapLoaded, 1 );
+
+  return true;
+}
+
+void BtreeIndex::readPostings( uint32_t block, uint32_t offset, uint32_t count,
+                               vector< uint32_t > & ordinals )
+{
+  TrigramHeader header;
+
+  memcpy( &header, trigramIndex.constData(), sizeof( header ) );
+
+  if ( block >= header.blocks )
+    throw exCorruptedChainData();
+
+  uint32_t blockOffset;
+
+  memcpy( &blockOffset, trigramIndex.constData() + sizeof( header ) +
+                        ( header.leaves + block ) * sizeof( uint32_t ), sizeof( uint32_t ) );
+
+  QByteArray data;
+
+  readNode( blockOffset, data );
+
+  if ( offset > (uint32_t) data.size() )
+    throw exCorruptedChainData();
+
+  unsigned char const * ptr = (unsigned char const *) data.constData() + offset;
+  unsigned char const * end = (unsigned char const *) data.constData() + data.size();
+
+  ordinals.clear();
+  ordinals.reserve( count );
+
+  uint32_t ordinal = 0;
+
+  while( count-- )
+  {
+    ordinal += readVarint( ptr, end );
+
+    if ( ordinal >= header.keys )
+      throw exCorruptedChainData();
+
+    ordinals.push_back( ordinal );
+  }
+}
+
+bool BtreeIndex::findChainsContaining( vector< wstring > const & folded,
+                                       vector< uint32_t > & ordinals )
+{
+  if ( !loadTrigramIndex() )
+    return false;
+
+  vector< quint64 > trigrams;
+
+  for( size_t x = 0; x < folded.size(); ++x )
+    appendTrigrams( folded[ x ], trigrams );
+
+  if ( trigrams.empty() )
+    return false;
+
+  std::sort( trigrams.begin(), trigrams.end() );
+  trigrams.erase( std::unique( trigrams.begin(), trigrams.end() ), trigrams.end() );
+
+  TrigramHeader header;
+
+  memcpy( &header, trigramIndex.constData(), sizeof( header ) );
+
+  char const * entries = trigramIndex.constData() + sizeof( header ) +
+                         ( 2 * (size_t) header.leaves + header.blocks ) * sizeof( uint32_t );
+
+  // Look all the trigrams up first, so the shortest posting list can be
+  // the one to start with
+
+  vector< TrigramEntry > found;
+
+  for( size_t x = 0; x < trigrams.size(); ++x )
+  {
+    uint32_t low = 0, high = header.trigrams;
+
+    while( low < high )
+    {
+      uint32_t middle = low + ( high - low ) / 2;
+
+      TrigramEntry entry;
+
+      memcpy( &entry, entries + middle * sizeof( TrigramEntry ), sizeof( entry ) );
+
+      quint64 trigram = ( (quint64) entry.trigramHigh << 32 ) | entry.trigramLow;
+
+      if ( trigram < trigrams[ x ] )
+        low = middle + 1;
+      else
+      if ( trigram > trigrams[ x ] )
+        high = middle;
+      else
+      {
+        found.push_back( entry );
+        break;
+      }
+    }
+
+    if ( found.size() != x + 1 )
+    {
+      // No headword has this trigram, so none has them all
+      ordinals.clear();
+      return true;
+    }
+  }
+
+  std::sort( found.begin(), found.end(), hasFewerPostings );
+
+  readPostings( found[ 0 ].block, found[ 0 ].offset, found[ 0 ].count, ordinals );
+
+  vector< uint32_t > list, intersection;
+
+  for( size_t x = 1; x < found.size() && !ordinals.empty(); ++x )
+  {
+    readPostings( found[ x ].block, found[ x ].offset, found[ x ].count, list );
+
+    intersection.clear();
+
+    std::set_intersection( ordinals.begin(), ordinals.end(), list.begin(), list.end(),
+                           std::back_inserter( intersection ) );
+
+    ordinals.swap( intersection );
+  }
+
+  return true;
+}
+
+char const * BtreeIndex::findChainByOrdinal( uint32_t ordinal, ChainCursor & cursor )
+{
+  TrigramHeader header;
+
+  memcpy( &header, trigramIndex.constData(), sizeof( header ) );
+
+  if ( ordinal >= header.keys )
+    throw exCorruptedChainData();
+
+  char const * leafOffsets = trigramIndex.constData() + sizeof( header );
+  char const * leafFirstKeys = leafOffsets + ( header.leaves + header.blocks ) * sizeof( uint32_t );
+
+  // Find the last leaf starting not past the ordinal
+
+  uint32_t low = 0, high = header.leaves;
+
+  while( high - low > 1 )
+  {
+    uint32_t middle = low + ( high - low ) / 2;
+    uint32_t firstKey;
+
+    memcpy( &firstKey, leafFirstKeys + middle * sizeof( uint32_t ), sizeof( uint32_t ) );
+
+    if ( firstKey <= ordinal )
+      low = middle;
+    else
+      high = middle;
+  }
+
+  if ( low >= header.leaves )
+    throw exCorruptedChainData();
+
+  if ( cursor.leafNumber != low || cursor.ordinal > ordinal )
+  {
+    uint32_t leafOffset;
+
+    memcpy( &leafOffset, leafOffsets + low * sizeof( uint32_t ), sizeof( uint32_t ) );
+
+    readNode( leafOffset, cursor.leaf );
+
+    cursor.leafNumber = low;
+    cursor.leafEnd = cursor.leaf.constData() + cursor.leaf.size();
+    cursor.chain = firstLeafChain( cursor.leaf.constData() );
+
+    memcpy( &cursor.ordinal, leafFirstKeys + low * sizeof( uint32_t ), sizeof( uint32_t ) );
+  }
+
+  cursor.chain = skipChains( cursor.chain, cursor.leafEnd, ordinal - cursor.ordinal );
+  cursor.ordinal = ordinal;
+
+  if ( cursor.chain >= cursor.leafEnd )
+    throw exCorruptedChainData();
+
+  return cursor.chain;
+}
+
+vector< WordArticleLink > BtreeIndex::findArticles( wstring const & word, bool ignoreDiacritics )
+{
+  vector< WordArticleLink > result;
+
+  try
+  {
+    wstring folded = Folding::apply( word );
+    if( folded.empty() )
+      folded = Folding::applyWhitespaceOnly( word );
+
+    if ( !mayContainKey( folded ) )
+      return result;
+
+    bool exactMatch;
+
+    QByteArray leaf;
+    uint32_t nextLeaf;
+
+    char const * leafEnd;
+
+    char const * chainOffset = findChainOffsetExactOrPrefix( folded, exactMatch,
+                                                             leaf, nextLeaf,
+                                                             leafEnd );
+
+    if ( chainOffset && exactMatch )
+    {
+      result = readChain( chainOffset );
+
+      antialias( word, result, ignoreDiacritics );
+    }
+  }
+  catch( std::exception & e )
+  {
+    gdWarning( "Articles searching failed, error: %s\n", e.what() );
+    result.clear();
+  }
+  catch(...)
+  {
+    qWarning( "Articles searching failed\n" );
+    result.clear();
+  }
+
+  return result;
+}
+
+vector< WordArticleLink > BtreeIndex::findArticlesBatch( vector< wstring > const & words,
+                                                         bool ignoreDiacritics )
+{
+  vector< vector< WordArticleLink > > results( words.size() );
+
+  // Fold all the words, and order them by their folded forms
+
+  vector< pair< wstring, size_t > > targets( words.size() );
+
+  for( size_t x = 0; x < words.size(); ++x )
+  {
+    targets[ x ].first = Folding::apply( words[ x ] );
+    if( targets[ x ].first.empty() )
+      targets[ x ].first = Folding::applyWhitespaceOnly( words[ x ] );
+
+    targets[ x ].second = x;
+  }
+
+  std::sort( targets.begin(), targets.end() );
+
+  QByteArray leaf; // The leaf the previous target landed in
+  uint32_t nextLeaf;
+  char const * leafEnd;
+
+  vector< wchar > wcharBuffer;
+  string targetUtf8;
+
+  vector< WordArticleLink > chain; // Chain of the previous target
+
+  for( size_t x = 0; x < targets.size(); ++x )
+  {
+    wstring const & target = targets[ x ].first;
+
+    if ( x && target == targets[ x - 1 ].first )
+    {
+      results[ targets[ x ].second ] = chain;
+      antialias( words[ targets[ x ].second ], results[ targets[ x ].second ],
+                 ignoreDiacritics );
+      continue;
+    }
+
+    // A failure only loses the results of the word it happened with. The
+    // leaf is dropped then, so the next word is looked up from the root.
+
+    chain.clear();
+
+    try
+    {
+      if ( !mayContainKey( target ) )
+        continue;
+
+      bool exactMatch = false;
+      char const * chainOffset = 0;
+
+      if ( !leaf.isEmpty() && leafEntryCount( leaf.constData() ) )
+      {
+        // Since the targets are sorted, the current one is either in the
+        // same leaf as the previous one, or further to the right.
+        targetUtf8.clear();
+
+        chainOffset = findChainInLeaf( target, targetUtf8, leaf.constData(),
+                                       exactMatch, wcharBuffer );
+      }
+
+      if ( !chainOffset )
+      {
+        leaf.clear();
+
+        chainOffset = findChainOffsetExactOrPrefix( target, exactMatch,
+                                                    leaf, nextLeaf, leafEnd );
+
+        if ( leaf.isEmpty() )
+          leaf = rootNode; // The root was the only leaf
+
+        if ( !chainOffset )
+          break; // This and all the further targets are past the end
+      }
+
+      if ( exactMatch )
+        chain = readChain( chainOffset );
+
+      results[ targets[ x ].second ] = chain;
+
+      antialias( words[ targets[ x ].second ], results[ targets[ x ].second ],
+                 ignoreDiacritics );
+    }
+    catch( std::exception & e )
+    {
+      gdWarning( "Articles searching failed, error: %s\n", e.what() );
+      chain.clear();
+      results[ targets[ x ].second ].clear();
+      leaf.clear();
+    }
+    catch(...)
+    {
+      qWarning( "Articles searching failed\n" );
+      chain.clear();
+      results[ targets[ x ].second ].clear();
+      leaf.clear();
+    }
+  }
+
+  vector< WordArticleLink > result;
+
+  for( size_t x = 0; x < results.size(); ++x )
+    result.insert( result.end(), results[ x ].begin(), results[ x ].end() );
+
+  return result;
+}
+
+class BtreeWordSearchRunnable: public QRunnable
+{
+  BtreeWordSearchRequest & r;
+  QSemaphore & hasExited;
+  
+public:
+
+  BtreeWordSearchRunnable( BtreeWordSearchRequest & r_,
+                           QSemaphore & hasExited_ ): r( r_ ),
+                                                      hasExited( hasExited_ )
+  {}
+
+  ~BtreeWordSearchRunnable()
+  {
+    hasExited.release();
+  }
+  
+  virtual void run();
+};
+
+void BtreeWordSearchRunnable::run()
+{
+  r.run();
+}
+
+BtreeWordSearchRequest::BtreeWordSearchRequest( BtreeDictionary & dict_,
+                                                wstring const & str_,
+                                                unsigned minLength_,
+                                                int maxSuffixVariation_,
+                                                bool allowMiddleMatches_,
+                                                unsigned long maxResults_,
+                                                bool startRunnable ):
+  dict( dict_ ), str( str_ ),
+  maxResults( maxResults_ ),
+  minLength( minLength_ ),
+  maxSuffixVariation( maxSuffixVariation_ ),
+  allowMiddleMatches( allowMiddleMatches_ )
+{
+  if( startRunnable )
+  {
+    QThreadPool::globalInstance()->start(
+      new BtreeWordSearchRunnable( *this, hasExited ) );
+  }
+}
+
+void BtreeWordSearchRequest::findMatches()
+{
+  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+  {
+    finish();
+    return;
+  }
+
+  if ( dict.ensureInitDone().size() )
+  {
+    setErrorString( QString::fromUtf8( dict.ensureInitDone().c_str() ) );
+    finish();
+    return;
+  }
+  
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
+  QRegularExpression regexp;
+#else
+  QRegExp regexp;
+#endif
+  bool useWildcards = false;
+  if( allowMiddleMatches )
+    useWildcards = ( str.find( '*' ) != wstring::npos ||
+                     str.find( '?' ) != wstring::npos ||
+                     str.find( '[' ) != wstring::npos ||
+                     str.find( ']' ) != wstring::npos );
+
+  wstring folded = Folding::apply( str );
+
+  int minMatchLength = 0;
+
+  // The literal parts of the wildcard pattern, folded
+  vector< wstring > fragments;
+
+  if( useWildcards )
+  {
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
+    regexp.setPattern( wildcardsToRegexp( gd::toQString( Folding::applyDiacriticsOnly( Folding::applySimpleCaseOnly( str ) ) ) ) );
+    if( !regexp.isValid() )
+      regexp.setPattern( QRegularExpression::escape( regexp.pattern() ) );
+    regexp.setPatternOptions( QRegularExpression::CaseInsensitiveOption );
+#else
+    regexp.setPattern( gd::toQString( Folding::applyDiacriticsOnly( Folding::applySimpleCaseOnly( str ) ) ) );
+    regexp.setPatternSyntax( QRegExp::WildcardUnix );
+    regexp.setCaseSensitivity( Qt::CaseInsensitive );
+#endif
+
+    bool bNoLetters = folded.empty();
+    wstring foldedWithWildcards;
+
+    if( bNoLetters )
+      foldedWithWildcards = Folding::applyWhitespaceOnly( str );
+    else
+      foldedWithWildcards = Folding::apply( str, useWildcards );
+
+    // Calculate minimum match length. Collect the literal fragments of the
+    // pattern along the way, for the trigram index to look up.
+
+    bool insideSet = false;
+    bool escaped = false;
+    wstring fragment;
+    for( wstring::size_type x = 0; x < foldedWithWildcards.size(); x++ )
+    {
+      wchar ch = foldedWithWildcards[ x ];
+
+      if( ch == L'\\' && !escaped )
+      {
+        escaped = true;
+        continue;
+      }
+
+      if( ch == L']' && !escaped )
+      {
+        insideSet = false;
+        continue;
+      }
+
+      if( insideSet )
+      {
+        escaped = false;
+        continue;
+      }
+
+      if( ( ch == L'[' || ch == L'*' || ch == L'?' ) && !escaped )
+      {
+        if( !bNoLetters && !fragment.empty() )
+          fragments.push_back( fragment );
+        fragment.clear();
+      }
+      else
+        fragment.push_back( ch );
+
+      if( ch == L'[' && !escaped )
+      {
+        minMatchLength += 1;
+        insideSet = true;
+        continue;
+      }
+
+      if( ch == L'*' && !escaped )
+        continue;
+
+      escaped = false;
+      minMatchLength += 1;
+    }
+
+    if( !bNoLetters && !fragment.empty() )
+      fragments.push_back( fragment );
+
+    // Fill first match chars
+
+    folded.clear();
+    folded.reserve( foldedWithWildcards.size() );
+    escaped = false;
+    for( wstring::size_type x = 0; x < foldedWithWildcards.size(); x++ )
+    {
+      wchar ch = foldedWithWildcards[ x ];
+
+      if( escaped )
+      {
+        if( bNoLetters || ( ch != L'*' && ch != L'?' && ch != L'[' && ch != L']' ) )
+          folded.push_back( ch );
+        escaped = false;
+        continue;
+      }
+
+      if( ch == L'\\' )
+      {
+        if( bNoLetters || folded.empty() )
+        {
+          escaped = true;
+          continue;
+        }
+        else
+          break;
+      }
+
+      if( ch == '*' || ch == '?' || ch == '[' || ch == ']' )
+        break;
+
+      folded.push_back( ch );
+    }
+  }
+  else
+  {
+    if( folded.empty() )
+      folded = Folding::applyWhitespaceOnly( str );
+  }
+
+  int initialFoldedSize = folded.size();
+
+  int charsLeftToChop = 0;
+
+  if ( maxSuffixVariation >= 0 )
+  {
+    charsLeftToChop = initialFoldedSize - (int)minLength;
+
+    if ( charsLeftToChop < 0 )
+      charsLeftToChop = 0;
+    else
+    if ( charsLeftToChop > maxSuffixVariation )
+      charsLeftToChop = maxSuffixVariation;
+  }
+
+  try
+  {
+    // A pattern starting with a wildcard would have every chain tested. If
+    // the index has the trigrams, only the chains having all the trigrams of
+    // the pattern's literal parts are.
+    vector< uint32_t > candidates;
+    bool useCandidates = useWildcards && folded.empty() && !fragments.empty() &&
+                         dict.findChainsContaining( fragments, candidates );
+
+    for( ; ; )
+    {
+      bool exactMatch;
+      QByteArray leaf;
+      uint32_t nextLeaf;
+      char const * leafEnd;
+
+      ChainCursor cursor;
+      size_t nextCandidate = 0;
+
+      char const * chainOffset;
+
+      if ( useCandidates )
+        chainOffset = candidates.empty() ? 0 :
+                      dict.findChainByOrdinal( candidates[ nextCandidate++ ], cursor );
+      else
+        chainOffset = dict.findChainOffsetExactOrPrefix( folded, exactMatch,
+                                                         leaf, nextLeaf,
+                                                         leafEnd );
+
+      if ( chainOffset )
+      for( ; ; )
+      {
+        if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+          break;
+
+        //DPRINTF( "offset = %u, size = %u\n", chainOffset - leaf.constData(), leaf.size() );
+
+        vector< WordArticleLink > chain = dict.readChain( chainOffset );
+
+        wstring chainHead = Utf8::decode( chain[ 0 ].word );
+
+        wstring resultFolded = Folding::apply( chainHead );
+        if( resultFolded.empty() )
+          resultFolded = Folding::applyWhitespaceOnly( chainHead );
+
+        if ( ( useWildcards && folded.empty() ) ||
+             ( resultFolded.size() >= folded.size()
+               && !resultFolded.compare( 0, folded.size(), folded ) ) )
+        {
+          // Exact or prefix match
+
+          Mutex::Lock _( dataMutex );
+
+          for( unsigned x = 0; x < chain.size(); ++x )
+          {
+            if( useWildcards )
+            {
+              wstring word = Utf8::decode( chain[ x ].prefix + chain[ x ].word );
+              wstring result = Folding::applyDiacriticsOnly( word );
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
+              if( result.size() >= (wstring::size_type)minMatchLength )
+              {
+                QRegularExpressionMatch match = regexp.match( gd::toQString( result ) );
+                if( match.hasMatch() && match.capturedStart() == 0 && acceptLink( chain[ x ] ) )
+                {
+                  addMatch( word );
+                }
+              }
+#else
+              if( result.size() >= (wstring::size_type)minMatchLength
+                  && regexp.indexIn( gd::toQString( result ) ) == 0
+                  && regexp.matchedLength() >= minMatchLength
+                  && acceptLink( chain[ x ] ) )
+              {
+                addMatch( word );
+              }
+#endif
+            }
+            else
+            {
+              // Skip middle matches, if requested. If suffix variation is specified,
+              // make sure the string isn't larger than requested.
+              if ( ( allowMiddleMatches || Folding::apply( Utf8::decode( chain[ x ].prefix ) ).empty() ) &&
+                   ( maxSuffixVariation < 0 || (int)resultFolded.size() - initialFoldedSize <= maxSuffixVariation ) &&
+                   acceptLink( chain[ x ] ) )
+                  addMatch( Utf8::decode( chain[ x ].prefix + chain[ x ].word ) );
+            }
+          }
+
+          if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+            break;
+
+          if ( matches.size() >= maxResults )
+          {
+            // For now we actually allow more than maxResults if the last
+            // chain yield more than one result. That's ok and maybe even more
+            // desirable.
+            break;
+          }
+        }
+        else
+          // Neither exact nor a prefix match, end this
+          break;
+
+        if ( useCandidates )
+        {
+          if ( nextCandidate == candidates.size() )
+            break;
+
+          chainOffset = dict.findChainByOrdinal( candidates[ nextCandidate++ ], cursor );
+        }
+        else
+        // Fetch new leaf if we're out of chains here
+        if ( chainOffset >= leafEnd )
+        {
+          // We're past the current leaf, fetch the next one
+
+          //DPRINTF( "advancing\n" );
+
+          if ( nextLeaf )
+          {
+            dict.readNode( nextLeaf, leaf, &nextLeaf );
+            leafEnd = leaf.constData() + leaf.size();
+
+            chainOffset = firstLeafChain( leaf.constData() );
+
+            uint32_t leafEntries = *(uint32_t *)leaf.constData();
+
+            if ( leafEntries == 0xffffFFFF )
+            {
+              //DPRINTF( "bah!\n" );
+              exit( 1 );
+            }
+          }
+          else
+            break; // That was the last leaf
+        }
+      }
+
+      if ( charsLeftToChop && !Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+      {
+        --charsLeftToChop;
+        folded.resize( folded.size() - 1 );
+      }
+      else
+        break;
+    }
+  }
+  catch( std::exception & e )
+  {
+    qWarning( "Index searching failed: \"%s\", error: %s\n",
+              dict.getName().c_str(), e.what() );
+  }
+  catch(...)
+  {
+    gdWarning( "Index searching failed: \"%s\"\n", dict.getName().c_str() );
+  }
+}
+
+void BtreeWordSearchRequest::run()
+{
+  if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+  {
+    finish();
+    return;
+  }
+
+  if ( dict.ensureInitDone().size() )
+  {
+    setErrorString( QString::fromUtf8( dict.ensureInitDone().c_str() ) );
+    finish();
+    return;
+  }
+
+  findMatches();
+
+  finish();
+}
+
+BtreeWordSearchRequest::~BtreeWordSearchRequest()
+{
+  isCancelled.ref();
+  hasExited.acquire();
+}
+
+sptr< Dictionary::WordSearchRequest > BtreeDictionary::prefixMatch(
+  wstring const & str, unsigned long maxResults )
+  THROW_SPEC( std::exception )
+{
+  return new BtreeWordSearchRequest( *this, str, 0, -1, true, maxResults );
+}
+
+sptr< Dictionary::WordSearchRequest > BtreeDictionary::stemmedMatch(
+  wstring const & str, unsigned minLength, unsigned maxSuffixVariation,
+  unsigned long maxResults )
+  THROW_SPEC( std::exception )
+{
+  return new BtreeWordSearchRequest( *this, str, minLength, (int)maxSuffixVariation,
+                                     false, maxResults );
+}
+
+sptr< Dictionary::WordSearchRequest > BtreeDictionary::fuzzyMatch(
+  wstring const & str, unsigned maxDistance, unsigned long maxResults )
+  THROW_SPEC( std::exception )
+{
+  return new BtreeFuzzySearchRequest( *this, str, maxDistance, maxResults );
+}
+
+BtreeFuzzySearchRequest::BtreeFuzzySearchRequest( BtreeDictionary & dict_,
+                                                  wstring const & str_,
+                                                  unsigned maxDistance_,
+                                                  unsigned long maxResults_ ):
+  BtreeWordSearchRequest( dict_, str_, 0, -1, false, maxResults_, false ),
+  maxDistance( maxDistance_ )
+{
+  QThreadPool::globalInstance()->start(
+    new BtreeWordSearchRunnable( *this, hasExited ) );
+}
+
+namespace {
+
+/// Orders the fuzzy matches by their distances
+struct CompareMatchDistances
+{
+  bool operator () ( pair< unsigned, wstring > const & first,
+                     pair< unsigned, wstring > const & second ) const
+  { return first.first < second.first; }
+};
+
+}
+
+void BtreeFuzzySearchRequest::findMatches()
+{
+  wstring target = Folding::apply( str );
+
+  if ( target.empty() )
+    return;
+
+  size_t targetSize = target.size();
+
+  // rows[ x ] holds the distances between the first x characters of the key
+  // and all the prefixes of the target, rowMinimums[ x ] the least of them.
+  // The rows are kept for the prefix of the key which the next key may share.
+  vector< vector< unsigned > > rows( 1, vector< unsigned >( targetSize + 1 ) );
+  vector< unsigned > rowMinimums( 1, 0 );
+
+  for( size_t x = 0; x <= targetSize; ++x )
+    rows[ 0 ][ x ] = x;
+
+  wstring key;
+
+  vector< pair< unsigned, wstring > > found;
+
+  try
+  {
+    bool exactMatch;
+    QByteArray leaf;
+    uint32_t nextLeaf;
+    char const * leafEnd;
+
+    char const * chainOffset = dict.findChainOffsetExactOrPrefix( wstring(), exactMatch,
+                                                                  leaf, nextLeaf,
+                                                                  leafEnd );
+
+    while( chainOffset )
+    {
+      if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+        break;
+
+      vector< WordArticleLink > chain = dict.readChain( chainOffset );
+
+      wstring chainHead = Utf8::decode( chain[ 0 ].word );
+
+      wstring resultFolded = Folding::apply( chainHead );
+      if( resultFolded.empty() )
+        resultFolded = Folding::applyWhitespaceOnly( chainHead );
+
+      // Keep the rows of the prefix shared with the previous key
+
+      size_t common = 0;
+
+      while( common + 1 < rows.size() && common < resultFolded.size() &&
+             key[ common ] == resultFolded[ common ] )
+        ++common;
+
+      rows.resize( common + 1 );
+      rowMinimums.resize( common + 1 );
+
+      key.swap( resultFolded );
+
+      size_t deadPrefix = 0; // Length of the prefix too far off, if any
+
+      for( size_t x = rows.size(); x <= key.size(); ++x )
+      {
+        rows.push_back( vector< unsigned >( targetSize + 1 ) );
+
+        vector< unsigned > & row = rows[ x ];
+        vector< unsigned > const & previous = rows[ x - 1 ];
+
+        row[ 0 ] = x;
+
+        unsigned minimum = x;
+
+        for( size_t y = 1; y <= targetSize; ++y )
+        {
+          unsigned value = std::min( previous[ y ], row[ y - 1 ] ) + 1;
+
+          value = std::min( value, previous[ y - 1 ] +
+                                   ( key[ x - 1 ] == target[ y - 1 ] ? 0 : 1 ) );
+
+          // A transposition of two adjacent characters
+          if ( x > 1 && y > 1 && key[ x - 1 ] == target[ y - 2 ] &&
+               key[ x - 2 ] == target[ y - 1 ] )
+            value = std::min( value, rows[ x - 2 ][ y - 2 ] + 1 );
+
+          row[ y ] = value;
+
+          if ( value < minimum )
+            minimum = value;
+        }
+
+        rowMinimums.push_back( minimum );
+
+        // Every next row builds upon this one or, through a transposition,
+        // upon the one before it at the cost of one more edit. If both are
+        // too far off, so is any key having this prefix.
+        if ( minimum > maxDistance && rowMinimums[ x - 1 ] >= maxDistance )
+        {
+          deadPrefix = x;
+          break;
+        }
+      }
+
+      if ( deadPrefix )
+      {
+        // Seek past all the keys having this prefix, keeping the rows of the
+        // part which the keys following them may still share
+
+        rows.resize( deadPrefix );
+        rowMinimums.resize( deadPrefix );
+
+        wstring next( key, 0, deadPrefix );
+
+        ++next[ deadPrefix - 1 ];
+
+        chainOffset = dict.findChainOffsetExactOrPrefix( next, exactMatch,
+                                                         leaf, nextLeaf,
+                                                         leafEnd );
+        continue;
+      }
+
+      unsigned distance = rows.back()[ targetSize ];
+
+      if ( distance <= maxDistance )
+      {
+        // Middle matches aren't the words the user might have meant
+        for( size_t x = 0; x < chain.size(); ++x )
+          if ( Folding::apply( Utf8::decode( chain[ x ].prefix ) ).empty() &&
+               acceptLink( chain[ x ] ) )
+            found.push_back( pair< unsigned, wstring >( distance,
+                             Utf8::decode( chain[ x ].prefix + chain[ x ].word ) ) );
+      }
+
+      if ( chainOffset >= leafEnd )
+      {
+        // We're past the current leaf, fetch the next one
+
+        if ( !nextLeaf )
+          break; // That was the last leaf
+
+        dict.readNode( nextLeaf, leaf, &nextLeaf );
+        leafEnd = leaf.constData() + leaf.size();
+
+        chainOffset = firstLeafChain( leaf.constData() );
+      }
+    }
+  }
+  catch( std::exception & e )
+  {
+    qWarning( "Index searching failed: \"%s\", error: %s\n",
+              dict.getName().c_str(), e.what() );
+  }
+  catch(...)
+  {
+    gdWarning( "Index searching failed: \"%s\"\n", dict.getName().c_str() );
+  }
+
+  std::stable_sort( found.begin(), found.end(), CompareMatchDistances() );
+
+  Mutex::Lock _( dataMutex );
+
+  for( size_t x = 0; x < found.size() && matches.size() < maxResults; ++x )
+    addMatch( Dictionary::WordMatch( found[ x ].second, -(int) found[ x ].first ) );
+}
+
+BtreeFuzzySearchRequest::~BtreeFuzzySearchRequest()
+{
+  // The search runs our findMatches(), so it has to be stopped before our
+  // part of the object is gone. Let the base destructor see it has exited.
+  isCancelled.ref();
+  hasExited.acquire();
+  hasExited.release();
+}
+
+/// Converts the regular leaf to the searchable one, as it is stored in the
+/// file.
+static void storeSearchableLeaf( vector< unsigned char > & leaf )
+{
+  uint32_t header[ 2 ];
+
+  header[ 0 ] = SearchableLeafMarker;
+  memcpy( &header[ 1 ], &leaf.front(), sizeof( uint32_t ) );
+
+  vector< unsigned char > result( sizeof( header ) );
+
+  memcpy( &result.front(), header, sizeof( header ) );
+
+  unsigned char const * chain = &leaf.front() + sizeof( uint32_t );
+
+  char const * prevWord = "";
+  size_t prevWordSize = 0;
+
+  for( uint32_t x = 0; x < header[ 1 ]; ++x )
+  {
+    uint32_t chainSize;
+
+    memcpy( &chainSize, chain, sizeof( uint32_t ) );
+
+    char const * ptr = (char const *) chain + sizeof( uint32_t );
+    char const * chainEnd = ptr + chainSize;
+
+    unsigned char firstLink = SearchableLeafFirstLink;
+
+    while( ptr != chainEnd )
+    {
+      size_t wordSize = strlen( ptr );
+
+      size_t shared = 0;
+
+      while( shared < wordSize && shared < prevWordSize &&
+             shared < SearchableLeafMaxShared && ptr[ shared ] == prevWord[ shared ] )
+        ++shared;
+
+      result.push_back( (unsigned char) shared | firstLink );
+
+      firstLink = 0;
+
+      prevWord = ptr;
+      prevWordSize = wordSize;
+
+      // The rest of the word, then the prefix and the offset as they are
+      char const * linkEnd = ptr + wordSize + 1;
+
+      linkEnd += strlen( linkEnd ) + 1 + sizeof( uint32_t );
+
+      result.insert( result.end(), ptr + shared, linkEnd );
+
+      ptr = linkEnd;
+    }
+
+    chain += sizeof( uint32_t ) + chainSize;
+  }
+
+  leaf.swap( result );
+}
+
+/// Converts the regular leaf to the searchable one, as it is used once read.
+/// The keys are those of the leaf's chains, in order.
+static void makeSearchableLeaf( vector< string > const & keys,
+                                vector< unsigned char > & leaf )
+{
+  uint32_t entries = keys.size();
+  uint32_t groups = ( entries + SearchableLeafRestartInterval - 1 ) / SearchableLeafRestartInterval;
+
+  vector< SearchableLeafSlot > restartSlots( groups );
+  vector< unsigned char > keyData;
+
+  unsigned char const * chains = &leaf.front() + sizeof( uint32_t );
+  unsigned char const * chain = chains;
+
+  for( uint32_t x = 0; x < entries; ++x )
+  {
+    string const & key = keys[ x ];
+
+    size_t shared = 0;
+
+    if ( x % SearchableLeafRestartInterval )
+    {
+      // Front-code the key against the previous one
+      string const & prevKey = keys[ x - 1 ];
+
+      while( shared < key.size() && shared < prevKey.size() && shared < 255 &&
+             key[ shared ] == prevKey[ shared ] )
+        ++shared;
+    }
+    else
+    {
+      // A restart point -- the key is stored in full and gets a slot
+      restartSlots[ x / SearchableLeafRestartInterval ].keyOffset = keyData.size();
+      restartSlots[ x / SearchableLeafRestartInterval ].chainOffset = chain - chains;
+    }
+
+    keyData.push_back( (unsigned char) shared );
+    keyData.insert( keyData.end(), key.begin() + shared, key.end() );
+    keyData.push_back( 0 );
+
+    uint32_t chainSize;
+
+    memcpy( &chainSize, chain, sizeof( uint32_t ) );
+
+    chain += sizeof( uint32_t ) + chainSize;
+  }
+
+  SearchableLeafHeader header;
+
+  header.marker = SearchableLeafMarker;
+  header.entries = entries;
+  header.restartInterval = SearchableLeafRestartInterval;
+  header.keysSize = keyData.size();
+
+  vector< unsigned char > result( sizeof( header ) + groups * sizeof( SearchableLeafSlot ) );
+
+  memcpy( &result.front(), &header, sizeof( header ) );
+
+  if ( groups )
+    memcpy( &result.front() + sizeof( header ), &restartSlots.front(),
+            groups * sizeof( SearchableLeafSlot ) );
+
+  result.insert( result.end(), keyData.begin(), keyData.end() );
+  result.insert( result.end(), leaf.begin() + sizeof( uint32_t ), leaf.end() );
+
+  leaf.swap( result );
+}
+
+/// Tells whether the node just read is a searchable leaf as it is stored.
+static inline bool isStoredSearchableLeaf( QByteArray const & node )
+{
+  uint32_t marker;
+
+  if ( (size_t) node.size() < sizeof( uint32_t ) )
+    return false;
+
+  memcpy( &marker, node.constData(), sizeof( uint32_t ) );
+
+  return marker == SearchableLeafMarker;
+}
+
+/// Expands the searchable leaf read from the file to the form the lookups
+/// use. The keys are folded from the first headwords of the chains, the same
+/// way the regular leaves have them folded on each lookup.
+static void expandSearchableLeaf( QByteArray & leaf )
+{
+  uint32_t header[ 2 ];
+
+  if ( (size_t) leaf.size() < sizeof( header ) )
+    throw exCorruptedChainData();
+
+  memcpy( header, leaf.constData(), sizeof( header ) );
+
+  vector< unsigned char > regularLeaf( sizeof( uint32_t ) );
+
+  memcpy( &regularLeaf.front(), &header[ 1 ], sizeof( uint32_t ) );
+
+  vector< string > keys;
+
+  keys.reserve( header[ 1 ] );
+
+  char const * ptr = leaf.constData() + sizeof( header );
+  char const * leafEnd = leaf.constData() + leaf.size();
+
+  string word;
+
+  size_t saveSizeHere = 0;
+
+  while( ptr != leafEnd )
+  {
+    unsigned char flags = *ptr++;
+    unsigned shared = flags & SearchableLeafMaxShared;
+
+    char const * wordEnd = (char const *) memchr( ptr, 0, leafEnd - ptr );
+
+    if ( shared > word.size() || !wordEnd )
+      throw exCorruptedChainData();
+
+    char const * prefixEnd = (char const *) memchr( wordEnd + 1, 0,
+                                                    leafEnd - wordEnd - 1 );
+
+    if ( !prefixEnd || (size_t)( leafEnd - prefixEnd - 1 ) < sizeof( uint32_t ) )
+      throw exCorruptedChainData();
+
+    word.resize( shared );
+    word.append( ptr, wordEnd );
+
+    if ( flags & SearchableLeafFirstLink )
+    {
+      if ( keys.size() == header[ 1 ] )
+        throw exCorruptedChainData();
+
+      if ( saveSizeHere )
+      {
+        uint32_t chainSize = regularLeaf.size() - saveSizeHere - sizeof( uint32_t );
+
+        memcpy( &regularLeaf[ saveSizeHere ], &chainSize, sizeof( uint32_t ) );
+      }
+
+      saveSizeHere = regularLeaf.size();
+
+      regularLeaf.resize( saveSizeHere + sizeof( uint32_t ) );
+
+      wstring decoded = Utf8::decode( word );
+      wstring folded = Folding::apply( decoded );
+
+      if ( folded.empty() )
+        folded = Folding::applyWhitespaceOnly( decoded );
+
+      keys.push_back( Utf8::encode( folded ) );
+    }
+    else
+    if ( !saveSizeHere )
+      throw exCorruptedChainData();
+
+    ptr = prefixEnd + 1 + sizeof( uint32_t );
+
+    regularLeaf.insert( regularLeaf.end(), word.begin(), word.end() );
+    regularLeaf.insert( regularLeaf.end(), wordEnd, ptr );
+  }
+
+  if ( keys.size() != header[ 1 ] )
+    throw exCorruptedChainData();
+
+  if ( saveSizeHere )
+  {
+    uint32_t chainSize = regularLeaf.size() - saveSizeHere - sizeof( uint32_t );
+
+    memcpy( &regularLeaf[ saveSizeHere ], &chainSize, sizeof( uint32_t ) );
+  }
+
+  makeSearchableLeaf( keys, regularLeaf );
+
+  leaf = QByteArray( (char const *) &regularLeaf.front(), regularLeaf.size() );
+}
+
+/// Uncompresses the node data to the given array, which must already be
+/// sized to the uncompressed size of the node.
+static void uncompressNode( unsigned char const * compressedData,
+                            uint32_t compressedSize, QByteArray & out )
+{
+  #ifdef __BTREE_USE_LZO
+
+  lzo_uint decompressedLength = out.size();
+
+  if ( lzo1x_decompress( compressedData, compressedSize,
+                         (unsigned char *)out.data(), &decompressedLength, 0 )
+       != LZO_E_OK || decompressedLength != (lzo_uint) out.size() )
+    throw exFailedToDecompressNode();
+
+  #else
+
+  unsigned long decompressedLength = out.size();
+
+  if ( uncompress( (unsigned char *)out.data(),
+                   &decompressedLength,
+                   compressedData,
+                   compressedSize ) != Z_OK ||
+       decompressedLength != (unsigned long) out.size() )
+    throw exFailedToDecompressNode();
+  #endif
+}
+
+void BtreeIndex::readNode( uint32_t offset, QByteArray & out, uint32_t * nextLeaf )
+{
+  uint32_t link = 0;
+
+  if ( !nodeCache.find( idxFileId, offset, out, link ) )
+  {
+    readNodeUncached( offset, out, &link );
+
+    nodeCache.insert( idxFileId, offset, out, link );
+  }
+
+  if ( nextLeaf )
+    *nextLeaf = link;
+}
+
+void BtreeIndex::readNodeUncached( uint32_t offset, QByteArray & out, uint32_t * nextLeaf )
+{
+  uint32_t link = 0;
+
+  uint32_t uncompressedSize, compressedSize;
+
+  if ( idxFileMapping )
+  {
+    // The index is mapped -- decompress straight from the mapping, no
+    // seeking and no intermediate copies.
+
+    if ( (qint64) offset > idxFileMappingSize )
+      throw exNodeOutOfBounds();
+
+    decodeNode( offset, idxFileMapping + offset, idxFileMappingSize - offset, out, &link );
+  }
+  else
+  {
+    // Read the header, the compressed data and, unless it's the root, the
+    // four bytes which follow the node, since they may be the link to the
+    // next leaf. Non-root nodes are never the last thing in the file.
+    uint32_t header[ 2 ];
+    vector< unsigned char > compressedData;
+    size_t trailerSize = ( offset != rootOffset ? sizeof( uint32_t ) : 0 );
+
+    if ( idxFile->readAt( offset, header, sizeof( header ) ) )
+    {
+      compressedData.resize( header[ 1 ] + trailerSize );
+
+      idxFile->readAt( (qint64) offset + sizeof( header ), &compressedData.front(),
+                       compressedData.size() );
+    }
+    else
+    {
+      // No positional reads here -- seek and read under the lock
+      Mutex::Lock _( *idxFileMutex );
+
+      idxFile->seek( offset );
+      idxFile->read( header, sizeof( header ) );
+
+      compressedData.resize( header[ 1 ] + trailerSize );
+
+      idxFile->read( &compressedData.front(), compressedData.size() );
+    }
+
+    uncompressedSize = header[ 0 ];
+    compressedSize = header[ 1 ];
+
+    //DPRINTF( "%x,%x\n", uncompressedSize, compressedSize );
+
+    out.resize( uncompressedSize );
+
+    uncompressNode( &compressedData.front(), compressedSize, out );
+
+    if ( hasNextLeafLink( offset, out ) )
+      memcpy( &link, &compressedData.front() + compressedSize, sizeof( uint32_t ) );
+
+    if ( isStoredSearchableLeaf( out ) )
+      expandSearchableLeaf( out );
+  }
+
+  if ( nextLeaf )
+    *nextLeaf = link;
+}
+
+void BtreeIndex::decodeNode( uint32_t offset, unsigned char const * data, qint64 size,
+                             QByteArray & out, uint32_t * nextLeaf )
+{
+  uint32_t link = 0;
+
+  uint32_t uncompressedSize, compressedSize;
+
+  qint64 const headerSize = 2 * sizeof( uint32_t );
+
+  if ( headerSize > size )
+    throw exNodeOutOfBounds();
+
+  memcpy( &uncompressedSize, data, sizeof( uint32_t ) );
+  memcpy( &compressedSize, data + sizeof( uint32_t ), sizeof( uint32_t ) );
+
+  data += headerSize;
+
+  if ( headerSize + compressedSize > size )
+    throw exNodeOutOfBounds();
+
+  out.resize( uncompressedSize );
+
+  uncompressNode( data, compressedSize, out );
+
+  if ( hasNextLeafLink( offset, out ) )
+  {
+    if ( headerSize + compressedSize + (qint64) sizeof( uint32_t ) > size )
+      throw exNodeOutOfBounds();
+
+    memcpy( &link, data + compressedSize, sizeof( uint32_t ) );
+  }
+
+  if ( isStoredSearchableLeaf( out ) )
+    expandSearchableLeaf( out );
+
+  if ( nextLeaf )
+    *nextLeaf = link;
+}
+
+bool BtreeIndex::hasNextLeafLink( uint32_t offset, QByteArray const & node ) const
+{
+  // Each leaf is followed by the link to the next one, except for the root,
+  // which is the only leaf when it's a leaf at all.
+  if ( offset == rootOffset || (size_t) node.size() < sizeof( uint32_t ) )
+    return false;
+
+  uint32_t leafEntries;
+
+  memcpy( &leafEntries, node.constData(), sizeof( uint32_t ) );
+
+  return leafEntries < AuxBlockMarkerFirst || leafEntries == SearchableLeafMarker;
+}
+
+char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
+                                                       bool & exactMatch,
+                                                       QByteArray & extLeaf,
+                                                       uint32_t & nextLeaf,
+                                                       char const * & leafEnd )
+{
+  if ( !idxFile )
+    throw exIndexWasNotOpened();
+
+  // Lookup the index by traversing the index btree
+
+  vector< wchar > wcharBuffer;
+
+  string targetUtf8; // Only needed for the searchable leaves
+
+  exactMatch = false;
+
+  // Read a node
+
+  loadRootNode();
+
+  uint32_t currentNodeOffset = rootOffset;
+
+  char const * leaf = rootNode.constData();
+  leafEnd = leaf + rootNode.size();
+
+  if( target.empty() )
+  {
+    //For empty target string we return first chain in index
+    for( ; ; )
+    {
+      uint32_t leafEntries = *(uint32_t *)leaf;
+
+      if ( leafEntries == 0xffffFFFF )
+      {
+        // A node
+        currentNodeOffset = *( (uint32_t *)leaf + 1 );
+        readNode( currentNodeOffset, extLeaf, &nextLeaf );
+        leaf = extLeaf.constData();
+        leafEnd = leaf + extLeaf.size();
+      }
+      else
+      {
+        // A leaf
+        if( currentNodeOffset == rootOffset )
+        {
+          // Only one leaf in index, there's no next leaf
+          nextLeaf = 0;
+        }
+        if( !leafEntryCount( leaf ) )
+          return 0;
+
+        return firstLeafChain( leaf );
+      }
+    }
+  }
+
+  for( ; ; )
+  {
+    // Is it a leaf or a node?
+
+    uint32_t leafEntries = *(uint32_t *)leaf;
+
+    if ( leafEntries == 0xffffFFFF )
+    {
+      // A node
+
+      //DPRINTF( "=>a node\n" );
+
+      uint32_t const * offsets = (uint32_t *)leaf + 1;
+
+      char const * ptr = leaf + sizeof( uint32_t ) +
+                         ( indexNodeSize + 1 ) * sizeof( uint32_t );
+
+      // ptr now points to a span of zero-separated strings, up to leafEnd.
+      // We find our match using a binary search.
+
+      char const * closestString;
+
+      int compareResult;
+
+      char const * window = ptr;
+      unsigned windowSize = leafEnd - ptr;
+
+      for( ; ; )
+      {  
+        // We boldly shoot in the middle of the whole mess, and then adjust
+        // to the beginning of the string that we've hit.
+        char const * testPoint = window + windowSize/2;
+  
+        closestString = testPoint;
+  
+        while( closestString > ptr && closestString[ -1 ] )
+          --closestString;
+  
+        size_t wordSize = strlen( closestString );
+  
+        if ( wcharBuffer.size() <= wordSize )
+          wcharBuffer.resize( wordSize + 1 );
+  
+        long result = Utf8::decode( closestString, wordSize, &wcharBuffer.front() );
+
+        if ( result < 0 )
+          throw Utf8::exCantDecode( closestString );
+  
+        wcharBuffer[ result ] = 0;
+
+        //DPRINTF( "Checking against %s\n", closestString );
+
+        compareResult = target.compare( &wcharBuffer.front() );
+  
+        if ( !compareResult )
+        {
+          // The target string matches the current one. Finish the search.
+          break;
+        }
+        if ( compareResult < 0 )
+        {
+          // The target string is smaller than the current one.
+          // Go to the left.
+          windowSize = closestString - window;
+
+          if ( !windowSize )
+            break;
+        }
+        else
+        {
+          // The target string is larger than the current one.
+          // Go to the right.
+          windowSize -= ( closestString - window )  + wordSize + 1;
+          window = closestString + wordSize + 1;
+
+          if ( !windowSize )
+            break;
+        }
+      }
+
+      #if 0
+      DPRINTF( "The winner is %s, compareResult = %d\n", closestString, compareResult );
+
+      if ( closestString != ptr )
+      {
+        char const * left = closestString -1;
+
+        while( left != ptr && left[ -1 ] )
+          --left;
+
+        DPRINTF( "To the left: %s\n", left );
+      }
+      else
+        DPRINTF( "To the lest -- nothing\n" );
+
+      char const * right = closestString + strlen( closestString ) + 1;
+
+      if ( right != leafEnd )
+      {
+        DPRINTF( "To the right: %s\n", right );
+      }
+      else
+        DPRINTF( "To the right -- nothing\n" );
+      #endif
+
+      // Now, whatever the outcome (compareResult) is, we need to find
+      // entry number for the closestMatch string.
+       
+      unsigned entry = 0;
+
+      for( char const * next = ptr; next != closestString;
+           next += strlen( next ) + 1, ++entry ) ;
+
+      // Ok, now check the outcome
+
+      if ( !compareResult )
+      {
+        // The target string matches the one found.
+        // Go to the right, since it's there where we store such results.
+        currentNodeOffset = offsets[ entry + 1 ];
+      }
+      if ( compareResult < 0 )
+      {
+        // The target string is smaller than the one found.
+        // Go to the left.
+        currentNodeOffset = offsets[ entry ];
+      }
+      else
+      {
+        // The target string is larger than the one found.
+        // Go to the right.
+        currentNodeOffset = offsets[ entry + 1 ];
+      }
+
+      //DPRINTF( "reading node at %x\n", currentNodeOffset );
+      readNode( currentNodeOffset, extLeaf, &nextLeaf );
+      leaf = extLeaf.constData();
+      leafEnd = leaf + extLeaf.size();
+    }
+    else
+    {
+      //DPRINTF( "=>a leaf\n" );
+      // A leaf
+
+      // If this leaf is the root, there's no next leaf, it just can't be.
+      // We do this check because there's no link to read for the root node
+      // anyway, since we precache it.
+      if ( currentNodeOffset == rootOffset )
+        nextLeaf = 0;
+
+      if ( !leafEntryCount( leaf ) )
+      {
+        // Empty leaf? This may only be possible for entirely empty trees only.
+        if ( currentNodeOffset != rootOffset )
+          throw exCorruptedChainData();
+        else
+          return 0; // No match
+      }
+
+      char const * chain = findChainInLeaf( target, targetUtf8, leaf,
+                                            exactMatch, wcharBuffer );
+
+      if ( chain )
+        return chain;
+
+      // The target is larger than anything in this leaf, so the first
+      // chain of the next leaf is the closest one, if there is a next leaf
+      if ( !nextLeaf )
+        return 0; // This was the last leaf
+
+      readNode( nextLeaf, extLeaf, &nextLeaf );
+
+      leafEnd = extLeaf.constData() + extLeaf.size();
+
+      return firstLeafChain( extLeaf.constData() );
+    }
+  }
+}
+
+vector< WordArticleLink > BtreeIndex::readChain( char const * & ptr )
+{
+  uint32_t chainSize;
+
+  memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+
+  ptr += sizeof( uint32_t );
+
+  vector< WordArticleLink > result;
+
+  while( chainSize )
+  {
+    string str = ptr;
+    ptr += str.size() + 1;
+
+    string prefix = ptr;
+    ptr += prefix.size() + 1;
+
+    uint32_t articleOffset;
+
+    memcpy( &articleOffset, ptr, sizeof( uint32_t ) );
+
+    ptr += sizeof( uint32_t );
+
+    result.push_back( WordArticleLink( str, articleOffset, prefix ) );
+
+    if ( chainSize < str.size() + 1 + prefix.size() + 1 + sizeof( uint32_t ) )
+      throw exCorruptedChainData();
+    else
+      chainSize -= str.size() + 1 + prefix.size() + 1 + sizeof( uint32_t );
+  }
+
+  return result;
+}
+
+void BtreeIndex::antialias( wstring const & str,
+                            vector< WordArticleLink > & chain,
+                            bool ignoreDiacritics )
+{
+  wstring caseFolded = Folding::applySimpleCaseOnly( gd::normalize( str ) );
+  if( ignoreDiacritics )
+    caseFolded = Folding::applyDiacriticsOnly( caseFolded );
+
+  for( unsigned x = chain.size(); x--; )
+  {
+    // If after applying case folding to each word they wouldn't match, we
+    // drop the entry.
+    wstring entry = Folding::applySimpleCaseOnly( gd::normalize( Utf8::decode( chain[ x ].prefix + chain[ x ].word ) ) );
+    if( ignoreDiacritics )
+      entry = Folding::applyDiacriticsOnly( entry );
+
+    if ( entry != caseFolded )
+      chain.erase( chain.begin() + x );
+    else
+    if ( chain[ x ].prefix.size() ) // If there's a prefix, merge it with the word,
+                                    // since it's what dictionaries expect
+    {
+      chain[ x ].word.insert( 0, chain[ x ].prefix );
+      chain[ x ].prefix.clear();
+    }
+  }
+}
+
+
+namespace {
+
+/// The sorted (key, chain) pairs the btree is built from, consumed one at a
+/// time.
+class IndexedWordsSource
+{
+public:
+
+  /// The folded key of the current pair
+  virtual string const & key() const = 0;
+
+  /// The chain of the current pair
+  virtual vector< WordArticleLink > const & chain() const = 0;
+
+  /// Advances to the next pair
+  virtual void next() = 0;
+
+  virtual ~IndexedWordsSource()
+  {}
+};
+
+/// Walks over the IndexedWords map
+class IndexedWordsMapSource: public IndexedWordsSource
+{
+  IndexedWords::const_iterator i;
+
+public:
+
+  IndexedWordsMapSource( IndexedWords::const_iterator const & begin ): i( begin )
+  {}
+
+  virtual string const & key() const
+  { return i->first; }
+
+  virtual vector< WordArticleLink > const & chain() const
+  { return i->second; }
+
+  virtual void next()
+  { ++i; }
+};
+
+}
+
+/// Compresses the node data
+static void compressNode( vector< unsigned char > const & uncompressedData,
+                          vector< unsigned char > & compressedData )
+{
+  #ifdef __BTREE_USE_LZO
+
+  compressedData.resize( uncompressedData.size() + uncompressedData.size() / 16 + 64 + 3 );
+
+  char workMem[ LZO1X_1_MEM_COMPRESS ];
+
+  lzo_uint compressedSize;
+
+  if ( lzo1x_1_compress( &uncompressedData.front(), uncompressedData.size(),
+                         &compressedData.front(), &compressedSize, workMem )
+       != LZO_E_OK )
+  {
+    FDPRINTF( stderr, "Failed to compress btree node.\n" );
+    abort();
+  }
+
+  #else
+
+  compressedData.resize( compressBound( uncompressedData.size() ) );
+
+  unsigned long compressedSize = compressedData.size();
+
+  if ( compress( &compressedData.front(), &compressedSize,
+                 &uncompressedData.front(), uncompressedData.size() ) != Z_OK )
+  {
+    qFatal( "Failed to compress btree node." );
+    abort();
+  }
+
+  #endif
+
+  compressedData.resize( compressedSize );
+}
+
+namespace {
+
+/// A node waiting in the NodeWriter's queue
+struct PendingNode
+{
+  vector< unsigned char > data, compressedData;
+  bool isLeaf;
+
+  /// For the nodes with children, the ids of those, to be replaced with
+  /// their offsets once they are written. The offsets are stored one after
+  /// another, beginning at childrenPos.
+  vector< size_t > children;
+  size_t childrenPos;
+
+  /// Set once compressedData is ready
+  bool compressed;
+};
+
+/// Compresses the btree nodes on the global thread pool and writes them out
+/// in the order they were added, so the result is the same as if everything
+/// was done sequentially. The nodes with children are compressed only once
+/// all the children are written, since only then their offsets are known.
+/// When no thread of the pool is free, the node is compressed right on the
+/// calling thread, so the writer never waits for the work queued behind
+/// someone else's.
+class NodeWriter
+{
+  File::Class & file;
+  bool parallel;
+  size_t maxPending;
+
+  /// Released by each of the runnables started once it's done with the writer
+  QSemaphore hasExited;
+  int started;
+
+  QMutex mutex;
+  QWaitCondition nodeCompressed;
+
+  std::deque< PendingNode * > pending;
+  size_t nextId; // Id of the first node in the pending queue
+
+  vector< uint32_t > offsets; // Offsets of the nodes written, by their ids
+  uint32_t lastLeafLinkOffset;
+
+  class CompressRunnable: public QRunnable
+  {
+    NodeWriter & writer;
+    PendingNode & node;
+
+  public:
+
+    CompressRunnable( NodeWriter & writer_, PendingNode & node_ ):
+      writer( writer_ ), node( node_ )
+    {}
+
+    ~CompressRunnable()
+    {
+      writer.hasExited.release();
+    }
+
+    virtual void run();
+  };
+
+  /// Writes out the node at the front of the queue
+  void writeFront();
+
+public:
+
+  NodeWriter( File::Class & );
+  ~NodeWriter();
+
+  /// Adds the node to the queue, taking its data. Returns the node id.
+  size_t add( vector< unsigned char > & data, bool isLeaf,
+              vector< size_t > const & children,
+              size_t childrenPos = sizeof( uint32_t ) );
+
+  /// Writes out all the nodes left. Returns the offset of the node with the
+  /// given id.
+  uint32_t finish( size_t id );
+};
+
+void NodeWriter::CompressRunnable::run()
+{
+  compressNode( node.data, node.compressedData );
+
+  QMutexLocker _( &writer.mutex );
+
+  node.compressed = true;
+
+  writer.nodeCompressed.wakeAll();
+}
+
+NodeWriter::NodeWriter( File::Class & file_ ): file( file_ ), started( 0 ),
+  nextId( 0 ), lastLeafLinkOffset( 0 )
+{
+  int threads = QThreadPool::globalInstance()->maxThreadCount();
+
+  parallel = threads > 1;
+  maxPending = threads > 1 ? threads * 4 : 1;
+}
+
+NodeWriter::~NodeWriter()
+{
+  hasExited.acquire( started );
+
+  for( size_t x = 0; x < pending.size(); ++x )
+    delete pending[ x ];
+}
+
+size_t NodeWriter::add( vector< unsigned char > & data, bool isLeaf,
+                        vector< size_t > const & children, size_t childrenPos )
+{
+  PendingNode * node = new PendingNode;
+
+  node->data.swap( data );
+  node->isLeaf = isLeaf;
+  node->children = children;
+  node->childrenPos = childrenPos;
+  node->compressed = false;
+
+  size_t id;
+
+  {
+    QMutexLocker _( &mutex );
+    pending.push_back( node );
+    id = nextId + pending.size() - 1;
+  }
+
+  if ( parallel && children.empty() )
+  {
+    CompressRunnable * runnable = new CompressRunnable( *this, *node );
+
+    if ( !QThreadPool::globalInstance()->tryStart( runnable ) )
+    {
+      // No thread is free, so compress the node right here
+      runnable->run();
+      delete runnable;
+    }
+
+    ++started;
+  }
+
+  // Write out whatever is ready, and make sure the queue doesn't grow too
+  // long
+
+  for( ; ; )
+  {
+    QMutexLocker _( &mutex );
+
+    if ( pending.empty() )
+      break;
+
+    PendingNode & front = *pending.front();
+
+    if ( !front.compressed && !front.children.empty() )
+    {
+      // All the children of the node are written already, so we can fill
+      // in their offsets and compress it right here
+      _.unlock();
+      writeFront();
+      continue;
+    }
+
+    if ( !front.compressed && parallel )
+    {
+      if ( pending.size() <= maxPending )
+        break;
+
+      nodeCompressed.wait( &mutex );
+      continue;
+    }
+
+    _.unlock();
+    writeFront();
+  }
+
+  return id;
+}
+
+void NodeWriter::writeFront()
+{
+  PendingNode * node;
+
+  {
+    QMutexLocker _( &mutex );
+    node = pending.front();
+  }
+
+  if ( !node->compressed )
+  {
+    for( size_t x = 0; x < node->children.size(); ++x )
+      memcpy( &node->data.front() + node->childrenPos + x * sizeof( uint32_t ),
+              &offsets[ node->children[ x ] ], sizeof( uint32_t ) );
+
+    compressNode( node->data, node->compressedData );
+  }
+
+  uint32_t offset = file.tell();
+
+  file.write< uint32_t >( node->data.size() );
+  file.write< uint32_t >( node->compressedData.size() );
+  file.write( &node->compressedData.front(), node->compressedData.size() );
+
+  if ( node->isLeaf )
+  {
+    // A link to the next leef, which is zero and which will be updated
+    // should we happen to have another leaf.
+    
+    file.write( ( uint32_t ) 0 );
+
+    uint32_t here = file.tell();
+
+    if ( lastLeafLinkOffset )
+    {
+      // Update the previous leaf to have the offset of this one.
+      file.seek( lastLeafLinkOffset );
+      file.write( offset );
+      file.seek( here );
+    }
+
+    // Make sure next leaf knows where to write its offset for us.
+    lastLeafLinkOffset = here - sizeof( uint32_t );
+  }
+
+  offsets.push_back( offset );
+
+  {
+    QMutexLocker _( &mutex );
+    pending.pop_front();
+    ++nextId;
+  }
+
+  delete node;
+}
+
+uint32_t NodeWriter::finish( size_t id )
+{
+  for( ; ; )
+  {
+    QMutexLocker _( &mutex );
+
+    if ( pending.empty() )
+      break;
+
+    PendingNode & front = *pending.front();
+
+    if ( !front.compressed && front.children.empty() && parallel )
+    {
+      nodeCompressed.wait( &mutex );
+      continue;
+    }
+
+    _.unlock();
+    writeFront();
+  }
+
+  return offsets[ id ];
+}
+
+}
+
+namespace {
+
+/// Appends the value as a varint, the way readVarint() reads it
+void appendVarint( string & out, uint32_t value )
+{
+  while( value >= 0x80 )
+  {
+    out.push_back( (char)( ( value & 0x7F ) | 0x80 ) );
+    value >>= 7;
+  }
+
+  out.push_back( (char) value );
+}
+
+/// Creates an empty temporary file for the data spilled while building the
+/// index, and returns its name. The file is to be removed by the caller.
+string createTemporaryFile()
+{
+  QTemporaryFile tmp( QDir::tempPath() + "/gd-index-XXXXXX" );
+
+  tmp.setAutoRemove( false );
+
+  if ( !tmp.open() )
+    throw File::exCantOpen( FsEncoding::encode( tmp.fileTemplate() ) );
+
+  return FsEncoding::encode( tmp.fileName() );
+}
+
+/// Collects the records of a plain struct type, and gives them back sorted
+/// by their operator <. Once there are more of them than fit in the memory
+/// limit, they get sorted and spilled to a temporary file, and the spilled
+/// runs are merged back when reading.
+template< class Record >
+class SortedRecords
+{
+  enum
+  {
+    /// The records are read back from each run this many at a time
+    ReadChunk = 4096
+  };
+
+  size_t maxRecords;
+  vector< Record > records;
+  vector< string > runFileNames;
+  vector< size_t > runRecords;
+
+  // The state of the reading
+
+  struct Run
+  {
+    sptr< File::Class > file;
+    size_t left; // Records not read from the file yet
+    vector< Record > chunk;
+    size_t next; // Next record of the chunk
+  };
+
+  vector< Run > runs;
+  vector< size_t > heap; // Indices of the runs which still have records
+  size_t next; // Next record in memory, when nothing was spilled
+
+  class HeadGreater
+  {
+    vector< Run > const & runs;
+
+  public:
+
+    HeadGreater( vector< Run > const & runs_ ): runs( runs_ )
+    {}
+
+    bool operator () ( size_t a, size_t b ) const
+    { return runs[ b ].chunk[ runs[ b ].next ] < runs[ a ].chunk[ runs[ a ].next ]; }
+  };
+
+  /// Makes sure the run has a record to read. Returns false if it has none
+  /// left.
+  bool fillChunk( Run & );
+
+  void spill();
+
+public:
+
+  explicit SortedRecords( size_t memoryLimit ):
+    maxRecords( std::max( memoryLimit / sizeof( Record ), (size_t) ReadChunk ) ),
+    next( 0 )
+  {}
+
+  ~SortedRecords();
+
+  void add( Record const & record )
+  {
+    records.push_back( record );
+
+    if ( records.size() >= maxRecords )
+      spill();
+  }
+
+  /// Sorts the records and starts reading them from the first one. Can be
+  /// called again to read them all once more. No records can be added
+  /// after that.
+  void rewind();
+
+  /// Reads the next record. Returns false when there are no more of them.
+  bool read( Record & );
+};
+
+template< class Record >
+SortedRecords< Record >::~SortedRecords()
+{
+  runs.clear(); // Closes the files
+
+  for( size_t x = 0; x < runFileNames.size(); ++x )
+    QFile::remove( FsEncoding::decode( runFileNames[ x ].c_str() ) );
+}
+
+template< class Record >
+void SortedRecords< Record >::spill()
+{
+  std::sort( records.begin(), records.end() );
+
+  runFileNames.push_back( createTemporaryFile() );
+  runRecords.push_back( records.size() );
+
+  File::Class run( runFileNames.back(), "wb" );
+
+  run.write( &records.front(), records.size() * sizeof( Record ) );
+
+  run.close();
+
+  // Keep the capacity around for the next run
+  records.clear();
+}
+
+template< class Record >
+void SortedRecords< Record >::rewind()
+{
+  if ( runFileNames.empty() )
+  {
+    // Everything fits in memory
+    if ( !next )
+      std::sort( records.begin(), records.end() );
+
+    next = 0;
+    return;
+  }
+
+  if ( !records.empty() )
+    spill();
+
+  runs.resize( runFileNames.size() );
+  heap.clear();
+
+  for( size_t x = 0; x < runs.size(); ++x )
+  {
+    if ( !runs[ x ].file )
+      runs[ x ].file = new File::Class( runFileNames[ x ], "rb" );
+    else
+      runs[ x ].file->rewind();
+
+    runs[ x ].left = runRecords[ x ];
+    runs[ x ].chunk.clear();
+    runs[ x ].next = 0;
+
+    if ( fillChunk( runs[ x ] ) )
+      heap.push_back( x );
+  }
+
+  std::make_heap( heap.begin(), heap.end(), HeadGreater( runs ) );
+}
+
+template< class Record >
+bool SortedRecords< Record >::fillChunk( Run & run )
+{
+  if ( run.next < run.chunk.size() )
+    return true;
+
+  if ( !run.left )
+    return false;
+
+  run.chunk.resize( std::min( run.left, (size_t) ReadChunk ) );
+  run.file->read( &run.chunk.front(), run.chunk.size() * sizeof( Record ) );
+
+  run.left -= run.chunk.size();
+  run.next = 0;
+
+  return true;
+}
+
+template< class Record >
+bool SortedRecords< Record >::read( Record & record )
+{
+  if ( runFileNames.empty() )
+  {
+    if ( next == records.size() )
+      return false;
+
+    record = records[ next++ ];
+    return true;
+  }
+
+  if ( heap.empty() )
+    return false;
+
+  std::pop_heap( heap.begin(), heap.end(), HeadGreater( runs ) );
+
+  Run & run = runs[ heap.back() ];
+
+  record = run.chunk[ run.next++ ];
+
+  if ( fillChunk( run ) )
+    std::push_heap( heap.begin(), heap.end(), HeadGreater( runs ) );
+  else
+    heap.pop_back();
+
+  return true;
+}
+
+/// Sees all the keys of the index, in order, as the leaves are built.
+class KeyObserver
+{
+public:
+
+  virtual void addKey( string const & key, vector< WordArticleLink > const & chain ) = 0;
+
+  /// Called once each leaf is handed over to the writer, after all of its
+  /// keys were added. The id is the one the writer assigned to it.
+  virtual void addLeaf( size_t /* id */, size_t /* keys */ )
+  {}
+
+  virtual ~KeyObserver()
+  {}
+};
+
+/// Sets the bits of the Bloom filter
+class BloomBitSetter
+{
+  unsigned char * bits;
+
+public:
+
+  BloomBitSetter( unsigned char * bits_ ): bits( bits_ )
+  {}
+
+  bool operator () ( size_t byte, unsigned char mask ) const
+  {
+    bits[ byte ] |= mask;
+    return true;
+  }
+};
+
+/// Builds the Bloom filter over all the keys
+class BloomFilterBuilder: public KeyObserver
+{
+  vector< unsigned char > data;
+  uint32_t blocks;
+
+public:
+
+  BloomFilterBuilder( size_t keys );
+
+  virtual void addKey( string const & key, vector< WordArticleLink > const & );
+
+  /// The filter block, as it is to be stored in the index
+  vector< unsigned char > & getData()
+  { return data; }
+};
+
+BloomFilterBuilder::BloomFilterBuilder( size_t keys )
+{
+  blocks = ( keys * BloomFilterBitsPerKey + BloomFilterBlockSize * 8 - 1 ) /
+           ( BloomFilterBlockSize * 8 );
+
+  if ( !blocks )
+    blocks = 1;
+
+  uint32_t header[ 3 ] = { BloomFilterMarker, BloomFilterHashes, blocks };
+
+  data.resize( sizeof( header ) + (size_t) blocks * BloomFilterBlockSize );
+
+  memcpy( &data.front(), header, sizeof( header ) );
+}
+
+void BloomFilterBuilder::addKey( string const & key, vector< WordArticleLink > const & )
+{
+  BloomBitSetter setter( &data.front() + 3 * sizeof( uint32_t ) );
+
+  forEachBloomBit( hashKey( key.data(), key.size() ), BloomFilterHashes, blocks,
+                   setter );
+}
+
+/// Hands the keys over to several observers
+class KeyObserverList: public KeyObserver
+{
+  vector< KeyObserver * > observers;
+
+public:
+
+  void add( KeyObserver & observer )
+  { observers.push_back( &observer ); }
+
+  virtual void addKey( string const & key, vector< WordArticleLink > const & chain )
+  {
+    for( size_t x = 0; x < observers.size(); ++x )
+      observers[ x ]->addKey( key, chain );
+  }
+
+  virtual void addLeaf( size_t id, size_t keys )
+  {
+    for( size_t x = 0; x < observers.size(); ++x )
+      observers[ x ]->addLeaf( id, keys );
+  }
+};
+
+/// Builds the trigram index. Each key gets listed under all the trigrams of
+/// its links' folded headwords, prefixes included, so any headword the
+/// wildcard search might match can be found through them. The postings are
+/// sorted by their trigrams through the spilled runs, so only the table of
+/// the trigrams is kept in memory as a whole.
+class TrigramIndexBuilder: public KeyObserver
+{
+  struct Posting
+  {
+    uint32_t trigramHigh, trigramLow; // See makeTrigram()
+    uint32_t key; // Ordinal of the key
+
+    bool operator < ( Posting const & other ) const
+    {
+      if ( trigramHigh != other.trigramHigh )
+        return trigramHigh < other.trigramHigh;
+
+      if ( trigramLow != other.trigramLow )
+        return trigramLow < other.trigramLow;
+
+      return key < other.key;
+    }
+  };
+
+  SortedRecords< Posting > postings;
+  uint32_t keys;
+
+  vector< size_t > leaves;
+  vector< uint32_t > leafFirstKeys;
+
+public:
+
+  TrigramIndexBuilder(): postings( ExtraPartMemoryLimit ), keys( 0 )
+  {}
+
+  virtual void addKey( string const & key, vector< WordArticleLink > const & );
+
+  virtual void addLeaf( size_t id, size_t keys );
+
+  /// Hands the posting blocks over to the writer and returns the trigram
+  /// index block, with the room for the offsets of its children, which are
+  /// stored to 'children'
+  vector< unsigned char > getData( NodeWriter &, vector< size_t > & children );
+};
+
+void TrigramIndexBuilder::addKey( string const &, vector< WordArticleLink > const & chain )
+{
+  vector< quint64 > trigrams;
+  string previous;
+
+  for( size_t x = 0; x < chain.size(); ++x )
+  {
+    string headword = chain[ x ].prefix + chain[ x ].word;
+
+    // The links mostly differ only in their articles
+    if ( x && headword == previous )
+      continue;
+
+    appendTrigrams( Folding::apply( Utf8::decode( headword ) ), trigrams );
+
+    previous.swap( headword );
+  }
+
+  std::sort( trigrams.begin(), trigrams.end() );
+  trigrams.erase( std::unique( trigrams.begin(), trigrams.end() ), trigrams.end() );
+
+  for( size_t x = 0; x < trigrams.size(); ++x )
+  {
+    Posting posting;
+
+    posting.trigramHigh = (uint32_t)( trigrams[ x ] >> 32 );
+    posting.trigramLow = (uint32_t) trigrams[ x ];
+    posting.key = keys;
+
+    postings.add( posting );
+  }
+
+  ++keys;
+}
+
+void TrigramIndexBuilder::addLeaf( size_t id, size_t leafKeys )
+{
+  leaves.push_back( id );
+  leafFirstKeys.push_back( keys - leafKeys );
+}
+
+vector< unsigned char > TrigramIndexBuilder::getData( NodeWriter & writer,
+                                                      vector< size_t > & children )
+{
+  vector< size_t > blocks;
+  vector< TrigramEntry > entries;
+
+  vector< unsigned char > block;
+  string deltas; // The posting list of the current trigram
+
+  postings.rewind();
+
+  Posting posting = Posting();
+  bool hasPosting = postings.read( posting );
+
+  for( ; ; )
+  {
+    // Gather the posting list of the next trigram
+
+    TrigramEntry entry;
+
+    entry.trigramHigh = posting.trigramHigh;
+    entry.trigramLow = posting.trigramLow;
+    entry.count = 0;
+
+    deltas.clear();
+
+    for( uint32_t last = 0; hasPosting && posting.trigramHigh == entry.trigramHigh &&
+                            posting.trigramLow == entry.trigramLow; )
+    {
+      appendVarint( deltas, posting.key - last );
+
+      last = posting.key;
+      ++entry.count;
+
+      hasPosting = postings.read( posting );
+    }
+
+    bool done = !entry.count;
+
+    // Flush the block once it's full, or once there's nothing left
+    if ( block.size() > sizeof( uint32_t ) &&
+         ( done || block.size() + deltas.size() > TrigramBlockSize ) )
+    {
+      blocks.push_back( writer.add( block, false, vector< size_t >() ) );
+      block.clear();
+    }
+
+    if ( done )
+      break;
+
+    if ( block.empty() )
+    {
+      block.resize( sizeof( uint32_t ) );
+
+      uint32_t marker = TrigramPostingsMarker;
+
+      memcpy( &block.front(), &marker, sizeof( marker ) );
+    }
+
+    entry.block = blocks.size();
+    entry.offset = block.size();
+
+    entries.push_back( entry );
+
+    block.insert( block.end(), deltas.begin(), deltas.end() );
+  }
+
+  TrigramHeader header;
+
+  header.marker = TrigramIndexMarker;
+  header.keys = keys;
+  header.leaves = leaves.size();
+  header.blocks = blocks.size();
+  header.trigrams = entries.size();
+
+  // The offsets of the leaves and of the blocks are filled in by the writer
+  vector< unsigned char > data( sizeof( header ) +
+                                ( leaves.size() + blocks.size() ) * sizeof( uint32_t ) );
+
+  memcpy( &data.front(), &header, sizeof( header ) );
+
+  if ( !leafFirstKeys.empty() )
+    data.insert( data.end(), (unsigned char const *) &leafFirstKeys.front(),
+                 (unsigned char const *) ( &leafFirstKeys.front() + leafFirstKeys.size() ) );
+
+  if ( !entries.empty() )
+    data.insert( data.end(), (unsigned char const *) &entries.front(),
+                 (unsigned char const *) ( &entries.front() + entries.size() ) );
+
+  children = leaves;
+  children.insert( children.end(), blocks.begin(), blocks.end() );
+
+  return data;
+}
+
+/// Builds the offset map. Each article gets mapped to the headword of the
+/// first link to it the index lists, which is the one the scan of the
+/// leaves would have found. Neither the links nor the headwords are kept in
+/// memory as a whole: the links are sorted by their articles through the
+/// spilled runs, and the headwords are spilled in the order they come. Only
+/// the headwords some article ends up mapped to get pooled in the index.
+class OffsetMapBuilder: public KeyObserver
+{
+  struct Link
+  {
+    uint32_t articleOffset;
+    uint32_t headword; // Number among all the headwords seen
+
+    bool operator < ( Link const & other ) const
+    {
+      return articleOffset < other.articleOffset ||
+             ( articleOffset == other.articleOffset && headword < other.headword );
+    }
+  };
+
+  SortedRecords< Link > links;
+
+  string headwords; // The headwords not spilled yet, zero-terminated
+  string headwordsFileName; // Empty if none were spilled
+  sptr< File::Class > headwordsFile;
+  string lastHeadword;
+  uint32_t headwordCount;
+
+  /// Walks all the headwords seen, in order. Those whose bits are set in
+  /// 'used' are packed into the blocks handed over to the writer.
+  void writeHeadwordBlocks( NodeWriter &, vector< uint32_t > const & used,
+                            vector< size_t > & blocks,
+                            vector< uint32_t > & firstHeadwords );
+
+  /// Same as the above, for the part of the headwords given
+  void addHeadwords( char const * data, size_t size, string & partial,
+                     vector< uint32_t > const & used, uint32_t & headword,
+                     NodeWriter &, vector< unsigned char > & block,
+                     vector< size_t > & blocks,
+                     vector< uint32_t > & firstHeadwords );
+
+public:
+
+  OffsetMapBuilder(): links( ExtraPartMemoryLimit / 2 ), headwordCount( 0 )
+  {}
+
+  ~OffsetMapBuilder();
+
+  virtual void addKey( string const & key, vector< WordArticleLink > const & );
+
+  /// Hands the entry and headword blocks over to the writer and returns the
+  /// offset map block, with the room for the offsets of its children, which
+  /// are stored to 'children'
+  vector< unsigned char > getData( NodeWriter &, vector< size_t > & children );
+};
+
+OffsetMapBuilder::~OffsetMapBuilder()
+{
+  headwordsFile.reset();
+
+  if ( headwordsFileName.size() )
+    QFile::remove( FsEncoding::decode( headwordsFileName.c_str() ) );
+}
+
+void OffsetMapBuilder::addKey( string const &, vector< WordArticleLink > const & chain )
+{
+  for( size_t x = 0; x < chain.size(); ++x )
+  {
+    string headword = chain[ x ].prefix + chain[ x ].word;
+
+    if ( !headwordCount || headword != lastHeadword )
+    {
+      headwords.append( headword.c_str(), headword.size() + 1 );
+      lastHeadword.swap( headword );
+      ++headwordCount;
+
+      if ( headwords.size() >= ExtraPartMemoryLimit / 2 )
+      {
+        if ( !headwordsFile )
+        {
+          headwordsFileName = createTemporaryFile();
+          headwordsFile = new File::Class( headwordsFileName, "wb" );
+        }
+
+        headwordsFile->write( headwords.data(), headwords.size() );
+        headwords.clear();
+      }
+    }
+
+    Link link;
+
+    link.articleOffset = chain[ x ].articleOffset;
+    link.headword = headwordCount - 1;
+
+    links.add( link );
+  }
+}
+
+/// Returns the number of the bits set
+static unsigned countBits( uint32_t value )
+{
+  value = value - ( ( value >> 1 ) & 0x55555555 );
+  value = ( value & 0x33333333 ) + ( ( value >> 2 ) & 0x33333333 );
+
+  return ( ( ( value + ( value >> 4 ) ) & 0x0F0F0F0F ) * 0x01010101 ) >> 24;
+}
+
+/// Returns the number of the used headwords preceding the given one
+static uint32_t usedNumber( vector< uint32_t > const & used,
+                            vector< uint32_t > const & usedBefore, uint32_t headword )
+{
+  return usedBefore[ headword / 32 ] +
+         countBits( used[ headword / 32 ] & ( ( 1u << ( headword % 32 ) ) - 1 ) );
+}
+
+void OffsetMapBuilder::addHeadwords( char const * data, size_t size, string & partial,
+                                     vector< uint32_t > const & used, uint32_t & headword,
+                                     NodeWriter & writer, vector< unsigned char > & block,
+                                     vector< size_t > & blocks,
+                                     vector< uint32_t > & firstHeadwords )
+{
+  while( size )
+  {
+    char const * end = (char const *) memchr( data, 0, size );
+
+    if ( !end )
+    {
+      // The rest of it comes with the next part
+      partial.append( data, size );
+      return;
+    }
+
+    partial.append( data, end - data );
+
+    size -= end - data + 1;
+    data = end + 1;
+
+    if ( used[ headword / 32 ] & ( 1u << ( headword % 32 ) ) )
+    {
+      if ( block.empty() )
+      {
+        uint32_t marker = OffsetMapHeadwordsMarker;
+
+        block.assign( (unsigned char const *) &marker,
+                      (unsigned char const *) &marker + sizeof( marker ) );
+
+        firstHeadwords.push_back( headword );
+      }
+
+      // Each block gets at least one headword, however long it is
+      block.insert( block.end(), partial.begin(), partial.end() );
+      block.push_back( 0 );
+
+      if ( block.size() >= OffsetMapBlockSize )
+      {
+        blocks.push_back( writer.add( block, false, vector< size_t >() ) );
+        block.clear();
+      }
+    }
+
+    partial.clear();
+    ++headword;
+  }
+}
+
+void OffsetMapBuilder::writeHeadwordBlocks( NodeWriter & writer,
+                                            vector< uint32_t > const & used,
+                                            vector< size_t > & blocks,
+                                            vector< uint32_t > & firstHeadwords )
+{
+  string partial;
+  uint32_t headword = 0;
+  vector< unsigned char > block;
+
+  if ( headwordsFile )
+  {
+    headwordsFile->close();
+
+    File::Class file( headwordsFileName, "rb" );
+
+    vector< char > buffer( 64 * 1024 );
+
+    while( size_t size = file.readRecords( &buffer.front(), 1, buffer.size() ) )
+      addHeadwords( &buffer.front(), size, partial, used, headword, writer, block,
+                    blocks, firstHeadwords );
+  }
+
+  addHeadwords( headwords.data(), headwords.size(), partial, used, headword, writer,
+                block, blocks, firstHeadwords );
+
+  if ( block.size() )
+    blocks.push_back( writer.add( block, false, vector< size_t >() ) );
+}
+
+vector< unsigned char > OffsetMapBuilder::getData( NodeWriter & writer,
+                                                   vector< size_t > & children )
+{
+  // Find out which headwords are used. The links of each article come
+  // sorted by their headwords, so the first one is the one to map to.
+
+  vector< uint32_t > used( headwordCount / 32 + 1 );
+
+  uint32_t entries = 0;
+
+  Link link;
+  bool hasLast = false;
+  uint32_t lastOffset = 0;
+
+  for( links.rewind(); links.read( link ); )
+  {
+    if ( hasLast && link.articleOffset == lastOffset )
+      continue;
+
+    used[ link.headword / 32 ] |= 1u << ( link.headword % 32 );
+
+    hasLast = true;
+    lastOffset = link.articleOffset;
+    ++entries;
+  }
+
+  // The numbers of the headwords pooled are the numbers of the used
+  // headwords preceding them. These are the ones preceding each word of
+  // the bits.
+
+  vector< uint32_t > usedBefore( used.size() );
+
+  uint32_t usedHeadwords = 0;
+
+  for( size_t x = 0; x < used.size(); ++x )
+  {
+    usedBefore[ x ] = usedHeadwords;
+    usedHeadwords += countBits( used[ x ] );
+  }
+
+  vector< size_t > headwordBlocks;
+  vector< uint32_t > firstHeadwords;
+
+  writeHeadwordBlocks( writer, used, headwordBlocks, firstHeadwords );
+
+  for( size_t x = 0; x < firstHeadwords.size(); ++x )
+    firstHeadwords[ x ] = usedNumber( used, usedBefore, firstHeadwords[ x ] );
+
+  vector< size_t > entryBlocks;
+  vector< uint32_t > firstOffsets;
+
+  vector< unsigned char > block;
+
+  hasLast = false;
+
+  for( links.rewind(); links.read( link ); )
+  {
+    if ( hasLast && link.articleOffset == lastOffset )
+      continue;
+
+    hasLast = true;
+    lastOffset = link.articleOffset;
+
+    if ( block.empty() )
+    {
+      uint32_t marker = OffsetMapEntriesMarker;
+
+      block.assign( (unsigned char const *) &marker,
+                    (unsigned char const *) &marker + sizeof( marker ) );
+
+      firstOffsets.push_back( link.articleOffset );
+    }
+
+    OffsetMapEntry entry;
+
+    entry.articleOffset = link.articleOffset;
+    entry.headword = usedNumber( used, usedBefore, link.headword );
+
+    block.insert( block.end(), (unsigned char const *) &entry,
+                  (unsigned char const *) &entry + sizeof( entry ) );
+
+    if ( block.size() == sizeof( uint32_t ) + OffsetMapBlockEntries * sizeof( entry ) )
+    {
+      entryBlocks.push_back( writer.add( block, false, vector< size_t >() ) );
+      block.clear();
+    }
+  }
+
+  if ( block.size() )
+    entryBlocks.push_back( writer.add( block, false, vector< size_t >() ) );
+
+  OffsetMapHeader header;
+
+  header.marker = OffsetMapMarker;
+  header.entries = entries;
+  header.entryBlocks = entryBlocks.size();
+  header.headwords = usedHeadwords;
+  header.headwordBlocks = headwordBlocks.size();
+
+  // The offsets of the blocks are filled in by the writer
+  vector< unsigned char > data( sizeof( header ) +
+                                ( entryBlocks.size() + headwordBlocks.size() ) *
+                                sizeof( uint32_t ) );
+
+  memcpy( &data.front(), &header, sizeof( header ) );
+
+  if ( !firstOffsets.empty() )
+    data.insert( data.end(), (unsigned char const *) &firstOffsets.front(),
+                 (unsigned char const *) ( &firstOffsets.front() + firstOffsets.size() ) );
+
+  if ( !firstHeadwords.empty() )
+    data.insert( data.end(), (unsigned char const *) &firstHeadwords.front(),
+                 (unsigned char const *) ( &firstHeadwords.front() + firstHeadwords.size() ) );
+
+  children = entryBlocks;
+  children.insert( children.end(), headwordBlocks.begin(), headwordBlocks.end() );
+
+  return data;
+}
+}
+
+/// A function which recursively creates btree node.
+/// The source is being advanced when building leaf nodes. The nodes are
+/// handed over to the writer, and the id it assigns to the node is returned.
+static size_t buildBtreeNode( IndexedWordsSource & source,
+                              size_t indexSize,
+                              NodeWriter & writer, size_t maxElements,
+                              bool searchableLeaves,
+                              KeyObserver & observer )
+{
+  // We compress all the node data. This buffer would hold it.
+  vector< unsigned char > uncompressedData;
+
+  bool isLeaf = indexSize <= maxElements;
+
+  // The ids of the children, for the nodes which have them
+  vector< size_t > children;
+
+  if ( isLeaf )
+  {
+    // A leaf.
+
+    // First uint32_t indicates that this is a leaf.
+    uncompressedData.resize( sizeof( uint32_t ) );
+    *(uint32_t *)&uncompressedData.front() = indexSize;
+
+    for( unsigned x = indexSize; x--; source.next() )
+    {
+      vector< WordArticleLink > const & chain = source.chain();
+
+      observer.addKey( source.key(), chain );
+
+      uint32_t size = 0;
+
+      for( unsigned y = 0; y < chain.size(); ++y )
+        size += chain[ y ].word.size() + 1 + chain[ y ].prefix.size() + 1 + sizeof( uint32_t );
+
+      size_t saveSizeHere = uncompressedData.size();
+
+      uncompressedData.resize( saveSizeHere + sizeof( uint32_t ) + size );
+
+      unsigned char * ptr = &uncompressedData.front() + saveSizeHere;
+
+      memcpy( ptr, &size, sizeof( uint32_t ) );
+      ptr += sizeof( uint32_t );
+
+      for( unsigned y = 0; y < chain.size(); ++y )
+      {
+        memcpy( ptr, chain[ y ].word.c_str(), chain[ y ].word.size() + 1 );
+        ptr += chain[ y ].word.size() + 1;
+
+        memcpy( ptr, chain[ y ].prefix.c_str(), chain[ y ].prefix.size() + 1 );
+        ptr += chain[ y ].prefix.size() + 1;
+
+        memcpy( ptr, &(chain[ y ].articleOffset), sizeof( uint32_t ) );
+        ptr += sizeof( uint32_t );
+      }
+    }
+
+    if ( searchableLeaves )
+      storeSearchableLeaf( uncompressedData );
+  }
+  else
+  {
+    // A node which will have children.
+
+    uncompressedData.resize( sizeof( uint32_t ) + ( maxElements + 1 ) * sizeof( uint32_t ) );
+
+    // First uint32_t indicates that this is a node.
+    *(uint32_t *)&uncompressedData.front() = 0xffffFFFF;
+
+    unsigned prevEntry = 0;
+
+    for( unsigned x = 0; x < maxElements; ++x )
+    {
+      unsigned curEntry = (uint64_t) indexSize * ( x + 1 ) / ( maxElements + 1 );
+
+      children.push_back( buildBtreeNode( source,
+                                          curEntry - prevEntry,
+                                          writer, maxElements,
+                                          searchableLeaves,
+                                          observer ) );
+
+      string const & key = source.key();
+
+      size_t sz = key.size() + 1;
+
+      size_t prevSize = uncompressedData.size();
+      uncompressedData.resize( prevSize + sz );
+
+      memcpy( &uncompressedData.front() + prevSize, key.c_str(), sz );
+
+      prevEntry = curEntry;
+    }
+
+    // Rightmost child
+    children.push_back( buildBtreeNode( source,
+                                        indexSize - prevEntry,
+                                        writer, maxElements,
+                                        searchableLeaves,
+                                        observer ) );
+
+    // The child offsets are filled in by the writer
+  }
+
+  // Save the result.
+
+  size_t id = writer.add( uncompressedData, isLeaf, children );
+
+  if ( isLeaf )
+    observer.addLeaf( id, indexSize );
+
+  return id;
+}
+
+/// Tells whether the link with the given prefix is a middle match, that is,
+/// a link of one of the headword's words but the first one. The link of the
+/// first word only has the punctuation the headword starts with as its
+/// prefix.
+static bool isMiddleMatch( string const & prefix )
+{
+  if ( prefix.empty() )
+    return false;
+
+  wstring decoded = Utf8::decode( prefix );
+
+  for( size_t x = 0; x < decoded.size(); ++x )
+    if ( !Folding::isWhitespace( decoded[ x ] ) && !Folding::isPunct( decoded[ x ] ) )
+      return true;
+
+  return false;
+}
+
+/// Splits the headword into the words it consists of, folds them and hands
+/// the resulting links over to the given collection's addLink().
+template< class Words >
+static void addWordLinks( Words & words, wstring const & word,
+                          uint32_t articleOffset, unsigned int maxHeadwordSize )
+{
+  wchar const * wordBegin = word.c_str();
+  string::size_type wordSize = word.size();
+
+  // Safeguard us against various bugs here. Don't attempt adding words
+  // which are freakishly huge.
+  if ( wordSize > maxHeadwordSize )
+  {
+#define MAX_LOG_WORD_SIZE 500
+    string headword;
+    if( wordSize <= MAX_LOG_WORD_SIZE )
+      headword = Utf8::encode( word );
+    else
+    {
+      std::vector< char > buffer( MAX_LOG_WORD_SIZE * 4 );
+      headword = string( &buffer.front(),
+                         Utf8::encode( wordBegin, MAX_LOG_WORD_SIZE, &buffer.front() ) );
+      headword += "...";
+    }
+    gdWarning( "Skipped too long headword: \"%s\"", headword.c_str() );
+    return;
+#undef MAX_LOG_WORD_SIZE
+  }
+
+  // Skip any leading whitespace
+  while( *wordBegin && Folding::isWhitespace( *wordBegin ) )
+  {
+    ++wordBegin;
+    --wordSize;
+  }
+
+  // Skip any trailing whitespace
+  while( wordSize && Folding::isWhitespace( wordBegin[ wordSize - 1 ] ) )
+    --wordSize;
+
+  wchar const * nextChar = wordBegin;
+
+  vector< char > utfBuffer( wordSize * 4 );
+
+  int wordsAdded = 0; // Number of stored parts
+
+  for( ; ; )
+  {
+    // Skip any whitespace/punctuation
+    for( ; ; ++nextChar )
+    {
+      if ( !*nextChar ) // End of string ends everything
+      {
+          if( wordsAdded == 0)
+          {
+              wstring folded = Folding::applyWhitespaceOnly( wstring( wordBegin, wordSize ) );
+              if( !folded.empty() )
+              {
+                  string utfKey( &utfBuffer.front(),
+                                 Utf8::encode( folded.data(), folded.size(), &utfBuffer.front() ) );
+
+                  string utfWord( &utfBuffer.front(),
+                                  Utf8::encode( wordBegin, wordSize, &utfBuffer.front() ) );
+                  string utfPrefix;
+                  words.addLink( utfKey, utfWord, utfPrefix, articleOffset );
+              }
+          }
+          return;
+      }
+  
+      if ( !Folding::isWhitespace( *nextChar ) && !Folding::isPunct( *nextChar ) )
+        break;
+    }
+
+    // Insert this word
+    wstring folded = Folding::apply( nextChar );
+
+    string utfKey( &utfBuffer.front(),
+                   Utf8::encode( folded.data(), folded.size(), &utfBuffer.front() ) );
+
+    string utfWord( &utfBuffer.front(),
+                    Utf8::encode( nextChar, wordSize - ( nextChar - wordBegin ), &utfBuffer.front() ) );
+
+    string utfPrefix( &utfBuffer.front(),
+                      Utf8::encode( wordBegin, nextChar - wordBegin, &utfBuffer.front() ) );
+
+    words.addLink( utfKey, utfWord, utfPrefix, articleOffset );
+
+    wordsAdded += 1;
+
+    // Skip all non-whitespace/punctuation
+    for( ++nextChar; ; ++nextChar )
+    {
+      if ( !*nextChar )
+        return; // End of string ends everything
+
+      if ( Folding::isWhitespace( *nextChar ) || Folding::isPunct( *nextChar ) )
+        break;
+    }
+  }
+}
+
+void IndexedWords::addWord( wstring const & word, uint32_t articleOffset, unsigned int maxHeadwordSize )
+{
+  addWordLinks( *this, word, articleOffset, maxHeadwordSize );
+}
+
+void IndexedWords::addLink( string const & key, string const & word,
+                            string const & prefix, uint32_t articleOffset )
+{
+  iterator i = insert( IndexedWords::value_type( key, vector< WordArticleLink >() ) ).first;
+
+  if ( ( i->second.size() < MaxMiddleMatches ) || !isMiddleMatch( prefix ) ) // Don't overpopulate chains with middle matches
+  {
+    // Try to conserve memory somewhat -- slow insertions are ok
+    i->second.reserve( i->second.size() + 1 );
+
+    i->second.push_back( WordArticleLink( word, articleOffset, prefix ) );
+  }
+}
+
+void IndexedWords::addSingleWord( wstring const & word, uint32_t articleOffset )
+{
+  wstring folded = Folding::apply( word );
+  if( folded.empty() )
+      folded = Folding::applyWhitespaceOnly( word );
+  operator []( Utf8::encode( folded ) ).push_back(
+    WordArticleLink( Utf8::encode( word ), articleOffset ) );
+}
+
+/// Builds the btree out of indexSize pairs the source provides
+static IndexInfo buildIndex( IndexedWordsSource & source, size_t indexSize,
+                             File::Class & file, unsigned formatVersion,
+                             unsigned extraParts )
+{
+  // We try to stick to two-level tree for most dictionaries. Try finding
+  // the right size for it.
+
+  size_t btreeMaxElements = ( (size_t) sqrt( (double) indexSize ) ) + 1;
+
+  if ( btreeMaxElements < BtreeMinElements )
+    btreeMaxElements = BtreeMinElements;
+  else
+  if ( btreeMaxElements > BtreeMaxElements )
+    btreeMaxElements = BtreeMaxElements;
+
+  GD_DPRINTF( "Building a tree of %u elements\n", (unsigned) btreeMaxElements );
+
+
+  NodeWriter writer( file );
+
+  BloomFilterBuilder bloomFilter( indexSize );
+  TrigramIndexBuilder trigrams;
+  OffsetMapBuilder offsetMap;
+
+  KeyObserverList observers;
+
+  observers.add( bloomFilter );
+
+  bool withTrigramIndex = ( extraParts & WithTrigramIndex ) &&
+                          indexSize >= TrigramIndexMinKeys;
+  bool withOffsetMap = extraParts & WithOffsetMap;
+
+  if ( withTrigramIndex )
+    observers.add( trigrams );
+
+  if ( withOffsetMap )
+    observers.add( offsetMap );
+
+  vector< size_t > parts;
+  vector< uint32_t > tags;
+
+  parts.push_back( buildBtreeNode( source, indexSize,
+                                   writer, btreeMaxElements,
+                                   formatVersion == SearchableFormatVersion,
+                                   observers ) );
+  tags.push_back( RootNodePart );
+
+  if ( withTrigramIndex )
+  {
+    vector< size_t > children;
+    vector< unsigned char > trigramData = trigrams.getData( writer, children );
+
+    parts.push_back( writer.add( trigramData, false, children, sizeof( TrigramHeader ) ) );
+    tags.push_back( TrigramIndexPart );
+  }
+
+  if ( withOffsetMap )
+  {
+    vector< size_t > children;
+    vector< unsigned char > offsetMapData = offsetMap.getData( writer, children );
+
+    parts.push_back( writer.add( offsetMapData, false, children, sizeof( OffsetMapHeader ) ) );
+    tags.push_back( OffsetMapPart );
+  }
+
+  parts.push_back( writer.add( bloomFilter.getData(), false, vector< size_t >() ) );
+  tags.push_back( BloomFilterPart );
+
+  // The directory of all the parts goes last. Its offset is the one the
+  // index is opened with.
+
+  vector< unsigned char > directory( ( 2 + 2 * parts.size() ) * sizeof( uint32_t ) );
+
+  uint32_t * ptr = (uint32_t *) &directory.front();
+
+  ptr[ 0 ] = IndexDirectoryMarker;
+  ptr[ 1 ] = parts.size();
+
+  memcpy( ptr + 2 + parts.size(), &tags.front(), tags.size() * sizeof( uint32_t ) );
+
+  size_t directoryId = writer.add( directory, false, parts, 2 * sizeof( uint32_t ) );
+
+  return IndexInfo( btreeMaxElements, writer.finish( directoryId ) );
+}
+
+IndexInfo buildIndex( IndexedWords const & indexedWords, File::Class & file,
+                      unsigned formatVersion, unsigned extraParts )
+{
+  size_t indexSize = indexedWords.size();
+  IndexedWords::const_iterator nextIndex = indexedWords.begin();
+
+  // Skip any empty words. No point in indexing those, and some dictionaries
+  // are known to have buggy empty-word entries (Stardict's jargon for instance).
+
+  while( indexSize && nextIndex->first.empty() )
+  {
+    indexSize--;
+    ++nextIndex;
+  }
+
+  IndexedWordsMapSource source( nextIndex );
+
+  return buildIndex( source, indexSize, file, formatVersion, extraParts );
+}
+
+namespace {
+
+/// The header of a link record in the SortedIndexedWords' arena and runs.
+/// The key, the word and the prefix follow it, in that order, unterminated.
+struct SortedWordHeader
+{
+  uint32_t keySize;
+  uint32_t wordSize;
+  uint32_t prefixSize;
+  uint32_t articleOffset;
+};
+
+/// A link record read back from the arena or the runs
+struct SortedWord
+{
+  string key, word, prefix;
+  uint32_t articleOffset;
+};
+
+quint64 keyPrefix( string const & key )
+{
+  quint64 result = 0;
+
+  for( size_t x = 0; x < 8; ++x )
+  {
+    result <<= 8;
+
+    if ( x < key.size() )
+      result |= (unsigned char) key[ x ];
+  }
+
+  return result;
+}
+
+/// Orders the records by their keys. Since the keys are utf8, the byte order
+/// is the order IndexedWords uses.
+class SortedWordRefLess
+{
+  char const * arena;
+
+public:
+
+  SortedWordRefLess( char const * arena_ ): arena( arena_ )
+  {}
+
+  bool operator () ( SortedWordRef const & a, SortedWordRef const & b ) const
+  {
+    if ( a.keyPrefix != b.keyPrefix )
+      return a.keyPrefix < b.keyPrefix;
+
+    SortedWordHeader ha, hb;
+
+    memcpy( &ha, arena + a.offset, sizeof( ha ) );
+    memcpy( &hb, arena + b.offset, sizeof( hb ) );
+
+    int result = memcmp( arena + a.offset + sizeof( ha ),
+                         arena + b.offset + sizeof( hb ),
+                         std::min( ha.keySize, hb.keySize ) );
+
+    return result ? result < 0 : ha.keySize < hb.keySize;
+  }
+};
+
+size_t sortedWordSize( char const * record )
+{
+  SortedWordHeader h;
+
+  memcpy( &h, record, sizeof( h ) );
+
+  return sizeof( h ) + h.keySize + h.wordSize + h.prefixSize;
+}
+
+/// Reads the records back in the sorted order
+class SortedWordsReader
+{
+public:
+
+  /// Reads the next record. Returns false when there are no more of them.
+  virtual bool read( SortedWord & ) = 0;
+
+  /// Starts over from the first record
+  virtual void rewind() = 0;
+
+  virtual ~SortedWordsReader()
+  {}
+};
+
+/// Reads the sorted arena
+class ArenaReader: public SortedWordsReader
+{
+  vector< char > const & arena;
+  vector< SortedWordRef > const & order;
+  size_t next;
+
+public:
+
+  ArenaReader( vector< char > const & arena_,
+               vector< SortedWordRef > const & order_ ):
+    arena( arena_ ), order( order_ ), next( 0 )
+  {}
+
+  virtual bool read( SortedWord & );
+
+  virtual void rewind()
+  { next = 0; }
+};
+
+bool ArenaReader::read( SortedWord & word )
+{
+  if ( next == order.size() )
+    return false;
+
+  char const * ptr = &arena.front() + order[ next++ ].offset;
+
+  SortedWordHeader h;
+
+  memcpy( &h, ptr, sizeof( h ) );
+  ptr += sizeof( h );
+
+  word.key.assign( ptr, h.keySize );
+  ptr += h.keySize;
+
+  word.word.assign( ptr, h.wordSize );
+  ptr += h.wordSize;
+
+  word.prefix.assign( ptr, h.prefixSize );
+
+  word.articleOffset = h.articleOffset;
+
+  return true;
+}
+
+/// Reads a single spilled run
+class RunReader: public SortedWordsReader
+{
+  File::Class file;
+  size_t records, left;
+
+  static void readString( File::Class & file, string & str, uint32_t size )
+  {
+    str.resize( size );
+
+    if ( size )
+      file.read( &str[ 0 ], size );
+  }
+
+public:
+
+  RunReader( string const & fileName, size_t records_ ):
+    file( fileName, "rb" ), records( records_ ), left( records_ )
+  {}
+
+  virtual bool read( SortedWord & );
+
+  virtual void rewind()
+  {
+    file.rewind();
+    left = records;
+  }
+};
+
+bool RunReader::read( SortedWord & word )
+{
+  if ( !left )
+    return false;
+
+  --left;
+
+  SortedWordHeader h;
+
+  file.read( &h, sizeof( h ) );
+
+  readString( file, word.key, h.keySize );
+  readString( file, word.word, h.wordSize );
+  readString( file, word.prefix, h.prefixSize );
+
+  word.articleOffset = h.articleOffset;
+
+  return true;
+}
+
+/// Merges the sorted runs into one sorted sequence. Among the records with
+/// the same key, those from the earlier runs go first, so the resulting
+/// order is the order of addition, just like in IndexedWords.
+class MergeReader: public SortedWordsReader
+{
+  vector< sptr< RunReader > > runs;
+  vector< SortedWord > heads;
+  vector< size_t > heap; // Indices of the runs which still have records
+
+  class HeadGreater
+  {
+    vector< SortedWord > const & heads;
+
+  public:
+
+    HeadGreater( vector< SortedWord > const & heads_ ): heads( heads_ )
+    {}
+
+    bool operator () ( size_t a, size_t b ) const
+    {
+      int result = heads[ a ].key.compare( heads[ b ].key );
+
+      return result ? result > 0 : a > b;
+    }
+  };
+
+public:
+
+  MergeReader( vector< string > const & fileNames,
+               vector< size_t > const & records );
+
+  virtual bool read( SortedWord & );
+
+  virtual void rewind();
+};
+
+MergeReader::MergeReader( vector< string > const & fileNames,
+                          vector< size_t > const & records ):
+  heads( fileNames.size() )
+{
+  for( size_t x = 0; x < fileNames.size(); ++x )
+    runs.push_back( new RunReader( fileNames[ x ], records[ x ] ) );
+
+  rewind();
+}
+
+void MergeReader::rewind()
+{
+  heap.clear();
+
+  for( size_t x = 0; x < runs.size(); ++x )
+  {
+    runs[ x ]->rewind();
 
-          window = chainToCheck + 1;
-        }
-      }
-    }
+    if ( runs[ x ]->read( heads[ x ] ) )
+      heap.push_back( x );
   }
+
+  std::make_heap( heap.begin(), heap.end(), HeadGreater( heads ) );
 }
 
-vector< WordArticleLink > BtreeIndex::readChain( char const * & ptr )
+bool MergeReader::read( SortedWord & word )
 {
-  uint32_t chainSize;
+  if ( heap.empty() )
+    return false;
 
-  memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+  std::pop_heap( heap.begin(), heap.end(), HeadGreater( heads ) );
 
-  ptr += sizeof( uint32_t );
+  size_t run = heap.back();
 
-  vector< WordArticleLink > result;
+  word.key.swap( heads[ run ].key );
+  word.word.swap( heads[ run ].word );
+  word.prefix.swap( heads[ run ].prefix );
+  word.articleOffset = heads[ run ].articleOffset;
 
-  while( chainSize )
+  if ( runs[ run ]->read( heads[ run ] ) )
+    std::push_heap( heap.begin(), heap.end(), HeadGreater( heads ) );
+  else
+    heap.pop_back();
+
+  return true;
+}
+
+/// Groups the sorted records into chains. Records with empty keys are
+/// skipped, and chains are kept from being overpopulated with middle
+/// matches exactly as IndexedWords::addLink() does it. The chains are then
+/// passed through the filter, if any.
+class SortedWordsSource: public IndexedWordsSource
+{
+  SortedWordsReader & reader;
+  ChainFilter * filter;
+  SortedWord lookahead;
+  bool hasLookahead;
+  string currentKey;
+  vector< WordArticleLink > currentChain;
+
+  bool readNonEmpty()
   {
-    string str = ptr;
-    ptr += str.size() + 1;
+    while( reader.read( lookahead ) )
+      if ( !lookahead.key.empty() )
+        return true;
 
-    string prefix = ptr;
-    ptr += prefix.size() + 1;
+    return false;
+  }
 
-    uint32_t articleOffset;
+public:
 
-    memcpy( &articleOffset, ptr, sizeof( uint32_t ) );
+  SortedWordsSource( SortedWordsReader & reader_, ChainFilter * filter_ ):
+    reader( reader_ ), filter( filter_ )
+  {
+    hasLookahead = readNonEmpty();
+    next();
+  }
 
-    ptr += sizeof( uint32_t );
+  virtual string const & key() const
+  { return currentKey; }
 
-    result.push_back( WordArticleLink( str, articleOffset, prefix ) );
+  virtual vector< WordArticleLink > const & chain() const
+  { return currentChain; }
 
-    if ( chainSize < str.size() + 1 + prefix.size() + 1 + sizeof( uint32_t ) )
-      throw exCorruptedChainData();
-    else
-      chainSize -= str.size() + 1 + prefix.size() + 1 + sizeof( uint32_t );
+  virtual void next();
+
+  /// Counts the unique non-empty keys the reader has, leaving it rewound
+  static size_t countKeys( SortedWordsReader & );
+};
+
+void SortedWordsSource::next()
+{
+  currentChain.clear();
+
+  if ( !hasLookahead )
+    return;
+
+  currentKey.swap( lookahead.key );
+
+  do
+  {
+    if ( currentChain.size() < MaxMiddleMatches || !isMiddleMatch( lookahead.prefix ) )
+      currentChain.push_back( WordArticleLink( lookahead.word, lookahead.articleOffset,
+                                               lookahead.prefix ) );
+
+    hasLookahead = readNonEmpty();
   }
+  while( hasLookahead && lookahead.key == currentKey );
 
-  return result;
+  if ( filter )
+    filter->filterChain( currentKey, currentChain );
 }
 
-void BtreeIndex::antialias( wstring const & str,
-                            vector< WordArticleLink > & chain,
-                            bool ignoreDiacritics )
+size_t SortedWordsSource::countKeys( SortedWordsReader & reader )
 {
-  wstring caseFolded = Folding::applySimpleCaseOnly( gd::normalize( str ) );
-  if( ignoreDiacritics )
-    caseFolded = Folding::applyDiacriticsOnly( caseFolded );
+  size_t result = 0;
 
-  for( unsigned x = chain.size(); x--; )
-  {
-    // If after applying case folding to each word they wouldn't match, we
-    // drop the entry.
-    wstring entry = Folding::applySimpleCaseOnly( gd::normalize( Utf8::decode( chain[ x ].prefix + chain[ x ].word ) ) );
-    if( ignoreDiacritics )
-      entry = Folding::applyDiacriticsOnly( entry );
+  SortedWord word;
+  string prevKey;
 
-    if ( entry != caseFolded )
-      chain.erase( chain.begin() + x );
-    else
-    if ( chain[ x ].prefix.size() ) // If there's a prefix, merge it with the word,
-                                    // since it's what dictionaries expect
+  while( reader.read( word ) )
+  {
+    if ( !word.key.empty() && ( !result || word.key != prevKey ) )
     {
-      chain[ x ].word.insert( 0, chain[ x ].prefix );
-      chain[ x ].prefix.clear();
+      ++result;
+      prevKey.swap( word.key );
     }
   }
+
+  reader.rewind();
+
+  return result;
 }
 
+}
 
-/// A function which recursively creates btree node.
-/// The nextIndex iterator is being iterated over and increased when building
-/// leaf nodes.
-static uint32_t buildBtreeNode( IndexedWords::const_iterator & nextIndex,
-                                size_t indexSize,
-                                File::Class & file, size_t maxElements,
-                                uint32_t & lastLeafLinkOffset )
+SortedIndexedWords::SortedIndexedWords( size_t memoryLimit_ ):
+  memoryLimit( memoryLimit_ )
 {
-  // We compress all the node data. This buffer would hold it.
-  vector< unsigned char > uncompressedData;
+}
 
-  bool isLeaf = indexSize <= maxElements;
+SortedIndexedWords::~SortedIndexedWords()
+{
+  clear();
+}
 
-  if ( isLeaf )
-  {
-    // A leaf.
+void SortedIndexedWords::addWord( wstring const & word, uint32_t articleOffset,
+                                  unsigned int maxHeadwordSize )
+{
+  addWordLinks( *this, word, articleOffset, maxHeadwordSize );
+}
 
-    uint32_t totalChainsLength = 0;
+void SortedIndexedWords::addSingleWord( wstring const & word, uint32_t articleOffset )
+{
+  wstring folded = Folding::apply( word );
+  if( folded.empty() )
+      folded = Folding::applyWhitespaceOnly( word );
 
-    IndexedWords::const_iterator nextWord = nextIndex;
+  addLink( Utf8::encode( folded ), Utf8::encode( word ), string(), articleOffset );
+}
 
-    for( unsigned x = indexSize; x--; ++nextWord )
-    {
-      totalChainsLength += sizeof( uint32_t );
+void SortedIndexedWords::addLink( string const & key, string const & word,
+                                  string const & prefix, uint32_t articleOffset )
+{
+  SortedWordHeader h;
 
-      vector< WordArticleLink > const & chain = nextWord->second;
+  h.keySize = key.size();
+  h.wordSize = word.size();
+  h.prefixSize = prefix.size();
+  h.articleOffset = articleOffset;
 
-      for( unsigned y = 0; y < chain.size(); ++y )
-        totalChainsLength += chain[ y ].word.size() + 1 + chain[ y ].prefix.size() + 1 + sizeof( uint32_t );
-    }
+  SortedWordRef ref;
 
-    uncompressedData.resize( sizeof( uint32_t ) + totalChainsLength );
+  ref.keyPrefix = keyPrefix( key );
+  ref.offset = arena.size();
 
-    // First uint32_t indicates that this is a leaf.
-    *(uint32_t *)&uncompressedData.front() = indexSize;
+  arena.resize( ref.offset + sizeof( h ) + key.size() + word.size() + prefix.size() );
 
-    unsigned char * ptr = &uncompressedData.front() + sizeof( uint32_t );
+  char * ptr = &arena.front() + ref.offset;
 
-    for( unsigned x = indexSize; x--; ++nextIndex )
-    {
-      vector< WordArticleLink > const & chain = nextIndex->second;
+  memcpy( ptr, &h, sizeof( h ) );
+  ptr += sizeof( h );
 
-      unsigned char * saveSizeHere = ptr;
+  memcpy( ptr, key.data(), key.size() );
+  ptr += key.size();
 
-      ptr += sizeof( uint32_t );
+  memcpy( ptr, word.data(), word.size() );
+  ptr += word.size();
 
-      uint32_t size = 0;
+  memcpy( ptr, prefix.data(), prefix.size() );
 
-      for( unsigned y = 0; y < chain.size(); ++y )
-      {
-        memcpy( ptr, chain[ y ].word.c_str(), chain[ y ].word.size() + 1 );
-        ptr += chain[ y ].word.size() + 1;
+  order.push_back( ref );
 
-        memcpy( ptr, chain[ y ].prefix.c_str(), chain[ y ].prefix.size() + 1 );
-        ptr += chain[ y ].prefix.size() + 1;
+  if ( arena.size() + order.size() * sizeof( SortedWordRef ) >= memoryLimit )
+    spillArena();
+}
 
-        memcpy( ptr, &(chain[ y ].articleOffset), sizeof( uint32_t ) );
-        ptr += sizeof( uint32_t );
+void SortedIndexedWords::clear()
+{
+  vector< char >().swap( arena );
+  vector< SortedWordRef >().swap( order );
+  sortedRunEnds.clear();
 
-        size += chain[ y ].word.size() + 1 + chain[ y ].prefix.size() + 1 + sizeof( uint32_t );
-      }
+  for( size_t x = 0; x < runFileNames.size(); ++x )
+    QFile::remove( FsEncoding::decode( runFileNames[ x ].c_str() ) );
 
-      memcpy( saveSizeHere, &size, sizeof( uint32_t ) );
-    }
-  }
-  else
-  {
-    // A node which will have children.
+  runFileNames.clear();
+  runRecords.clear();
+}
 
-    uncompressedData.resize( sizeof( uint32_t ) + ( maxElements + 1 ) * sizeof( uint32_t ) );
+void SortedIndexedWords::sortTail()
+{
+  size_t sortedEnd = sortedRunEnds.empty() ? 0 : sortedRunEnds.back();
 
-    // First uint32_t indicates that this is a node.
-    *(uint32_t *)&uncompressedData.front() = 0xffffFFFF;
+  if ( sortedEnd == order.size() )
+    return;
 
-    unsigned prevEntry = 0;
+  std::stable_sort( order.begin() + sortedEnd, order.end(),
+                    SortedWordRefLess( &arena.front() ) );
 
-    for( unsigned x = 0; x < maxElements; ++x )
-    {
-      unsigned curEntry = (uint64_t) indexSize * ( x + 1 ) / ( maxElements + 1 );
+  sortedRunEnds.push_back( order.size() );
+}
 
-      uint32_t offset = buildBtreeNode( nextIndex,
-                                        curEntry - prevEntry,
-                                        file, maxElements,
-                                        lastLeafLinkOffset );
+void SortedIndexedWords::sortArena()
+{
+  sortTail();
 
-      memcpy( &uncompressedData.front() + sizeof( uint32_t ) + x * sizeof( uint32_t ), &offset, sizeof( uint32_t ) );
+  // Merge the sorted runs into the first one. The merge is stable, so the
+  // links with equal keys keep the order they were added in.
+  for( size_t x = 1; x < sortedRunEnds.size(); ++x )
+    std::inplace_merge( order.begin(), order.begin() + sortedRunEnds[ x - 1 ],
+                        order.begin() + sortedRunEnds[ x ],
+                        SortedWordRefLess( &arena.front() ) );
 
-      size_t sz = nextIndex->first.size() + 1;
+  if ( sortedRunEnds.size() > 1 )
+    sortedRunEnds.erase( sortedRunEnds.begin(), sortedRunEnds.end() - 1 );
+}
 
-      size_t prevSize = uncompressedData.size();
-      uncompressedData.resize( prevSize + sz );
+void SortedIndexedWords::append( SortedIndexedWords & other )
+{
+  if ( !other.runFileNames.empty() )
+  {
+    // The spilled runs are merged in their order, so everything we have
+    // goes to a run before the other's ones
+    spillArena();
+    other.spillArena();
 
-      memcpy( &uncompressedData.front() + prevSize, nextIndex->first.c_str(),
-              sz );
+    runFileNames.insert( runFileNames.end(), other.runFileNames.begin(),
+                         other.runFileNames.end() );
+    runRecords.insert( runRecords.end(), other.runRecords.begin(),
+                       other.runRecords.end() );
 
-      prevEntry = curEntry;
-    }
+    other.runFileNames.clear();
+    other.runRecords.clear();
 
-    // Rightmost child
-    uint32_t offset = buildBtreeNode( nextIndex,
-                                      indexSize - prevEntry,
-                                      file, maxElements,
-                                      lastLeafLinkOffset );
-    memcpy( &uncompressedData.front() + sizeof( uint32_t ) +
-            maxElements * sizeof( uint32_t ), &offset, sizeof( offset ) );
+    return;
   }
 
-  // Save the result.
+  if ( other.order.empty() )
+    return;
 
-  #ifdef __BTREE_USE_LZO
+  sortTail();
+  other.sortArena();
 
-  vector< unsigned char > compressedData( uncompressedData.size() + uncompressedData.size() / 16 + 64 + 3 );
+  size_t base = arena.size();
+  size_t first = order.size();
 
-  char workMem[ LZO1X_1_MEM_COMPRESS ];
+  arena.insert( arena.end(), other.arena.begin(), other.arena.end() );
+  order.insert( order.end(), other.order.begin(), other.order.end() );
 
-  lzo_uint compressedSize;
+  for( size_t x = first; x < order.size(); ++x )
+    order[ x ].offset += base;
 
-  if ( lzo1x_1_compress( &uncompressedData.front(), uncompressedData.size(),
-                         &compressedData.front(), &compressedSize, workMem )
-       != LZO_E_OK )
-  {
-    FDPRINTF( stderr, "Failed to compress btree node.\n" );
-    abort();
-  }
+  sortedRunEnds.push_back( order.size() );
 
-  #else
+  other.clear();
 
-  vector< unsigned char > compressedData( compressBound( uncompressedData.size() ) );
+  if ( arena.size() + order.size() * sizeof( SortedWordRef ) >= memoryLimit )
+    spillArena();
+}
 
-  unsigned long compressedSize = compressedData.size();
+void SortedIndexedWords::spillArena()
+{
+  if ( order.empty() )
+    return;
 
-  if ( compress( &compressedData.front(), &compressedSize,
-                 &uncompressedData.front(), uncompressedData.size() ) != Z_OK )
-  {
-    qFatal( "Failed to compress btree node." );
-    abort();
-  }
+  sortArena();
 
-  #endif
+  string fileName = createTemporaryFile();
 
-  uint32_t offset = file.tell();
+  runFileNames.push_back( fileName );
+  runRecords.push_back( order.size() );
 
-  file.write< uint32_t >( uncompressedData.size() );
-  file.write< uint32_t >( compressedSize );
-  file.write( &compressedData.front(), compressedSize );
+  File::Class run( fileName, "wb" );
 
-  if ( isLeaf )
+  for( size_t x = 0; x < order.size(); ++x )
   {
-    // A link to the next leef, which is zero and which will be updated
-    // should we happen to have another leaf.
-    
-    file.write( ( uint32_t ) 0 );
-
-    uint32_t here = file.tell();
-
-    if ( lastLeafLinkOffset )
-    {
-      // Update the previous leaf to have the offset of this one.
-      file.seek( lastLeafLinkOffset );
-      file.write( offset );
-      file.seek( here );
-    }
+    char const * record = &arena.front() + order[ x ].offset;
 
-    // Make sure next leaf knows where to write its offset for us.
-    lastLeafLinkOffset = here - sizeof( uint32_t );
+    run.write( record, sortedWordSize( record ) );
   }
 
-  return offset;
+  run.close();
+
+  // Keep the capacity around for the next run
+  arena.clear();
+  order.clear();
+  sortedRunEnds.clear();
 }
 
-void IndexedWords::addWord( wstring const & word, uint32_t articleOffset, unsigned int maxHeadwordSize )
+IndexInfo buildIndex( SortedIndexedWords & words, File::Class & file,
+                      unsigned formatVersion, unsigned extraParts,
+                      ChainFilter * filter )
 {
-  wchar const * wordBegin = word.c_str();
-  string::size_type wordSize = word.size();
+  sptr< SortedWordsReader > reader;
 
-  // Safeguard us against various bugs here. Don't attempt adding words
-  // which are freakishly huge.
-  if ( wordSize > maxHeadwordSize )
+  if ( words.runFileNames.empty() )
   {
-#define MAX_LOG_WORD_SIZE 500
-    string headword;
-    if( wordSize <= MAX_LOG_WORD_SIZE )
-      headword = Utf8::encode( word );
-    else
-    {
-      std::vector< char > buffer( MAX_LOG_WORD_SIZE * 4 );
-      headword = string( &buffer.front(),
-                         Utf8::encode( wordBegin, MAX_LOG_WORD_SIZE, &buffer.front() ) );
-      headword += "...";
-    }
-    gdWarning( "Skipped too long headword: \"%s\"", headword.c_str() );
-    return;
-#undef MAX_LOG_WORD_SIZE
+    // Everything fits in memory
+    words.sortArena();
+    reader = new ArenaReader( words.arena, words.order );
   }
-
-  // Skip any leading whitespace
-  while( *wordBegin && Folding::isWhitespace( *wordBegin ) )
+  else
   {
-    ++wordBegin;
-    --wordSize;
+    words.spillArena();
+    reader = new MergeReader( words.runFileNames, words.runRecords );
   }
 
-  // Skip any trailing whitespace
-  while( wordSize && Folding::isWhitespace( wordBegin[ wordSize - 1 ] ) )
-    --wordSize;
-
-  wchar const * nextChar = wordBegin;
-
-  vector< char > utfBuffer( wordSize * 4 );
-
-  int wordsAdded = 0; // Number of stored parts
-
-  for( ; ; )
-  {
-    // Skip any whitespace/punctuation
-    for( ; ; ++nextChar )
-    {
-      if ( !*nextChar ) // End of string ends everything
-      {
-          if( wordsAdded == 0)
-          {
-              wstring folded = Folding::applyWhitespaceOnly( wstring( wordBegin, wordSize ) );
-              if( !folded.empty() )
-              {
-                  iterator i = insert(
-                    IndexedWords::value_type(
-                      string( &utfBuffer.front(),
-                              Utf8::encode( folded.data(), folded.size(), &utfBuffer.front() ) ),
-                      vector< WordArticleLink >() ) ).first;
+  size_t indexSize = SortedWordsSource::countKeys( *reader );
 
-                  // Try to conserve memory somewhat -- slow insertions are ok
-                  i->second.reserve( i->second.size() + 1 );
-
-                  string utfWord( &utfBuffer.front(),
-                                  Utf8::encode( wordBegin, wordSize, &utfBuffer.front() ) );
-                  string utfPrefix;
-                  i->second.push_back( WordArticleLink( utfWord, articleOffset, utfPrefix ) );
-              }
-          }
-          return;
-      }
-  
-      if ( !Folding::isWhitespace( *nextChar ) && !Folding::isPunct( *nextChar ) )
-        break;
-    }
+  SortedWordsSource source( *reader, filter );
 
-    // Insert this word
-    wstring folded = Folding::apply( nextChar );
-    
-    iterator i = insert(
-      IndexedWords::value_type(
-        string( &utfBuffer.front(),
-                Utf8::encode( folded.data(), folded.size(), &utfBuffer.front() ) ),
-        vector< WordArticleLink >() ) ).first;
+  return buildIndex( source, indexSize, file, formatVersion, extraParts );
+}
 
-    if ( ( i->second.size() < 1024 ) || ( nextChar == wordBegin ) ) // Don't overpopulate chains with middle matches
-    {
-      // Try to conserve memory somewhat -- slow insertions are ok
-      i->second.reserve( i->second.size() + 1 );
-  
-      string utfWord( &utfBuffer.front(),
-                      Utf8::encode( nextChar, wordSize - ( nextChar - wordBegin ), &utfBuffer.front() ) );
-  
-      string utfPrefix( &utfBuffer.front(),
-                        Utf8::encode( wordBegin, nextChar - wordBegin, &utfBuffer.front() ) );
-  
-      i->second.push_back( WordArticleLink( utfWord, articleOffset, utfPrefix ) );
-    }
+class ParallelCollector::CollectRunnable: public QRunnable
+{
+  ParallelCollector & collector;
+  size_t part;
+  uint32_t begin, end;
+  SortedIndexedWords & words, & resources;
+  string & error;
+  QSemaphore & hasExited;
 
-    wordsAdded += 1;
+public:
 
-    // Skip all non-whitespace/punctuation
-    for( ++nextChar; ; ++nextChar )
-    {
-      if ( !*nextChar )
-        return; // End of string ends everything
+  CollectRunnable( ParallelCollector & collector_, size_t part_,
+                   uint32_t begin_, uint32_t end_, SortedIndexedWords & words_,
+                   SortedIndexedWords & resources_, string & error_,
+                   QSemaphore & hasExited_ ):
+    collector( collector_ ), part( part_ ), begin( begin_ ), end( end_ ),
+    words( words_ ), resources( resources_ ), error( error_ ),
+    hasExited( hasExited_ )
+  {}
 
-      if ( Folding::isWhitespace( *nextChar ) || Folding::isPunct( *nextChar ) )
-        break;
-    }
+  ~CollectRunnable()
+  {
+    hasExited.release();
   }
-}
 
-void IndexedWords::addSingleWord( wstring const & word, uint32_t articleOffset )
+  virtual void run();
+};
+
+void ParallelCollector::CollectRunnable::run()
 {
-  wstring folded = Folding::apply( word );
-  if( folded.empty() )
-      folded = Folding::applyWhitespaceOnly( word );
-  operator []( Utf8::encode( folded ) ).push_back(
-    WordArticleLink( Utf8::encode( word ), articleOffset ) );
+  try
+  {
+    collector.collect( part, begin, end, words, resources );
+
+    words.sort();
+    resources.sort();
+  }
+  catch( std::exception & e )
+  {
+    error = e.what();
+
+    if ( error.empty() )
+      error = "unknown error";
+  }
+  catch( ... )
+  {
+    error = "unknown error";
+  }
 }
 
-IndexInfo buildIndex( IndexedWords const & indexedWords, File::Class & file )
+void ParallelCollector::run( uint32_t count, SortedIndexedWords & words,
+                             SortedIndexedWords & resources )
 {
-  size_t indexSize = indexedWords.size();
-  IndexedWords::const_iterator nextIndex = indexedWords.begin();
+  int threads = QThreadPool::globalInstance()->maxThreadCount();
 
-  // Skip any empty words. No point in indexing those, and some dictionaries
-  // are known to have buggy empty-word entries (Stardict's jargon for instance).
-
-  while( indexSize && nextIndex->first.empty() )
+  if ( threads <= 1 || count < MinParallelRecords )
   {
-    indexSize--;
-    ++nextIndex;
+    prepare( 1 );
+    collect( 0, 0, count, words, resources );
+    return;
   }
 
-  // We try to stick to two-level tree for most dictionaries. Try finding
-  // the right size for it.
+  size_t parts = threads;
 
-  size_t btreeMaxElements = ( (size_t) sqrt( (double) indexSize ) ) + 1;
+  prepare( parts );
 
-  if ( btreeMaxElements < BtreeMinElements )
-    btreeMaxElements = BtreeMinElements;
-  else
-  if ( btreeMaxElements > BtreeMaxElements )
-    btreeMaxElements = BtreeMaxElements;
+  vector< sptr< SortedIndexedWords > > partWords( parts ), partResources( parts );
+  vector< string > errors( parts );
 
-  GD_DPRINTF( "Building a tree of %u elements\n", (unsigned) btreeMaxElements );
+  // The parts run on the global thread pool, shared with the compression of
+  // the nodes and the chunks. The ones no thread is free for are collected
+  // right here, so we never wait for the work queued behind someone else's.
+  QSemaphore hasExited;
 
+  for( size_t x = 0; x < parts; ++x )
+  {
+    partWords[ x ] = new SortedIndexedWords( SortedIndexedWords::DefaultMemoryLimit / parts );
+    partResources[ x ] = new SortedIndexedWords( SortedIndexedWords::DefaultMemoryLimit / parts );
 
-  uint32_t lastLeafOffset = 0;
+    CollectRunnable * runnable =
+      new CollectRunnable( *this, x, (uint64_t) count * x / parts,
+                           (uint64_t) count * ( x + 1 ) / parts,
+                           *partWords[ x ], *partResources[ x ],
+                           errors[ x ], hasExited );
 
-  uint32_t rootOffset = buildBtreeNode( nextIndex, indexSize,
-                                        file, btreeMaxElements,
-                                        lastLeafOffset );
+    if ( !QThreadPool::globalInstance()->tryStart( runnable ) )
+    {
+      runnable->run();
+      delete runnable;
+    }
+  }
 
-  return IndexInfo( btreeMaxElements, rootOffset );
-}
+  hasExited.acquire( parts );
 
-void BtreeIndex::getAllHeadwords( QSet< QString > & headwords )
-{
-  if ( !idxFile )
-    throw exIndexWasNotOpened();
+  for( size_t x = 0; x < parts; ++x )
+    if ( !errors[ x ].empty() )
+      throw exCollectingFailed( errors[ x ] );
 
-  findArticleLinks( NULL, NULL, &headwords );
+  for( size_t x = 0; x < parts; ++x )
+  {
+    words.append( *partWords[ x ] );
+    resources.append( *partResources[ x ] );
+
+    // Release the memory and the spilled runs of the part right away
+    partWords[ x ].reset();
+    partResources[ x ].reset();
+  }
 }
 
-void BtreeIndex::findAllArticleLinks( QVector< WordArticleLink > & articleLinks )
+void BtreeIndex::findArticleOffsets( QVector< uint32_t > & offsets,
+                                     QAtomicInt * isCancelled )
 {
-  if ( !idxFile )
-    throw exIndexWasNotOpened();
+  offsets.clear();
 
-  QSet< uint32_t > offsets;
+  if ( loadOffsetMap() )
+  {
+    // The map lists each article once, in order
 
-  findArticleLinks( &articleLinks, &offsets, NULL );
-}
+    OffsetMapHeader header;
 
-void BtreeIndex::findArticleLinks( QVector< WordArticleLink > * articleLinks,
-                                   QSet< uint32_t > * offsets,
-                                   QSet< QString > *headwords,
-                                   QAtomicInt * isCancelled )
-{
-  uint32_t currentNodeOffset = rootOffset;
-  uint32_t nextLeaf = 0;
-  uint32_t leafEntries;
+    memcpy( &header, offsetMap.constData(), sizeof( header ) );
 
-  Mutex::Lock _( *idxFileMutex );
+    uint32_t const * blockOffsets = (uint32_t const *)( offsetMap.constData() + sizeof( header ) );
 
-  if ( !rootNodeLoaded )
-  {
-    // Time to load our root node. We do it only once, at the first request.
-    readNode( rootOffset, rootNode );
-    rootNodeLoaded = true;
+    offsets.reserve( header.entries );
+
+    QByteArray block;
+
+    for( uint32_t x = 0; x < header.entryBlocks; ++x )
+    {
+      if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
+        return;
+
+      readNodeUncached( blockOffsets[ x ], block );
+
+      uint32_t marker = 0;
+
+      if ( (size_t) block.size() >= sizeof( marker ) )
+        memcpy( &marker, block.constData(), sizeof( marker ) );
+
+      if ( marker != OffsetMapEntriesMarker )
+        throw exCorruptedChainData();
+
+      OffsetMapEntry const * entries = (OffsetMapEntry const *)( block.constData() + sizeof( uint32_t ) );
+      size_t count = ( block.size() - sizeof( uint32_t ) ) / sizeof( OffsetMapEntry );
+
+      for( size_t y = 0; y < count; ++y )
+        offsets.push_back( entries[ y ].articleOffset );
+    }
+
+    return;
   }
 
-  char const * leaf = &rootNode.front();
-  char const * leafEnd = leaf + rootNode.size();
-  char const * chainPtr = 0;
+  // Otherwise the offsets of all the links are collected. They are sorted,
+  // and their duplicates are dropped, each time their number doubles, so
+  // there are never many more of them than there are articles.
 
-  vector< char > extLeaf;
+  ChainReader reader( *this );
 
-  // Find first leaf
+  vector< WordArticleLink > chain;
+
+  int unique = 0;
 
   for( ; ; )
   {
-    leafEntries = *(uint32_t *)leaf;
-
-    if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
-      return;
+    bool done = !reader.next( chain );
 
-    if ( leafEntries == 0xffffFFFF )
+    if ( done || offsets.size() >= std::max( 2 * unique, 65536 ) )
     {
-      // A node
-      currentNodeOffset = *( (uint32_t *)leaf + 1 );
-      readNode( currentNodeOffset, extLeaf );
-      leaf = &extLeaf.front();
-      leafEnd = leaf + extLeaf.size();
-      nextLeaf = idxFile->read< uint32_t >();
+      std::sort( offsets.begin(), offsets.end() );
+      offsets.erase( std::unique( offsets.begin(), offsets.end() ), offsets.end() );
+
+      unique = offsets.size();
     }
-    else
-    {
-      // A leaf
-      chainPtr = leaf + sizeof( uint32_t );
+
+    if ( done )
       break;
-    }
+
+    if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
+      return;
+
+    for( size_t x = 0; x < chain.size(); ++x )
+      offsets.push_back( chain[ x ].articleOffset );
   }
+}
+
+ChainReader::ChainReader( BtreeIndex & index_ ):
+  index( index_ ), chainPtr( 0 ), leafEnd( 0 ), nextLeaf( 0 ),
+  windowOffset( 0 ), fileSize( 0 )
+{
+  if ( !index.idxFile )
+    throw exIndexWasNotOpened();
+
+  index.loadRootNode();
+
+  if ( !index.idxFileMapping )
+    fileSize = index.idxFile->file().size();
 
-  if ( !leafEntries )
+  leaf = index.rootNode;
+
+  // Descend to the first leaf
+
+  while( *(uint32_t const *) leaf.constData() == 0xffffFFFF )
+    readLeaf( *( (uint32_t const *) leaf.constData() + 1 ) );
+
+  chainPtr = firstLeafChain( leaf.constData() );
+  leafEnd = leaf.constData() + leaf.size();
+}
+
+bool ChainReader::next( vector< WordArticleLink > & chain )
+{
+  while( chainPtr >= leafEnd )
   {
-    // Empty leaf? This may only be possible for entirely empty trees only.
-    if ( currentNodeOffset != rootOffset )
+    if ( !nextLeaf )
+      return false; // That was the last leaf
+
+    readLeaf( nextLeaf );
+
+    if ( *(uint32_t const *) leaf.constData() == 0xffffFFFF )
       throw exCorruptedChainData();
-    else
-      return; // No match
+
+    chainPtr = firstLeafChain( leaf.constData() );
+    leafEnd = leaf.constData() + leaf.size();
   }
 
-  // Read all chains
+  chain = index.readChain( chainPtr );
 
-  for( ; ; )
+  return true;
+}
+
+void ChainReader::readLeaf( uint32_t offset )
+{
+  if ( index.idxFileMapping )
   {
-    vector< WordArticleLink > result = readChain( chainPtr );
+    // Nothing to read ahead then
+    index.readNodeUncached( offset, leaf, &nextLeaf );
+    return;
+  }
 
-    if( headwords && static_cast< vector< WordArticleLink >::size_type >( headwords->capacity() ) < headwords->size() + result.size() )
-    {
-      int n = headwords->capacity();
-      headwords->reserve( n + n / 10 );
-    }
+  qint64 const headerSize = 2 * sizeof( uint32_t );
 
-    if( offsets && static_cast< vector< WordArticleLink >::size_type >( offsets->capacity() ) < offsets->size() + result.size() )
-    {
-      int n = offsets->capacity();
-      offsets->reserve( n + n / 10 );
-    }
+  // First just the header is needed, then the whole node along with the
+  // link which follows it
+  qint64 needed = headerSize;
 
-    if( articleLinks && static_cast< vector< WordArticleLink >::size_type >( articleLinks->capacity() ) < articleLinks->size() + result.size() )
-    {
-      int n = articleLinks->capacity();
-      articleLinks->reserve( n + n / 10 );
-    }
+  for( ; ; )
+  {
+    qint64 windowEnd = windowOffset + (qint64) window.size();
 
-    for( unsigned i = 0; i < result.size(); i++ )
+    if ( offset >= windowOffset && offset + needed <= windowEnd )
     {
-      if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
-        return;
+      if ( needed == headerSize )
+      {
+        uint32_t compressedSize;
 
-      if( headwords )
-        headwords->insert( QString::fromUtf8( ( result[ i ].prefix + result[ i ].word ).c_str() ) );
+        memcpy( &compressedSize, &window.front() + ( offset - windowOffset ) + sizeof( uint32_t ),
+                sizeof( uint32_t ) );
 
-      if( offsets && offsets->contains( result[ i ].articleOffset ) )
-        continue;
+        needed = std::min( headerSize + compressedSize + (qint64) sizeof( uint32_t ),
+                           fileSize - offset );
 
-      if( offsets )
-        offsets->insert( result[ i ].articleOffset );
+        if ( needed < headerSize )
+          throw exNodeOutOfBounds();
+
+        continue;
+      }
 
-      if( articleLinks )
-        articleLinks->push_back( WordArticleLink( result[ i ].prefix + result[ i ].word, result[ i ].articleOffset ) );
+      index.decodeNode( offset, &window.front() + ( offset - windowOffset ),
+                        windowEnd - offset, leaf, &nextLeaf );
+      return;
     }
 
-    if ( chainPtr >= leafEnd )
-    {
-      // We're past the current leaf, fetch the next one
+    // Read the window anew, starting from the node
 
-      if ( nextLeaf )
-      {
-        readNode( nextLeaf, extLeaf );
-        leaf = &extLeaf.front();
-        leafEnd = leaf + extLeaf.size();
+    qint64 size = std::min( std::max( needed, (qint64) ReadAheadSize ), fileSize - (qint64) offset );
 
-        nextLeaf = idxFile->read< uint32_t >();
-        chainPtr = leaf + sizeof( uint32_t );
+    if ( size < needed )
+      throw exNodeOutOfBounds();
 
-        leafEntries = *(uint32_t *)leaf;
+    window.resize( size );
+    windowOffset = offset;
 
-        if ( leafEntries == 0xffffFFFF )
-          throw exCorruptedChainData();
-      }
-      else
-        break; // That was the last leaf
+    if ( !index.idxFile->readAt( offset, &window.front(), size ) )
+    {
+      // No positional reads here -- seek and read under the lock
+      Mutex::Lock _( *index.idxFileMutex );
+
+      index.idxFile->seek( offset );
+      index.idxFile->read( &window.front(), size );
     }
   }
 }
 
+void BtreeIndex::forEachChain( ChainVisitor & visitor, QAtomicInt * isCancelled )
+{
+  ChainReader reader( *this );
+
+  vector< WordArticleLink > chain;
+
+  while( reader.next( chain ) )
+  {
+    if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
+      return;
+
+    visitor.visitChain( chain );
+  }
+}
+
 void BtreeIndex::getHeadwordsFromOffsets( QList<uint32_t> & offsets,
                                           QVector<QString> & headwords,
                                           QAtomicInt * isCancelled )
 {
-  uint32_t currentNodeOffset = rootOffset;
-  uint32_t nextLeaf = 0;
-  uint32_t leafEntries;
-
   std::sort( offsets.begin(), offsets.end() );
 
-  Mutex::Lock _( *idxFileMutex );
-
-  if ( !rootNodeLoaded )
+  if ( loadOffsetMap() )
   {
-    // Time to load our root node. We do it only once, at the first request.
-    readNode( rootOffset, rootNode );
-    rootNodeLoaded = true;
+    getHeadwordsFromOffsetMap( offsets, headwords, isCancelled );
+    return;
   }
 
-  char const * leaf = &rootNode.front();
+  loadRootNode();
+
+  uint32_t currentNodeOffset = rootOffset;
+  uint32_t nextLeaf = 0;
+  uint32_t leafEntries;
+
+  char const * leaf = rootNode.constData();
   char const * leafEnd = leaf + rootNode.size();
   char const * chainPtr = 0;
 
-  vector< char > extLeaf;
+  QByteArray extLeaf;
 
   // Find first leaf
 
@@ -1448,20 +5064,19 @@ void BtreeIndex::getHeadwordsFromOffsets( QList<uint32_t> & offsets,
     {
       // A node
       currentNodeOffset = *( (uint32_t *)leaf + 1 );
-      readNode( currentNodeOffset, extLeaf );
-      leaf = &extLeaf.front();
+      readNode( currentNodeOffset, extLeaf, &nextLeaf );
+      leaf = extLeaf.constData();
       leafEnd = leaf + extLeaf.size();
-      nextLeaf = idxFile->read< uint32_t >();
     }
     else
     {
       // A leaf
-      chainPtr = leaf + sizeof( uint32_t );
+      chainPtr = firstLeafChain( leaf );
       break;
     }
   }
 
-  if ( !leafEntries )
+  if ( !leafEntryCount( leaf ) )
   {
     // Empty leaf? This may only be possible for entirely empty trees only.
     if ( currentNodeOffset != rootOffset )
@@ -1508,12 +5123,11 @@ void BtreeIndex::getHeadwordsFromOffsets( QList<uint32_t> & offsets,
 
       if ( nextLeaf )
       {
-        readNode( nextLeaf, extLeaf );
-        leaf = &extLeaf.front();
+        readNode( nextLeaf, extLeaf, &nextLeaf );
+        leaf = extLeaf.constData();
         leafEnd = leaf + extLeaf.size();
 
-        nextLeaf = idxFile->read< uint32_t >();
-        chainPtr = leaf + sizeof( uint32_t );
+        chainPtr = firstLeafChain( leaf );
 
         leafEntries = *(uint32_t *)leaf;
 
@@ -1526,36 +5140,188 @@ void BtreeIndex::getHeadwordsFromOffsets( QList<uint32_t> & offsets,
   }
 }
 
-bool BtreeDictionary::getHeadwords( QStringList &headwords )
+namespace {
+
+/// Orders the offset map entries by their article offsets
+struct OffsetMapEntryLess
+{
+  bool operator () ( OffsetMapEntry const & entry, uint32_t articleOffset ) const
+  { return entry.articleOffset < articleOffset; }
+};
+
+}
+
+void BtreeIndex::getHeadwordsFromOffsetMap( QList< uint32_t > & offsets,
+                                            QVector< QString > & headwords,
+                                            QAtomicInt * isCancelled )
 {
-  QSet< QString > setOfHeadwords;
+  OffsetMapHeader header;
+
+  memcpy( &header, offsetMap.constData(), sizeof( header ) );
+
+  uint32_t const * blockOffsets = (uint32_t const *)( offsetMap.constData() + sizeof( header ) );
+  uint32_t const * firstOffsets = blockOffsets + header.entryBlocks + header.headwordBlocks;
+  uint32_t const * firstHeadwords = firstOffsets + header.entryBlocks;
+
+  // Look up the headword numbers first. The offsets are sorted, so each
+  // entry block is read once.
+
+  vector< std::pair< uint32_t, uint32_t > > found; // Headword number, article offset
+  QList< uint32_t > notFound;
+
+  QByteArray block;
+  uint32_t blockNumber = header.entryBlocks; // None loaded yet
+
+  for( QList< uint32_t >::const_iterator i = offsets.constBegin(); i != offsets.constEnd(); ++i )
+  {
+    if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
+      return;
+
+    uint32_t const * next = std::upper_bound( firstOffsets, firstOffsets + header.entryBlocks, *i );
+
+    if ( next == firstOffsets )
+    {
+      notFound.append( *i );
+      continue;
+    }
+
+    if ( (uint32_t)( next - firstOffsets - 1 ) != blockNumber )
+    {
+      blockNumber = next - firstOffsets - 1;
+
+      readNode( blockOffsets[ blockNumber ], block );
+
+      uint32_t marker = 0;
+
+      if ( (size_t) block.size() >= sizeof( marker ) )
+        memcpy( &marker, block.constData(), sizeof( marker ) );
+
+      if ( marker != OffsetMapEntriesMarker )
+        throw exCorruptedChainData();
+    }
+
+    OffsetMapEntry const * entries = (OffsetMapEntry const *)( block.constData() + sizeof( uint32_t ) );
+    OffsetMapEntry const * entriesEnd = entries +
+      ( block.size() - sizeof( uint32_t ) ) / sizeof( OffsetMapEntry );
+
+    OffsetMapEntry const * entry = std::lower_bound( entries, entriesEnd, *i,
+                                                     OffsetMapEntryLess() );
+
+    if ( entry == entriesEnd || entry->articleOffset != *i )
+    {
+      notFound.append( *i );
+      continue;
+    }
+
+    if ( entry->headword >= header.headwords )
+      throw exCorruptedChainData();
+
+    found.push_back( std::make_pair( entry->headword, *i ) );
+  }
+
+  offsets = notFound;
+
+  // Then fetch the headwords, in the order the index lists them. Each
+  // headword block is read once, and is walked forward only.
+
+  std::sort( found.begin(), found.end() );
+
+  blockNumber = header.headwordBlocks;
+
+  char const * ptr = 0, * end = 0;
+  uint32_t headwordNumber = 0;
+
+  for( size_t x = 0; x < found.size(); ++x )
+  {
+    if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
+      return;
 
-  headwords.clear();
-  setOfHeadwords.reserve( getWordCount() );
+    uint32_t const * next = std::upper_bound( firstHeadwords,
+                                              firstHeadwords + header.headwordBlocks,
+                                              found[ x ].first );
 
+    if ( next == firstHeadwords )
+      throw exCorruptedChainData();
+
+    if ( (uint32_t)( next - firstHeadwords - 1 ) != blockNumber )
+    {
+      blockNumber = next - firstHeadwords - 1;
+
+      readNode( blockOffsets[ header.entryBlocks + blockNumber ], block );
+
+      uint32_t marker = 0;
+
+      if ( (size_t) block.size() >= sizeof( marker ) )
+        memcpy( &marker, block.constData(), sizeof( marker ) );
+
+      if ( marker != OffsetMapHeadwordsMarker )
+        throw exCorruptedChainData();
+
+      ptr = block.constData() + sizeof( uint32_t );
+      end = block.constData() + block.size();
+      headwordNumber = firstHeadwords[ blockNumber ];
+    }
+
+    for( ; headwordNumber < found[ x ].first; ++headwordNumber )
+    {
+      ptr = (char const *) memchr( ptr, 0, end - ptr );
+
+      if ( !ptr )
+        throw exCorruptedChainData();
+
+      ++ptr;
+    }
+
+    char const * headwordEnd = (char const *) memchr( ptr, 0, end - ptr );
+
+    if ( !headwordEnd )
+      throw exCorruptedChainData();
+
+    headwords.append( QString::fromUtf8( ptr, headwordEnd - ptr ) );
+  }
+}
+
+bool BtreeDictionary::forEachHeadword( Dictionary::HeadwordVisitor & visitor,
+                                       QAtomicInt * isCancelled )
+{
   try
   {
-    getAllHeadwords( setOfHeadwords );
+    ChainReader reader( *this );
+
+    vector< WordArticleLink > chain;
+
+    // The same headword of several articles is listed under the same key,
+    // so only the headwords of the current chain are to be told apart
+    std::set< string > listed;
 
-    if( setOfHeadwords.size() )
+    while( reader.next( chain ) )
     {
-#if QT_VERSION >= 0x040700
-      headwords.reserve( setOfHeadwords.size() );
-#endif
+      if( isCancelled && Qt4x5::AtomicInt::loadAcquire( *isCancelled ) )
+        break;
+
+      listed.clear();
 
-      QSet< QString >::const_iterator it = setOfHeadwords.constBegin();
-      QSet< QString >::const_iterator end = setOfHeadwords.constEnd();
+      for( size_t x = 0; x < chain.size(); ++x )
+      {
+        // Each headword is stored under the keys of all its words, and is
+        // listed under the one of its first word
+        if ( isMiddleMatch( chain[ x ].prefix ) )
+          continue;
 
-      for( ; it != end; ++it )
-        headwords.append( *it );
+        string headword = chain[ x ].prefix + chain[ x ].word;
+
+        if ( listed.insert( headword ).second )
+          visitor.visitHeadword( QString::fromUtf8( headword.data(), headword.size() ) );
+      }
     }
   }
   catch( std::exception &ex )
   {
     gdWarning( "Failed headwords retrieving for \"%s\", reason: %s\n", getName().c_str(), ex.what() );
+    return false;
   }
 
-  return headwords.size() > 0;
+  return true;
 }
 
 void BtreeDictionary::getArticleText(uint32_t, QString &, QString & )
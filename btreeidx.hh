@@ -14,6 +14,8 @@
 #include <QVector>
 #include <QSet>
 #include <QList>
+#include <QByteArray>
+#include <QAtomicInt>
 #include "cpp_features.hh"
 
 #if defined( _MSC_VER ) && _MSC_VER < 1800 // VS2012 and older
@@ -36,14 +38,59 @@ enum
   /// This is to be bumped up each time the internal format changes.
   /// The value isn't used here by itself, it is supposed to be added
   /// to each dictionary's internal format version.
-  FormatVersion = 4
+  /// Since version 5, each index ends with a directory of its parts, which
+  /// include a Bloom filter over all the keys.
+  FormatVersion = 5,
+
+  /// The format in which the leaves have the first headwords of their chains
+  /// front-coded, which makes the index smaller. Once read, each leaf gets
+  /// its folded keys and a directory of restart points, so the lookups
+  /// binary search it without folding the headwords. Dictionaries opt in to
+  /// it by passing it to buildIndex(), and then add it to their internal
+  /// format version instead of FormatVersion. All the formats are always
+  /// readable.
+  SearchableFormatVersion = 6
 };
 
+/// The optional parts buildIndex() may add to the index, which can be
+/// combined in any way and with any of the formats. Each part is found
+/// through the index's directory, so the indices lacking it stay readable.
+/// Dictionaries asking for a part are to bump their internal format version,
+/// so their existing indices get rebuilt with it.
+enum ExtraIndexParts
+{
+  NoExtraParts = 0,
+
+  /// A trigram index over the folded headwords. The wildcard searches with
+  /// a leading wildcard then only test the headwords which have all the
+  /// trigrams of the pattern's literal parts, instead of all of them. The
+  /// index takes some space, so it's only built for the indices having at
+  /// least TrigramIndexMinKeys keys. The smaller ones are walked quickly
+  /// enough.
+  WithTrigramIndex = 1,
+
+  /// A table which maps the article offsets back to their headwords. The
+  /// headwords of the full-text search results are then looked up in it,
+  /// instead of being searched for through all of the leaves.
+  WithOffsetMap = 2
+};
+
+enum
+{
+  TrigramIndexMinKeys = 200000
+};
+
+/// Sets the memory budget, in bytes, of the cache of decompressed nodes
+/// which is shared by all the opened indices. Zero disables the cache.
+void setNodeCacheSize( int bytes );
+
 // These exceptions which might be thrown during the index traversal
 
 DEF_EX( exIndexWasNotOpened, "The index wasn't opened", Dictionary::Ex )
 DEF_EX( exFailedToDecompressNode, "Failed to decompress a btree's node", Dictionary::Ex )
 DEF_EX( exCorruptedChainData, "Corrupted chain data in the leaf of a btree encountered", Dictionary::Ex )
+DEF_EX( exNodeOutOfBounds, "A btree's node lies outside of the index file", Dictionary::Ex )
+DEF_EX_STR( exCollectingFailed, "Failed to collect the headwords:", Dictionary::Ex )
 
 /// This structure describes a word linked to its translation. The
 /// translation is represented as an abstract 32-bit offset.
@@ -70,6 +117,30 @@ struct IndexInfo
   {}
 };
 
+/// Receives the chains of the index walked by BtreeIndex::forEachChain()
+class ChainVisitor
+{
+public:
+
+  virtual void visitChain( vector< WordArticleLink > const & ) = 0;
+
+  virtual ~ChainVisitor()
+  {}
+};
+
+/// The position of the chain last found by BtreeIndex::findChainByOrdinal().
+/// The chains which follow it in the same leaf are found from there on.
+struct ChainCursor
+{
+  QByteArray leaf;
+  uint32_t leafNumber, ordinal;
+  char const * chain;
+  char const * leafEnd;
+
+  ChainCursor(): leafNumber( 0xffffFFFF ), ordinal( 0 ), chain( 0 ), leafEnd( 0 )
+  {}
+};
+
 /// Base btree indexing class which allows using what buildIndex() function
 /// created. It's quite low-lovel and is basically a set of 'building blocks'
 /// functions.
@@ -81,30 +152,51 @@ public:
 
   /// Opens the index. The file reference is saved to be used for
   /// subsequent lookups.
-  /// The mutex is the one to be locked when working with the file.
-  void openIndex( IndexInfo const &, File::Class &, Mutex & );
+  /// The mutex is the one to be locked when working with the file. The
+  /// lookups themselves don't lock it, since they use either the mapping or
+  /// positional reads, unless the platform supports neither.
+  /// If mapIndex is true, the file is memory-mapped when possible, and the
+  /// nodes are then decompressed straight from the mapping, without seeking
+  /// and copying. Otherwise, or if the mapping fails, the nodes are read
+  /// through the file itself.
+  void openIndex( IndexInfo const &, File::Class &, Mutex &, bool mapIndex = true );
 
   /// Finds articles that match the given string. A case-insensitive search
   /// is performed.
   vector< WordArticleLink > findArticles( wstring const &, bool ignoreDiacritics = false );
 
-  /// Find all unique article links in the index
-  void findAllArticleLinks( QVector< WordArticleLink > & articleLinks );
-
-  /// Retrieve all unique headwords from index
-  void getAllHeadwords( QSet< QString > & headwords );
-
-  /// Find all article links and/or headwords in the index
-  void findArticleLinks( QVector< WordArticleLink > * articleLinks,
-                         QSet< uint32_t > * offsets,
-                         QSet< QString > * headwords,
-                         QAtomicInt * isCancelled = 0 );
-
-  /// Retrieve headwords for presented article addresses
+  /// Same as calling findArticles() for each of the words given and
+  /// concatenating the results, in order. The words are looked up in their
+  /// folded order though, and the ones landing in the same leaf are found
+  /// there without descending the tree again. Meant for a word together
+  /// with its alternate writings.
+  vector< WordArticleLink > findArticlesBatch( vector< wstring > const &,
+                                               bool ignoreDiacritics = false );
+
+  /// Stores the offsets of all the articles the index links to, sorted,
+  /// each one once, without building a set of them on the way. The indices
+  /// having the offset map have it read in order, the others have their
+  /// leaves walked.
+  void findArticleOffsets( QVector< uint32_t > & offsets,
+                           QAtomicInt * isCancelled = 0 );
+
+  /// Retrieve headwords for presented article addresses. The offsets found
+  /// are removed from the list. The indices having the offset map have the
+  /// headwords looked up in it, the others have all their leaves scanned.
   void getHeadwordsFromOffsets( QList< uint32_t > & offsets,
                                 QVector< QString > & headwords,
                                 QAtomicInt * isCancelled = 0 );
 
+  /// Hands all the chains of the index over to the visitor, in the order of
+  /// their keys, as they are read by ChainReader.
+  void forEachChain( ChainVisitor &, QAtomicInt * isCancelled = 0 );
+
+  /// Identifies the current revision of the index file: its path, size,
+  /// modification time and a hash of its root node. Empty until the index
+  /// is opened.
+  QString const & getIndexIdentity() const
+  { return idxFileIdentity; }
+
 protected:
 
   /// Finds the offset in the btree leaf for the given word, either matching
@@ -121,13 +213,52 @@ protected:
   /// the node data.
   char const * findChainOffsetExactOrPrefix( wstring const & target,
                                              bool & exactMatch,
-                                             vector< char > & leaf,
+                                             QByteArray & leaf,
                                              uint32_t & nextLeaf,
                                              char const * & leafEnd );
 
   /// Reads a node or leaf at the given offset. Just uncompresses its data
-  /// to the given vector and does nothing more.
-  void readNode( uint32_t offset, vector< char > & out );
+  /// to the given array and does nothing more. If nextLeaf is non-zero, the
+  /// link to the next leaf is stored there. The link is zero for the nodes
+  /// and for the root leaf.
+  /// The decompressed data is taken from the shared node cache when it's
+  /// there, and is put there otherwise. It must be treated as read-only.
+  void readNode( uint32_t offset, QByteArray & out, uint32_t * nextLeaf = 0 );
+
+  /// Same as readNode(), but bypasses the node cache and doesn't read any
+  /// links. Used for the parts of the index which are loaded only once.
+  void readNodeUncached( uint32_t offset, QByteArray & out, uint32_t * nextLeaf = 0 );
+
+  /// Loads the root node, unless it's already loaded. If the index begins
+  /// with a directory, the directory is parsed and the parts it lists are
+  /// loaded as well.
+  void loadRootNode();
+
+  /// Returns false if the index definitely has no such folded key, as told
+  /// by its Bloom filter. The indices without one always return true.
+  bool mayContainKey( wstring const & folded );
+
+  /// Finds the chains whose headwords contain all the given folded strings,
+  /// or rather all of their trigrams, using the trigram index. Their
+  /// ordinals are stored to 'ordinals', in order. Returns false if the index
+  /// has no trigram index, or if none of the strings has any trigrams.
+  bool findChainsContaining( vector< wstring > const & folded,
+                             vector< uint32_t > & ordinals );
+
+  /// Returns the chain with the given ordinal, as listed by
+  /// findChainsContaining(). The leaf is loaded to the cursor, unless the
+  /// cursor already points into it, before the chain sought.
+  char const * findChainByOrdinal( uint32_t ordinal, ChainCursor & );
+
+  /// Decompresses the node stored at the given offset from the given data,
+  /// which holds 'size' bytes of the file starting from that offset.
+  /// Otherwise the same as readNodeUncached().
+  void decodeNode( uint32_t offset, unsigned char const * data, qint64 size,
+                   QByteArray & out, uint32_t * nextLeaf = 0 );
+
+  /// Returns true if the given node, read at the given offset, is followed
+  /// by the link to the next leaf.
+  bool hasNextLeafLink( uint32_t offset, QByteArray const & node ) const;
 
   /// Reads the word-article links' chain at the given offset. The pointer
   /// is updated to point to the next chain, if there's any.
@@ -144,11 +275,91 @@ protected:
 
 private:
 
+  // The whole index file mapped into memory, or 0 if it isn't mapped
+  unsigned char const * idxFileMapping;
+  qint64 idxFileMappingSize;
+
+  // Identifies the index file in the node cache
+  QString idxFileIdentity;
+  quint32 idxFileId;
+
   uint32_t indexNodeSize;
-  uint32_t rootOffset;
-  bool rootNodeLoaded;
-  vector< char > rootNode; // We load root note here and keep it at all times,
+  uint32_t rootOffset; // Points to the directory until the root is loaded
+  QAtomicInt rootNodeLoaded;
+  QByteArray rootNode; // We load root note here and keep it at all times,
                            // since all searches always start with it.
+  QByteArray bloomFilter; // Empty if the index has none
+
+  // The trigram index is only loaded once a wildcard search needs it
+  uint32_t trigramIndexOffset; // Zero if the index has none
+  QAtomicInt trigramIndexLoaded;
+  QByteArray trigramIndex;
+
+  /// Loads the trigram index, unless it's already loaded. Returns false if
+  /// the index has none.
+  bool loadTrigramIndex();
+
+  /// Decodes the posting list having the given number of the ordinals,
+  /// which is stored in the given posting block at the given offset
+  void readPostings( uint32_t block, uint32_t offset, uint32_t count,
+                     vector< uint32_t > & ordinals );
+
+  // The offset map is only loaded once the headwords of some articles
+  // are needed
+  uint32_t offsetMapOffset; // Zero if the index has none
+  QAtomicInt offsetMapLoaded;
+  QByteArray offsetMap;
+
+  /// Loads the offset map, unless it's already loaded. Returns false if the
+  /// index has none.
+  bool loadOffsetMap();
+
+  /// Does what getHeadwordsFromOffsets() does, using the offset map
+  void getHeadwordsFromOffsetMap( QList< uint32_t > & offsets,
+                                  QVector< QString > & headwords,
+                                  QAtomicInt * isCancelled );
+
+  friend class ChainReader;
+
+};
+
+/// Reads all the chains of an index, in the order of their keys, a leaf at
+/// a time. Only the current leaf is kept decompressed. The ones which follow
+/// it are read ahead, ReadAheadSize bytes of the file at once, so walking
+/// a whole index takes constant memory and few reads. The leaves are read
+/// past the node cache, so the walk doesn't evict the nodes the lookups
+/// need.
+class ChainReader
+{
+public:
+
+  enum
+  {
+    ReadAheadSize = 1024 * 1024
+  };
+
+  explicit ChainReader( BtreeIndex & );
+
+  /// Reads the next chain to the given vector. Returns false once all of
+  /// them were read.
+  bool next( vector< WordArticleLink > & chain );
+
+private:
+
+  BtreeIndex & index;
+
+  QByteArray leaf;
+  char const * chainPtr;
+  char const * leafEnd;
+  uint32_t nextLeaf;
+
+  // The part of the index file read ahead, unless it's mapped
+  vector< unsigned char > window;
+  qint64 windowOffset;
+  qint64 fileSize;
+
+  /// Reads the leaf at the given offset, through the window
+  void readLeaf( uint32_t offset );
 };
 
 /// A base for the dictionary that utilizes a btree index build using
@@ -175,10 +386,38 @@ public:
                                                               unsigned long maxResults )
     THROW_SPEC( std::exception );
 
+  /// Walks the index with a Levenshtein automaton, skipping all the keys
+  /// sharing a prefix once that prefix is too far off the word.
+  virtual sptr< Dictionary::WordSearchRequest > fuzzyMatch( wstring const &,
+                                                            unsigned maxDistance,
+                                                            unsigned long maxResults )
+    THROW_SPEC( std::exception );
+
   virtual bool isLocalDictionary()
   { return true; }
 
-  virtual bool getHeadwords( QStringList &headwords );
+  /// Returns true if prefixMatch() and stemmedMatch() find nothing beyond
+  /// what the index has, so the index can stand in for the dictionary in a
+  /// merged group index. Derivatives adding their own matches return false.
+  virtual bool searchesIndexOnly() const
+  { return true; }
+
+  /// Walks the headwords with a ChainReader, in the order of their keys
+  virtual bool forEachHeadword( Dictionary::HeadwordVisitor &, QAtomicInt * isCancelled = 0 );
+
+  /// Finds the articles of the word and of all its alternate writings, as
+  /// given to getArticle(), in a single lookup. The links of the word come
+  /// first, then the ones of each of the alts in turn.
+  vector< WordArticleLink > findArticlesWithAlts( wstring const & word,
+                                                  vector< wstring > const & alts,
+                                                  bool ignoreDiacritics );
+
+  /// Finds the articles for all the words given. The default looks them all
+  /// up in the index at once with findArticlesBatch(). Derivatives having
+  /// the headwords elsewhere as well override it.
+  virtual vector< WordArticleLink > findAllArticles( vector< wstring > const & words,
+                                                     bool ignoreDiacritics )
+  { return findArticlesBatch( words, ignoreDiacritics ); }
 
   virtual void getArticleText( uint32_t articleAddress, QString & headword, QString & text );
 
@@ -191,6 +430,12 @@ public:
   virtual uint32_t getFtsIndexVersion()
   { return 0; }
 
+  /// Stores the offsets of all the articles to be indexed or surveyed for
+  /// the full-text search. The default is all the articles the index links to.
+  virtual void findArticleOffsetsForFTS( QVector< uint32_t > & offsets,
+                                         QAtomicInt & isCancelled )
+  { findArticleOffsets( offsets, &isCancelled ); }
+
   // Sort articles offsets for full-text search in dictionary-specific order
   // to increase of articles retrieving speed
   // Default - simple sorting in increase order
@@ -210,6 +455,7 @@ protected:
   string ftsIdxName;
 
   friend class BtreeWordSearchRequest;
+  friend class BtreeFuzzySearchRequest;
   friend class FTSResultsRequest;
 };
 
@@ -238,6 +484,12 @@ public:
 
   virtual void findMatches();
 
+  /// Called for each link found before its word is added to the matches.
+  /// Derivatives can skip some of the links by returning false. The default
+  /// implementation accepts all of them.
+  virtual bool acceptLink( WordArticleLink const & )
+  { return true; }
+
   void run(); // Run from another thread by BtreeWordSearchRunnable
 
   virtual void cancel()
@@ -248,6 +500,27 @@ public:
   ~BtreeWordSearchRequest();
 };
 
+/// Finds the headwords within the given edit distance of the word. The keys
+/// are walked in order, with the distances computed incrementally for the
+/// characters each key adds to the prefix it shares with the previous one.
+/// Once a prefix gets too far off, the walk seeks right past all the keys
+/// beginning with it.
+class BtreeFuzzySearchRequest: public BtreeWordSearchRequest
+{
+  unsigned maxDistance;
+
+public:
+
+  BtreeFuzzySearchRequest( BtreeDictionary & dict_,
+                           wstring const & str_,
+                           unsigned maxDistance_,
+                           unsigned long maxResults_ );
+
+  virtual void findMatches();
+
+  ~BtreeFuzzySearchRequest();
+};
+
 // Everything below is for building the index data.
 
 /// This represents the index in its source form, as a map which binds folded
@@ -264,12 +537,166 @@ struct IndexedWords: public map< string, vector< WordArticleLink > >
   /// Differs from addWord() in that it only adds a single entry. We use this
   /// for zip's file names.
   void addSingleWord( wstring const & word, uint32_t articleOffset );
+
+  /// Adds a single link under the given folded utf8 key. Used by addWord().
+  void addLink( string const & key, string const & word, string const & prefix,
+                uint32_t articleOffset );
 };
 
 /// Builds the index, as a compressed btree. Returns IndexInfo.
 /// All the data is stored to the given file, beginning from its current
-/// position.
-IndexInfo buildIndex( IndexedWords const &, File::Class & file );
+/// position. The formatVersion is either FormatVersion or
+/// SearchableFormatVersion. The extraParts are the ExtraIndexParts flags.
+IndexInfo buildIndex( IndexedWords const &, File::Class & file,
+                      unsigned formatVersion = FormatVersion,
+                      unsigned extraParts = NoExtraParts );
+
+/// A reference to a single link stored in the SortedIndexedWords' arena.
+struct SortedWordRef
+{
+  quint64 keyPrefix; // First 8 bytes of the key, big-endian, zero-padded
+  size_t offset; // Offset of the record in the arena
+};
+
+class SortedIndexedWords;
+
+/// Rewrites the chains built from the SortedIndexedWords before they are
+/// stored, e.g. to collapse the links which only differ in their offsets.
+class ChainFilter
+{
+public:
+
+  /// The chain given is never empty, and must not be left empty
+  virtual void filterChain( string const & key, vector< WordArticleLink > & chain ) = 0;
+
+  virtual ~ChainFilter()
+  {}
+};
+
+/// Builds the index from the SortedIndexedWords. The result is identical to
+/// the one built from IndexedWords holding the same words, unless the chains
+/// are rewritten by the filter given.
+IndexInfo buildIndex( SortedIndexedWords &, File::Class & file,
+                      unsigned formatVersion = FormatVersion,
+                      unsigned extraParts = NoExtraParts,
+                      ChainFilter * filter = 0 );
+
+/// A drop-in replacement for IndexedWords meant for the dictionaries with
+/// millions of headwords. Instead of a map, the links are appended to a flat
+/// arena and are only sorted once all of them are added. Should the arena
+/// grow beyond the memory limit given, it gets sorted and spilled to a
+/// temporary file, and the spilled runs are merged back when building the
+/// index.
+class SortedIndexedWords
+{
+public:
+
+  enum
+  {
+    DefaultMemoryLimit = 64 * 1024 * 1024
+  };
+
+  explicit SortedIndexedWords( size_t memoryLimit = DefaultMemoryLimit );
+  ~SortedIndexedWords();
+
+  /// Same as IndexedWords::addWord()
+  void addWord( wstring const & word, uint32_t articleOffset, unsigned int maxHeadwordSize = 256U );
+
+  /// Same as IndexedWords::addSingleWord()
+  void addSingleWord( wstring const & word, uint32_t articleOffset );
+
+  /// Same as IndexedWords::addLink()
+  void addLink( string const & key, string const & word, string const & prefix,
+                uint32_t articleOffset );
+
+  /// Sorts the links added so far. buildIndex() does it anyway, this is to
+  /// have it done on the thread which added the links.
+  void sort()
+  { sortArena(); }
+
+  /// Moves all the links of the other words in, as if they were added after
+  /// the ones added so far, leaving the other words empty. The links of
+  /// each of the words are sorted separately, and are only merged as sorted
+  /// runs later on.
+  void append( SortedIndexedWords & other );
+
+  bool empty() const
+  { return order.empty() && runFileNames.empty(); }
+
+  /// Releases all the data, including the spilled runs
+  void clear();
+
+private:
+
+  size_t memoryLimit;
+  vector< char > arena;
+  vector< SortedWordRef > order;
+  /// The ends of the sorted runs the order begins with. The links past the
+  /// last one are not sorted yet.
+  vector< size_t > sortedRunEnds;
+  vector< string > runFileNames;
+  vector< size_t > runRecords;
+
+  /// Stable-sorts the links in the arena by their keys
+  void sortArena();
+
+  /// Sorts the links added past the last sorted run into a run of their own
+  void sortTail();
+
+  /// Sorts the arena and moves its contents to a new temporary file
+  void spillArena();
+
+  SortedIndexedWords( SortedIndexedWords const & );
+  SortedIndexedWords & operator = ( SortedIndexedWords const & );
+
+  friend IndexInfo buildIndex( SortedIndexedWords &, File::Class &, unsigned, unsigned,
+                               ChainFilter * );
+};
+
+/// Collects the headwords of a dictionary on several threads. The records of
+/// the dictionary are split into consecutive parts, and each part is
+/// collected on a thread of its own, into words of its own. Those are sorted
+/// on the same thread, then merged in the order of the parts, so the index
+/// built is the same as if all the records were added in order on one
+/// thread.
+class ParallelCollector
+{
+public:
+
+  enum
+  {
+    /// The dictionaries with fewer records are collected on the calling
+    /// thread, as a single part
+    MinParallelRecords = 65536
+  };
+
+  virtual ~ParallelCollector()
+  {}
+
+  /// Collects the records [0, count), adding their links to the words and the
+  /// resources given. Throws exCollectingFailed if collecting any of the
+  /// parts failed.
+  void run( uint32_t count, SortedIndexedWords & words,
+            SortedIndexedWords & resources );
+
+protected:
+
+  /// Called before collecting, with the number of the parts, so that the
+  /// state kept for each part can be allocated
+  virtual void prepare( size_t parts )
+  { (void) parts; }
+
+  /// Collects the records [begin, end) of the given part. With several parts,
+  /// it's called on different threads at once.
+  virtual void collect( size_t part, uint32_t begin, uint32_t end,
+                        SortedIndexedWords & words,
+                        SortedIndexedWords & resources )=0;
+
+private:
+
+  class CollectRunnable;
+  friend class CollectRunnable;
+};
 
 }
 
@@ -4,17 +4,510 @@
 #include "chunkedstorage.hh"
 #include <zlib.h>
 #include <string.h>
+#include <algorithm>
+
+#ifdef MAKE_ZSTD_SUPPORT
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include <deque>
+
+#include <QCache>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QWaitCondition>
 
 namespace ChunkedStorage {
 
 enum
 {
-  ChunkMaxSize = 65536 // Can't be more since it would overflow the address
+  ChunkMaxSize = 65536, // Can't be more since it would overflow the address
+  DefaultChunkCacheSize = 16 * 1024 * 1024,
+
+  /// Starts the chunk table of the files using a codec other than zlib. The
+  /// older tables start with the chunk count instead, which can never be
+  /// that large.
+  CodecTableMarker = 0xffffFFC0,
+
+  ZstdLevel = 9,
+  DictionaryTrainingSize = 4 * 1024 * 1024, // How much data to train on
+  // With less data than that, the dictionary would cost more than it saves
+  DictionaryMinTrainingSize = 1024 * 1024,
+  DictionaryMaxSize = 64 * 1024
 };
 
-Writer::Writer( File::Class & f ):
-  file( f ), chunkStarted( false ), bufferUsed( 0 )
+#ifdef MAKE_ZSTD_SUPPORT
+
+struct ZstdCompressor
+{
+  ZSTD_CDict * dictionary; // 0 if there's none
+
+  ZstdCompressor(): dictionary( 0 )
+  {}
+
+  ~ZstdCompressor()
+  {
+    for( size_t x = 0; x < contexts.size(); ++x )
+      ZSTD_freeCCtx( contexts[ x ] );
+
+    ZSTD_freeCDict( dictionary );
+  }
+
+  /// Is to be called before any compression is done
+  void setDictionary( vector< unsigned char > const & data )
+  {
+    if ( !data.empty() )
+      dictionary = ZSTD_createCDict( &data.front(), data.size(), ZstdLevel );
+  }
+
+  /// Can be called from several threads at once, each using a context of
+  /// its own
+  size_t compress( void * dst, size_t dstCapacity, void const * src, size_t srcSize )
+  {
+    ZSTD_CCtx * context = 0;
+
+    {
+      QMutexLocker _( &mutex );
+
+      if ( !contexts.empty() )
+      {
+        context = contexts.back();
+        contexts.pop_back();
+      }
+    }
+
+    if ( !context )
+      context = ZSTD_createCCtx();
+
+    size_t result;
+
+    if ( dictionary )
+      result = ZSTD_compress_usingCDict( context, dst, dstCapacity, src, srcSize, dictionary );
+    else
+      result = ZSTD_compressCCtx( context, dst, dstCapacity, src, srcSize, ZstdLevel );
+
+    QMutexLocker _( &mutex );
+
+    contexts.push_back( context );
+
+    return result;
+  }
+
+private:
+
+  QMutex mutex;
+  vector< ZSTD_CCtx * > contexts; // The ones not in use at the moment
+};
+
+struct ZstdDecompressor
+{
+  ZSTD_DCtx * context;
+  ZSTD_DDict * dictionary; // 0 if there's none
+
+  explicit ZstdDecompressor( vector< unsigned char > const & data ):
+    context( ZSTD_createDCtx() ), dictionary( 0 )
+  {
+    if ( !data.empty() )
+      dictionary = ZSTD_createDDict( &data.front(), data.size() );
+  }
+
+  ~ZstdDecompressor()
+  {
+    ZSTD_freeDDict( dictionary );
+    ZSTD_freeDCtx( context );
+  }
+
+  size_t decompress( void * dst, size_t dstCapacity, void const * src, size_t srcSize )
+  {
+    if ( dictionary )
+      return ZSTD_decompress_usingDDict( context, dst, dstCapacity, src, srcSize, dictionary );
+    else
+      return ZSTD_decompressDCtx( context, dst, dstCapacity, src, srcSize );
+  }
+};
+
+#endif
+
+namespace {
+
+/// A cache of decompressed chunks, shared by all the readers in the process.
+/// The chunks are keyed by their file and their offset in it, and are
+/// evicted in the least-recently-used order once the memory budget is
+/// exceeded. Like the btree node cache, it is split into several
+/// independently locked shards.
+class ChunkCache
+{
+public:
+
+  ChunkCache()
+  { setMaxSize( DefaultChunkCacheSize ); }
+
+  /// Returns the id to be used for the file with the given identity string.
+  /// The same identity always yields the same id.
+  quint32 getFileId( QString const & identity );
+
+  /// Looks the chunk up. Returns true and fills in the data if it was found.
+  bool find( quint32 fileId, uint32_t offset, QByteArray & data );
+
+  void insert( quint32 fileId, uint32_t offset, QByteArray const & data );
+
+  void setMaxSize( int bytes );
+
+private:
+
+  enum
+  {
+    Shards = 8
+  };
+
+  struct Shard
+  {
+    QMutex mutex;
+    QCache< quint64, QByteArray > cache;
+  };
+
+  static quint64 makeKey( quint32 fileId, uint32_t offset )
+  { return ( (quint64) fileId << 32 ) | offset; }
+
+  Shard & shardFor( quint64 key )
+  { return shards[ ( key ^ ( key >> 32 ) ^ ( key >> 16 ) ) % Shards ]; }
+
+  Shard shards[ Shards ];
+
+  QMutex fileIdsMutex;
+  QHash< QString, quint32 > fileIds;
+};
+
+quint32 ChunkCache::getFileId( QString const & identity )
+{
+  QMutexLocker _( &fileIdsMutex );
+
+  QHash< QString, quint32 >::const_iterator i = fileIds.constFind( identity );
+
+  if ( i != fileIds.constEnd() )
+    return *i;
+
+  quint32 id = fileIds.size() + 1;
+
+  fileIds.insert( identity, id );
+
+  return id;
+}
+
+bool ChunkCache::find( quint32 fileId, uint32_t offset, QByteArray & data )
+{
+  quint64 key = makeKey( fileId, offset );
+  Shard & shard = shardFor( key );
+
+  QMutexLocker _( &shard.mutex );
+
+  QByteArray * chunk = shard.cache.object( key );
+
+  if ( !chunk )
+    return false;
+
+  data = *chunk;
+
+  return true;
+}
+
+void ChunkCache::insert( quint32 fileId, uint32_t offset, QByteArray const & data )
+{
+  quint64 key = makeKey( fileId, offset );
+  Shard & shard = shardFor( key );
+
+  QMutexLocker _( &shard.mutex );
+
+  // If the chunk is larger than the whole shard, the cache deletes it at once
+  shard.cache.insert( key, new QByteArray( data ), data.size() + sizeof( QByteArray ) );
+}
+
+void ChunkCache::setMaxSize( int bytes )
+{
+  for( int x = 0; x < Shards; ++x )
+  {
+    QMutexLocker _( &shards[ x ].mutex );
+
+    shards[ x ].cache.setMaxCost( bytes / Shards );
+  }
+}
+
+ChunkCache chunkCache;
+
+}
+
+void setChunkCacheSize( int bytes )
+{
+  chunkCache.setMaxSize( bytes );
+}
+
+namespace {
+
+/// Compresses the chunk with zstd if the compressor is given, or with zlib
+/// otherwise. Returns false on failure.
+bool compressChunk( ZstdCompressor * zstd, vector< unsigned char > const & data,
+                    vector< unsigned char > & compressedData )
+{
+  unsigned char const * source = data.empty() ? 0 : &data.front();
+
+#ifdef MAKE_ZSTD_SUPPORT
+  if ( zstd )
+  {
+    compressedData.resize( ZSTD_compressBound( data.size() ) );
+
+    size_t compressedSize = zstd->compress( &compressedData.front(), compressedData.size(),
+                                            source, data.size() );
+
+    if ( ZSTD_isError( compressedSize ) )
+      return false;
+
+    compressedData.resize( compressedSize );
+
+    return true;
+  }
+#else
+  (void) zstd;
+#endif
+
+  unsigned long compressedSize = compressBound( data.size() );
+
+  compressedData.resize( compressedSize );
+
+  if ( compress( &compressedData.front(), &compressedSize,
+                 source, data.size() ) != Z_OK )
+    return false;
+
+  compressedData.resize( compressedSize );
+
+  return true;
+}
+
+/// A chunk waiting in the CompressionQueue
+struct PendingChunk
+{
+  vector< unsigned char > data, compressedData;
+
+  /// Set once compressedData is ready
+  bool compressed;
+  bool failed;
+};
+
+}
+
+/// Compresses the chunks on the global thread pool and writes them out in
+/// the order they were added, so they get the very numbers the addresses of
+/// their blocks were made of. The writing is done on the thread adding the
+/// chunks, as it's the one owning the file. The pool is shared by all the
+/// queues, so the dictionaries being indexed at once don't run more threads
+/// than there are cores. When no thread of the pool is free, the chunk is
+/// compressed right on the adding thread, so the queue never waits for the
+/// work queued behind someone else's, which could otherwise deadlock when
+/// the queue itself is run from the pool.
+class CompressionQueue
+{
+  File::Class & file;
+  vector< uint32_t > & offsets;
+  ZstdCompressor * zstd;
+
+  bool parallel;
+  size_t maxPending;
+
+  /// Released by each of the runnables started once it's done with the queue
+  QSemaphore hasExited;
+  int started;
+
+  QMutex mutex;
+  QWaitCondition chunkCompressed;
+
+  std::deque< PendingChunk * > pending;
+
+  class CompressRunnable: public QRunnable
+  {
+    CompressionQueue & queue;
+    PendingChunk & chunk;
+
+  public:
+
+    CompressRunnable( CompressionQueue & queue_, PendingChunk & chunk_ ):
+      queue( queue_ ), chunk( chunk_ )
+    {}
+
+    ~CompressRunnable()
+    {
+      queue.hasExited.release();
+    }
+
+    virtual void run();
+  };
+
+  /// Writes out the chunk at the front of the queue, recording its offset
+  void writeFront();
+
+public:
+
+  CompressionQueue( File::Class &, vector< uint32_t > & offsets, ZstdCompressor * );
+  ~CompressionQueue();
+
+  /// Adds the chunk to the queue, taking its data, and writes out the ones
+  /// which are ready.
+  void add( vector< unsigned char > & data );
+
+  /// Writes out all the chunks left.
+  void finish();
+};
+
+void CompressionQueue::CompressRunnable::run()
+{
+  chunk.failed = !compressChunk( queue.zstd, chunk.data, chunk.compressedData );
+
+  QMutexLocker _( &queue.mutex );
+
+  chunk.compressed = true;
+
+  queue.chunkCompressed.wakeAll();
+}
+
+CompressionQueue::CompressionQueue( File::Class & file_, vector< uint32_t > & offsets_,
+                                    ZstdCompressor * zstd_ ):
+  file( file_ ), offsets( offsets_ ), zstd( zstd_ ), started( 0 )
 {
+  int threads = QThreadPool::globalInstance()->maxThreadCount();
+
+  parallel = threads > 1;
+  maxPending = threads > 1 ? threads * 4 : 1;
+}
+
+CompressionQueue::~CompressionQueue()
+{
+  hasExited.acquire( started );
+
+  for( size_t x = 0; x < pending.size(); ++x )
+    delete pending[ x ];
+}
+
+void CompressionQueue::add( vector< unsigned char > & data )
+{
+  PendingChunk * chunk = new PendingChunk;
+
+  chunk->data.swap( data );
+  chunk->compressed = false;
+  chunk->failed = false;
+
+  {
+    QMutexLocker _( &mutex );
+    pending.push_back( chunk );
+  }
+
+  if ( parallel )
+  {
+    CompressRunnable * runnable = new CompressRunnable( *this, *chunk );
+
+    if ( !QThreadPool::globalInstance()->tryStart( runnable ) )
+    {
+      // No thread is free, so compress the chunk right here
+      runnable->run();
+      delete runnable;
+    }
+
+    ++started;
+  }
+
+  // Write out whatever is ready, and make sure the queue doesn't grow too
+  // long
+
+  for( ; ; )
+  {
+    QMutexLocker _( &mutex );
+
+    if ( pending.empty() )
+      break;
+
+    if ( !pending.front()->compressed && parallel )
+    {
+      if ( pending.size() <= maxPending )
+        break;
+
+      chunkCompressed.wait( &mutex );
+      continue;
+    }
+
+    _.unlock();
+    writeFront();
+  }
+}
+
+void CompressionQueue::writeFront()
+{
+  PendingChunk * chunk;
+
+  {
+    QMutexLocker _( &mutex );
+    chunk = pending.front();
+  }
+
+  if ( !chunk->compressed )
+    chunk->failed = !compressChunk( zstd, chunk->data, chunk->compressedData );
+
+  if ( chunk->failed )
+    throw exFailedToCompressChunk();
+
+  offsets.push_back( file.tell() );
+
+  file.write( (uint32_t) chunk->data.size() );
+  file.write( (uint32_t) chunk->compressedData.size() );
+  file.write( &chunk->compressedData.front(), chunk->compressedData.size() );
+
+  {
+    QMutexLocker _( &mutex );
+    pending.pop_front();
+  }
+
+  delete chunk;
+}
+
+void CompressionQueue::finish()
+{
+  for( ; ; )
+  {
+    QMutexLocker _( &mutex );
+
+    if ( pending.empty() )
+      break;
+
+    if ( !pending.front()->compressed && parallel )
+    {
+      chunkCompressed.wait( &mutex );
+      continue;
+    }
+
+    _.unlock();
+    writeFront();
+  }
+}
+
+Writer::Writer( File::Class & f, Codec codec_ ):
+  file( f ), codec( codec_ ), chunkStarted( false ), bufferUsed( 0 ),
+  chunksSaved( 0 ), training( false ), zstd( 0 )
+{
+#ifdef MAKE_ZSTD_SUPPORT
+  if ( codec != ZlibCodec )
+  {
+    zstd = new ZstdCompressor;
+    training = ( codec == ZstdDictionaryCodec );
+  }
+#else
+  codec = ZlibCodec;
+#endif
+
+  queue = new CompressionQueue( file, offsets, zstd );
+
   // Create a sratchpad at the beginning of file. We use it to write chunk
   // table if it would fit, in order to save some seek times.
 
@@ -28,6 +521,15 @@ Writer::Writer( File::Class & f ):
   file.write( zero, sizeof( zero ) );
 }
 
+Writer::~Writer()
+{
+  delete queue;
+
+#ifdef MAKE_ZSTD_SUPPORT
+  delete zstd;
+#endif
+}
+
 uint32_t Writer::startNewBlock()
 {
   if ( bufferUsed >= ChunkMaxSize )
@@ -38,10 +540,13 @@ uint32_t Writer::startNewBlock()
 
   chunkStarted = true;
 
+  if ( training )
+    sampleSizes.push_back( 0 );
+
   // The address is comprised of the offset within the chunk (in lower
   // 16 bits, always fits there since ChunkMaxSize-1 does) and the
   // number of the chunk, which is therefore limited to be 65535 max.
-  return bufferUsed | ( (uint32_t)offsets.size() << 16 );
+  return bufferUsed | ( (uint32_t)chunksSaved << 16 );
 }
 
 void Writer::addToBlock( void const * data, size_t size )
@@ -56,42 +561,104 @@ void Writer::addToBlock( void const * data, size_t size )
 
   bufferUsed += size;
 
+  if ( training && !sampleSizes.empty() )
+    sampleSizes.back() += size;
+
   chunkStarted = false;
 }
 
 void Writer::saveCurrentChunk()
 {
-  size_t maxCompressedSize = compressBound( bufferUsed );
-
-  if ( bufferCompressed.size() < maxCompressedSize )
-    bufferCompressed.resize( maxCompressedSize );
-
-  unsigned long compressedSize = bufferCompressed.size();
+  if ( training )
+  {
+    pendingData.insert( pendingData.end(), buffer.begin(), buffer.begin() + bufferUsed );
+    pendingChunkSizes.push_back( bufferUsed );
 
-  if ( compress( &bufferCompressed.front(), &compressedSize,
-                 &buffer.front(), bufferUsed ) != Z_OK )
-    throw exFailedToCompressChunk();
+    if ( pendingData.size() >= DictionaryTrainingSize )
+      trainDictionary();
+  }
+  else
+  {
+    vector< unsigned char > data( buffer.begin(), buffer.begin() + bufferUsed );
 
-  offsets.push_back( file.tell() );
+    queue->add( data );
+  }
 
-  file.write( (uint32_t) bufferUsed );
-  file.write( (uint32_t) compressedSize );
-  file.write( &bufferCompressed.front(), compressedSize );
+  ++chunksSaved;
 
   bufferUsed = 0;
 
   chunkStarted = false;
 }
 
+void Writer::trainDictionary()
+{
+  training = false;
+
+#ifdef MAKE_ZSTD_SUPPORT
+  // Empty blocks make no samples
+  sampleSizes.erase( std::remove( sampleSizes.begin(), sampleSizes.end(), (size_t) 0 ),
+                     sampleSizes.end() );
+
+  if ( pendingData.size() >= DictionaryMinTrainingSize )
+  {
+    dictionary.resize( DictionaryMaxSize );
+
+    size_t size = ZDICT_trainFromBuffer( &dictionary.front(), dictionary.size(),
+                                         &pendingData.front(), &sampleSizes.front(),
+                                         sampleSizes.size() );
+
+    // Too few samples or too little data to train on, so there won't be any
+    if ( ZDICT_isError( size ) )
+      size = 0;
+
+    dictionary.resize( size );
+
+    zstd->setDictionary( dictionary );
+  }
+#endif
+
+  vector< unsigned char >::const_iterator i = pendingData.begin();
+
+  for( size_t x = 0; x < pendingChunkSizes.size(); ++x )
+  {
+    vector< unsigned char > data( i, i + pendingChunkSizes[ x ] );
+
+    queue->add( data );
+
+    i += pendingChunkSizes[ x ];
+  }
+
+  vector< unsigned char >().swap( pendingData );
+  vector< size_t >().swap( pendingChunkSizes );
+  vector< size_t >().swap( sampleSizes );
+}
+
 uint32_t Writer::finish()
 {
   if ( bufferUsed || chunkStarted )
     saveCurrentChunk();
 
+  if ( training )
+    trainDictionary(); // There wasn't as much data as we wanted to train on
+
+  queue->finish();
+
+  // The dictionary goes right before the table
+  uint32_t dictionaryOffset = 0;
+
+  if ( dictionary.size() )
+  {
+    dictionaryOffset = file.tell();
+    file.write( &dictionary.front(), dictionary.size() );
+  }
+
+  size_t tableHeaderSize = ( codec == ZlibCodec ? 1 : 5 ) * sizeof( uint32_t );
+
   bool useScratchPad = false;
   uint32_t savedOffset = 0;
 
-  if ( scratchPadSize >= offsets.size() * sizeof( uint32_t ) + sizeof( uint32_t ) )
+  if ( scratchPadSize >= offsets.size() * sizeof( uint32_t ) + tableHeaderSize )
   {
     useScratchPad = true;
     savedOffset = file.tell();
@@ -100,6 +667,14 @@ uint32_t Writer::finish()
 
   uint32_t offset = file.tell();
 
+  if ( codec != ZlibCodec )
+  {
+    file.write( (uint32_t) CodecTableMarker );
+    file.write( (uint32_t) ZstdCodec );
+    file.write( dictionaryOffset );
+    file.write( (uint32_t) dictionary.size() );
+  }
+
   file.write( (uint32_t) offsets.size() );
 
   if ( offsets.size() )
@@ -109,58 +684,144 @@ uint32_t Writer::finish()
     file.seek( savedOffset );
 
   offsets.clear();
+  dictionary.clear();
+  chunksSaved = 0;
   chunkStarted = false;
 
   return offset;
 }
 
-Reader::Reader( File::Class & f, uint32_t offset ): file( f )
+Reader::Reader( File::Class & f, uint32_t offset ):
+  file( f ), codec( ZlibCodec ), zstd( 0 )
 {
   file.seek( offset );
 
   uint32_t size =  file.read< uint32_t >();
-  if ( size == 0 )
-    return;
-  offsets.resize( size );
-  file.read( &offsets.front(), offsets.size() * sizeof( uint32_t ) );
+
+  vector< unsigned char > dictionary;
+
+  if ( size == CodecTableMarker )
+  {
+    codec = file.read< uint32_t >();
+
+    uint32_t dictionaryOffset = file.read< uint32_t >();
+    uint32_t dictionarySize = file.read< uint32_t >();
+
+    size = file.read< uint32_t >();
+
+#ifdef MAKE_ZSTD_SUPPORT
+    if ( codec != ZstdCodec )
+      throw exUnsupportedCodec();
+#else
+    throw exUnsupportedCodec();
+#endif
+
+    if ( dictionarySize )
+    {
+      dictionary.resize( dictionarySize );
+
+      file.seek( dictionaryOffset );
+      file.read( &dictionary.front(), dictionary.size() );
+      file.seek( offset + 5 * sizeof( uint32_t ) );
+    }
+  }
+
+#ifdef MAKE_ZSTD_SUPPORT
+  if ( codec == ZstdCodec )
+    zstd = new ZstdDecompressor( dictionary );
+#endif
+
+  if ( size )
+  {
+    offsets.resize( size );
+    file.read( &offsets.front(), offsets.size() * sizeof( uint32_t ) );
+  }
+
+  // The cached chunks are only valid for this very revision of the file,
+  // so its size and modification time are a part of its identity. The time
+  // may only have a second's resolution, though, so a rebuild within the
+  // same second is told apart by the checksum of the chunk offsets, which
+  // change with any change of the stored chunks.
+  QFileInfo fileInfo( file.file().fileName() );
+
+  uLong checksum = crc32( 0, 0, 0 );
+
+  if ( !offsets.empty() )
+    checksum = crc32( checksum, (Bytef const *) &offsets.front(),
+                      offsets.size() * sizeof( uint32_t ) );
+
+  fileId = chunkCache.getFileId( fileInfo.canonicalFilePath() + "|" +
+                                 QString::number( fileInfo.size() ) + "|" +
+                                 QString::number( fileInfo.lastModified().toTime_t() ) + "|" +
+                                 QString::number( offset ) + "|" +
+                                 QString::number( (quint64) checksum ) );
+}
+
+Reader::~Reader()
+{
+#ifdef MAKE_ZSTD_SUPPORT
+  delete zstd;
+#endif
 }
 
-char * Reader::getBlock( uint32_t address, vector< char > & chunk )
+char const * Reader::getBlock( uint32_t address, QByteArray & chunk )
 {
   size_t chunkIdx = address >> 16;
 
   if ( chunkIdx >= offsets.size() )
     throw exAddressOutOfRange();
 
-  // Read and decompress the chunk
+  if ( !chunkCache.find( fileId, offsets[ chunkIdx ], chunk ) )
   {
-    file.seek( offsets[ chunkIdx ] );
+    readChunk( chunkIdx, chunk );
 
-    uint32_t uncompressedSize = file.read< uint32_t >();
-    uint32_t compressedSize = file.read< uint32_t >();
+    chunkCache.insert( fileId, offsets[ chunkIdx ], chunk );
+  }
+
+  size_t offsetInChunk = address & 0xffFF;
+
+  if ( offsetInChunk > (size_t) chunk.size() ) // It can be equal to for 0-sized blocks
+    throw exAddressOutOfRange();
+
+  return chunk.constData() + offsetInChunk;
+}
+
+void Reader::readChunk( size_t chunkIdx, QByteArray & chunk )
+{
+  file.seek( offsets[ chunkIdx ] );
+
+  uint32_t uncompressedSize = file.read< uint32_t >();
+  uint32_t compressedSize = file.read< uint32_t >();
 
-    chunk.resize( uncompressedSize );
+  chunk.resize( uncompressedSize );
 
-    vector< unsigned char > compressedData( compressedSize );
+  vector< unsigned char > compressedData( compressedSize );
 
-    file.read( &compressedData.front(), compressedData.size() );
+  file.read( &compressedData.front(), compressedData.size() );
 
-    unsigned long decompressedLength = chunk.size();
+#ifdef MAKE_ZSTD_SUPPORT
+  if ( zstd )
+  {
+    size_t decompressedSize = zstd->decompress( chunk.data(), chunk.size(),
+                                                &compressedData.front(),
+                                                compressedData.size() );
 
-    if ( uncompress( (unsigned char *)&chunk.front(),
-                     &decompressedLength,
-                     &compressedData.front(),
-                     compressedData.size() ) != Z_OK ||
-         decompressedLength != chunk.size() )
+    if ( ZSTD_isError( decompressedSize ) ||
+         decompressedSize != (size_t) chunk.size() )
       throw exFailedToDecompressChunk();
-  }
 
-  size_t offsetInChunk = address & 0xffFF;
+    return;
+  }
+#endif
 
-  if ( offsetInChunk > chunk.size() ) // It can be equal to for 0-sized blocks
-    throw exAddressOutOfRange();
+  unsigned long decompressedLength = chunk.size();
 
-  return &chunk.front() + offsetInChunk;
+  if ( uncompress( (unsigned char *) chunk.data(),
+                   &decompressedLength,
+                   &compressedData.front(),
+                   compressedData.size() ) != Z_OK ||
+       decompressedLength != (unsigned long) chunk.size() )
+    throw exFailedToDecompressChunk();
 }
 
 }
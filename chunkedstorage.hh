@@ -8,6 +8,7 @@
 #include "file.hh"
 
 #include <vector>
+#include <QByteArray>
 #if defined( _MSC_VER ) && _MSC_VER < 1800 // VS2012 and older
 #include <stdint_msvc.h>
 #else
@@ -29,17 +30,53 @@ DEF_EX( Ex, "Chunked storage exception", std::exception )
 DEF_EX( exFailedToCompressChunk, "Failed to compress a chunk", Ex )
 DEF_EX( exAddressOutOfRange, "The given chunked address is out of range", Ex )
 DEF_EX( exFailedToDecompressChunk, "Failed to decompress a chunk", Ex )
+DEF_EX( exUnsupportedCodec, "The chunks were compressed with an unsupported codec", Ex )
 
-/// This class writes data blocks in chunks.
+/// The codecs the chunks can be compressed with
+enum Codec
+{
+  ZlibCodec = 0,
+  ZstdCodec = 1,
+  /// Zstd, using a dictionary trained on the first few megabytes of the
+  /// blocks written. Only makes sense for the Writer; the files just record
+  /// ZstdCodec along with the dictionary.
+  ZstdDictionaryCodec = 2
+};
+
+/// The best codec this build supports. The dictionaries using it are to
+/// add it to their format version, so that their indices get rebuilt if
+/// the program is rebuilt with a different zstd support.
+#ifdef MAKE_ZSTD_SUPPORT
+Codec const PreferredCodec = ZstdDictionaryCodec;
+#else
+Codec const PreferredCodec = ZlibCodec;
+#endif
+
+struct ZstdCompressor;
+struct ZstdDecompressor;
+class CompressionQueue;
+
+/// Sets the memory budget, in bytes, of the cache of decompressed chunks
+/// which is shared by all the readers. Zero disables the cache.
+void setChunkCacheSize( int bytes );
+
+/// This class writes data blocks in chunks. The chunks are compressed on a
+/// pool of threads while the next ones are being filled, and are written out
+/// in order.
 class Writer
 {
   vector< uint32_t > offsets;
   File::Class & file;
   size_t scratchPadOffset, scratchPadSize;
+  Codec codec;
 
 public:
 
-  Writer( File::Class & );
+  /// The chunks are compressed with the given codec. Without the zstd
+  /// support built in, zlib is always used.
+  Writer( File::Class &, Codec = ZlibCodec );
+
+  ~Writer();
 
   /// Starts new block. Returns its address.
   uint32_t startNewBlock();
@@ -61,32 +98,68 @@ private:
   // stored (>=ChunkMaxSize), or there's no more data left to store.
   vector< unsigned char > buffer;
 
-  // Here we compress the chunk before writing it out to file.
-  vector< unsigned char > bufferCompressed;
-
   // The amount of data stored in buffer so far. We keep it separate
   // from buffer.size() for performance reasons; the latter one only
   // grows, but never shrinks.
   size_t bufferUsed;
 
+  // The number of the chunks saved so far, whether written out or not
+  size_t chunksSaved;
+
+  // With ZstdDictionaryCodec, the chunks are held back until enough data is
+  // collected to train the dictionary on, each block making a sample.
+  bool training;
+  vector< unsigned char > pendingData;
+  vector< size_t > pendingChunkSizes;
+  vector< size_t > sampleSizes;
+
+  vector< unsigned char > dictionary;
+
+  ZstdCompressor * zstd;
+
+  CompressionQueue * queue;
+
   void saveCurrentChunk();
+
+  /// Trains the dictionary on the chunks held back and queues them up
+  void trainDictionary();
+
+  Writer( Writer const & );
+  Writer & operator = ( Writer const & );
 };
 
 /// This class reads data blocks previously written by Writer.
+/// The decompressed chunks are kept in a cache shared by all the readers,
+/// so the blocks sharing a chunk don't get it decompressed over and over.
 class Reader
 {
   vector< uint32_t > offsets;
   File::Class & file;
+  quint32 fileId; // Identifies the file in the chunk cache
+  uint32_t codec;
+  ZstdDecompressor * zstd;
 
 public:
   /// Creates reader by giving it a file to read from and the offset returned
   /// by Writer::finish().
   Reader( File::Class &, uint32_t );
 
+  ~Reader();
+
   /// Reads the block previously written by Writer, identified by its address.
-  /// Uses the user-provided storage to load the entire chunk, and then to
-  /// return a pointer to the requested block inside it.
-  char * getBlock( uint32_t address, vector< char > & );
+  /// The entire chunk is loaded into the array given, which is shared with
+  /// the cache rather than copied, and a pointer to the requested block
+  /// inside it is returned. The pointer stays valid for as long as the array
+  /// does.
+  char const * getBlock( uint32_t address, QByteArray & );
+
+private:
+
+  /// Reads and decompresses the chunk with the given number
+  void readChunk( size_t chunkIdx, QByteArray & );
+
+  Reader( Reader const & );
+  Reader & operator = ( Reader const & );
 };
 
 }
@@ -236,6 +236,7 @@ Preferences::Preferences():
   escKeyHidesMainWindow( false ),
   alwaysOnTop ( false ),
   searchInDock ( false ),
+  fuzzyWordListSearch( false ),
 
   enableMainWindowHotkey( true ),
   mainWindowHotkey( QKeySequence( "Ctrl+F11,F11" ) ),
@@ -288,6 +289,7 @@ Preferences::Preferences():
 , trackClipboardChanges( false )
 #endif
 , synonymSearchEnabled( true )
+, mergedGroupIndices( false )
 {
 }
 
@@ -877,6 +879,7 @@ Class load() THROW_SPEC( exError )
     c.preferences.autoStart = ( preferences.namedItem( "autoStart" ).toElement().text() == "1" );
     c.preferences.alwaysOnTop = ( preferences.namedItem( "alwaysOnTop" ).toElement().text() == "1" );
     c.preferences.searchInDock = ( preferences.namedItem( "searchInDock" ).toElement().text() == "1" );
+    c.preferences.fuzzyWordListSearch = ( preferences.namedItem( "fuzzyWordListSearch" ).toElement().text() == "1" );
 
     if ( !preferences.namedItem( "doubleClickTranslates" ).isNull() )
       c.preferences.doubleClickTranslates = ( preferences.namedItem( "doubleClickTranslates" ).toElement().text() == "1" );
@@ -1021,6 +1024,9 @@ Class load() THROW_SPEC( exError )
     if ( !preferences.namedItem( "synonymSearchEnabled" ).isNull() )
       c.preferences.synonymSearchEnabled = ( preferences.namedItem( "synonymSearchEnabled" ).toElement().text() == "1" );
 
+    if ( !preferences.namedItem( "mergedGroupIndices" ).isNull() )
+      c.preferences.mergedGroupIndices = ( preferences.namedItem( "mergedGroupIndices" ).toElement().text() == "1" );
+
     QDomNode fts = preferences.namedItem( "fullTextSearch" );
 
     if ( !fts.isNull() )
@@ -1193,6 +1199,24 @@ Class load() THROW_SPEC( exError )
   if ( !root.namedItem( "maxHeadwordsToExpand" ).isNull() )
     c.maxHeadwordsToExpand = root.namedItem( "maxHeadwordsToExpand" ).toElement().text().toUInt();
 
+  if ( !root.namedItem( "indexCacheSize" ).isNull() )
+    c.indexCacheSize = root.namedItem( "indexCacheSize" ).toElement().text().toUInt();
+
+  if ( !root.namedItem( "articleCacheSize" ).isNull() )
+    c.articleCacheSize = root.namedItem( "articleCacheSize" ).toElement().text().toUInt();
+
+  if ( !root.namedItem( "dictzipCacheSize" ).isNull() )
+    c.dictzipCacheSize = root.namedItem( "dictzipCacheSize" ).toElement().text().toUInt();
+
+  if ( !root.namedItem( "zimCacheSize" ).isNull() )
+    c.zimCacheSize = root.namedItem( "zimCacheSize" ).toElement().text().toUInt();
+
+  if ( !root.namedItem( "slobCacheSize" ).isNull() )
+    c.slobCacheSize = root.namedItem( "slobCacheSize" ).toElement().text().toUInt();
+
+  if ( !root.namedItem( "mdxCacheSize" ).isNull() )
+    c.mdxCacheSize = root.namedItem( "mdxCacheSize" ).toElement().text().toUInt();
+
   QDomNode headwordsDialog = root.namedItem( "headwordsDialog" );
 
   if ( !headwordsDialog.isNull() )
@@ -1879,6 +1903,10 @@ void save( Class const & c ) THROW_SPEC( exError )
     opt.appendChild( dd.createTextNode( c.preferences.searchInDock ? "1" : "0" ) );
     preferences.appendChild( opt );
 
+    opt = dd.createElement( "fuzzyWordListSearch" );
+    opt.appendChild( dd.createTextNode( c.preferences.fuzzyWordListSearch ? "1" : "0" ) );
+    preferences.appendChild( opt );
+
     opt = dd.createElement( "historyStoreInterval" );
     opt.appendChild( dd.createTextNode( QString::number( c.preferences.historyStoreInterval ) ) );
     preferences.appendChild( opt );
@@ -2006,6 +2034,10 @@ void save( Class const & c ) THROW_SPEC( exError )
     opt.appendChild( dd.createTextNode( c.preferences.synonymSearchEnabled ? "1" : "0" ) );
     preferences.appendChild( opt );
 
+    opt = dd.createElement( "mergedGroupIndices" );
+    opt.appendChild( dd.createTextNode( c.preferences.mergedGroupIndices ? "1" : "0" ) );
+    preferences.appendChild( opt );
+
     {
       QDomNode hd = dd.createElement( "fullTextSearch" );
       preferences.appendChild( hd );
@@ -2212,6 +2244,30 @@ void save( Class const & c ) THROW_SPEC( exError )
     opt = dd.createElement( "maxHeadwordsToExpand" );
     opt.appendChild( dd.createTextNode( QString::number( c.maxHeadwordsToExpand ) ) );
     root.appendChild( opt );
+
+    opt = dd.createElement( "indexCacheSize" );
+    opt.appendChild( dd.createTextNode( QString::number( c.indexCacheSize ) ) );
+    root.appendChild( opt );
+
+    opt = dd.createElement( "articleCacheSize" );
+    opt.appendChild( dd.createTextNode( QString::number( c.articleCacheSize ) ) );
+    root.appendChild( opt );
+
+    opt = dd.createElement( "dictzipCacheSize" );
+    opt.appendChild( dd.createTextNode( QString::number( c.dictzipCacheSize ) ) );
+    root.appendChild( opt );
+
+    opt = dd.createElement( "zimCacheSize" );
+    opt.appendChild( dd.createTextNode( QString::number( c.zimCacheSize ) ) );
+    root.appendChild( opt );
+
+    opt = dd.createElement( "slobCacheSize" );
+    opt.appendChild( dd.createTextNode( QString::number( c.slobCacheSize ) ) );
+    root.appendChild( opt );
+
+    opt = dd.createElement( "mdxCacheSize" );
+    opt.appendChild( dd.createTextNode( QString::number( c.mdxCacheSize ) ) );
+    root.appendChild( opt );
   }
 
   {
@@ -300,6 +300,10 @@ struct Preferences
   /// are in the dockable side panel, not on the toolbar.
   bool searchInDock;
 
+  /// The word lists show the headwords similar to the word typed instead of
+  /// those beginning with it
+  bool fuzzyWordListSearch;
+
   bool enableMainWindowHotkey;
   HotKey mainWindowHotkey;
   bool enableClipboardHotkey;
@@ -366,6 +370,10 @@ struct Preferences
 
   bool synonymSearchEnabled;
 
+  /// Search the dictionaries of each group through a single index merged
+  /// from theirs
+  bool mergedGroupIndices;
+
   QString addonStyle;
 
   FullTextSearch fts;
@@ -712,6 +720,18 @@ struct Class
 
   unsigned int maxHeadwordsToExpand;
 
+  /// The memory budgets, in MiB, of the caches shared by all the
+  /// dictionaries: of the decompressed index nodes, of the decompressed
+  /// article chunks and of the decompressed dictzip chunks, then of the
+  /// decompressed blocks of the zim, slob and mdx files. Zero disables
+  /// the cache.
+  unsigned int indexCacheSize;
+  unsigned int articleCacheSize;
+  unsigned int dictzipCacheSize;
+  unsigned int zimCacheSize;
+  unsigned int slobCacheSize;
+  unsigned int mdxCacheSize;
+
   HeadwordsDialog headwordsDialog;
 
 #ifdef Q_OS_WIN
@@ -725,7 +745,9 @@ struct Class
            pinPopupWindow( false ), showingDictBarNames( false ),
            usingSmallIconsInToolbars( false ),
            maxPictureWidth( 0 ), maxHeadwordSize ( 256U ),
-           maxHeadwordsToExpand( 0 )
+           maxHeadwordsToExpand( 0 ), indexCacheSize( 32 ),
+           articleCacheSize( 16 ), dictzipCacheSize( 16 ),
+           zimCacheSize( 64 ), slobCacheSize( 64 ), mdxCacheSize( 32 )
   {}
   Group * getGroup( unsigned id );
   Group const * getGroup( unsigned id ) const;
@@ -7,8 +7,13 @@
 #include "zstd.h"
 #endif
 
+#include <algorithm>
+
 #define CHUNK_SIZE 2048
 
+// The least amount of data IncrementalDecompressor produces at once
+#define INCREMENTAL_STEP_SIZE 65536
+
 QByteArray zlibDecompress( const char * bufptr, unsigned length )
 {
 z_stream zs;
@@ -175,3 +180,219 @@ string decompressZstd( const char *bufptr, unsigned length )
 }
 
 #endif
+
+struct IncrementalDecompressor::State
+{
+  z_stream zs;
+  bz_stream bzs;
+#ifdef MAKE_ZIM_SUPPORT
+  lzma_stream ls;
+  ZSTD_DStream * zds;
+  ZSTD_inBuffer zin;
+#endif
+};
+
+IncrementalDecompressor::IncrementalDecompressor( Format format_,
+                                                  QByteArray const & compressed ):
+  format( format_ ), input( compressed ), state( new State ),
+  finished( false ), failed( false )
+{
+  bool ok = false;
+
+  switch( format )
+  {
+    case Zlib:
+      memset( &state->zs, 0, sizeof( state->zs ) );
+      state->zs.next_in = (Bytef *)input.constData();
+      state->zs.avail_in = input.size();
+      ok = inflateInit( &state->zs ) == Z_OK;
+      break;
+
+    case Bzip2:
+      memset( &state->bzs, 0, sizeof( state->bzs ) );
+      state->bzs.next_in = (char *)input.constData();
+      state->bzs.avail_in = input.size();
+      ok = BZ2_bzDecompressInit( &state->bzs, 0, 0 ) == BZ_OK;
+      break;
+
+#ifdef MAKE_ZIM_SUPPORT
+    case Lzma2:
+    {
+      lzma_stream init = LZMA_STREAM_INIT;
+      state->ls = init;
+      state->ls.next_in = reinterpret_cast< const uint8_t * >( input.constData() );
+      state->ls.avail_in = input.size();
+      ok = lzma_stream_decoder( &state->ls, UINT64_MAX, 0 ) == LZMA_OK;
+      break;
+    }
+
+    case Zstd:
+      state->zin.src = input.constData();
+      state->zin.size = input.size();
+      state->zin.pos = 0;
+      state->zds = ZSTD_createDStream();
+      ok = state->zds && !ZSTD_isError( ZSTD_initDStream( state->zds ) );
+      if( !ok && state->zds )
+      {
+        ZSTD_freeDStream( state->zds );
+        state->zds = 0;
+      }
+      break;
+#endif
+
+    default:
+      break;
+  }
+
+  if( !ok )
+  {
+    // Nothing to release for the decoders which failed to initialize
+    delete state;
+    state = 0;
+    input.clear();
+    finished = failed = true;
+  }
+}
+
+IncrementalDecompressor::~IncrementalDecompressor()
+{
+  release();
+}
+
+void IncrementalDecompressor::release()
+{
+  if( state )
+  {
+    switch( format )
+    {
+      case Zlib:
+        inflateEnd( &state->zs );
+        break;
+      case Bzip2:
+        BZ2_bzDecompressEnd( &state->bzs );
+        break;
+#ifdef MAKE_ZIM_SUPPORT
+      case Lzma2:
+        lzma_end( &state->ls );
+        break;
+      case Zstd:
+        ZSTD_freeDStream( state->zds );
+        break;
+#endif
+      default:
+        break;
+    }
+
+    delete state;
+    state = 0;
+  }
+
+  input.clear();
+}
+
+size_t IncrementalDecompressor::inputLeft() const
+{
+  switch( format )
+  {
+    case Zlib:
+      return state->zs.avail_in;
+    case Bzip2:
+      return state->bzs.avail_in;
+#ifdef MAKE_ZIM_SUPPORT
+    case Lzma2:
+      return state->ls.avail_in;
+    case Zstd:
+      return state->zin.size - state->zin.pos;
+#endif
+    default:
+      return 0;
+  }
+}
+
+bool IncrementalDecompressor::decompressStep( char * out, int size, int & produced )
+{
+  switch( format )
+  {
+    case Zlib:
+    {
+      state->zs.next_out = (Bytef *)out;
+      state->zs.avail_out = size;
+      int res = inflate( &state->zs, Z_SYNC_FLUSH );
+      produced = size - state->zs.avail_out;
+      if( res == Z_STREAM_END )
+        finished = true;
+      return res == Z_OK || res == Z_STREAM_END || res == Z_BUF_ERROR;
+    }
+
+    case Bzip2:
+    {
+      state->bzs.next_out = out;
+      state->bzs.avail_out = size;
+      int res = BZ2_bzDecompress( &state->bzs );
+      produced = size - state->bzs.avail_out;
+      if( res == BZ_STREAM_END )
+        finished = true;
+      return res == BZ_OK || res == BZ_STREAM_END;
+    }
+
+#ifdef MAKE_ZIM_SUPPORT
+    case Lzma2:
+    {
+      state->ls.next_out = reinterpret_cast< uint8_t * >( out );
+      state->ls.avail_out = size;
+      // All the input is there from the start, so the decoder is always told
+      // to finish. It still stops once the output buffer is full.
+      lzma_ret res = lzma_code( &state->ls, LZMA_FINISH );
+      produced = size - state->ls.avail_out;
+      if( res == LZMA_STREAM_END )
+        finished = true;
+      return res == LZMA_OK || res == LZMA_STREAM_END;
+    }
+
+    case Zstd:
+    {
+      ZSTD_outBuffer zout = { out, (size_t) size, 0 };
+      size_t res = ZSTD_decompressStream( state->zds, &zout, &state->zin );
+      produced = zout.pos;
+      if( ZSTD_isError( res ) )
+        return false;
+      // Zero means a frame is over, and there may be more of them
+      if( res == 0 && state->zin.pos >= state->zin.size )
+        finished = true;
+      return true;
+    }
+#endif
+
+    default:
+      produced = 0;
+      return false;
+  }
+}
+
+bool IncrementalDecompressor::decompressTo( QByteArray & out, int size )
+{
+  while( out.size() < size && !finished )
+  {
+    int had = out.size();
+    int room = std::max( size - had, INCREMENTAL_STEP_SIZE );
+
+    out.resize( had + room );
+
+    size_t left = inputLeft();
+    int produced = 0;
+    bool ok = decompressStep( out.data() + had, room, produced );
+
+    out.resize( had + produced );
+
+    if( !ok )
+      failed = finished = true;
+    else
+    if( !produced && !finished && inputLeft() == left )
+      finished = true; // No progress, the data must be truncated
+
+    if( finished )
+      release();
+  }
+
+  return !failed;
+}
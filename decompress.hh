@@ -3,6 +3,7 @@
 
 #include <QByteArray>
 #include <string>
+#include <stddef.h>
 
 using std::string;
 
@@ -21,4 +22,52 @@ string decompressZstd( const char * bufptr, unsigned length );
 
 #endif
 
+/// Decompresses a buffer gradually, only as far as asked for so far, keeping
+/// the decoder state in between the calls. The Lzma2 and Zstd formats are
+/// only available with the zim support.
+class IncrementalDecompressor
+{
+public:
+
+  enum Format
+  {
+    Zlib,
+    Bzip2,
+    Lzma2,
+    Zstd
+  };
+
+  IncrementalDecompressor( Format, QByteArray const & compressed );
+  ~IncrementalDecompressor();
+
+  /// Appends the decompressed data to 'out' until it holds at least 'size'
+  /// bytes, or until the end of the data. Returns false on errors.
+  bool decompressTo( QByteArray & out, int size );
+
+  /// Returns true once the end of the data was reached, or on errors. The
+  /// compressed data and the decoder are released at that point.
+  bool isFinished() const
+  { return finished; }
+
+  /// Returns the size of the compressed data still held
+  int compressedSize() const
+  { return input.size(); }
+
+private:
+
+  struct State;
+
+  Format format;
+  QByteArray input;
+  State * state;
+  bool finished, failed;
+
+  size_t inputLeft() const;
+  bool decompressStep( char * out, int size, int & produced );
+  void release();
+
+  IncrementalDecompressor( IncrementalDecompressor const & );
+  IncrementalDecompressor & operator = ( IncrementalDecompressor const & );
+};
+
 #endif // DECOMPRESS_HH
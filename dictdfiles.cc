@@ -93,7 +93,7 @@ class DictdDictionary: public BtreeIndexing::BtreeDictionary
   IdxHeader idxHeader;
   dictData * dz;
   string dictionaryName;
-  Mutex indexFileMutex, dzMutex;
+  Mutex indexFileMutex;
 
 public:
 
@@ -265,16 +265,7 @@ sptr< Dictionary::DataRequest > DictdDictionary::getArticle( wstring const & wor
 {
   try
   {
-    vector< WordArticleLink > chain = findArticles( word, ignoreDiacritics );
-
-    for( unsigned x = 0; x < alts.size(); ++x )
-    {
-      /// Make an additional query for each alt
-
-      vector< WordArticleLink > altChain = findArticles( alts[ x ], ignoreDiacritics );
-
-      chain.insert( chain.end(), altChain.begin(), altChain.end() );
-    }
+    vector< WordArticleLink > chain = findArticlesWithAlts( word, alts, ignoreDiacritics );
 
     multimap< wstring, string > mainArticles, alternateArticles;
 
@@ -331,16 +322,14 @@ sptr< Dictionary::DataRequest > DictdDictionary::getArticle( wstring const & wor
 
       string articleText;
 
-      char * articleBody;
-      {
-        Mutex::Lock _( dzMutex );
-        articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-      }
+      char dzError[ DICT_ERROR_STRING_SIZE ];
+
+      char * articleBody = dict_data_read_r( dz, articleOffset, articleSize, dzError );
 
       if ( !articleBody )
       {
         articleText = string( "<div class=\"dictd_article\">DICTZIP error: " )
-                      + dict_error_str( dz ) + "</div>";
+                      + dzError + "</div>";
       }
       else
       {
@@ -557,15 +546,13 @@ void DictdDictionary::getArticleText( uint32_t articleAddress, QString & headwor
 
     string articleText;
 
-    char * articleBody;
-    {
-      Mutex::Lock _( dzMutex );
-      articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-    }
+    char dzError[ DICT_ERROR_STRING_SIZE ];
+
+    char * articleBody = dict_data_read_r( dz, articleOffset, articleSize, dzError );
 
     if ( !articleBody )
     {
-      articleText = dict_error_str( dz );
+      articleText = dzError;
     }
     else
     {
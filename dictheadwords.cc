@@ -19,6 +19,84 @@
 
 #define AUTO_APPLY_LIMIT 150000
 
+namespace {
+
+/// Appends the headwords walked to the list
+class HeadwordLister: public Dictionary::HeadwordVisitor
+{
+  QStringList & list;
+
+public:
+
+  HeadwordLister( QStringList & list_ ): list( list_ )
+  {}
+
+  virtual void visitHeadword( QString const & headword )
+  { list.append( headword ); }
+};
+
+/// Writes the headwords walked which pass the filter to the file, one per
+/// line, updating the progress dialog as it goes. The walk is cancelled once
+/// the dialog is, or once writing fails.
+class HeadwordExporter: public Dictionary::HeadwordVisitor
+{
+  QFile & file;
+  QSortFilterProxyModel const & filter;
+  QProgressDialog & progress;
+  int step;
+  int visited;
+
+public:
+
+  QAtomicInt isCancelled;
+  bool failed;
+
+  HeadwordExporter( QFile & file_, QSortFilterProxyModel const & filter_,
+                    QProgressDialog & progress_, int step_ ):
+    file( file_ ), filter( filter_ ), progress( progress_ ), step( step_ ),
+    visited( 0 ), failed( false )
+  {}
+
+  virtual void visitHeadword( QString const & headword );
+};
+
+void HeadwordExporter::visitHeadword( QString const & headword )
+{
+  if( visited++ % step == 0 )
+  {
+    progress.setValue( visited / step );
+
+    if( progress.wasCanceled() )
+    {
+      Qt4x5::AtomicInt::storeRelease( isCancelled, 1 );
+      return;
+    }
+  }
+
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 12, 0 )
+  if( !filter.filterRegularExpression().match( headword ).hasMatch() )
+    return;
+#else
+  if( filter.filterRegExp().indexIn( headword ) < 0 )
+    return;
+#endif
+
+  QByteArray line = headword.toUtf8();
+
+  line.replace( '\n', ' ' );
+  line.replace( '\r', ' ' );
+
+  line += "\n";
+
+  if ( file.write( line ) != line.size() )
+  {
+    failed = true;
+    Qt4x5::AtomicInt::storeRelease( isCancelled, 1 );
+  }
+}
+
+}
+
 DictHeadwords::DictHeadwords( QWidget *parent, Config::Class & cfg_,
                               Dictionary::Class * dict_ ) :
   QDialog(parent)
@@ -136,7 +214,13 @@ void DictHeadwords::setup( Dictionary::Class *dict_ )
   headers.clear();
   model->setStringList( headers );
 
-  dict->getHeadwords( headers );
+#if QT_VERSION >= 0x040700
+  headers.reserve( dict->getWordCount() );
+#endif
+
+  HeadwordLister lister( headers );
+
+  dict->forEachHeadword( lister );
   model->setStringList( headers );
 
   proxy->sort( 0 );
@@ -311,7 +395,10 @@ void DictHeadwords::saveHeadersToFile()
     if ( !file.open( QFile::WriteOnly | QIODevice::Text ) )
       break;
 
-    int headwordsNumber = proxy->rowCount();
+    // The headwords are written straight from the dictionary as they are
+    // walked, so the export takes constant memory. They aren't sorted.
+
+    int headwordsNumber = headers.size();
 
     // Setup progress dialog
     int n = headwordsNumber;
@@ -334,31 +421,11 @@ void DictHeadwords::saveHeadersToFile()
 
     // Write headwords
 
-    int i;
-    for( i = 0; i < headwordsNumber; ++i )
-    {
-      if( i % step == 0 )
-        progress.setValue( i / step );
-
-      if( progress.wasCanceled() )
-        break;
+    HeadwordExporter exporter( file, *proxy, progress, step );
 
-      QVariant value = proxy->data( proxy->index( i, 0 ) );
-      if( !value.canConvert< QString >() )
-        continue;
-
-      line = value.toString().toUtf8();
-
-      line.replace( '\n', ' ' );
-      line.replace( '\r', ' ' );
-
-      line += "\n";
-
-      if ( file.write( line ) != line.size() )
-        break;
-    }
+    dict->forEachHeadword( exporter, &exporter.isCancelled );
 
-    if( i < headwordsNumber && !progress.wasCanceled() )
+    if( exporter.failed )
       break;
 
     file.close();
@@ -157,6 +157,14 @@ sptr< WordSearchRequest > Class::stemmedMatch( wstring const & /*str*/,
   return new WordSearchRequestInstant();
 }
 
+sptr< WordSearchRequest > Class::fuzzyMatch( wstring const & /*str*/,
+                                             unsigned /*maxDistance*/,
+                                             unsigned long /*maxResults*/ )
+  THROW_SPEC( std::exception )
+{
+  return new WordSearchRequestInstant();
+}
+
 sptr< WordSearchRequest > Class::findHeadwordsForSynonym( wstring const & )
   THROW_SPEC( std::exception )
 {
@@ -256,6 +256,17 @@ enum Feature
 Q_DECLARE_FLAGS( Features, Feature )
 Q_DECLARE_OPERATORS_FOR_FLAGS( Features )
 
+/// Receives the headwords of a dictionary walked by Class::forEachHeadword()
+class HeadwordVisitor
+{
+public:
+
+  virtual void visitHeadword( QString const & ) = 0;
+
+  virtual ~HeadwordVisitor()
+  {}
+};
+
 /// A dictionary. Can be used to query words.
 class Class
 {
@@ -360,6 +371,17 @@ public:
                                                   unsigned maxSuffixVariation,
                                                   unsigned long maxResults ) THROW_SPEC( std::exception );
 
+  /// Looks up a given word in the dictionary, aiming to find the headwords
+  /// which differ from it by at most maxDistance edits, that is, insertions,
+  /// deletions, substitutions or transpositions of adjacent characters. The
+  /// comparison is done on the folded forms. Each match gets the negated
+  /// distance as its weight, and the closest ones come first. Not more than
+  /// maxResults results should be stored.
+  /// The default implementation does nothing, returning an empty result.
+  virtual sptr< WordSearchRequest > fuzzyMatch( wstring const &,
+                                                unsigned maxDistance,
+                                                unsigned long maxResults ) THROW_SPEC( std::exception );
+
   /// Finds known headwords for the given word, that is, the words for which
   /// the given word is a synonym. If a dictionary can't perform this operation,
   /// it should leave the default implementation which always returns an empty
@@ -436,8 +458,11 @@ public:
   virtual void setFTSParameters( Config::FullTextSearch const & )
   {}
 
-  /// Retrieve all dictionary headwords
-  virtual bool getHeadwords( QStringList & )
+  /// Walks all the dictionary headwords, each one once, in no particular
+  /// order. The headwords aren't kept, so the walk takes constant memory.
+  /// It stops early once isCancelled is set. Returns false if the dictionary
+  /// can't list its headwords.
+  virtual bool forEachHeadword( HeadwordVisitor &, QAtomicInt * = 0 )
   { return false; }
 
   /// Enable/disable search via synonyms
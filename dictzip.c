@@ -139,6 +139,10 @@
 
 #include <sys/stat.h>
 
+#ifndef __WIN32
+#include <unistd.h>
+#endif
+
 #define USE_CACHE 1
 
 #define dict_data_filter( ... )
@@ -460,6 +464,489 @@ static enum  DZ_ERRORS dict_read_header( const char *filename,
    return DZ_NOERROR;
 }
 
+/* Mutexes for the reentrant reading */
+
+static void dict_mutex_init( dictMutex *m )
+{
+#ifdef __WIN32
+   InitializeCriticalSection( m );
+#else
+   pthread_mutex_init( m, NULL );
+#endif
+}
+
+static void dict_mutex_destroy( dictMutex *m )
+{
+#ifdef __WIN32
+   DeleteCriticalSection( m );
+#else
+   pthread_mutex_destroy( m );
+#endif
+}
+
+static void dict_mutex_lock( dictMutex *m )
+{
+#ifdef __WIN32
+   EnterCriticalSection( m );
+#else
+   pthread_mutex_lock( m );
+#endif
+}
+
+static void dict_mutex_unlock( dictMutex *m )
+{
+#ifdef __WIN32
+   LeaveCriticalSection( m );
+#else
+   pthread_mutex_unlock( m );
+#endif
+}
+
+/* The cache of inflated chunks used by dict_data_read_r(), shared by all the
+   files. The chunks are keyed by the id of their file and their number. The
+   cache is split into several independently locked shards, each evicting its
+   chunks in the least-recently-used order once its budget is exceeded. */
+
+#define DZ_CACHE_SHARDS        8
+#define DZ_CACHE_BUCKETS       256
+#define DZ_DEFAULT_CACHE_SIZE  (16 * 1024 * 1024)
+
+typedef struct dzCacheEntry {
+   unsigned long       id;
+   int                 chunk;
+   int                 count;
+   char                *data;
+   struct dzCacheEntry *hashNext;
+   struct dzCacheEntry *newer, *older;
+} dzCacheEntry;
+
+typedef struct dzCacheShard {
+   dictMutex     mutex;
+   dzCacheEntry  *buckets[DZ_CACHE_BUCKETS];
+   dzCacheEntry  *newest, *oldest;
+   unsigned long used;
+   unsigned long maxSize;
+} dzCacheShard;
+
+static dzCacheShard  dzCache[DZ_CACHE_SHARDS];
+static dictMutex     dzIdMutex;
+static unsigned long dzLastId;
+
+static void dz_do_init( void )
+{
+   int i;
+
+   for (i = 0; i < DZ_CACHE_SHARDS; i++) {
+      memset( &dzCache[i], 0, sizeof( dzCache[i] ) );
+      dict_mutex_init( &dzCache[i].mutex );
+      dzCache[i].maxSize = DZ_DEFAULT_CACHE_SIZE / DZ_CACHE_SHARDS;
+   }
+
+   dict_mutex_init( &dzIdMutex );
+}
+
+#ifdef __WIN32
+static volatile LONG dzInitState = 0;
+
+static void dz_init( void )
+{
+   if (InterlockedCompareExchange( &dzInitState, 1, 0 ) == 0) {
+      dz_do_init();
+      InterlockedExchange( &dzInitState, 2 );
+   } else {
+      while (dzInitState != 2)
+	 Sleep( 0 );
+   }
+}
+#else
+static pthread_once_t dzInitOnce = PTHREAD_ONCE_INIT;
+
+static void dz_init( void )
+{
+   pthread_once( &dzInitOnce, dz_do_init );
+}
+#endif
+
+static unsigned long dz_cache_key( unsigned long id, int chunk )
+{
+   return id * 2654435761UL + (unsigned long)chunk;
+}
+
+static dzCacheShard *dz_cache_shard( unsigned long key )
+{
+   return &dzCache[key % DZ_CACHE_SHARDS];
+}
+
+static dzCacheEntry **dz_cache_bucket( dzCacheShard *shard, unsigned long key )
+{
+   return &shard->buckets[(key / DZ_CACHE_SHARDS) % DZ_CACHE_BUCKETS];
+}
+
+static void dz_cache_unlink( dzCacheShard *shard, dzCacheEntry *e )
+{
+   if (e->newer) e->newer->older = e->older;
+   else          shard->newest   = e->older;
+   if (e->older) e->older->newer = e->newer;
+   else          shard->oldest   = e->newer;
+}
+
+static void dz_cache_push( dzCacheShard *shard, dzCacheEntry *e )
+{
+   e->newer = NULL;
+   e->older = shard->newest;
+   if (shard->newest) shard->newest->newer = e;
+   else               shard->oldest = e;
+   shard->newest = e;
+}
+
+/* Removes the chunk from the shard and frees it */
+static void dz_cache_remove( dzCacheShard *shard, dzCacheEntry *e )
+{
+   dzCacheEntry **pe;
+
+   dz_cache_unlink( shard, e );
+
+   for (pe = dz_cache_bucket( shard, dz_cache_key( e->id, e->chunk ) );
+	*pe != e; pe = &(*pe)->hashNext)
+      ;
+   *pe = e->hashNext;
+
+   shard->used -= e->count + sizeof( dzCacheEntry );
+   xfree( e->data );
+   xfree( e );
+}
+
+/* Drops the least recently used chunks until the shard fits its budget */
+static void dz_cache_shrink( dzCacheShard *shard )
+{
+   dzCacheEntry *e;
+
+   while (shard->used > shard->maxSize && (e = shard->oldest))
+      dz_cache_remove( shard, e );
+}
+
+/* Drops all the chunks of the file. The ids are never reused, so the chunks
+   of a closed file would otherwise only occupy the budget until evicted. */
+static void dz_cache_evict( unsigned long id )
+{
+   int          i;
+   dzCacheEntry *e, *older;
+
+   for (i = 0; i < DZ_CACHE_SHARDS; i++) {
+      dict_mutex_lock( &dzCache[i].mutex );
+
+      for (e = dzCache[i].newest; e; e = older) {
+	 older = e->older;
+	 if (e->id == id)
+	    dz_cache_remove( &dzCache[i], e );
+      }
+
+      dict_mutex_unlock( &dzCache[i].mutex );
+   }
+}
+
+/* Copies the chunk into data if it's cached. Returns nonzero if it was. */
+static int dz_cache_find( unsigned long id, int chunk, char *data, int *count )
+{
+   unsigned long key    = dz_cache_key( id, chunk );
+   dzCacheShard  *shard = dz_cache_shard( key );
+   dzCacheEntry  *e;
+
+   dict_mutex_lock( &shard->mutex );
+
+   for (e = *dz_cache_bucket( shard, key ); e; e = e->hashNext)
+      if (e->id == id && e->chunk == chunk)
+	 break;
+
+   if (e) {
+      memcpy( data, e->data, e->count );
+      *count = e->count;
+      dz_cache_unlink( shard, e );
+      dz_cache_push( shard, e );
+   }
+
+   dict_mutex_unlock( &shard->mutex );
+
+   return e != NULL;
+}
+
+static void dz_cache_insert( unsigned long id, int chunk, const char *data, int count )
+{
+   unsigned long key    = dz_cache_key( id, chunk );
+   dzCacheShard  *shard = dz_cache_shard( key );
+   dzCacheEntry  *e, **bucket;
+
+   dict_mutex_lock( &shard->mutex );
+
+   bucket = dz_cache_bucket( shard, key );
+
+   /* Another thread could have inserted it meanwhile */
+   for (e = *bucket; e; e = e->hashNext)
+      if (e->id == id && e->chunk == chunk)
+	 break;
+
+   if (!e && count + sizeof( dzCacheEntry ) <= shard->maxSize
+       && (e = xmalloc( sizeof( dzCacheEntry ) ))) {
+      if ((e->data = xmalloc( count ? count : 1 ))) {
+	 memcpy( e->data, data, count );
+	 e->id       = id;
+	 e->chunk    = chunk;
+	 e->count    = count;
+	 e->hashNext = *bucket;
+	 *bucket     = e;
+	 dz_cache_push( shard, e );
+	 shard->used += count + sizeof( dzCacheEntry );
+	 dz_cache_shrink( shard );
+      } else
+	 xfree( e );
+   }
+
+   dict_mutex_unlock( &shard->mutex );
+}
+
+void dict_data_set_cache_size( unsigned long bytes )
+{
+   int i;
+
+   dz_init();
+
+   for (i = 0; i < DZ_CACHE_SHARDS; i++) {
+      dict_mutex_lock( &dzCache[i].mutex );
+      dzCache[i].maxSize = bytes / DZ_CACHE_SHARDS;
+      dz_cache_shrink( &dzCache[i] );
+      dict_mutex_unlock( &dzCache[i].mutex );
+   }
+}
+
+/* Reads size bytes at the given offset without moving the file position, so
+   it can be done from several threads at once. Returns nonzero on success. */
+static int dict_read_at( dictData *h, char *buffer, unsigned long size,
+			 unsigned long offset )
+{
+#ifdef __WIN32
+   OVERLAPPED ov;
+   DWORD      readed = 0;
+
+   memset( &ov, 0, sizeof( ov ) );
+   ov.Offset     = (DWORD)offset;
+   ov.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+
+   return ReadFile( h->fd, buffer, size, &readed, &ov ) && readed == size;
+#else
+   unsigned long done = 0;
+   ssize_t       n;
+
+   while (done < size) {
+      n = pread( fileno( h->fd ), buffer + done, size - done, offset + done );
+      if (n < 0 && errno == EINTR)
+	 continue;
+      if (n <= 0)
+	 return 0;
+      done += n;
+   }
+
+   return 1;
+#endif
+}
+
+/* Takes an inflate context from the pool of the file, or creates a new one */
+static z_stream *dict_acquire_stream( dictData *h )
+{
+   z_stream *s = NULL;
+
+   dict_mutex_lock( &h->streamsMutex );
+   if (h->streamCount)
+      s = h->streams[--h->streamCount];
+   dict_mutex_unlock( &h->streamsMutex );
+
+   if (s)
+      return s;
+
+   if (!(s = xmalloc( sizeof( z_stream ) )))
+      return NULL;
+
+   memset( s, 0, sizeof( z_stream ) );
+
+   if (inflateInit2( s, -15 ) != Z_OK) {
+      xfree( s );
+      return NULL;
+   }
+
+   return s;
+}
+
+static void dict_release_stream( dictData *h, z_stream *s )
+{
+   dict_mutex_lock( &h->streamsMutex );
+   if (h->streamCount < DICT_STREAM_POOL_SIZE) {
+      h->streams[h->streamCount++] = s;
+      s = NULL;
+   }
+   dict_mutex_unlock( &h->streamsMutex );
+
+   if (s) {
+      inflateEnd( s );
+      xfree( s );
+   }
+}
+
+/* The random access index of a plain gzip file, much like the one of zlib's
+   zran example */
+
+#define GZ_WINSIZE     32768U   /* The inflate window */
+#define GZ_INPUT_SIZE  65536U
+#define GZ_INDEX_MAGIC 0x58495a47UL /* GZIX on little-endian */
+#define GZ_INDEX_VERSION 1
+
+typedef struct dictGzipPoint {
+   unsigned long out;         /* Offset in the uncompressed data */
+   unsigned long in;          /* Offset of the first full byte in the file */
+   int           bits;        /* Bits of the byte before it to start with */
+   unsigned long windowSize;
+   unsigned char *window;     /* The window preceding the point, deflated */
+} dictGzipPoint;
+
+struct dictGzipIndex {
+   unsigned long length;      /* The uncompressed size covered */
+   int           count;
+   int           allocated;
+   dictGzipPoint *points;
+};
+
+static void dict_gzip_index_free( struct dictGzipIndex *index )
+{
+   int i;
+
+   if (!index)
+      return;
+
+   for (i = 0; i < index->count; i++)
+      xfree( index->points[i].window );
+
+   xfree( index->points );
+   xfree( index );
+}
+
+/* Reads size bytes at start of the plain gzip file through its index */
+static int dict_gzip_read( dictData *h, unsigned long start, unsigned long size,
+			   char *buffer, char *errorString )
+{
+   struct dictGzipIndex *index = h->gzIndex;
+   dictGzipPoint        *p;
+   unsigned char        *window  = NULL;
+   unsigned char        *input   = NULL;
+   unsigned char        *discard = NULL;
+   z_stream             *stream  = NULL;
+   uLongf               windowSize;
+   unsigned long        pos, skip, n;
+   unsigned char        c;
+   int                  lo, hi, mid, target = 0, ret;
+
+   if (start > index->length || size > index->length - start) {
+      strcpy( errorString, "Read beyond the end of the data" );
+      return 0;
+   }
+
+   /* The last point at or before the start */
+   for (lo = 0, hi = index->count - 1; lo < hi; ) {
+      mid = (lo + hi + 1) / 2;
+      if (index->points[mid].out <= start) lo = mid;
+      else                                 hi = mid - 1;
+   }
+   p = &index->points[lo];
+
+   window  = xmalloc( GZ_WINSIZE );
+   input   = xmalloc( GZ_INPUT_SIZE );
+   discard = xmalloc( GZ_WINSIZE );
+   if (!window || !input || !discard) {
+      strcpy( errorString, dz_error_str( DZ_ERR_NOMEMORY ) );
+      goto error;
+   }
+
+   windowSize = GZ_WINSIZE;
+   if (uncompress( window, &windowSize, p->window, p->windowSize ) != Z_OK
+       || windowSize != GZ_WINSIZE) {
+      strcpy( errorString, dz_error_str( DZ_ERR_INVALID_FORMAT ) );
+      goto error;
+   }
+
+   if (!(stream = dict_acquire_stream( h ))) {
+      strcpy( errorString, "Cannot initialize inflation engine" );
+      goto error;
+   }
+
+   inflateReset( stream );
+
+   pos = p->in;
+
+   if (p->bits) {
+      if (!dict_read_at( h, (char *)&c, 1, pos - 1 )) {
+	 strcpy( errorString, dz_error_str( DZ_ERR_READFILE ) );
+	 goto error;
+      }
+      inflatePrime( stream, p->bits, c >> (8 - p->bits) );
+   }
+
+   inflateSetDictionary( stream, window, GZ_WINSIZE );
+
+   /* Inflate the data before the start into the discard buffer, and then
+      the data wanted into the result */
+   skip = start - p->out;
+   stream->avail_in  = 0;
+   stream->avail_out = 0;
+
+   for (;;) {
+      if (!stream->avail_out) {
+	 if (skip) {
+	    n = skip < GZ_WINSIZE ? skip : GZ_WINSIZE;
+	    stream->next_out  = discard;
+	    stream->avail_out = n;
+	    skip -= n;
+	 } else if (!target) {
+	    stream->next_out  = (Bytef *)buffer;
+	    stream->avail_out = size;
+	    target = 1;
+	 } else
+	    break;
+      }
+
+      if (!stream->avail_in) {
+	 n = h->size > pos ? h->size - pos : 0;
+	 if (n > GZ_INPUT_SIZE)
+	    n = GZ_INPUT_SIZE;
+	 if (!n || !dict_read_at( h, (char *)input, n, pos )) {
+	    strcpy( errorString, dz_error_str( DZ_ERR_READFILE ) );
+	    goto error;
+	 }
+	 pos += n;
+	 stream->next_in  = input;
+	 stream->avail_in = n;
+      }
+
+      ret = inflate( stream, Z_NO_FLUSH );
+      if (ret == Z_STREAM_END && stream->avail_out)
+	 ret = Z_DATA_ERROR; /* The data has ended early */
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+	 sprintf( errorString, "inflate: %s\n", stream->msg ? stream->msg : "" );
+	 goto error;
+      }
+   }
+
+   dict_release_stream( h, stream );
+   xfree( window );
+   xfree( input );
+   xfree( discard );
+   return 1;
+
+error:
+   if (stream)
+      dict_release_stream( h, stream );
+   xfree( window );
+   xfree( input );
+   xfree( discard );
+   return 0;
+}
+
 dictData *dict_data_open( const char *filename,
                           enum DZ_ERRORS * error,
                           int computeCRC )
@@ -487,6 +974,13 @@ dictData *dict_data_open( const char *filename,
 #endif
    h->initialized = 0;
 
+   dict_mutex_init( &h->streamsMutex );
+
+   dz_init();
+   dict_mutex_lock( &dzIdMutex );
+   h->id = ++dzLastId;
+   dict_mutex_unlock( &dzIdMutex );
+
    for(;;)
    {
 #ifdef __WIN32
@@ -552,6 +1046,9 @@ void dict_data_close( dictData *header )
    if (!header)
       return;
 
+   if (header->id)
+      dz_cache_evict( header->id );
+
 #ifdef __WIN32
    if ( header->fd != INVALID_HANDLE_VALUE )
      CloseHandle( header->fd );
@@ -575,6 +1072,15 @@ void dict_data_close( dictData *header )
 	 xfree (header -> cache [i].inBuffer);
    }
 
+   for (i = 0; i < header->streamCount; ++i) {
+      inflateEnd( header->streams[i] );
+      xfree( header->streams[i] );
+   }
+
+   dict_mutex_destroy( &header->streamsMutex );
+
+   dict_gzip_index_free( header->gzIndex );
+
    memset( header, 0, sizeof( struct dictData ) );
    xfree( header );
 }
@@ -625,6 +1131,14 @@ char *dict_data_read_ (
 		 " or dzip format (for space savings).\n" );
       break;
 */
+      if (h->gzIndex) {
+	 if (!dict_gzip_read( h, start, size, buffer, h->errorString )) {
+	    xfree( buffer );
+	    return 0;
+	 }
+	 buffer[size] = '\0';
+	 break;
+      }
       strcpy( h->errorString, "Cannot seek on pure gzip format files" );
       xfree( buffer );
       return 0;
@@ -830,6 +1344,435 @@ char *dict_data_read_ (
    return buffer;
 }
 
+char *dict_data_read_r (
+   dictData *h, unsigned long start, unsigned long size,
+   char *errorString )
+{
+   char          *buffer;
+   char          *pt;
+   char          *inBuffer  = NULL;
+   char          *outBuffer = NULL;
+   z_stream      *stream    = NULL;
+   unsigned long end;
+   int           count;
+   int           firstChunk, lastChunk;
+   int           firstOffset, lastOffset;
+   int           i;
+
+   end  = start + size;
+
+   buffer = xmalloc( size + 1 );
+   if( !buffer )
+   {
+     strcpy( errorString, dz_error_str( DZ_ERR_NOMEMORY ) );
+     return 0;
+   }
+
+   if ( !size )
+   {
+     *buffer = 0;
+     return buffer;
+   }
+
+   switch (h->type) {
+   case DICT_GZIP:
+      if (!h->gzIndex) {
+	 strcpy( errorString, "Cannot seek on pure gzip format files" );
+	 goto error;
+      }
+      if (!dict_gzip_read( h, start, size, buffer, errorString ))
+	 goto error;
+      buffer[size] = '\0';
+      return buffer;
+   case DICT_UNKNOWN:
+      strcpy( errorString, "Cannot read unknown file type" );
+      goto error;
+   case DICT_TEXT:
+      if (!dict_read_at( h, buffer, size, start )) {
+	 strcpy( errorString, dz_error_str( DZ_ERR_READFILE ) );
+	 goto error;
+      }
+      buffer[size] = '\0';
+      return buffer;
+   case DICT_DZIP:
+      break;
+   }
+
+   inBuffer  = xmalloc( h->chunkLength );
+   outBuffer = xmalloc( OUT_BUFFER_SIZE );
+   if (!inBuffer || !outBuffer) {
+      strcpy( errorString, dz_error_str( DZ_ERR_NOMEMORY ) );
+      goto error;
+   }
+
+   firstChunk  = start / h->chunkLength;
+   firstOffset = start - firstChunk * h->chunkLength;
+   lastChunk   = end / h->chunkLength;
+   lastOffset  = end - lastChunk * h->chunkLength;
+
+   for (pt = buffer, i = firstChunk; i <= lastChunk; i++) {
+      if (i == lastChunk && !lastOffset)
+	 break; /* The data ends right at the chunk boundary */
+
+      if (i >= h->chunkCount) {
+	 strcpy( errorString, dz_error_str( DZ_ERR_INVALID_FORMAT ) );
+	 goto error;
+      }
+
+      if (!dz_cache_find( h->id, i, inBuffer, &count )) {
+	 if (h->chunks[i] >= OUT_BUFFER_SIZE ) {
+	    sprintf( errorString, "h->chunks[%d] = %d >= %ld (OUT_BUFFER_SIZE)\n",
+		     i, h->chunks[i], OUT_BUFFER_SIZE );
+	    goto error;
+	 }
+
+	 if (!dict_read_at( h, outBuffer, h->chunks[i], h->offsets[i] )) {
+	    strcpy( errorString, dz_error_str( DZ_ERR_READFILE ) );
+	    goto error;
+	 }
+
+	 if (!stream && !(stream = dict_acquire_stream( h ))) {
+	    strcpy( errorString, "Cannot initialize inflation engine" );
+	    goto error;
+	 }
+
+	 /* Each chunk is flushed fully, so it can be inflated on its own */
+	 inflateReset( stream );
+
+	 stream->next_in   = (Bytef *)outBuffer;
+	 stream->avail_in  = h->chunks[i];
+	 stream->next_out  = (Bytef *)inBuffer;
+	 stream->avail_out = h->chunkLength;
+	 if (inflate( stream, Z_PARTIAL_FLUSH ) != Z_OK) {
+	    sprintf( errorString, "inflate: %s\n", stream->msg ? stream->msg : "" );
+	    goto error;
+	 }
+	 if (stream->avail_in) {
+	    sprintf( errorString, "inflate did not flush (%d pending, %d avail)\n",
+		     stream->avail_in, stream->avail_out );
+	    goto error;
+	 }
+
+	 count = h->chunkLength - stream->avail_out;
+
+	 dz_cache_insert( h->id, i, inBuffer, count );
+      }
+
+      if (i == lastChunk ? count < lastOffset : count != h->chunkLength) {
+	 sprintf( errorString, "Length = %d instead of %d\n",
+		  count, i == lastChunk ? lastOffset : h->chunkLength );
+	 goto error;
+      }
+
+      if (i == firstChunk) {
+	 if (i == lastChunk) {
+	    memcpy( pt, inBuffer + firstOffset, lastOffset-firstOffset);
+	    pt += lastOffset - firstOffset;
+	 } else {
+	    memcpy( pt, inBuffer + firstOffset,
+		    h->chunkLength - firstOffset );
+	    pt += h->chunkLength - firstOffset;
+	 }
+      } else if (i == lastChunk) {
+	 memcpy( pt, inBuffer, lastOffset );
+	 pt += lastOffset;
+      } else {
+	 memcpy( pt, inBuffer, h->chunkLength );
+	 pt += h->chunkLength;
+      }
+   }
+   *pt = '\0';
+
+   if (stream)
+      dict_release_stream( h, stream );
+   xfree( inBuffer );
+   xfree( outBuffer );
+   return buffer;
+
+error:
+   if (stream)
+      dict_release_stream( h, stream );
+   xfree( inBuffer );
+   xfree( outBuffer );
+   xfree( buffer );
+   return 0;
+}
+
+/* Adds a point with the given window, which is circular, its oldest byte
+   being the one after the 'left' last ones */
+static int dict_gzip_add_point( struct dictGzipIndex *index, int bits,
+				unsigned long in, unsigned long out,
+				unsigned left, const unsigned char *window,
+				unsigned char *scratch )
+{
+   dictGzipPoint *p;
+   uLongf        size;
+
+   if (index->count == index->allocated) {
+      int           allocated = index->allocated ? index->allocated * 2 : 64;
+      dictGzipPoint *points   = realloc( index->points,
+					 allocated * sizeof( dictGzipPoint ) );
+      if (!points)
+	 return 0;
+      index->points    = points;
+      index->allocated = allocated;
+   }
+
+   if (left)
+      memcpy( scratch, window + GZ_WINSIZE - left, left );
+   if (left < GZ_WINSIZE)
+      memcpy( scratch + left, window, GZ_WINSIZE - left );
+
+   size = compressBound( GZ_WINSIZE );
+
+   p = &index->points[index->count];
+   if (!(p->window = xmalloc( size )))
+      return 0;
+
+   if (compress( p->window, &size, scratch, GZ_WINSIZE ) != Z_OK) {
+      xfree( p->window );
+      return 0;
+   }
+
+   p->out        = out;
+   p->in         = in;
+   p->bits       = bits;
+   p->windowSize = size;
+   ++index->count;
+
+   return 1;
+}
+
+static void dict_put32( FILE *f, unsigned long v )
+{
+   putc( v & 0xff, f );
+   putc( (v >> 8) & 0xff, f );
+   putc( (v >> 16) & 0xff, f );
+   putc( (v >> 24) & 0xff, f );
+}
+
+static unsigned long dict_get32( FILE *f )
+{
+   unsigned long v;
+
+   v  = (unsigned long)(getc( f ) & 0xff);
+   v |= (unsigned long)(getc( f ) & 0xff) << 8;
+   v |= (unsigned long)(getc( f ) & 0xff) << 16;
+   v |= (unsigned long)(getc( f ) & 0xff) << 24;
+
+   return v;
+}
+
+/* The index is saved along with the size, the crc and the uncompressed size
+   of the file it's made for, so it wouldn't be used for any other one. */
+static enum DZ_ERRORS dict_gzip_index_save( dictData *h, const char *indexFilename )
+{
+   struct dictGzipIndex *index = h->gzIndex;
+   FILE                 *f;
+   int                  i, failed;
+
+   if (!(f = gd_fopen( indexFilename, "wb" )))
+      return DZ_ERR_OPENFILE;
+
+   dict_put32( f, GZ_INDEX_MAGIC );
+   dict_put32( f, GZ_INDEX_VERSION );
+   dict_put32( f, h->size );
+   dict_put32( f, h->crc );
+   dict_put32( f, h->length );
+   dict_put32( f, index->length );
+   dict_put32( f, index->count );
+
+   for (i = 0; i < index->count; i++) {
+      dictGzipPoint *p = &index->points[i];
+
+      dict_put32( f, p->out );
+      dict_put32( f, p->in );
+      dict_put32( f, p->bits );
+      dict_put32( f, p->windowSize );
+      fwrite( p->window, 1, p->windowSize, f );
+   }
+
+   failed = ferror( f );
+
+   if (fclose( f ) || failed)
+      return DZ_ERR_INTERNAL;
+
+   return DZ_NOERROR;
+}
+
+enum DZ_ERRORS dict_gzip_index_make( const char *filename,
+				     const char *indexFilename,
+				     unsigned long span )
+{
+   dictData             *h;
+   struct dictGzipIndex *index;
+   z_stream             strm;
+   unsigned char        *input   = NULL;
+   unsigned char        *window  = NULL;
+   unsigned char        *scratch = NULL;
+   unsigned long        totin, totout, last, pos, n;
+   enum DZ_ERRORS       error;
+   int                  ret;
+
+   if (!(h = dict_data_open( filename, &error, 0 )))
+      return error;
+
+   if (h->type != DICT_GZIP) {
+      dict_data_close( h );
+      return DZ_NOERROR;
+   }
+
+   index   = xmalloc( sizeof( struct dictGzipIndex ) );
+   input   = xmalloc( GZ_INPUT_SIZE );
+   window  = xmalloc( GZ_WINSIZE );
+   scratch = xmalloc( GZ_WINSIZE );
+
+   memset( &strm, 0, sizeof( strm ) );
+
+   if (!index || !input || !window || !scratch) {
+      xfree( index );
+      index = NULL;
+      error = DZ_ERR_NOMEMORY;
+      goto done;
+   }
+
+   memset( index, 0, sizeof( struct dictGzipIndex ) );
+   memset( window, 0, GZ_WINSIZE );
+   h->gzIndex = index;
+
+   if (inflateInit2( &strm, 47 ) != Z_OK) { /* Expect the gzip header */
+      error = DZ_ERR_NOMEMORY;
+      goto done;
+   }
+
+   /* Inflate the whole file block by block, making a point at the start of
+      the first block after every span */
+   error  = DZ_NOERROR;
+   totin  = totout = last = pos = 0;
+   strm.avail_out = 0;
+
+   do {
+      n = h->size - pos;
+      if (n > GZ_INPUT_SIZE)
+	 n = GZ_INPUT_SIZE;
+      if (!n || !dict_read_at( h, (char *)input, n, pos )) {
+	 error = DZ_ERR_READFILE;
+	 break;
+      }
+      pos += n;
+
+      strm.next_in  = input;
+      strm.avail_in = n;
+
+      do {
+	 if (!strm.avail_out) {
+	    strm.next_out  = window;
+	    strm.avail_out = GZ_WINSIZE;
+	 }
+
+	 totin  += strm.avail_in;
+	 totout += strm.avail_out;
+	 ret = inflate( &strm, Z_BLOCK );
+	 totin  -= strm.avail_in;
+	 totout -= strm.avail_out;
+
+	 if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+	    error = DZ_ERR_INVALID_FORMAT;
+	    break;
+	 }
+
+	 if (ret == Z_STREAM_END)
+	    break;
+
+	 /* At the end of a block, and not of the last one */
+	 if ((strm.data_type & 128) && !(strm.data_type & 64)
+	     && (totout == 0 || totout - last > span)) {
+	    if (!dict_gzip_add_point( index, strm.data_type & 7, totin, totout,
+				      strm.avail_out, window, scratch )) {
+	       error = DZ_ERR_NOMEMORY;
+	       break;
+	    }
+	    last = totout;
+	 }
+      } while (strm.avail_in);
+   } while (error == DZ_NOERROR && ret != Z_STREAM_END);
+
+   inflateEnd( &strm );
+
+   index->length = totout;
+
+   if (error == DZ_NOERROR)
+      error = dict_gzip_index_save( h, indexFilename );
+
+done:
+   xfree( input );
+   xfree( window );
+   xfree( scratch );
+   dict_data_close( h );
+
+   return error;
+}
+
+int dict_data_load_gzip_index( dictData *h, const char *indexFilename )
+{
+   struct dictGzipIndex *index;
+   FILE                 *f;
+   int                  i, count, ok;
+
+   if (h->type != DICT_GZIP || h->gzIndex)
+      return h->gzIndex != NULL;
+
+   if (!(f = gd_fopen( indexFilename, "rb" )))
+      return 0;
+
+   if (dict_get32( f ) != GZ_INDEX_MAGIC
+       || dict_get32( f ) != GZ_INDEX_VERSION
+       || dict_get32( f ) != (h->size & 0xffffffffUL)
+       || dict_get32( f ) != (h->crc & 0xffffffffUL)
+       || dict_get32( f ) != (h->length & 0xffffffffUL)
+       || !(index = xmalloc( sizeof( struct dictGzipIndex ) ))) {
+      fclose( f );
+      return 0;
+   }
+
+   memset( index, 0, sizeof( struct dictGzipIndex ) );
+
+   index->length = dict_get32( f );
+   count         = dict_get32( f );
+
+   ok = count > 0 && count < 0x1000000
+	&& (index->points = xmalloc( count * sizeof( dictGzipPoint ) ));
+
+   for (i = 0; ok && i < count; i++) {
+      dictGzipPoint *p = &index->points[i];
+
+      p->window     = NULL;
+      p->out        = dict_get32( f );
+      p->in         = dict_get32( f );
+      p->bits       = dict_get32( f );
+      p->windowSize = dict_get32( f );
+
+      ok = !feof( f ) && p->bits < 8 && p->windowSize <= compressBound( GZ_WINSIZE )
+	   && (p->window = xmalloc( p->windowSize ))
+	   && fread( p->window, 1, p->windowSize, f ) == p->windowSize;
+
+      if (p->window)
+	 ++index->count;
+   }
+
+   fclose( f );
+
+   if (!ok) {
+      dict_gzip_index_free( index );
+      return 0;
+   }
+
+   index->allocated = index->count;
+   h->gzIndex       = index;
+
+   return 1;
+}
+
 char *dict_error_str( dictData *data )
 {
   return data->errorString;
@@ -29,6 +29,8 @@
 
 #ifdef __WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
 #endif
 
 #ifdef __cplusplus
@@ -41,6 +43,23 @@ extern "C"
 
 #define DICT_CACHE_SIZE 5
 
+/* The number of idle inflate contexts kept by each file for dict_data_read_r() */
+#define DICT_STREAM_POOL_SIZE 4
+
+#define DICT_ERROR_STRING_SIZE 512
+
+/* The default distance, in the uncompressed data, between the checkpoints of
+   the random access index of a plain gzip file */
+#define DICT_GZIP_INDEX_SPAN (1024 * 1024)
+
+struct dictGzipIndex;
+
+#ifdef __WIN32
+typedef CRITICAL_SECTION dictMutex;
+#else
+typedef pthread_mutex_t dictMutex;
+#endif
+
 typedef struct dictCache {
    int           chunk;
    char          *inBuffer;
@@ -90,7 +109,14 @@ typedef struct dictData {
    unsigned long compressedLength;
    int           stamp;
    dictCache     cache[DICT_CACHE_SIZE];
-   char          errorString[512];
+   char          errorString[DICT_ERROR_STRING_SIZE];
+
+   unsigned long id;            /* Identifies the file in the shared cache */
+   dictMutex     streamsMutex;
+   z_stream      *streams[DICT_STREAM_POOL_SIZE]; /* Idle inflate contexts */
+   int           streamCount;
+
+   struct dictGzipIndex *gzIndex; /* Random access index of a plain gzip file */
 } dictData;
 
 
@@ -107,6 +133,34 @@ extern char *dict_data_read_ (
    const char *preFilter,
    const char *postFilter );
 
+/* Same as dict_data_read_(), but can be called from several threads at once
+   for the same data. The chunks are read with positional reads, inflated
+   with the contexts from a pool and kept in a cache shared by all the files.
+   On failure, returns 0 and puts the error message into errorString, which
+   is to hold DICT_ERROR_STRING_SIZE characters. */
+extern char *dict_data_read_r (
+   dictData *data,
+   unsigned long start, unsigned long size,
+   char *errorString );
+
+/* Sets the memory budget, in bytes, of the chunk cache used by
+   dict_data_read_r(). Zero disables the cache. */
+extern void dict_data_set_cache_size( unsigned long bytes );
+
+/* Plain gzip files, lacking the dictzip chunk table, can only be read with a
+   random access index. It holds a checkpoint, with the inflate window, for
+   every 'span' bytes of the uncompressed data, so reading anywhere only
+   takes inflating from the nearest checkpoint before it. */
+
+/* Builds the random access index of the given file and saves it to
+   indexFilename, if the file is a plain gzip one. Does nothing otherwise. */
+extern enum DZ_ERRORS dict_gzip_index_make(
+   const char *filename, const char *indexFilename, unsigned long span );
+
+/* Loads the random access index previously made for the file opened.
+   Returns nonzero if it was there, and was made for this very file. */
+extern int dict_data_load_gzip_index( dictData *data, const char *indexFilename );
+
 extern char *dict_error_str( dictData *data );
 
 extern const char *dz_error_str( enum DZ_ERRORS error );
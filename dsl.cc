@@ -90,7 +90,8 @@ DEF_EX_STR( exDictzipError, "DICTZIP error", Dictionary::Ex )
 enum
 {
   Signature = 0x584c5344, // DSLX on little-endian, XLSD on big-endian
-  CurrentFormatVersion = 23 + BtreeIndexing::FormatVersion + Folding::Version,
+  CurrentFormatVersion = 24 + BtreeIndexing::FormatVersion + Folding::Version +
+                         ChunkedStorage::PreferredCodec,
   CurrentZipSupportVersion = 2,
   CurrentFtsIndexVersion = 7
 };
@@ -161,8 +162,8 @@ class DslDictionary: public BtreeIndexing::BtreeDictionary
   string dictionaryName;
   string preferredSoundDictionary;
   map< string, string > abrv;
-  Mutex dzMutex;
   dictData * dz;
+  string gzipIndexName; // The random access index, for the plain gzip files
   Mutex resourceZipMutex;
   IndexedZip resourceZip;
   BtreeIndex resourceZipIndex;
@@ -310,6 +311,7 @@ DslDictionary::DslDictionary( string const & id,
   can_FTS = true;
 
   ftsIdxName = indexFile + "_FTS";
+  gzipIndexName = indexFile + "_GZIDX";
 
   if( !Dictionary::needToRebuildIndex( dictionaryFiles, ftsIdxName )
       && !FtsHelpers::ftsIndexIsOldOrBad( ftsIdxName, this ) )
@@ -435,13 +437,15 @@ void DslDictionary::doDeferredInit()
         throw exDictzipError( string( dz_error_str( error ) )
                               + "(" + getDictionaryFilenames()[ 0 ] + ")" );
 
+      dict_data_load_gzip_index( dz, gzipIndexName.c_str() );
+
       // Read the abrv, if any
 
       if ( idxHeader.hasAbrv )
       {
-        vector< char > chunk;
+        QByteArray chunk;
 
-        char * abrvBlock = chunks->getBlock( idxHeader.abrvAddress, chunk );
+        char const * abrvBlock = chunks->getBlock( idxHeader.abrvAddress, chunk );
 
         uint32_t total;
         memcpy( &total, abrvBlock, sizeof( uint32_t ) );
@@ -455,7 +459,7 @@ void DslDictionary::doDeferredInit()
           memcpy( &keySz, abrvBlock, sizeof( uint32_t ) );
           abrvBlock += sizeof( uint32_t );
 
-          char * key = abrvBlock;
+          char const * key = abrvBlock;
 
           abrvBlock += keySz;
 
@@ -561,9 +565,9 @@ void DslDictionary::loadArticle( uint32_t address,
   wstring articleData;
 
   {
-    vector< char > chunk;
+    QByteArray chunk;
 
-    char * articleProps;
+    char const * articleProps;
 
     {
       Mutex::Lock _( idxMutex );
@@ -580,18 +584,14 @@ void DslDictionary::loadArticle( uint32_t address,
     GD_DPRINTF( "offset = %x\n", articleOffset );
 
 
-    char * articleBody;
-
-    {
-      Mutex::Lock _( dzMutex );
+    char dzError[ DICT_ERROR_STRING_SIZE ];
 
-      articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-    }
+    char * articleBody = dict_data_read_r( dz, articleOffset, articleSize, dzError );
 
     if ( !articleBody )
     {
 //      throw exCantReadFile( getDictionaryFilenames()[ 0 ] );
-      articleData = GD_NATIVE_TO_WS( L"\n\r\t" ) + gd::toWString( QString( "DICTZIP error: " ) + dict_error_str( dz ) );
+      articleData = GD_NATIVE_TO_WS( L"\n\r\t" ) + gd::toWString( QString( "DICTZIP error: " ) + dzError );
     }
     else
     {
@@ -1331,9 +1331,9 @@ void DslDictionary::getArticleText( uint32_t articleAddress, QString & headword,
   headword.clear();
   text.clear();
 
-  vector< char > chunk;
+  QByteArray chunk;
 
-  char * articleProps;
+  char const * articleProps;
   wstring articleData;
 
   {
@@ -1347,12 +1347,9 @@ void DslDictionary::getArticleText( uint32_t articleAddress, QString & headword,
   memcpy( &articleSize, articleProps + sizeof( articleOffset ),
           sizeof( articleSize ) );
 
-  char * articleBody;
+  char dzError[ DICT_ERROR_STRING_SIZE ];
 
-  {
-    Mutex::Lock _( dzMutex );
-    articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-  }
+  char * articleBody = dict_data_read_r( dz, articleOffset, articleSize, dzError );
 
   if ( !articleBody )
   {
@@ -1699,16 +1696,7 @@ void DslArticleRequest::run()
     return;
   }
 
-  vector< WordArticleLink > chain = dict.findArticles( word, ignoreDiacritics );
-
-  for( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-
-    vector< WordArticleLink > altChain = dict.findArticles( alts[ x ], ignoreDiacritics );
-
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
+  vector< WordArticleLink > chain = dict.findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   // Some synonyms make it that the articles appear several times. We combat
   // this by only allowing them to appear once. Dsl treats different headwords
@@ -2168,7 +2156,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
         IndexedWords indexedWords;
 
-        ChunkedStorage::Writer chunks( idx );
+        ChunkedStorage::Writer chunks( idx, ChunkedStorage::PreferredCodec );
 
         // Read the abbreviations
 
@@ -2545,6 +2533,16 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
         else
           idxHeader.hasZipFile = 0;
 
+        // A plain gzip file, not a dictzip one, needs a random access index
+        // for its articles to be read
+
+        DZ_ERRORS gzipIndexError = dict_gzip_index_make( dictFiles[ 0 ].c_str(),
+                                                         ( indexFile + "_GZIDX" ).c_str(),
+                                                         DICT_GZIP_INDEX_SPAN );
+        if ( gzipIndexError != DZ_NOERROR )
+          gdWarning( "DSL: Failed building the random access index for \"%s\", reason: %s\n",
+                     dictFiles[ 0 ].c_str(), dz_error_str( gzipIndexError ) );
+
         // That concludes it. Update the header.
 
         idxHeader.signature = Signature;
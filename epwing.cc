@@ -163,6 +163,10 @@ public:
                                                               unsigned long maxResults )
     THROW_SPEC( std::exception );
 
+  /// The searches also consult the book's own engine
+  virtual bool searchesIndexOnly() const
+  { return false; }
+
 protected:
 
   void loadIcon() throw();
@@ -290,9 +294,9 @@ void EpwingDictionary::loadArticle( quint32 address,
                                     int & articlePage,
                                     int & articleOffset )
 {
-  vector< char > chunk;
+  QByteArray chunk;
 
-  char * articleProps;
+  char const * articleProps;
 
   {
     Mutex::Lock _( idxMutex );
@@ -402,8 +406,8 @@ void EpwingDictionary::getArticleText( uint32_t articleAddress, QString & headwo
   headword.clear();
   text.clear();
 
-  vector< char > chunk;
-  char * articleProps;
+  QByteArray chunk;
+  char const * articleProps;
 
   {
     Mutex::Lock _( idxMutex );
@@ -502,16 +506,7 @@ void EpwingArticleRequest::run()
     return;
   }
 
-  vector< WordArticleLink > chain = dict.findArticles( word, ignoreDiacritics );
-
-  for( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-
-    vector< WordArticleLink > altChain = dict.findArticles( alts[ x ], ignoreDiacritics );
-
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
+  vector< WordArticleLink > chain = dict.findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   multimap< wstring, pair< string, string > > mainArticles, alternateArticles;
 
@@ -30,6 +30,10 @@ enum
   WriteBufferSize = 65536
 };
 
+// On 32-bit systems the address space is scarce, so we don't map files
+// larger than this there
+static qint64 const MaxMappingSize32 = 256 * 1024 * 1024;
+
 bool tryPossibleName( std::string const & name, std::string & copyTo )
 {
   if ( File::exists( name ) )
@@ -111,13 +115,14 @@ void Class::open( char const * filename, char const * mode ) THROW_SPEC( exCantO
 }
 
 Class::Class( char const * filename, char const * mode ) THROW_SPEC( exCantOpen ):
-  writeBuffer( 0 )
+  writeBuffer( 0 ), mapping( 0 ), mappingSize( 0 ), mappingAttempted( false )
 {
   open( filename, mode );
 }
 
 Class::Class( std::string const & filename, char const * mode )
-  THROW_SPEC( exCantOpen ): writeBuffer( 0 )
+  THROW_SPEC( exCantOpen ): writeBuffer( 0 ), mapping( 0 ), mappingSize( 0 ),
+  mappingAttempted( false )
 {
   open( filename.c_str(), mode );
 }
@@ -136,6 +141,41 @@ void Class::read( void * buf, qint64 size ) THROW_SPEC( exReadError, exWriteErro
     throw exReadError();
 }
 
+bool Class::readAt( qint64 offset, void * buf, qint64 size ) THROW_SPEC( exReadError )
+{
+#ifdef __WIN32
+  // A positional ReadFile() would move the file pointer under QFile's feet
+  (void) offset;
+  (void) buf;
+  (void) size;
+  return false;
+#else
+  int fd = f.handle();
+
+  if ( fd < 0 )
+    return false;
+
+  char * ptr = reinterpret_cast< char * >( buf );
+
+  while( size > 0 )
+  {
+    ssize_t result = ::pread( fd, ptr, size, offset );
+
+    if ( result < 0 && errno == EINTR )
+      continue;
+
+    if ( result <= 0 )
+      throw exReadError();
+
+    ptr += result;
+    offset += result;
+    size -= result;
+  }
+
+  return true;
+#endif
+}
+
 size_t Class::readRecords( void * buf, qint64 size, size_t count ) THROW_SPEC( exWriteError )
 {
   if ( writeBuffer )
@@ -284,6 +324,29 @@ qint64 Class::tell() THROW_SPEC( exSeekError )
   return result;
 }
 
+uchar const * Class::mapAll() THROW_SPEC( exWriteError )
+{
+  if ( mappingAttempted )
+    return mapping;
+
+  mappingAttempted = true;
+
+  if ( writeBuffer )
+    flushWriteBuffer();
+
+  qint64 size = f.size();
+
+  if ( size <= 0 || ( sizeof( void * ) < 8 && size > MaxMappingSize32 ) )
+    return 0;
+
+  mapping = f.map( 0, size );
+
+  if ( mapping )
+    mappingSize = size;
+
+  return mapping;
+}
+
 bool Class::eof() THROW_SPEC( exWriteError )
 {
   if ( writeBuffer )
@@ -302,7 +365,11 @@ QFile & Class::file() THROW_SPEC( exWriteError )
 void Class::close() THROW_SPEC( exWriteError )
 {
   releaseWriteBuffer();
-  f.close();
+  f.close(); // This also unmaps the file
+
+  mapping = 0;
+  mappingSize = 0;
+  mappingAttempted = false;
 }
 
 Class::~Class() throw()
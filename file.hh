@@ -41,6 +41,9 @@ class Class
   QFile f;
   char * writeBuffer;
   qint64 writeBufferLeft;
+  uchar * mapping;
+  qint64 mappingSize;
+  bool mappingAttempted;
 
   void open( char const * filename, char const * mode ) THROW_SPEC( exCantOpen );
 
@@ -62,6 +65,14 @@ public:
   T read() THROW_SPEC( exReadError, exWriteError )
   { T value; read( value ); return value; }
 
+  /// Reads the number of bytes from the given offset, without using or
+  /// changing the current position in the file, throws an error if it failed
+  /// to fill the whole buffer. Unlike read(), this one can be called from
+  /// several threads at once, as long as nothing writes to the file.
+  /// Returns false, without reading anything, if such reads aren't supported
+  /// on this platform -- seek() and read() under a lock should be used then.
+  bool readAt( qint64 offset, void * buf, qint64 size ) THROW_SPEC( exReadError );
+
   /// Attempts reading at most 'count' records sized 'size'. Returns
   /// the number of records it managed to read, up to 'count'.
   size_t readRecords( void * buf, qint64 size, size_t count ) THROW_SPEC( exWriteError );
@@ -107,6 +118,16 @@ public:
   /// Tells the current position within the file, relative to its beginning.
   qint64 tell() THROW_SPEC( exSeekError );
 
+  /// Maps the whole file into memory and returns the pointer to its data,
+  /// or 0 if the file can't be mapped. The mapping is only established once,
+  /// subsequent calls return the same pointer. It stays valid until the file
+  /// is closed. Only makes sense for the files opened read-only.
+  uchar const * mapAll() THROW_SPEC( exWriteError );
+
+  /// Returns the size of the mapping established by mapAll().
+  qint64 mappedSize() const
+  { return mappingSize; }
+
   /// Returns true if end-of-file condition is set.
   bool eof() THROW_SPEC( exWriteError );
 
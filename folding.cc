@@ -688,6 +688,21 @@ QString unescapeWildcardSymbols( const QString & str )
   return unescaped;
 }
 
+bool hasWildcardSymbols( QString const & str )
+{
+  for( int x = 0; x < str.size(); ++x )
+  {
+    ushort ch = str.at( x ).unicode();
+
+    if ( ch == '\\' )
+      ++x;
+    else if ( ch == '[' || ch == ']' || ch == '?' || ch == '*' )
+      return true;
+  }
+
+  return false;
+}
+
 void prepareToEmbedRTL( QString & str )
 {
   if( str.isRightToLeft() )
@@ -85,6 +85,9 @@ QString unescapeWildcardSymbols( QString const & );
 /// Escape all wildcard symbols (for place word to input line)
 QString escapeWildcardSymbols( QString const & );
 
+/// Tells if there are any wildcard symbols which are not escaped
+bool hasWildcardSymbols( QString const & );
+
 /// Prepare a possibly right-to-left string @p str to be embedded into another, possibly left-to-right string.
 void prepareToEmbedRTL( QString & str );
 
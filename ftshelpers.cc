@@ -312,31 +312,13 @@ void makeFTSIndex( BtreeIndexing::BtreeDictionary * dict, QAtomicInt & isCancell
 
   ftsIdx.write( ftsIdxHeader );
 
-  ChunkedStorage::Writer chunks( ftsIdx );
+  ChunkedStorage::Writer chunks( ftsIdx, ChunkedStorage::PreferredCodec );
 
   BtreeIndexing::IndexedWords indexedWords;
 
-  QSet< uint32_t > setOfOffsets;
-  setOfOffsets.reserve( dict->getArticleCount() );
-
-  dict->findArticleLinks( 0, &setOfOffsets, 0, &isCancelled );
-
-  if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-    throw exUserAbort();
-
   QVector< uint32_t > offsets;
-  offsets.resize( setOfOffsets.size() );
-  uint32_t * ptr = &offsets.front();
 
-  for( QSet< uint32_t >::ConstIterator it = setOfOffsets.constBegin();
-       it != setOfOffsets.constEnd(); ++it )
-  {
-    *ptr = *it;
-    ptr++;
-  }
-
-  // Free memory
-  setOfOffsets.clear();
+  dict->findArticleOffsetsForFTS( offsets, isCancelled );
 
   if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
     throw exUserAbort();
@@ -817,8 +799,8 @@ void FTSResultsRequest::indexSearch( BtreeIndexing::BtreeIndex & ftsIndex,
       if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
         return;
 
-      vector< char > chunk;
-      char * linksPtr;
+      QByteArray chunk;
+      char const * linksPtr;
       {
         Mutex::Lock _( dict.getFtsMutex() );
         linksPtr = chunks->getBlock( links[ x ].articleOffset, chunk );
@@ -828,7 +810,7 @@ void FTSResultsRequest::indexSearch( BtreeIndexing::BtreeIndex & ftsIndex,
       linksPtr += sizeof(uint32_t);
       for( uint32_t y = 0; y < size; y++ )
       {
-        tmp.insert( *( reinterpret_cast< uint32_t * >( linksPtr ) ) );
+        tmp.insert( *( reinterpret_cast< uint32_t const * >( linksPtr ) ) );
         linksPtr += sizeof(uint32_t);
       }
     }
@@ -916,8 +898,8 @@ void FTSResultsRequest::combinedIndexSearch( BtreeIndexing::BtreeIndex & ftsInde
         if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
           return;
 
-        vector< char > chunk;
-        char * linksPtr;
+        QByteArray chunk;
+        char const * linksPtr;
         {
           Mutex::Lock _( dict.getFtsMutex() );
           linksPtr = chunks->getBlock( links[ x ].articleOffset, chunk );
@@ -927,7 +909,7 @@ void FTSResultsRequest::combinedIndexSearch( BtreeIndexing::BtreeIndex & ftsInde
         linksPtr += sizeof(uint32_t);
         for( uint32_t y = 0; y < size; y++ )
         {
-          tmp.insert( *( reinterpret_cast< uint32_t * >( linksPtr ) ) );
+          tmp.insert( *( reinterpret_cast< uint32_t const * >( linksPtr ) ) );
           linksPtr += sizeof(uint32_t);
         }
       }
@@ -947,46 +929,48 @@ void FTSResultsRequest::combinedIndexSearch( BtreeIndexing::BtreeIndex & ftsInde
 
   if( !wordsList.isEmpty() )
   {
-    QVector< BtreeIndexing::WordArticleLink > links;
-    links.reserve( wordsInIndex );
-    ftsIndex.findArticleLinks( &links, 0, 0, &isCancelled );
+    // The words are read as they go, rather than collected first
+    BtreeIndexing::ChainReader reader( ftsIndex );
+    vector< BtreeIndexing::WordArticleLink > links;
 
-    for( int x = 0; x < links.size(); x++ )
+    while( reader.next( links ) )
     {
-      if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-        return;
+      for( unsigned x = 0; x < links.size(); x++ )
+      {
+        if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+          return;
 
-      QString word = QString::fromUtf8( links[ x ].word.data(), links[ x ].word.size() );
+        string headword = links[ x ].prefix + links[ x ].word;
+        QString word = QString::fromUtf8( headword.data(), headword.size() );
 
-      if( ignoreDiacritics )
-        word = gd::toQString( Folding::applyDiacriticsOnly( gd::toWString( word ) ) );
+        if( ignoreDiacritics )
+          word = gd::toQString( Folding::applyDiacriticsOnly( gd::toWString( word ) ) );
 
-      for( int i = 0; i < wordsList.size(); i++ )
-      {
-        if( word.length() >= wordsList.at( i ).length() && word.contains( wordsList.at( i ) ) )
+        for( int i = 0; i < wordsList.size(); i++ )
         {
-          vector< char > chunk;
-          char * linksPtr;
+          if( word.length() >= wordsList.at( i ).length() && word.contains( wordsList.at( i ) ) )
           {
-            Mutex::Lock _( dict.getFtsMutex() );
-            linksPtr = chunks->getBlock( links[ x ].articleOffset, chunk );
-          }
+            QByteArray chunk;
+            char const * linksPtr;
+            {
+              Mutex::Lock _( dict.getFtsMutex() );
+              linksPtr = chunks->getBlock( links[ x ].articleOffset, chunk );
+            }
 
-          memcpy( &size, linksPtr, sizeof(uint32_t) );
-          linksPtr += sizeof(uint32_t);
-          for( uint32_t y = 0; y < size; y++ )
-          {
-            allWordsLinks[ wordNom ].insert( *( reinterpret_cast< uint32_t * >( linksPtr ) ) );
+            memcpy( &size, linksPtr, sizeof(uint32_t) );
             linksPtr += sizeof(uint32_t);
+            for( uint32_t y = 0; y < size; y++ )
+            {
+              allWordsLinks[ wordNom ].insert( *( reinterpret_cast< uint32_t const * >( linksPtr ) ) );
+              linksPtr += sizeof(uint32_t);
+            }
+            wordNom += 1;
+            if( searchMode == FTS::PlainText || searchMode == FTS::WholeWords )
+              break;
           }
-          wordNom += 1;
-          if( searchMode == FTS::PlainText || searchMode == FTS::WholeWords )
-            break;
         }
       }
     }
-
-    links.clear();
   }
 
   for( int i = 0; i < allWordsLinks.size(); i++ )
@@ -1028,7 +1012,6 @@ void FTSResultsRequest::fullIndexSearch( BtreeIndexing::BtreeIndex & ftsIndex,
 {
   QSet< uint32_t > setOfOffsets;
   uint32_t size;
-  QVector< BtreeIndexing::WordArticleLink > links;
 
   if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
     return;
@@ -1036,48 +1019,51 @@ void FTSResultsRequest::fullIndexSearch( BtreeIndexing::BtreeIndex & ftsIndex,
   if( indexWords.isEmpty() )
     return;
 
-  links.reserve( wordsInIndex );
-  ftsIndex.findArticleLinks( &links, 0, 0, &isCancelled );
-
   QVector< QSet< uint32_t > > allWordsLinks;
   allWordsLinks.resize( indexWords.size() );
 
-  for( int x = 0; x < links.size(); x++ )
+  // The words are read as they go, rather than collected first
+  BtreeIndexing::ChainReader reader( ftsIndex );
+  vector< BtreeIndexing::WordArticleLink > links;
+
+  while( reader.next( links ) )
   {
-    if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-      return;
+    for( unsigned x = 0; x < links.size(); x++ )
+    {
+      if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+        return;
 
-    QString word = QString::fromUtf8( links[ x ].word.data(), links[ x ].word.size() );
+      string headword = links[ x ].prefix + links[ x ].word;
+      QString word = QString::fromUtf8( headword.data(), headword.size() );
 
-    if( ignoreDiacritics )
-      word = gd::toQString( Folding::applyDiacriticsOnly( gd::toWString( word ) ) );
+      if( ignoreDiacritics )
+        word = gd::toQString( Folding::applyDiacriticsOnly( gd::toWString( word ) ) );
 
-    for( int i = 0; i < indexWords.size(); i++ )
-    {
-      if( word.length() >= indexWords.at( i ).length() && word.contains( indexWords.at( i ) ) )
+      for( int i = 0; i < indexWords.size(); i++ )
       {
-        vector< char > chunk;
-        char * linksPtr;
+        if( word.length() >= indexWords.at( i ).length() && word.contains( indexWords.at( i ) ) )
         {
-          Mutex::Lock _( dict.getFtsMutex() );
-          linksPtr = chunks->getBlock( links[ x ].articleOffset, chunk );
-        }
+          QByteArray chunk;
+          char const * linksPtr;
+          {
+            Mutex::Lock _( dict.getFtsMutex() );
+            linksPtr = chunks->getBlock( links[ x ].articleOffset, chunk );
+          }
 
-        memcpy( &size, linksPtr, sizeof(uint32_t) );
-        linksPtr += sizeof(uint32_t);
-        for( uint32_t y = 0; y < size; y++ )
-        {
-          allWordsLinks[ i ].insert( *( reinterpret_cast< uint32_t * >( linksPtr ) ) );
+          memcpy( &size, linksPtr, sizeof(uint32_t) );
           linksPtr += sizeof(uint32_t);
+          for( uint32_t y = 0; y < size; y++ )
+          {
+            allWordsLinks[ i ].insert( *( reinterpret_cast< uint32_t const * >( linksPtr ) ) );
+            linksPtr += sizeof(uint32_t);
+          }
+          if( searchMode == FTS::PlainText )
+            break;
         }
-        if( searchMode == FTS::PlainText )
-          break;
       }
     }
   }
 
-  links.clear();
-
   for( int i = 0; i < allWordsLinks.size(); i++ )
   {
     if( i == 0 )
@@ -1113,32 +1099,16 @@ void FTSResultsRequest::fullSearch( QStringList & searchWords, QRegExp & regexp
 {
   // Whole file survey
 
-  if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
-    return;
-
-  QSet< uint32_t > setOfOffsets;
-  setOfOffsets.reserve( dict.getArticleCount() );
-  dict.findArticleLinks( 0, &setOfOffsets, 0, &isCancelled );
-
   if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
     return;
 
   QVector< uint32_t > offsets;
-  offsets.resize( setOfOffsets.size() );
-  uint32_t * ptr = &offsets.front();
 
-  for( QSet< uint32_t >::ConstIterator it = setOfOffsets.constBegin();
-       it != setOfOffsets.constEnd(); ++it )
-  {
-    *ptr = *it;
-    ptr++;
-  }
+  dict.findArticleOffsetsForFTS( offsets, isCancelled );
 
   if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
     return;
 
-  setOfOffsets.clear();
-
   dict.sortArticlesOffsetsForFTS( offsets, isCancelled );
 
   if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
@@ -1187,8 +1157,6 @@ void FTSResultsRequest::run()
 
         ftsIdxHeader = ftsIdx.read< FtsIdxHeader >();
 
-        wordsInIndex = ftsIdxHeader.wordCount;
-
         ftsIndex.openIndex( BtreeIndexing::IndexInfo( ftsIdxHeader.indexBtreeMaxElements,
                                                       ftsIdxHeader.indexRootOffset ),
                             ftsIdx, dict.getFtsMutex() );
@@ -22,7 +22,7 @@ namespace FtsHelpers
 enum
 {
   FtsSignature = 0x58535446, // FTSX on little-endian, XSTF on big-endian
-  CurrentFtsFormatVersion = 2 + BtreeIndexing::FormatVersion,
+  CurrentFtsFormatVersion = 2 + BtreeIndexing::FormatVersion + ChunkedStorage::PreferredCodec,
 };
 
 #pragma pack(push,1)
@@ -95,7 +95,6 @@ class FTSResultsRequest : public Dictionary::DataRequest
   bool hasCJK;
   bool ignoreWordsOrder;
   bool ignoreDiacritics;
-  int wordsInIndex;
 
   QAtomicInt isCancelled;
   QSemaphore hasExited;
@@ -138,8 +137,7 @@ public:
     maxResults( maxResults_ ),
     hasCJK( false ),
     ignoreWordsOrder( ignoreWordsOrder_ ),
-    ignoreDiacritics( ignoreDiacritics_ ),
-    wordsInIndex( 0 )
+    ignoreDiacritics( ignoreDiacritics_ )
   {
     if( ignoreDiacritics_ )
       searchString = gd::toQString( Folding::applyDiacriticsOnly( gd::toWString( searchString_ ) ) );
@@ -439,7 +439,6 @@ class GlsDictionary: public BtreeIndexing::BtreeDictionary
   IdxHeader idxHeader;
   dictData * dz;
   ChunkedStorage::Reader chunks;
-  Mutex dzMutex;
   Mutex resourceZipMutex;
   IndexedZip resourceZip;
   string dictionaryName;
@@ -693,8 +692,8 @@ void GlsDictionary::loadArticleText( uint32_t address,
                                      vector< string > & headwords,
                                      string & articleText )
 {
-  vector< char > chunk;
-  char * articleProps;
+  QByteArray chunk;
+  char const * articleProps;
   {
     Mutex::Lock _( idxMutex );
 
@@ -707,13 +706,9 @@ void GlsDictionary::loadArticleText( uint32_t address,
   memcpy( &articleSize, articleProps + sizeof( articleOffset ),
           sizeof( articleSize ) );
 
-  char * articleBody;
+  char dzError[ DICT_ERROR_STRING_SIZE ];
 
-  {
-    Mutex::Lock _( dzMutex );
-
-    articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-  }
+  char * articleBody = dict_data_read_r( dz, articleOffset, articleSize, dzError );
 
   headwords.clear();
   articleText.clear();
@@ -721,7 +716,7 @@ void GlsDictionary::loadArticleText( uint32_t address,
 
   if ( !articleBody )
   {
-    articleText = string( "\n\tDICTZIP error: " ) + dict_error_str( dz );
+    articleText = string( "\n\tDICTZIP error: " ) + dzError;
   }
   else
   {
@@ -1209,16 +1204,7 @@ void GlsArticleRequest::run()
   }
   try
   {
-    vector< WordArticleLink > chain = dict.findArticles( word, ignoreDiacritics );
-
-    for( unsigned x = 0; x < alts.size(); ++x )
-    {
-      /// Make an additional query for each alt
-
-      vector< WordArticleLink > altChain = dict.findArticles( alts[ x ], ignoreDiacritics );
-
-      chain.insert( chain.end(), altChain.begin(), altChain.end() );
-    }
+    vector< WordArticleLink > chain = dict.findArticlesWithAlts( word, alts, ignoreDiacritics );
 
     multimap< wstring, pair< string, string > > mainArticles, alternateArticles;
 
@@ -321,11 +321,13 @@ HEADERS += folding.hh \
     externalaudioplayer.hh \
     externalviewer.hh \
     wordfinder.hh \
+    groupindex.hh \
     groupcombobox.hh \
     keyboardstate.hh \
     mouseover.hh \
     preferences.hh \
     mutex.hh \
+    sharedcache.hh \
     mediawiki.hh \
     sounddir.hh \
     hunspell.hh \
@@ -460,6 +462,7 @@ SOURCES += folding.cc \
     externalaudioplayer.cc \
     externalviewer.cc \
     wordfinder.cc \
+    groupindex.cc \
     groupcombobox.cc \
     keyboardstate.cc \
     mouseover.cc \
@@ -585,6 +588,11 @@ CONFIG( zim_support ) {
   LIBS += -llzma -lzstd
 }
 
+CONFIG( zstd_support ) {
+  DEFINES += MAKE_ZSTD_SUPPORT
+  LIBS += -lzstd
+}
+
 !CONFIG( no_extra_tiff_handler ) {
   DEFINES += MAKE_EXTRA_TIFF_HANDLER
   LIBS += -ltiff
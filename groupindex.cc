@@ -0,0 +1,763 @@
+/* This file is (c) 2008-2012 Konstantin Isakov <ikm@goldendict.org>
+ * Part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
+
+#include "groupindex.hh"
+#include "btreeidx.hh"
+#include "file.hh"
+#include "folding.hh"
+#include "utf8.hh"
+#include "fsencoding.hh"
+#include "config.hh"
+#include "gddebug.hh"
+
+#include <map>
+#include <string>
+#include <string.h>
+#include <QDir>
+#include <QFile>
+#include <QThreadPool>
+#include <QSemaphore>
+#include <QCryptographicHash>
+
+#include "qt4x5.hh"
+
+namespace GroupIndex {
+
+using std::string;
+using std::map;
+using BtreeIndexing::WordArticleLink;
+using BtreeIndexing::IndexInfo;
+
+namespace {
+
+enum
+{
+  Signature = 0x49505247, // GRPI on little-endian, IPRG on big-endian
+  CurrentFormatVersion = 2 + BtreeIndexing::SearchableFormatVersion
+};
+
+struct IdxHeader
+{
+  uint32_t signature; // First comes the signature, GRPI
+  uint32_t formatVersion; // File format version (CurrentFormatVersion)
+  char stamp[ 32 ]; // Md5 of the dictionaries' ids and their index identities, in hex
+  uint32_t dictionaryCount; // Number of the dictionaries merged
+  uint32_t linkCount; // Total number of links, for informative purposes only
+  uint32_t indexBtreeMaxElements; // Two fields from IndexInfo
+  uint32_t indexRootOffset;
+  uint32_t bitmapCount; // Number of the dictionary bitmaps
+  uint32_t bitmapsOffset; // The offset of the bitmaps in the file
+}
+#ifndef _MSC_VER
+__attribute__((packed))
+#endif
+;
+
+/// The index files are named after the ids of the dictionaries they merge,
+/// with this suffix, so they aren't mistaken for the dictionaries' ones
+char const IndexSuffix[] = "_GRP";
+
+bool indexIsOldOrBad( string const & indexFile, QByteArray const & stamp,
+                      uint32_t dictionaryCount )
+{
+  try
+  {
+    File::Class idx( indexFile, "rb" );
+
+    IdxHeader header;
+
+    return idx.readRecords( &header, sizeof( header ), 1 ) != 1 ||
+           header.signature != Signature ||
+           header.formatVersion != CurrentFormatVersion ||
+           header.dictionaryCount != dictionaryCount ||
+           (size_t) stamp.size() != sizeof( header.stamp ) ||
+           memcmp( header.stamp, stamp.constData(), sizeof( header.stamp ) ) != 0;
+  }
+  catch( File::exCantOpen & )
+  {
+    return true;
+  }
+}
+
+/// The number of the 32-bit words in a bitmap of the given number of the
+/// dictionaries
+size_t bitmapWords( size_t dictionaryCount )
+{ return ( dictionaryCount + 31 ) / 32; }
+
+/// The merged index itself. It's a dictionary only to be able to reuse the
+/// btree word search -- it has no articles. Each of its links stands for the
+/// same link found in one or more of the dictionaries, and its offset is the
+/// number of the bitmap of those dictionaries' ordinals.
+class MergedIndex: public BtreeIndexing::BtreeDictionary
+{
+  Mutex idxMutex;
+  File::Class idx;
+  IdxHeader idxHeader;
+  vector< uint32_t > bitmaps;
+
+public:
+
+  MergedIndex( string const & id, string const & indexFile );
+
+  /// Makes the mask to be passed to hasAnyOf() from the flags of the
+  /// dictionaries allowed, indexed by their ordinals
+  vector< uint32_t > makeMask( vector< char > const & allowed ) const;
+
+  /// Tells if any of the dictionaries of the given bitmap is in the mask
+  bool hasAnyOf( uint32_t bitmap, vector< uint32_t > const & mask ) const;
+
+  virtual string getName() throw()
+  { return "Merged group index"; }
+
+  virtual map< Dictionary::Property, string > getProperties() throw()
+  { return map< Dictionary::Property, string >(); }
+
+  virtual unsigned long getArticleCount() throw()
+  { return 0; }
+
+  virtual unsigned long getWordCount() throw()
+  { return idxHeader.linkCount; }
+
+  virtual sptr< Dictionary::DataRequest > getArticle( wstring const &,
+                                                      vector< wstring > const &,
+                                                      wstring const &,
+                                                      bool )
+    THROW_SPEC( std::exception )
+  { return new Dictionary::DataRequestInstant( false ); }
+};
+
+MergedIndex::MergedIndex( string const & id, string const & indexFile ):
+  BtreeDictionary( id, vector< string >() ),
+  idx( indexFile, "rb" ),
+  idxHeader( idx.read< IdxHeader >() )
+{
+  bitmaps.resize( (size_t) idxHeader.bitmapCount * bitmapWords( idxHeader.dictionaryCount ) );
+
+  if ( bitmaps.size() )
+  {
+    idx.seek( idxHeader.bitmapsOffset );
+    idx.read( &bitmaps.front(), bitmaps.size() * sizeof( uint32_t ) );
+  }
+
+  openIndex( IndexInfo( idxHeader.indexBtreeMaxElements,
+                        idxHeader.indexRootOffset ),
+                        idx, idxMutex );
+}
+
+vector< uint32_t > MergedIndex::makeMask( vector< char > const & allowed ) const
+{
+  vector< uint32_t > mask( bitmapWords( idxHeader.dictionaryCount ), 0 );
+
+  for( size_t x = 0; x < allowed.size() && x < idxHeader.dictionaryCount; ++x )
+    if ( allowed[ x ] )
+      mask[ x / 32 ] |= 1U << ( x % 32 );
+
+  return mask;
+}
+
+bool MergedIndex::hasAnyOf( uint32_t bitmap, vector< uint32_t > const & mask ) const
+{
+  if ( bitmap >= idxHeader.bitmapCount )
+    return false;
+
+  uint32_t const * words = &bitmaps.front() + (size_t) bitmap * mask.size();
+
+  for( size_t x = 0; x < mask.size(); ++x )
+    if ( words[ x ] & mask[ x ] )
+      return true;
+
+  return false;
+}
+
+class MergedWordSearchRunnable: public QRunnable
+{
+  BtreeIndexing::BtreeWordSearchRequest & r;
+  QSemaphore & hasExited;
+
+public:
+
+  MergedWordSearchRunnable( BtreeIndexing::BtreeWordSearchRequest & r_,
+                            QSemaphore & hasExited_ ): r( r_ ),
+                                                       hasExited( hasExited_ )
+  {}
+
+  ~MergedWordSearchRunnable()
+  {
+    hasExited.release();
+  }
+
+  virtual void run()
+  { r.run(); }
+};
+
+/// Searches the merged index, only accepting the links coming from the
+/// dictionaries allowed
+class MergedWordSearchRequest: public BtreeIndexing::BtreeWordSearchRequest
+{
+  sptr< Dictionary::Class > index; // Keeps the index alive during the search
+  MergedIndex & mergedIndex;
+  vector< uint32_t > mask;
+
+public:
+
+  MergedWordSearchRequest( Selection const & selection,
+                           wstring const & str_,
+                           unsigned minLength_,
+                           int maxSuffixVariation_,
+                           bool allowMiddleMatches_,
+                           unsigned long maxResults_ ):
+    BtreeWordSearchRequest( dynamic_cast< MergedIndex & >( *selection.index ),
+                            str_, minLength_, maxSuffixVariation_,
+                            allowMiddleMatches_, maxResults_, false ),
+    index( selection.index ),
+    mergedIndex( dynamic_cast< MergedIndex & >( *selection.index ) ),
+    mask( mergedIndex.makeMask( selection.allowed ) )
+  {
+    QThreadPool::globalInstance()->start(
+      new MergedWordSearchRunnable( *this, hasExited ) );
+  }
+
+  ~MergedWordSearchRequest()
+  {
+    // The search must be over before the index gets released. The base
+    // class waits for it once again, so the semaphore is given back.
+    isCancelled.ref();
+    hasExited.acquire();
+    hasExited.release();
+  }
+
+  virtual bool acceptLink( WordArticleLink const & link )
+  { return mergedIndex.hasAnyOf( link.articleOffset, mask ); }
+};
+
+/// Adds the links of each chain visited to the merged index being built,
+/// tagged with the ordinal of their dictionary
+class LinkCollector: public BtreeIndexing::ChainVisitor
+{
+  BtreeIndexing::SortedIndexedWords & indexedWords;
+  uint32_t ordinal;
+
+public:
+
+  LinkCollector( BtreeIndexing::SortedIndexedWords & indexedWords_,
+                 uint32_t ordinal_ ):
+    indexedWords( indexedWords_ ), ordinal( ordinal_ )
+  {}
+
+  virtual void visitChain( vector< WordArticleLink > const & chain );
+};
+
+void LinkCollector::visitChain( vector< WordArticleLink > const & chain )
+{
+  if ( chain.empty() )
+    return;
+
+  // All the links of a chain share the key, which is their word folded,
+  // exactly as the word search folds it
+
+  string key;
+
+  try
+  {
+    wstring head = Utf8::decode( chain[ 0 ].word );
+
+    wstring folded = Folding::apply( head );
+    if ( folded.empty() )
+      folded = Folding::applyWhitespaceOnly( head );
+
+    key = Utf8::encode( folded );
+  }
+  catch( Utf8::exCantDecode & )
+  {
+    return; // The word search wouldn't find it either
+  }
+
+  for( size_t x = 0; x < chain.size(); ++x )
+    indexedWords.addLink( key, chain[ x ].word, chain[ x ].prefix, ordinal );
+}
+
+/// Collapses the links of a chain which only differ in the dictionaries they
+/// come from into one. Its offset becomes the number of the bitmap of those
+/// dictionaries' ordinals. The same bitmaps are shared by all the chains.
+class LinkMerger: public BtreeIndexing::ChainFilter
+{
+  size_t words;
+  map< vector< uint32_t >, uint32_t > numbers;
+  vector< uint32_t > bitmaps;
+  uint32_t linkCount;
+
+public:
+
+  LinkMerger( size_t dictionaryCount ):
+    words( bitmapWords( dictionaryCount ) ), linkCount( 0 )
+  {}
+
+  virtual void filterChain( string const &, vector< WordArticleLink > & chain );
+
+  /// All the bitmaps, in the order of their numbers
+  vector< uint32_t > const & getBitmaps() const
+  { return bitmaps; }
+
+  uint32_t getBitmapCount() const
+  { return numbers.size(); }
+
+  /// The number of the links left
+  uint32_t getLinkCount() const
+  { return linkCount; }
+};
+
+void LinkMerger::filterChain( string const &, vector< WordArticleLink > & chain )
+{
+  vector< WordArticleLink > merged;
+  vector< vector< uint32_t > > mergedBitmaps;
+  map< std::pair< string, string >, size_t > positions;
+
+  for( size_t x = 0; x < chain.size(); ++x )
+  {
+    std::pair< map< std::pair< string, string >, size_t >::iterator, bool > inserted =
+      positions.insert( std::make_pair( std::make_pair( chain[ x ].word, chain[ x ].prefix ),
+                                        merged.size() ) );
+
+    if ( inserted.second )
+    {
+      merged.push_back( chain[ x ] );
+      mergedBitmaps.push_back( vector< uint32_t >( words, 0 ) );
+    }
+
+    uint32_t ordinal = chain[ x ].articleOffset;
+
+    mergedBitmaps[ inserted.first->second ][ ordinal / 32 ] |= 1U << ( ordinal % 32 );
+  }
+
+  for( size_t x = 0; x < merged.size(); ++x )
+  {
+    std::pair< map< vector< uint32_t >, uint32_t >::iterator, bool > inserted =
+      numbers.insert( std::make_pair( mergedBitmaps[ x ], (uint32_t) numbers.size() ) );
+
+    if ( inserted.second )
+      bitmaps.insert( bitmaps.end(), mergedBitmaps[ x ].begin(), mergedBitmaps[ x ].end() );
+
+    merged[ x ].articleOffset = inserted.first->second;
+  }
+
+  linkCount += merged.size();
+
+  chain.swap( merged );
+}
+
+/// Makes sure the merged index file is up to date, building it anew if not
+class BuildJob: public QRunnable
+{
+  vector< BtreeIndexing::BtreeDictionary * > dictionaries;
+  string indexFile;
+  QAtomicInt isCancelled, isDone;
+  bool succeeded;
+  vector< QString > indexIdentities;
+
+  bool build();
+
+public:
+
+  /// The dictionaries must outlive the job
+  BuildJob( vector< BtreeIndexing::BtreeDictionary * > const & dictionaries_,
+            string const & indexFile_ ):
+    dictionaries( dictionaries_ ), indexFile( indexFile_ ), succeeded( false )
+  { setAutoDelete( false ); }
+
+  virtual void run();
+
+  void cancel()
+  { isCancelled.ref(); }
+
+  bool isFinished()
+  { return Qt4x5::AtomicInt::loadAcquire( isDone ); }
+
+  /// Only valid once the job is finished
+  bool hasSucceeded() const
+  { return succeeded; }
+
+  /// The identities of the dictionaries' indices the index is up to date
+  /// with. Only valid once the job has succeeded.
+  vector< QString > const & getIndexIdentities() const
+  { return indexIdentities; }
+};
+
+void BuildJob::run()
+{
+  try
+  {
+    succeeded = build();
+  }
+  catch( std::exception & e )
+  {
+    gdWarning( "Merged group index building failed: %s\n", e.what() );
+  }
+
+  Qt4x5::AtomicInt::storeRelease( isDone, 1 );
+}
+
+bool BuildJob::build()
+{
+  // The index is up to date as long as the dictionaries, in their order,
+  // and their indices are the same
+
+  QCryptographicHash hash( QCryptographicHash::Md5 );
+
+  indexIdentities.clear();
+
+  for( size_t x = 0; x < dictionaries.size(); ++x )
+  {
+    if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+      return false;
+
+    if ( dictionaries[ x ]->ensureInitDone().size() )
+      return false; // The dictionary is unusable, and so is the index
+
+    string const & id = dictionaries[ x ]->getId();
+
+    indexIdentities.push_back( dictionaries[ x ]->getIndexIdentity() );
+
+    hash.addData( id.c_str(), id.size() + 1 );
+    hash.addData( indexIdentities.back().toUtf8() + '\n' );
+  }
+
+  QByteArray stamp = hash.result().toHex();
+
+  if ( indexIsOldOrBad( indexFile, stamp, dictionaries.size() ) )
+  {
+    gdDebug( "Building the merged group index %s\n", indexFile.c_str() );
+
+    string tempFile = indexFile + ".tmp";
+
+    try
+    {
+      File::Class idx( tempFile, "wb" );
+
+      IdxHeader idxHeader;
+
+      memset( &idxHeader, 0, sizeof( idxHeader ) );
+
+      // We write a dummy header first, and then rewrite it at the end
+      idx.write( idxHeader );
+
+      BtreeIndexing::SortedIndexedWords indexedWords;
+
+      for( size_t x = 0; x < dictionaries.size(); ++x )
+      {
+        LinkCollector collector( indexedWords, x );
+
+        dictionaries[ x ]->forEachChain( collector, &isCancelled );
+
+        if ( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+        {
+          idx.close();
+          QFile::remove( FsEncoding::decode( tempFile.c_str() ) );
+          return false;
+        }
+      }
+
+      LinkMerger merger( dictionaries.size() );
+
+      IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx,
+                                                     BtreeIndexing::SearchableFormatVersion,
+                                                     BtreeIndexing::NoExtraParts,
+                                                     &merger );
+
+      idxHeader.indexBtreeMaxElements = idxInfo.btreeMaxElements;
+      idxHeader.indexRootOffset = idxInfo.rootOffset;
+
+      idxHeader.bitmapCount = merger.getBitmapCount();
+      idxHeader.bitmapsOffset = idx.tell();
+
+      if ( merger.getBitmaps().size() )
+        idx.write( &merger.getBitmaps().front(),
+                   merger.getBitmaps().size() * sizeof( uint32_t ) );
+
+      idxHeader.signature = Signature;
+      idxHeader.formatVersion = CurrentFormatVersion;
+      idxHeader.dictionaryCount = dictionaries.size();
+      idxHeader.linkCount = merger.getLinkCount();
+      memcpy( idxHeader.stamp, stamp.constData(), sizeof( idxHeader.stamp ) );
+
+      idx.rewind();
+
+      idx.write( &idxHeader, sizeof( idxHeader ) );
+    }
+    catch( ... )
+    {
+      QFile::remove( FsEncoding::decode( tempFile.c_str() ) );
+      throw;
+    }
+
+    // The old index is replaced only once the new one is complete
+
+    QFile::remove( FsEncoding::decode( indexFile.c_str() ) );
+
+    if ( !QFile::rename( FsEncoding::decode( tempFile.c_str() ),
+                         FsEncoding::decode( indexFile.c_str() ) ) )
+    {
+      gdWarning( "Can't replace the merged group index %s\n", indexFile.c_str() );
+      QFile::remove( FsEncoding::decode( tempFile.c_str() ) );
+      return false;
+    }
+  }
+
+  return true;
+}
+
+struct Entry
+{
+  string id;
+  string indexFile;
+  map< string, size_t > ordinals; // Of the dictionaries, by their ids
+  vector< sptr< Dictionary::Class > > dictionaries; // Held while the job runs
+  sptr< BuildJob > job; // Set while the index is being built or opened
+  sptr< Dictionary::Class > index; // Set once the index is ready
+  vector< QString > indexIdentities; // The dictionaries' ones the index matches
+};
+
+typedef map< string, Entry > Entries;
+
+Entries entries;
+
+/// The builds go on in their own pool, so they don't hold up the searches
+QThreadPool & buildPool()
+{
+  static QThreadPool pool;
+
+  return pool;
+}
+
+/// Opens the index once its job has finished successfully
+void checkJob( Entry & entry )
+{
+  if ( !entry.job || !entry.job->isFinished() )
+    return;
+
+  if ( entry.job->hasSucceeded() )
+  {
+    try
+    {
+      entry.index = new MergedIndex( entry.id, entry.indexFile );
+      entry.indexIdentities = entry.job->getIndexIdentities();
+    }
+    catch( std::exception & e )
+    {
+      gdWarning( "Can't open the merged group index %s: %s\n",
+                 entry.indexFile.c_str(), e.what() );
+    }
+  }
+
+  entry.job.reset();
+  entry.dictionaries.clear();
+}
+
+void stopBuilds()
+{
+  for( Entries::iterator i = entries.begin(); i != entries.end(); ++i )
+    if ( i->second.job )
+      i->second.job->cancel();
+
+  buildPool().waitForDone();
+
+  // Some might have finished before being cancelled
+  for( Entries::iterator i = entries.begin(); i != entries.end(); ++i )
+    checkJob( i->second );
+}
+
+/// Makes the id of the merged index from the ids of its dictionaries
+string makeIndexId( vector< sptr< Dictionary::Class > > const & dictionaries )
+{
+  QCryptographicHash hash( QCryptographicHash::Md5 );
+
+  for( size_t x = 0; x < dictionaries.size(); ++x )
+  {
+    string id = dictionaries[ x ]->getId();
+
+    hash.addData( id.c_str(), id.size() + 1 );
+  }
+
+  return string( hash.result().toHex().data() ) + IndexSuffix;
+}
+
+/// Removes the files of the merged indices no longer used
+void removeStaleIndices()
+{
+  QDir indexDir( Config::getIndexDir() );
+
+  QStringList files = indexDir.entryList( QStringList( QString( "*" ) + IndexSuffix + "*" ),
+                                          QDir::Files );
+
+  for( QStringList::const_iterator i = files.constBegin(); i != files.constEnd(); ++i )
+    if ( entries.find( FsEncoding::encode( *i ) ) == entries.end() )
+      indexDir.remove( *i );
+}
+
+}
+
+void setGroups( Instances::Groups const & groups, bool enabled )
+{
+  // Whatever is being built is restarted below, if it's still needed
+  stopBuilds();
+
+  Entries newEntries;
+
+  if ( enabled )
+  {
+    string indexDir = FsEncoding::encode( Config::getIndexDir() );
+
+    for( size_t x = 0; x < groups.size(); ++x )
+    {
+      vector< sptr< Dictionary::Class > > dictionaries;
+      vector< BtreeIndexing::BtreeDictionary * > btreeDictionaries;
+
+      for( size_t y = 0; y < groups[ x ].dictionaries.size(); ++y )
+      {
+        BtreeIndexing::BtreeDictionary * dict =
+          dynamic_cast< BtreeIndexing::BtreeDictionary * >( groups[ x ].dictionaries[ y ].get() );
+
+        if ( dict && dict->searchesIndexOnly() )
+        {
+          dictionaries.push_back( groups[ x ].dictionaries[ y ] );
+          btreeDictionaries.push_back( dict );
+        }
+      }
+
+      if ( dictionaries.size() < 2 )
+        continue; // Nothing to merge
+
+      string id = makeIndexId( dictionaries );
+
+      if ( newEntries.find( id ) != newEntries.end() )
+        continue; // Another group has the same dictionaries
+
+      Entry & entry = newEntries[ id ];
+
+      // The id is made of the dictionaries' ids, so the index is still the
+      // same as long as their indices are. The dictionaries themselves might
+      // have been reloaded meanwhile.
+
+      Entries::iterator old = entries.find( id );
+
+      if ( old != entries.end() && old->second.index &&
+           old->second.indexIdentities.size() == btreeDictionaries.size() )
+      {
+        size_t y = 0;
+
+        while( y < btreeDictionaries.size() &&
+               btreeDictionaries[ y ]->getIndexIdentity() == old->second.indexIdentities[ y ] )
+          ++y;
+
+        if ( y == btreeDictionaries.size() )
+        {
+          entry = old->second;
+          continue;
+        }
+      }
+
+      entry.id = id;
+      entry.indexFile = indexDir + id;
+      entry.dictionaries = dictionaries;
+
+      for( size_t y = 0; y < dictionaries.size(); ++y )
+        entry.ordinals[ dictionaries[ y ]->getId() ] = y;
+
+      entry.job = new BuildJob( btreeDictionaries, entry.indexFile );
+    }
+  }
+
+  entries.swap( newEntries );
+  newEntries.clear(); // Releases the indices no longer needed
+
+  removeStaleIndices();
+
+  for( Entries::iterator i = entries.begin(); i != entries.end(); ++i )
+    if ( i->second.job )
+      buildPool().start( i->second.job.get() );
+}
+
+void clear()
+{
+  stopBuilds();
+
+  // The ready indices don't refer to the dictionaries, so they are kept for
+  // setGroups() to reuse
+
+  for( Entries::iterator i = entries.begin(); i != entries.end(); )
+    if ( i->second.index )
+      ++i;
+    else
+      entries.erase( i++ );
+}
+
+Selection select( vector< sptr< Dictionary::Class > > const & dictionaries,
+                  Dictionary::Features features, vector< char > & covered )
+{
+  Selection result;
+
+  covered.assign( dictionaries.size(), 0 );
+
+  Entry * best = 0;
+  size_t bestCount = 1; // Two dictionaries at least
+
+  for( Entries::iterator i = entries.begin(); i != entries.end(); ++i )
+  {
+    checkJob( i->second );
+
+    if ( !i->second.index )
+      continue;
+
+    size_t count = 0;
+
+    for( size_t x = 0; x < dictionaries.size(); ++x )
+      if ( i->second.ordinals.count( dictionaries[ x ]->getId() ) &&
+           ( dictionaries[ x ]->getFeatures() & features ) == features )
+        ++count;
+
+    if ( count > bestCount )
+    {
+      best = &i->second;
+      bestCount = count;
+    }
+  }
+
+  if ( !best )
+    return result;
+
+  result.index = best->index;
+  result.allowed.assign( best->indexIdentities.size(), 0 ); // One per dictionary
+
+  for( size_t x = 0; x < dictionaries.size(); ++x )
+  {
+    map< string, size_t >::const_iterator i =
+      best->ordinals.find( dictionaries[ x ]->getId() );
+
+    if ( i != best->ordinals.end() &&
+         ( dictionaries[ x ]->getFeatures() & features ) == features )
+    {
+      covered[ x ] = 1;
+      result.allowed[ i->second ] = 1;
+    }
+  }
+
+  return result;
+}
+
+sptr< Dictionary::WordSearchRequest > prefixMatch( Selection const & selection,
+                                                   wstring const & str,
+                                                   unsigned long maxResults )
+{
+  return new MergedWordSearchRequest( selection, str, 0, -1, true, maxResults );
+}
+
+sptr< Dictionary::WordSearchRequest > stemmedMatch( Selection const & selection,
+                                                    wstring const & str,
+                                                    unsigned minLength,
+                                                    unsigned maxSuffixVariation,
+                                                    unsigned long maxResults )
+{
+  return new MergedWordSearchRequest( selection, str, minLength, (int)maxSuffixVariation,
+                                      false, maxResults );
+}
+
+}
@@ -0,0 +1,68 @@
+/* This file is (c) 2008-2012 Konstantin Isakov <ikm@goldendict.org>
+ * Part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
+
+#ifndef __GROUPINDEX_HH_INCLUDED__
+#define __GROUPINDEX_HH_INCLUDED__
+
+#include "dictionary.hh"
+#include "instances.hh"
+
+/// Merged group indices. The btree indices of all the dictionaries of a group
+/// are merged into a single one, which maps each folded headword to the
+/// dictionaries having it. The prefix and stemmed searches then walk that one
+/// index per keystroke, instead of walking one index per dictionary.
+/// The indices are built in background, and are rebuilt once the group's
+/// dictionaries or any of their indices change. All the functions here are
+/// to be called from the GUI thread only.
+namespace GroupIndex {
+
+using std::vector;
+using gd::wstring;
+
+/// Makes the merged indices of the given groups available, opening the
+/// up-to-date ones and building the others in background. The indices of the
+/// groups no longer given are released. With 'enabled' false, all of them
+/// are released.
+void setGroups( Instances::Groups const &, bool enabled );
+
+/// Stops any builds in progress and releases the dictionaries they hold.
+/// This is to be done before the dictionaries get reloaded. The ready indices
+/// are kept, and setGroups() reuses them as long as the indices of their
+/// dictionaries stay the same.
+void clear();
+
+/// A merged index picked to stand in for some of the given dictionaries
+struct Selection
+{
+  sptr< Dictionary::Class > index; // 0 if there's none
+  vector< char > allowed; // Which of the dictionaries the index holds to match
+
+  bool empty() const
+  { return !index; }
+};
+
+/// Picks the ready merged index which holds the most of the given
+/// dictionaries having all the features given, two of them at least.
+/// 'covered' is set to flag the dictionaries the index stands in for, the
+/// others are to be searched on their own. The selection is empty if there's
+/// no such index.
+Selection select( vector< sptr< Dictionary::Class > > const &,
+                  Dictionary::Features, vector< char > & covered );
+
+/// Same as Dictionary::Class::prefixMatch(), done for all the dictionaries
+/// of the selection at once.
+sptr< Dictionary::WordSearchRequest > prefixMatch( Selection const &,
+                                                   wstring const &,
+                                                   unsigned long maxResults );
+
+/// Same as Dictionary::Class::stemmedMatch(), done for all the dictionaries
+/// of the selection at once.
+sptr< Dictionary::WordSearchRequest > stemmedMatch( Selection const &,
+                                                    wstring const &,
+                                                    unsigned minLength,
+                                                    unsigned maxSuffixVariation,
+                                                    unsigned long maxResults );
+
+}
+
+#endif
@@ -31,6 +31,9 @@
 #include "dictserver.hh"
 #include "slob.hh"
 #include "gls.hh"
+#include "btreeidx.hh"
+#include "chunkedstorage.hh"
+#include "dictzip.h"
 
 #ifndef NO_EPWING_SUPPORT
 #include "epwing.hh"
@@ -254,6 +257,18 @@ void loadDictionaries( QWidget * parent, bool showInitially,
 {
   dictionaries.clear();
 
+  // The caches are shared by all the dictionaries. The sizes are capped so
+  // the byte counts fit into an int.
+
+  BtreeIndexing::setNodeCacheSize( qMin( cfg.indexCacheSize, 1024U ) * 1024 * 1024 );
+  ChunkedStorage::setChunkCacheSize( qMin( cfg.articleCacheSize, 1024U ) * 1024 * 1024 );
+  dict_data_set_cache_size( qMin( cfg.dictzipCacheSize, 1024U ) * 1024 * 1024 );
+  Mdx::setRecordBlockCacheSize( qMin( cfg.mdxCacheSize, 1024U ) * 1024 * 1024 );
+#ifdef MAKE_ZIM_SUPPORT
+  Zim::setClusterCacheSize( qMin( cfg.zimCacheSize, 1024U ) * 1024 * 1024 );
+  Slob::setItemCacheSize( qMin( cfg.slobCacheSize, 1024U ) * 1024 * 1024 );
+#endif
+
   ::Initializing init( parent, showInitially );
 
   // Start a thread to load all the dictionaries
@@ -414,6 +429,11 @@ void loadDictionaries( QWidget * parent, bool showInitially,
          && i->size() == 36
          && ids.find( FsEncoding::encode( i->left( 32 ) ) ) == ids.end() )
       indexDir.remove( *i );
+    else
+    if ( i->endsWith( "_GZIDX" )
+         && i->size() == 38
+         && ids.find( FsEncoding::encode( i->left( 32 ) ) ) == ids.end() )
+      indexDir.remove( *i );
   }
 
   // Run deferred inits
@@ -219,16 +219,7 @@ sptr< Dictionary::DataRequest > LsaDictionary::getArticle( wstring const & word,
                                                            bool ignoreDiacritics )
   THROW_SPEC( std::exception )
 {
-  vector< WordArticleLink > chain = findArticles( word, ignoreDiacritics );
-
-  for( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-
-    vector< WordArticleLink > altChain = findArticles( alts[ x ], ignoreDiacritics );
-
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
+  vector< WordArticleLink > chain = findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   multimap< wstring, string > mainArticles, alternateArticles;
 
@@ -14,6 +14,7 @@
 #include "mruqmenu.hh"
 #include "gestures.hh"
 #include "dictheadwords.hh"
+#include "groupindex.hh"
 #include <limits.h>
 #include <QDebug>
 #include <QTextStream>
@@ -383,6 +384,7 @@ MainWindow::MainWindow( Config::Class & cfg_ ):
   buttonMenu->addMenu( ui.menu_Help );
 
   ui.fullTextSearchAction->setEnabled( cfg.preferences.fts.enabled );
+  ui.fuzzyWordListSearch->setChecked( cfg.preferences.fuzzyWordListSearch );
 
   menuButton = new QToolButton( navToolbar );
   menuButton->setPopupMode( QToolButton::InstantPopup );
@@ -1155,6 +1157,8 @@ MainWindow::~MainWindow()
 
   ftsIndexing.stopIndexing();
 
+  GroupIndex::clear();
+
 #if QT_VERSION >= QT_VERSION_CHECK(4, 6, 0)
   ui.centralWidget->ungrabGesture( Gestures::GDPinchGestureType );
   ui.centralWidget->ungrabGesture( Gestures::GDSwipeGestureType );
@@ -1565,6 +1569,8 @@ void MainWindow::updateGroupList()
   // found in case they got moved.
   Instances::updateNames( cfg, dictionaries );
 
+  GroupIndex::setGroups( groupInstances, cfg.preferences.mergedGroupIndices );
+
   groupList->fill( groupInstances );
   groupList->setCurrentGroup( cfg.lastMainGroupId );
   updateCurrentGroupProperty();
@@ -2267,6 +2273,9 @@ void MainWindow::editDictionaries( unsigned editDictionaryGroup )
   wordFinder.clear();
   dictionariesUnmuted.clear();
 
+  // The dictionaries might get reloaded
+  GroupIndex::clear();
+
   hideGDHelp();
 
   { // Limit existence of newCfg
@@ -2313,6 +2322,8 @@ void MainWindow::editDictionaries( unsigned editDictionaryGroup )
 
     updateSuggestionList();
   }
+  else
+    GroupIndex::setGroups( groupInstances, cfg.preferences.mergedGroupIndices );
 
   }
 
@@ -2361,6 +2372,7 @@ void MainWindow::editPreferences()
     p.hideMenubar = cfg.preferences.hideMenubar;
     p.searchInDock = cfg.preferences.searchInDock;
     p.alwaysOnTop = cfg.preferences.alwaysOnTop;
+    p.fuzzyWordListSearch = cfg.preferences.fuzzyWordListSearch;
 #ifndef Q_WS_X11
     p.trackClipboardChanges = cfg.preferences.trackClipboardChanges;
 #endif
@@ -2461,6 +2473,8 @@ void MainWindow::editPreferences()
 
     ui.fullTextSearchAction->setEnabled( cfg.preferences.fts.enabled );
 
+    GroupIndex::setGroups( groupInstances, cfg.preferences.mergedGroupIndices );
+
     Config::save( cfg );
   }
 
@@ -2574,7 +2588,11 @@ void MainWindow::updateSuggestionList( QString const & newValue )
 
   wordList->setCursor( Qt::WaitCursor );
 
-  wordFinder.prefixMatch( req, getActiveDicts() );
+  // The wildcards are only understood by the prefix search
+  if ( cfg.preferences.fuzzyWordListSearch && !Folding::hasWildcardSymbols( req ) )
+    wordFinder.fuzzyMatch( Folding::unescapeWildcardSymbols( req ), getActiveDicts() );
+  else
+    wordFinder.prefixMatch( req, getActiveDicts() );
 }
 
 void MainWindow::translateInputFinished( bool checkModifiers )
@@ -4215,6 +4233,7 @@ void MainWindow::on_rescanFiles_triggered()
   ftsIndexing.stopIndexing();
   ftsIndexing.clearDictionaries();
 
+  GroupIndex::clear();
   groupInstances.clear(); // Release all the dictionaries they hold
   dictionaries.clear();
   dictionariesUnmuted.clear();
@@ -4239,6 +4258,13 @@ void MainWindow::on_rescanFiles_triggered()
   updateSuggestionList();
 }
 
+void MainWindow::on_fuzzyWordListSearch_triggered( bool checked )
+{
+  cfg.preferences.fuzzyWordListSearch = checked;
+
+  updateSuggestionList();
+}
+
 void MainWindow::on_alwaysOnTop_triggered( bool checked )
 {
     cfg.preferences.alwaysOnTop = checked;
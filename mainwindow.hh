@@ -489,6 +489,7 @@ private slots:
   void on_exportHistory_triggered();
   void on_importHistory_triggered();
   void on_alwaysOnTop_triggered( bool checked );
+  void on_fuzzyWordListSearch_triggered( bool checked );
   void focusWordList();
 
   void on_exportFavorites_triggered();
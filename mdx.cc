@@ -18,6 +18,7 @@
 #include "filetype.hh"
 #include "ftshelpers.hh"
 #include "htmlescape.hh"
+#include "sharedcache.hh"
 
 #include <algorithm>
 #include <map>
@@ -37,6 +38,8 @@
 #include <QAtomicInt>
 #include <QTextDocument>
 #include <QCryptographicHash>
+#include <QMutex>
+#include <QMutexLocker>
 
 #if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
 #include <QRegularExpression>
@@ -65,7 +68,8 @@ using namespace Mdict;
 enum
 {
   kSignature = 0x4349444d,  // MDIC
-  kCurrentFormatVersion = 11 + BtreeIndexing::FormatVersion + Folding::Version
+  kCurrentFormatVersion = 11 + BtreeIndexing::FormatVersion + Folding::Version +
+                          ChunkedStorage::PreferredCodec
 };
 
 DEF_EX( exCorruptDictionary, "dictionary file was tampered or corrupted", std::exception )
@@ -106,6 +110,89 @@ __attribute__( ( packed ) )
 #endif
 ;
 
+/// A decompressed record block of an mdx or mdd file. Neighbouring records
+/// live in the same block, so looking up words one after another tends to
+/// ask for it again and again. Each block is guarded by its own mutex, so the
+/// threads asking for the same block at once wait for a single
+/// decompression.
+class RecordBlock
+{
+public:
+
+  QMutex mutex; // Guards all the rest
+
+  bool isRead; // Whether the block was read and decompressed yet
+  QByteArray data;
+
+  RecordBlock(): isRead( false )
+  {}
+
+  /// The memory taken by the block, used as its cost in the cache
+  int cost() const
+  { return data.size() + sizeof( *this ); }
+};
+
+/// The record blocks, shared by all the mdx and mdd files in the process
+SharedCache< RecordBlock > recordBlockCache( 32 * 1024 * 1024, 4 );
+
+void setRecordBlockCacheSize( int bytes )
+{
+  recordBlockCache.setMaxSize( bytes );
+}
+
+/// Returns the record block the given record lies in, reading it from the
+/// memory-mapped file given unless it's in the cache. The file is only
+/// mapped and read with the mutex given locked, the decompression is done
+/// with it unlocked. Returns false on failure.
+bool getRecordBlock( quint32 cacheId, QFile & file, Mutex & fileMutex,
+                     MdictParser::RecordInfo const & recordInfo, QByteArray & block )
+{
+  SharedCache< RecordBlock >::Ref cached =
+    recordBlockCache.get( cacheId, recordInfo.compressedBlockPos );
+
+  QMutexLocker _( &cached->mutex );
+
+  if ( !cached->isRead )
+  {
+    QByteArray compressedBlock;
+
+    {
+      Mutex::Lock _( fileMutex );
+
+      ScopedMemMap compressed( file, recordInfo.compressedBlockPos, recordInfo.compressedBlockSize );
+      if ( compressed.startAddress() )
+        compressedBlock = QByteArray( ( char const * )compressed.startAddress(),
+                                      recordInfo.compressedBlockSize );
+    }
+
+    if ( compressedBlock.isEmpty()
+         || !MdictParser::parseCompressedBlock( compressedBlock.size(), compressedBlock.constData(),
+                                                recordInfo.decompressedBlockSize, cached->data ) )
+    {
+      // Not cached, so that the next one asking tries again
+      cached->data.clear();
+      recordBlockCache.remove( cacheId, recordInfo.compressedBlockPos, cached );
+      return false;
+    }
+
+    cached->isRead = true;
+
+    recordBlockCache.update( cacheId, recordInfo.compressedBlockPos, cached );
+  }
+
+  // The data is shared rather than copied
+  block = cached->data;
+
+  return true;
+}
+
+/// Returns true if the record lies within the decompressed block
+inline bool recordFits( MdictParser::RecordInfo const & recordInfo, QByteArray const & block )
+{
+  return recordInfo.recordOffset >= 0 && recordInfo.recordSize >= 0
+         && recordInfo.recordOffset + recordInfo.recordSize <= block.size();
+}
+
 // A helper method to read resources from .mdd file
 class IndexedMdd: public BtreeIndexing::BtreeIndex
 {
@@ -114,13 +201,15 @@ class IndexedMdd: public BtreeIndexing::BtreeIndex
   ChunkedStorage::Reader & chunks;
   QFile mddFile;
   bool isFileOpen;
+  quint32 cacheId; // Keys the blocks of the file in the record block cache
 
 public:
 
   IndexedMdd( Mutex & idxMutex, ChunkedStorage::Reader & chunks ):
     idxMutex( idxMutex ),
     chunks( chunks ),
-    isFileOpen( false )
+    isFileOpen( false ),
+    cacheId( recordBlockCache.newFileId() )
   {}
 
   /// Opens the index. The values are those previously returned by buildIndex().
@@ -162,20 +251,17 @@ public:
       return false;
 
     MdictParser::RecordInfo indexEntry;
-    vector< char > chunk;
-    Mutex::Lock _( idxMutex );
-    const char * indexEntryPtr = chunks.getBlock( links[ 0 ].articleOffset, chunk );
-    memcpy( &indexEntry, indexEntryPtr, sizeof( indexEntry ) );
 
-    ScopedMemMap compressed( mddFile, indexEntry.compressedBlockPos, indexEntry.compressedBlockSize );
-    if ( !compressed.startAddress() )
     {
-      return false;
+      QByteArray chunk;
+      Mutex::Lock _( idxMutex );
+      const char * indexEntryPtr = chunks.getBlock( links[ 0 ].articleOffset, chunk );
+      memcpy( &indexEntry, indexEntryPtr, sizeof( indexEntry ) );
     }
 
     QByteArray decompressed;
-    if ( !MdictParser::parseCompressedBlock( indexEntry.compressedBlockSize, ( char * )compressed.startAddress(),
-                                             indexEntry.decompressedBlockSize, decompressed ) )
+    if ( !getRecordBlock( cacheId, mddFile, fileMutex, indexEntry, decompressed )
+         || !recordFits( indexEntry, decompressed ) )
     {
       return false;
     }
@@ -196,6 +282,7 @@ class MdxDictionary: public BtreeIndexing::BtreeDictionary
   string encoding;
   ChunkedStorage::Reader chunks;
   QFile dictFile;
+  quint32 cacheId; // Keys the blocks of the file in the record block cache
   vector< sptr< IndexedMdd > > mddResources;
   MdictParser::StyleSheets styleSheets;
 
@@ -304,6 +391,7 @@ MdxDictionary::MdxDictionary( string const & id, string const & indexFile,
   idx( indexFile, "rb" ),
   idxHeader( idx.read< IdxHeader >() ),
   chunks( idx, idxHeader.chunksOffset ),
+  cacheId( recordBlockCache.newFileId() ),
   deferredInitRunnableStarted( false )
 {
   // Read the dictionary's name
@@ -628,14 +716,7 @@ void MdxArticleRequest::run()
     return;
   }
 
-  vector< WordArticleLink > chain = dict.findArticles( word, ignoreDiacritics );
-
-  for ( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-    vector< WordArticleLink > altChain = dict.findArticles( alts[ x ], ignoreDiacritics );
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
+  vector< WordArticleLink > chain = dict.findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   // Some synonims make it that the articles appear several times. We combat this
   // by only allowing them to appear once.
@@ -967,8 +1048,8 @@ const QString & MdxDictionary::getDescription()
   else
   {
     Mutex::Lock _( idxMutex );
-    vector< char > chunk;
-    char * dictDescription = chunks.getBlock( idxHeader.descriptionAddress, chunk );
+    QByteArray chunk;
+    char const * dictDescription = chunks.getBlock( idxHeader.descriptionAddress, chunk );
     string str( dictDescription );
     dictionaryDescription = QString::fromUtf8( str.c_str(), str.size() );
   }
@@ -998,25 +1079,25 @@ void MdxDictionary::loadIcon() throw()
 
 void MdxDictionary::loadArticle( uint32_t offset, string & articleText, bool noFilter )
 {
-  vector< char > chunk;
-  Mutex::Lock _( idxMutex );
-
   // Load record info from index
   MdictParser::RecordInfo recordInfo;
-  char * pRecordInfo = chunks.getBlock( offset, chunk );
-  memcpy( &recordInfo, pRecordInfo, sizeof( recordInfo ) );
+
+  {
+    QByteArray chunk;
+    Mutex::Lock _( idxMutex );
+    char const * pRecordInfo = chunks.getBlock( offset, chunk );
+    memcpy( &recordInfo, pRecordInfo, sizeof( recordInfo ) );
+  }
 
   // Make a sub unique id for this article
   QString articleId;
-  articleId.setNum( ( quint64 )pRecordInfo, 16 );
-
-  ScopedMemMap compressed( dictFile, recordInfo.compressedBlockPos, recordInfo.compressedBlockSize );
-  if ( !compressed.startAddress() )
-    throw exCorruptDictionary();
+  articleId.setNum( offset, 16 );
 
+  // The dict file is guarded by idxMutex too, which is only held while
+  // reading it
   QByteArray decompressed;
-  if ( !MdictParser::parseCompressedBlock( recordInfo.compressedBlockSize, ( char * )compressed.startAddress(),
-                                           recordInfo.decompressedBlockSize, decompressed ) )
+  if ( !getRecordBlock( cacheId, dictFile, idxMutex, recordInfo, decompressed )
+       || !recordFits( recordInfo, decompressed ) )
     throw exCorruptDictionary();
 
   QString article = MdictParser::toUtf16( encoding.c_str(),
@@ -1681,7 +1762,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries( vector< string > const & f
       // This map maps folded words to the original words and the corresponding
       // articles' offsets.
       IndexedWords indexedWords;
-      ChunkedStorage::Writer chunks( idx );
+      ChunkedStorage::Writer chunks( idx, ChunkedStorage::PreferredCodec );
 
       idxHeader.isRightToLeft = parser.isRightToLeft();
 
@@ -16,6 +16,11 @@ vector< sptr< Dictionary::Class > > makeDictionaries( vector< string > const & f
                                                       string const & indicesDir,
                                                       Dictionary::Initializing & ) THROW_SPEC( std::exception );
 
+/// Sets the memory budget, in bytes, of the cache of decompressed record
+/// blocks which is shared by all the mdx and mdd files. Zero disables the
+/// cache.
+void setRecordBlockCacheSize( int bytes );
+
 }
 
 #endif // __MDX_HH_INCLUDED__
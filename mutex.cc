@@ -12,3 +12,15 @@ Mutex::Lock::~Lock()
 {
   m.unlock();
 }
+
+Mutex::OptionalLock::OptionalLock( Mutex * m_ ): m( m_ )
+{
+  if ( m )
+    m->lock();
+}
+
+Mutex::OptionalLock::~OptionalLock()
+{
+  if ( m )
+    m->unlock();
+}
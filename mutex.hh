@@ -31,6 +31,21 @@ public:
   private:
     Lock( Lock const & );
   };
+
+  /// Locks the given mutex, if any, on construction and unlocks it on
+  /// destruction
+  class OptionalLock
+  {
+    Mutex * m;
+
+  public:
+
+    explicit OptionalLock( Mutex * );
+    ~OptionalLock();
+
+  private:
+    OptionalLock( OptionalLock const & );
+  };
 };
 
 #endif
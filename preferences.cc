@@ -221,6 +221,8 @@ Preferences::Preferences( QWidget * parent, Config::Class & cfg_ ):
 
   ui.synonymSearchEnabled->setChecked( p.synonymSearchEnabled );
 
+  ui.mergedGroupIndices->setChecked( p.mergedGroupIndices );
+
   ui.maxDictsInContextMenu->setValue( p.maxDictionaryRefsInContextMenu );
 
   // Different platforms have different keys available
@@ -446,6 +448,8 @@ Config::Preferences Preferences::getPreferences()
 
   p.synonymSearchEnabled = ui.synonymSearchEnabled->isChecked();
 
+  p.mergedGroupIndices = ui.mergedGroupIndices->isChecked();
+
   p.maxDictionaryRefsInContextMenu = ui.maxDictsInContextMenu->text().toInt();
 
   p.pronounceOnLoadMain = ui.pronounceOnLoadMain->isChecked();
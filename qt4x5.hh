@@ -51,6 +51,15 @@ inline int loadAcquire( QAtomicInt const & ref )
 #endif
 }
 
+inline void storeRelease( QAtomicInt & ref, int value )
+{
+#if IS_QT_5
+  ref.storeRelease( value );
+#else
+  ref.fetchAndStoreRelease( value );
+#endif
+}
+
 }
 
 namespace Url
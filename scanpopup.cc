@@ -821,7 +821,11 @@ void ScanPopup::updateSuggestionList( QString const & text )
 
   ui.translateBox->wordList()->setCursor( Qt::WaitCursor );
 
-  wordFinder.prefixMatch( req, getActiveDicts() );
+  // The wildcards are only understood by the prefix search
+  if ( cfg.preferences.fuzzyWordListSearch && !Folding::hasWildcardSymbols( req ) )
+    wordFinder.fuzzyMatch( Folding::unescapeWildcardSymbols( req ), getActiveDicts() );
+  else
+    wordFinder.prefixMatch( req, getActiveDicts() );
 }
 
 void ScanPopup::translateInputFinished()
@@ -0,0 +1,176 @@
+/* This file is (c) 2008-2012 Konstantin Isakov <ikm@goldendict.org>
+ * Part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
+
+#ifndef __SHAREDCACHE_HH_INCLUDED__
+#define __SHAREDCACHE_HH_INCLUDED__
+
+#include <QAtomicInt>
+#include <QCache>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPair>
+
+/// A cache of the items decoded from the dictionary files, shared by all the
+/// files of a format in the process. The items are evicted in the
+/// least-recently-used order once the memory budget is exceeded, and the
+/// cache is split into several independently locked shards.
+///
+/// The cache hands out an empty item on a miss, and the caller fills it in.
+/// The Item is to have a mutex of its own for that, so the threads asking for
+/// the same item at once wait for a single decoding, and the int cost() const
+/// function giving the memory it takes.
+template< class Item >
+class SharedCache
+{
+  struct Node
+  {
+    Item item;
+    QAtomicInt refCount;
+
+    Node(): refCount( 1 )
+    {}
+  };
+
+public:
+
+  /// A reference to an item, which keeps it alive. Unlike sptr, it can be
+  /// copied and released from any thread.
+  class Ref
+  {
+    Node * node;
+
+    friend class SharedCache;
+
+    /// Takes over the reference held by the caller
+    explicit Ref( Node * node_ ): node( node_ )
+    {}
+
+  public:
+
+    Ref( Ref const & other ): node( other.node )
+    { node->refCount.ref(); }
+
+    ~Ref()
+    {
+      if( !node->refCount.deref() )
+        delete node;
+    }
+
+    Item * operator -> () const
+    { return &node->item; }
+
+    Item & operator * () const
+    { return node->item; }
+
+    bool operator == ( Ref const & other ) const
+    { return node == other.node; }
+
+  private:
+    Ref & operator = ( Ref const & );
+  };
+
+  SharedCache( int maxSize, int shards_ ):
+    shards( new Shard[ shards_ ] ), shardCount( shards_ ), lastFileId( 0 )
+  { setMaxSize( maxSize ); }
+
+  ~SharedCache()
+  { delete [] shards; }
+
+  /// Returns a new id to key the items of a file with
+  quint32 newFileId()
+  {
+    QMutexLocker _( &fileIdMutex );
+
+    return ++lastFileId;
+  }
+
+  /// Returns the item at the given position of the given file, which is
+  /// created empty if it isn't in the cache
+  Ref get( quint32 fileId, quint64 position )
+  {
+    Key key( fileId, position );
+    Shard & shard = shardFor( key );
+
+    QMutexLocker _( &shard.mutex );
+
+    Ref * cached = shard.cache.object( key );
+
+    if( cached )
+      return *cached;
+
+    Ref item( new Node );
+
+    shard.cache.insert( key, new Ref( item ), item->cost() );
+
+    return item;
+  }
+
+  /// Updates the cost of the item in the cache after it was filled in. The
+  /// caller must hold the mutex of the item.
+  void update( quint32 fileId, quint64 position, Ref const & item )
+  {
+    Key key( fileId, position );
+    Shard & shard = shardFor( key );
+
+    int cost = item->cost();
+
+    QMutexLocker _( &shard.mutex );
+
+    Ref * cached = shard.cache.object( key );
+
+    if( cached && !( *cached == item ) )
+      return; // Replaced by another one meanwhile
+
+    // If the item is larger than the whole shard, the cache deletes it at once
+    shard.cache.insert( key, new Ref( item ), cost );
+  }
+
+  /// Drops the item from the cache, unless it was replaced meanwhile
+  void remove( quint32 fileId, quint64 position, Ref const & item )
+  {
+    Key key( fileId, position );
+    Shard & shard = shardFor( key );
+
+    QMutexLocker _( &shard.mutex );
+
+    Ref * cached = shard.cache.object( key );
+
+    if( cached && *cached == item )
+      shard.cache.remove( key );
+  }
+
+  /// Sets the memory budget of the whole cache, in bytes
+  void setMaxSize( int bytes )
+  {
+    for( int x = 0; x < shardCount; ++x )
+    {
+      QMutexLocker _( &shards[ x ].mutex );
+
+      shards[ x ].cache.setMaxCost( bytes / shardCount );
+    }
+  }
+
+private:
+
+  typedef QPair< quint32, quint64 > Key;
+
+  struct Shard
+  {
+    QMutex mutex;
+    QCache< Key, Ref > cache;
+  };
+
+  Shard & shardFor( Key const & key )
+  { return shards[ ( key.first ^ key.second ^ ( key.second >> 32 ) ) % shardCount ]; }
+
+  Shard * shards;
+  int shardCount;
+
+  QMutex fileIdMutex;
+  quint32 lastFileId;
+
+  SharedCache( SharedCache const & );
+  SharedCache & operator = ( SharedCache const & );
+};
+
+#endif
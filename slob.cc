@@ -19,6 +19,7 @@
 #include "filetype.hh"
 #include "tiff.hh"
 #include "qt4x5.hh"
+#include "sharedcache.hh"
 
 #ifdef _MSC_VER
 #include <stub_msvc.h>
@@ -35,6 +36,8 @@
 #include <QProcess>
 #include <QVector>
 #include <QtAlgorithms>
+#include <QMutex>
+#include <QMutexLocker>
 
 #if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
 #include <QRegularExpression>
@@ -72,7 +75,7 @@ DEF_EX( exNoResource, "No resource found", Dictionary::Ex )
 enum
 {
   Signature = 0x58424C53, // SLBX on little-endian, XBLS on big-endian
-  CurrentFormatVersion = 2 + BtreeIndexing::FormatVersion + Folding::Version
+  CurrentFormatVersion = 6 + BtreeIndexing::SearchableFormatVersion + Folding::Version
 };
 
 struct IdxHeader
@@ -117,6 +120,35 @@ bool indexIsOldOrBad( string const & indexFile )
 }
 
 
+/// A decompressed store item of a slob file, holding the contents of several
+/// bins. Each item is guarded by its own mutex, so the threads asking for
+/// the same item at once wait for a single decompression.
+class StoreItem
+{
+public:
+
+  QMutex mutex; // Guards all the rest
+
+  bool isRead; // Whether the item was read and decompressed yet
+  string data; // Empty if the item is broken
+
+  StoreItem(): isRead( false )
+  {}
+
+  /// The memory taken by the item, used as its cost in the cache
+  int cost() const
+  { return data.size() + sizeof( *this ); }
+};
+
+/// The store items, shared by all the slob files in the process. There are
+/// fewer shards than for zim clusters, since the items are larger.
+SharedCache< StoreItem > itemCache( 64 * 1024 * 1024, 4 );
+
+void setItemCacheSize( int bytes )
+{
+  itemCache.setMaxSize( bytes );
+}
+
 class SlobFile
 {
 public:
@@ -139,9 +171,8 @@ private:
   quint64 storeOffset, fileSize, refsOffset;
   quint32 refsCount, itemsCount;
   quint64 itemsOffset, itemsDataOffset;
-  quint32 currentItem;
   quint32 contentTypesCount;
-  string currentItemData;
+  quint32 cacheId; // Keys the items of the file in the item cache
   RefOffsetsVector refsOffsetVector;
 
   QString readTinyText();
@@ -161,8 +192,8 @@ public:
   , itemsCount( 0 )
   , itemsOffset( 0 )
   , itemsDataOffset( 0 )
-  , currentItem( 0xFFFFFFFF )
   , contentTypesCount( 0 )
+  , cacheId( itemCache.newFileId() )
   {}
 
   ~SlobFile();
@@ -208,7 +239,19 @@ public:
 
   void getRefEntry(quint32 ref_nom, RefEntry & entry );
 
-  quint8 getItem( RefEntry const & entry, string * data );
+  /// Returns the content type id of the bin of the entry, or 0xFF if it's
+  /// broken. If data isn't 0, the bin is read into it. The decompressed
+  /// store items are kept in a cache shared by all the files. If the file is
+  /// shared between threads, 'fileMutex' is to be the mutex guarding it. It
+  /// must not be held by the caller, since it's only locked to read the
+  /// file, while the decompression is done with it unlocked.
+  quint8 getItem( RefEntry const & entry, string * data, Mutex * fileMutex = 0 );
+
+private:
+
+  /// Reads and decompresses the store item at the given offset of the file
+  /// into the result, which is left empty on failure
+  void readStoreItem( quint64 offset, string & result, Mutex * fileMutex );
 };
 
 SlobFile::~SlobFile()
@@ -470,35 +513,105 @@ void SlobFile::getRefEntry( quint32 ref_nom, RefEntry & entry )
   throw exCantReadFile( string( error.toUtf8().data() ) );
 }
 
-quint8 SlobFile::getItem( RefEntry const & entry, string * data )
+void SlobFile::readStoreItem( quint64 offset, string & result, Mutex * fileMutex )
+{
+  QByteArray compressedData;
+
+  {
+    Mutex::OptionalLock _( fileMutex );
+
+    quint32 length, length_be;
+    if( !file.seek( offset )
+        || file.read( ( char * )&length_be, sizeof( length_be ) ) != sizeof( length_be ) )
+    {
+      QString error = fileName + ": " + file.errorString();
+      throw exCantReadFile( string( error.toUtf8().data() ) );
+    }
+    length = qFromBigEndian( length_be );
+
+    compressedData = file.read( length );
+
+    if( (quint32)compressedData.size() != length )
+    {
+      QString error = fileName + ": " + file.errorString();
+      throw exCantReadFile( string( error.toUtf8().data() ) );
+    }
+  }
+
+  if( compression == NONE )
+    result = string( compressedData.data(), compressedData.length() );
+  else
+  if( compression == ZLIB )
+    result = decompressZlib( compressedData.data(), compressedData.length() );
+  else
+  if( compression == BZ2 )
+    result = decompressBzip2( compressedData.data(), compressedData.length() );
+  else
+    result = decompressLzma2( compressedData.data(), compressedData.length(), true );
+}
+
+/// Copies the given bin of the decompressed store item into the result.
+/// Returns false if the item is broken.
+static bool getBin( string const & item, quint32 bins, quint16 binIndex,
+                    string & result )
+{
+  const char * ptr = item.c_str();
+  quint64 pos = binIndex * sizeof( quint32 );
+
+  if( pos + sizeof( quint32 ) > item.length() )
+    return false;
+
+  quint32 offset, offset_be;
+  memcpy( &offset_be, ptr + pos, sizeof( offset_be ) );
+  offset = qFromBigEndian( offset_be );
+
+  pos = bins * sizeof( quint32 ) + (quint64)offset;
+
+  if( pos + sizeof( quint32 ) > item.length() )
+    return false;
+
+  quint32 length, len_be;
+  memcpy( &len_be, ptr + pos, sizeof( len_be ) );
+  length = qFromBigEndian( len_be );
+
+  result = item.substr( pos + sizeof( len_be ), length );
+
+  return true;
+}
+
+quint8 SlobFile::getItem( RefEntry const & entry, string * data, Mutex * fileMutex )
 {
   quint64 pos = itemsOffset + entry.itemIndex * sizeof( quint64 );
   quint64 offset, tmp;
+  quint32 bins, bins_be;
+  QVector< quint8 > ids;
 
   for( ; ; )
   {
-    // Read item data types
+    {
+      Mutex::OptionalLock _( fileMutex );
 
-    if( !file.seek( pos ) || file.read( ( char * )&tmp, sizeof( tmp ) ) != sizeof( tmp ) )
-      break;
+      // Read item data types
 
-    offset = qFromBigEndian( tmp ) + itemsDataOffset;
+      if( !file.seek( pos ) || file.read( ( char * )&tmp, sizeof( tmp ) ) != sizeof( tmp ) )
+        break;
 
-    if( !file.seek( offset ) )
-      break;
+      offset = qFromBigEndian( tmp ) + itemsDataOffset;
 
-    quint32 bins, bins_be;
-    if( file.read( ( char * )&bins_be, sizeof( bins_be ) ) != sizeof( bins_be ) )
-      break;
-    bins = qFromBigEndian( bins_be );
+      if( !file.seek( offset ) )
+        break;
 
-    if( entry.binIndex >= bins )
-      return 0xFF;
+      if( file.read( ( char * )&bins_be, sizeof( bins_be ) ) != sizeof( bins_be ) )
+        break;
+      bins = qFromBigEndian( bins_be );
 
-    QVector< quint8 > ids;
-    ids.resize( bins );
-    if( file.read( ( char * )ids.data(), bins ) != bins )
-      break;
+      if( entry.binIndex >= bins )
+        return 0xFF;
+
+      ids.resize( bins );
+      if( file.read( ( char * )ids.data(), bins ) != bins )
+        break;
+    }
 
     quint8 id = ids[ entry.binIndex ];
 
@@ -507,61 +620,27 @@ quint8 SlobFile::getItem( RefEntry const & entry, string * data )
 
     if( data != 0 )
     {
-      // Read item data
-      if( currentItem != entry.itemIndex )
-      {
-        currentItemData.clear();
-        quint32 length, length_be;
-        if( file.read( ( char * )&length_be, sizeof( length_be ) ) != sizeof( length_be ) )
-          break;
-        length = qFromBigEndian( length_be );
-
-        QByteArray compressedData = file.read( length );
-
-        if( compression == NONE )
-          currentItemData = string( compressedData.data(), compressedData.length() );
-        else
-        if( compression == ZLIB )
-          currentItemData = decompressZlib( compressedData.data(), length );
-        else
-        if( compression == BZ2 )
-          currentItemData = decompressBzip2( compressedData.data(), length );
-        else
-          currentItemData = decompressLzma2( compressedData.data(), length, true );
-
-        if( currentItemData.empty() )
-        {
-          currentItem = 0xFFFFFFFF;
-          return 0xFF;
-        }
-        currentItem = entry.itemIndex;
-      }
+      // Read item data, which follows the content type ids. The other bins
+      // of the item are usually asked for soon, so it's kept decompressed
+      // in the cache.
 
-      // Find bin data inside item
+      SharedCache< StoreItem >::Ref item = itemCache.get( cacheId, entry.itemIndex );
 
-      const char * ptr = currentItemData.c_str();
-      quint32 pos = entry.binIndex * sizeof( quint32 );
+      QMutexLocker _( &item->mutex );
 
-      if( pos >= currentItemData.length() - sizeof( quint32 ) )
-        return 0xFF;
-
-      quint32 offset, offset_be;
-      memcpy( &offset_be, ptr + pos, sizeof( offset_be ) );
-      offset = qFromBigEndian( offset_be );
+      if( !item->isRead )
+      {
+        readStoreItem( offset + sizeof( bins_be ) + bins, item->data, fileMutex );
+        item->isRead = true;
 
-      pos = bins * sizeof( quint32 ) + offset;
+        itemCache.update( cacheId, entry.itemIndex, item );
+      }
 
-      if( pos >= currentItemData.length() - sizeof( quint32 ) )
+      if( !getBin( item->data, bins, entry.binIndex, *data ) )
         return 0xFF;
-
-      quint32 length, len_be;
-      memcpy( &len_be, ptr + pos, sizeof( len_be ) );
-      length = qFromBigEndian( len_be );
-
-      *data = currentItemData.substr( pos + sizeof( len_be ), length );
     }
 
-    return ids[ entry.binIndex ];
+    return id;
   }
   QString error = fileName + ": " + file.errorString();
   throw exCantReadFile( string( error.toUtf8().data() ) );
@@ -1102,13 +1181,14 @@ quint32 SlobDictionary::readArticle( quint32 articleNumber, std::string & result
   string data;
   quint8 contentId;
 
+  if( entry.key.isEmpty() )
   {
     Mutex::Lock _( slobMutex );
-    if( entry.key.isEmpty() )
-      sf.getRefEntry( articleNumber, entry );
-    contentId = sf.getItem( entry, &data );
+    sf.getRefEntry( articleNumber, entry );
   }
 
+  contentId = sf.getItem( entry, &data, &slobMutex );
+
   if( contentId == 0xFF )
     return 0xFFFFFFFF;
 
@@ -1172,20 +1252,19 @@ void SlobDictionary::makeFTSIndex( QAtomicInt & isCancelled, bool firstIteration
 
     ftsIdx.write( ftsIdxHeader );
 
-    ChunkedStorage::Writer chunks( ftsIdx );
+    ChunkedStorage::Writer chunks( ftsIdx, ChunkedStorage::PreferredCodec );
 
     BtreeIndexing::IndexedWords indexedWords;
 
-    QSet< uint32_t > setOfOffsets;
-    setOfOffsets.reserve( getWordCount() );
+    QVector< uint32_t > indexedOffsets;
 
-    findArticleLinks( 0, &setOfOffsets, 0, &isCancelled );
+    findArticleOffsets( indexedOffsets, &isCancelled );
 
     if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
       throw exUserAbort();
 
     QVector< uint32_t > offsets;
-    offsets.reserve( setOfOffsets.size() );
+    offsets.reserve( indexedOffsets.size() );
 
     slobMutex.lock();
     SlobFile::RefOffsetsVector const & sortedOffsets = sf.getSortedRefOffsets();
@@ -1194,13 +1273,14 @@ void SlobDictionary::makeFTSIndex( QAtomicInt & isCancelled, bool firstIteration
     qint32 entries = sf.getRefsCount();
     for( qint32 i = 0; i < entries; i++ )
     {
-      if( setOfOffsets.find( sortedOffsets[ i ].second ) != setOfOffsets.end() )
+      if( std::binary_search( indexedOffsets.constBegin(), indexedOffsets.constEnd(),
+                              sortedOffsets[ i ].second ) )
         offsets.append( sortedOffsets[ i ].second );
     }
 
     // Free memory
     sf.clearRefOffsets();
-    setOfOffsets.clear();
+    indexedOffsets.clear();
 
     if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
       throw exUserAbort();
@@ -1430,16 +1510,7 @@ void SlobArticleRequest::run()
     return;
   }
 
-  vector< WordArticleLink > chain = dict.findArticles( word, ignoreDiacritics );
-
-  for( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-
-    vector< WordArticleLink > altChain = dict.findArticles( alts[ x ], ignoreDiacritics );
-
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
+  vector< WordArticleLink > chain = dict.findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   multimap< wstring, pair< string, string > > mainArticles, alternateArticles;
 
@@ -1695,6 +1766,123 @@ sptr< Dictionary::DataRequest > SlobDictionary::getResource( string const & name
 }
 
 
+/// Collects the headwords and the resources of a slob file, see
+/// BtreeIndexing::ParallelCollector. The refs are collected in the order of
+/// their offsets, and with several parts, each of them reads the refs
+/// through a file of its own.
+class RefCollector: public BtreeIndexing::ParallelCollector
+{
+public:
+
+  RefCollector( SlobFile & file_, QString const & fileName_,
+                SlobFile::RefOffsetsVector const & offsets_,
+                unsigned maxHeadwordsToExpand_ ):
+    file( file_ ), fileName( fileName_ ), offsets( offsets_ ),
+    maxHeadwordsToExpand( maxHeadwordsToExpand_ ), parts( 0 )
+  {}
+
+  /// The number of the distinct articles, since several refs may point
+  /// to the same one
+  quint32 getArticleCount();
+
+  quint32 getWordCount() const;
+
+protected:
+
+  virtual void prepare( size_t parts_ )
+  {
+    parts = parts_;
+    articlesPos.assign( parts, set< quint64 >() );
+    wordCounts.assign( parts, 0 );
+  }
+
+  virtual void collect( size_t part, uint32_t begin, uint32_t end,
+                        BtreeIndexing::SortedIndexedWords & indexedWords,
+                        BtreeIndexing::SortedIndexedWords & indexedResources );
+
+private:
+
+  SlobFile & file;
+  QString fileName;
+  SlobFile::RefOffsetsVector const & offsets;
+  unsigned maxHeadwordsToExpand;
+
+  size_t parts;
+  vector< set< quint64 > > articlesPos; // By parts
+  vector< quint32 > wordCounts; // By parts
+};
+
+quint32 RefCollector::getArticleCount()
+{
+  for( size_t x = 1; x < articlesPos.size(); ++x )
+  {
+    articlesPos[ 0 ].insert( articlesPos[ x ].begin(), articlesPos[ x ].end() );
+    articlesPos[ x ].clear();
+  }
+
+  return articlesPos.empty() ? 0 : articlesPos[ 0 ].size();
+}
+
+quint32 RefCollector::getWordCount() const
+{
+  quint32 result = 0;
+
+  for( size_t x = 0; x < wordCounts.size(); ++x )
+    result += wordCounts[ x ];
+
+  return result;
+}
+
+void RefCollector::collect( size_t part, uint32_t begin, uint32_t end,
+                            BtreeIndexing::SortedIndexedWords & indexedWords,
+                            BtreeIndexing::SortedIndexedWords & indexedResources )
+{
+  sptr< SlobFile > ownFile;
+  SlobFile * sf = &file;
+
+  if( parts > 1 )
+  {
+    ownFile = new SlobFile;
+    ownFile->open( fileName );
+    sf = ownFile.get();
+  }
+
+  quint32 entries = sf->getRefsCount();
+  set< quint64 > & partArticlesPos = articlesPos[ part ];
+  quint32 wordCount = 0;
+  RefEntry refEntry;
+
+  for( quint32 i = begin; i < end; i++ )
+  {
+    sf->getRefEntryAtOffset( offsets[ i ].first, refEntry );
+
+    quint8 type = sf->getItem( refEntry, 0 );
+
+    QString contentType = sf->getContentType( type );
+
+    if( contentType.startsWith( "text/html", Qt::CaseInsensitive )
+        || contentType.startsWith( "text/plain", Qt::CaseInsensitive ) )
+    {
+      //Article
+      if( maxHeadwordsToExpand && entries > maxHeadwordsToExpand )
+        indexedWords.addSingleWord( gd::toWString( refEntry.key ), offsets[ i ].second );
+      else
+        indexedWords.addWord( gd::toWString( refEntry.key ), offsets[ i ].second );
+
+      wordCount += 1;
+
+      quint64 pos = ( ( (quint64)refEntry.itemIndex ) << 32 ) + refEntry.binIndex;
+      partArticlesPos.insert( pos );
+    }
+    else
+    {
+      indexedResources.addSingleWord( gd::toWString( refEntry.key ), offsets[ i ].second );
+    }
+  }
+
+  wordCounts[ part ] = wordCount;
+}
+
 vector< sptr< Dictionary::Class > > makeDictionaries(
                                       vector< string > const & fileNames,
                                       string const & indicesDir,
@@ -1744,53 +1932,30 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
           idx.write( idxHeader );
 
-          RefEntry refEntry;
           quint32 entries = sf.getRefsCount();
 
-          IndexedWords indexedWords, indexedResources;
+          BtreeIndexing::SortedIndexedWords indexedWords, indexedResources;
 
-          set< quint64 > articlesPos;
           quint32 articleCount = 0, wordCount = 0;
 
-          SlobFile::RefOffsetsVector const & offsets = sf.getSortedRefOffsets();
-
-          for( quint32 i = 0; i < entries; i++ )
           {
-            sf.getRefEntryAtOffset( offsets[ i ].first, refEntry );
+            RefCollector collector( sf, firstName, sf.getSortedRefOffsets(),
+                                    maxHeadwordsToExpand );
 
-            quint8 type = sf.getItem( refEntry, 0 );
-
-            QString contentType = sf.getContentType( type );
-
-            if( contentType.startsWith( "text/html", Qt::CaseInsensitive )
-                || contentType.startsWith( "text/plain", Qt::CaseInsensitive ) )
-            {
-              //Article
-              if( maxHeadwordsToExpand && entries > maxHeadwordsToExpand )
-                indexedWords.addSingleWord( gd::toWString( refEntry.key ), offsets[ i ].second );
-              else
-                indexedWords.addWord( gd::toWString( refEntry.key ), offsets[ i ].second );
+            collector.run( entries, indexedWords, indexedResources );
 
-              wordCount += 1;
-
-              quint64 pos = ( ( (quint64)refEntry.itemIndex ) << 32 ) + refEntry.binIndex;
-              if( articlesPos.find( pos ) == articlesPos.end() )
-              {
-                articleCount += 1;
-                articlesPos.insert( pos );
-              }
-            }
-            else
-            {
-              indexedResources.addSingleWord( gd::toWString( refEntry.key ), offsets[ i ].second );
-            }
+            articleCount = collector.getArticleCount();
+            wordCount = collector.getWordCount();
           }
+
           sf.clearRefOffsets();
 
           // Build index
 
           {
-            IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx );
+            IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx,
+                                                           BtreeIndexing::SearchableFormatVersion,
+                                                           BtreeIndexing::WithOffsetMap );
 
             idxHeader.indexBtreeMaxElements = idxInfo.btreeMaxElements;
             idxHeader.indexRootOffset = idxInfo.rootOffset;
@@ -1799,7 +1964,8 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
           }
 
           {
-            IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedResources, idx );
+            IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedResources, idx,
+                                                           BtreeIndexing::SearchableFormatVersion );
 
             idxHeader.resourceIndexBtreeMaxElements = idxInfo.btreeMaxElements;
             idxHeader.resourceIndexRootOffset = idxInfo.rootOffset;
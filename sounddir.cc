@@ -130,16 +130,7 @@ sptr< Dictionary::DataRequest > SoundDirDictionary::getArticle( wstring const &
                                                                 bool ignoreDiacritics )
   THROW_SPEC( std::exception )
 {
-  vector< WordArticleLink > chain = findArticles( word, ignoreDiacritics );
-
-  for( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-
-    vector< WordArticleLink > altChain = findArticles( alts[ x ], ignoreDiacritics );
-
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
+  vector< WordArticleLink > chain = findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   // maps to the chain number
   multimap< wstring, unsigned > mainArticles, alternateArticles;
@@ -185,8 +176,8 @@ sptr< Dictionary::DataRequest > SoundDirDictionary::getArticle( wstring const &
   multimap< wstring, uint32_t >::const_iterator i;
 
   string displayedName;
-  vector< char > chunk;
-  char * nameBlock;
+  QByteArray chunk;
+  char const * nameBlock;
 
   result += "<table class=\"lsa_play\">";
   for( i = mainArticles.begin(); i != mainArticles.end(); ++i )
@@ -200,15 +191,16 @@ sptr< Dictionary::DataRequest > SoundDirDictionary::getArticle( wstring const &
         Mutex::Lock _( idxMutex );
         nameBlock = chunks.getBlock( chain[ i->second ].articleOffset, chunk );
 
-        if ( nameBlock >= &chunk.front() + chunk.size() )
+        if ( nameBlock >= chunk.constData() + chunk.size() )
         {
           // chunks reader thinks it's okay since zero-sized records can exist,
           // but we don't allow that.
           throw ChunkedStorage::exAddressOutOfRange();
         }
 
-        chunk.back() = 0; // It must end with 0 anyway, but just in case
-        displayedName = string( nameBlock );
+        // It must end with 0 anyway, but just in case
+        displayedName = string( nameBlock,
+                                qstrnlen( nameBlock, chunk.constData() + chunk.size() - nameBlock ) );
       }
       catch(  ChunkedStorage::exAddressOutOfRange & )
       {
@@ -244,15 +236,16 @@ sptr< Dictionary::DataRequest > SoundDirDictionary::getArticle( wstring const &
         Mutex::Lock _( idxMutex );
         nameBlock = chunks.getBlock( chain[ i->second ].articleOffset, chunk );
 
-        if ( nameBlock >= &chunk.front() + chunk.size() )
+        if ( nameBlock >= chunk.constData() + chunk.size() )
         {
           // chunks reader thinks it's okay since zero-sized records can exist,
           // but we don't allow that.
           throw ChunkedStorage::exAddressOutOfRange();
         }
 
-        chunk.back() = 0; // It must end with 0 anyway, but just in case
-        displayedName = string( nameBlock );
+        // It must end with 0 anyway, but just in case
+        displayedName = string( nameBlock,
+                                qstrnlen( nameBlock, chunk.constData() + chunk.size() - nameBlock ) );
       }
       catch(  ChunkedStorage::exAddressOutOfRange & )
       {
@@ -315,8 +308,8 @@ sptr< Dictionary::DataRequest > SoundDirDictionary::getResource( string const &
   if ( !isNumber )
     return new Dictionary::DataRequestInstant( false ); // No such resource
 
-  vector< char > chunk;
-  char * articleData;
+  QByteArray chunk;
+  char const * articleData;
 
   try
   {
@@ -324,7 +317,7 @@ sptr< Dictionary::DataRequest > SoundDirDictionary::getResource( string const &
 
     articleData = chunks.getBlock( articleOffset, chunk );
 
-    if ( articleData >= &chunk.front() + chunk.size() )
+    if ( articleData >= chunk.constData() + chunk.size() )
     {
       // chunks reader thinks it's okay since zero-sized records can exist,
       // but we don't allow that.
@@ -337,11 +330,12 @@ sptr< Dictionary::DataRequest > SoundDirDictionary::getResource( string const &
     return new Dictionary::DataRequestInstant( false ); // No such resource
   }
 
-  chunk.back() = 0; // It must end with 0 anyway, but just in case
+  // It must end with 0 anyway, but just in case
+  int articleSize = qstrnlen( articleData, chunk.constData() + chunk.size() - articleData );
 
   QDir dir( QDir::fromNativeSeparators( FsEncoding::decode( getDictionaryFilenames()[ 0 ].c_str() ) ) );
 
-  QString fileName = QDir::toNativeSeparators( dir.filePath( QString::fromUtf8( articleData ) ) );
+  QString fileName = QDir::toNativeSeparators( dir.filePath( QString::fromUtf8( articleData, articleSize ) ) );
 
   // Now try loading that file
 
@@ -97,7 +97,8 @@ struct Ifo
 enum
 {
   Signature = 0x58444953, // SIDX on little-endian, XDIS on big-endian
-  CurrentFormatVersion = 9 + BtreeIndexing::FormatVersion + Folding::Version
+  CurrentFormatVersion = 10 + BtreeIndexing::FormatVersion + Folding::Version +
+                         ChunkedStorage::PreferredCodec
 };
 
 struct IdxHeader
@@ -142,7 +143,6 @@ class StardictDictionary: public BtreeIndexing::BtreeDictionary
   string bookName;
   string sameTypeSequence;
   ChunkedStorage::Reader chunks;
-  Mutex dzMutex;
   dictData * dz;
   Mutex resourceZipMutex;
   IndexedZip resourceZip;
@@ -328,11 +328,11 @@ void StardictDictionary::getArticleProps( uint32_t articleAddress,
                                           string & headword,
                                           uint32_t & offset, uint32_t & size )
 {
-  vector< char > chunk;
+  QByteArray chunk;
 
   Mutex::Lock _( idxMutex );
 
-  char * articleData = chunks.getBlock( articleAddress, chunk );
+  char const * articleData = chunks.getBlock( articleAddress, chunk );
 
   memcpy( &offset, articleData, sizeof( uint32_t ) );
   articleData += sizeof( uint32_t );
@@ -987,19 +987,15 @@ void StardictDictionary::loadArticle( uint32_t address,
 
   getArticleProps( address, headword, offset, size );
 
-  char * articleBody;
+  char dzError[ DICT_ERROR_STRING_SIZE ];
 
-  {
-    Mutex::Lock _( dzMutex );
-
-    // Note that the function always zero-pads the result.
-    articleBody = dict_data_read_( dz, offset, size, 0, 0 );
-  }
+  // Note that the function always zero-pads the result.
+  char * articleBody = dict_data_read_r( dz, offset, size, dzError );
 
   if ( !articleBody )
   {
 //    throw exCantReadFile( getDictionaryFilenames()[ 2 ] );
-    articleText = string( "<div class=\"sdict_m\">DICTZIP error: " ) + dict_error_str( dz ) + "</div>";
+    articleText = string( "<div class=\"sdict_m\">DICTZIP error: " ) + dzError + "</div>";
     return;
   }
 
@@ -1474,16 +1470,7 @@ void StardictArticleRequest::run()
 
   try
   {
-    vector< WordArticleLink > chain = dict.findArticles( word, ignoreDiacritics );
-
-    for( unsigned x = 0; x < alts.size(); ++x )
-    {
-      /// Make an additional query for each alt
-
-      vector< WordArticleLink > altChain = dict.findArticles( alts[ x ], ignoreDiacritics );
-
-      chain.insert( chain.end(), altChain.begin(), altChain.end() );
-    }
+    vector< WordArticleLink > chain = dict.findArticlesWithAlts( word, alts, ignoreDiacritics );
 
     multimap< wstring, pair< string, string > > mainArticles, alternateArticles;
 
@@ -2202,7 +2189,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
         IndexedWords indexedWords;
 
-        ChunkedStorage::Writer chunks( idx );
+        ChunkedStorage::Writer chunks( idx, ChunkedStorage::PreferredCodec );
 
         // Load indices
         if ( !ifo.synwordcount )
@@ -2229,7 +2216,9 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
         // Build index
 
-        IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx );
+        IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx,
+                                                       BtreeIndexing::FormatVersion,
+                                                       BtreeIndexing::WithTrigramIndex );
 
         idxHeader.indexBtreeMaxElements = idxInfo.btreeMaxElements;
         idxHeader.indexRootOffset = idxInfo.rootOffset;
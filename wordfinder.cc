@@ -4,8 +4,10 @@
 #include "wordfinder.hh"
 #include "folding.hh"
 #include "wstring_qt.hh"
+#include "groupindex.hh"
 #include <QThreadPool>
 #include <map>
+#include <algorithm>
 #include "gddebug.hh"
 
 using std::vector;
@@ -86,6 +88,35 @@ void WordFinder::stemmedMatch( QString const & str,
     startSearch();
 }
 
+void WordFinder::fuzzyMatch( QString const & str,
+                             std::vector< sptr< Dictionary::Class > > const & dicts,
+                             unsigned maxDistance,
+                             unsigned long maxResults,
+                             Dictionary::Features features )
+{
+  cancel();
+
+  searchQueued = true;
+  searchType = FuzzyMatch;
+  inputWord = str;
+  inputDicts = &dicts;
+  requestedMaxResults = maxResults;
+  requestedFeatures = features;
+
+  // Allow a single edit for the words of up to four letters. More edits
+  // would match nearly every short headword.
+  size_t length = Folding::apply( gd::toWString( str ) ).size();
+
+  fuzzyMaxDistance = length <= 4 ? std::min( maxDistance, 1u ) : maxDistance;
+
+  resultsArray.clear();
+  resultsIndex.clear();
+  searchResults.clear();
+
+  if ( queuedRequests.empty() )
+    startSearch();
+}
+
 void WordFinder::expressionMatch( QString const & str,
                                   std::vector< sptr< Dictionary::Class > > const & dicts,
                                   unsigned long maxResults,
@@ -140,10 +171,46 @@ void WordFinder::startSearch()
     allWordWritings.insert( allWordWritings.end(), writings.begin(), writings.end() );
   }
 
-  // Query each dictionary for all word writings
+  // The dictionaries a merged group index holds are queried through it, all
+  // at once. The merged indices don't do the fuzzy matching though.
+
+  vector< char > covered( inputDicts->size() );
+  GroupIndex::Selection merged;
+
+  if ( searchType != FuzzyMatch )
+    merged = GroupIndex::select( *inputDicts, requestedFeatures, covered );
+
+  if ( !merged.empty() )
+  {
+    for( size_t y = 0; y < allWordWritings.size(); ++y )
+    {
+      try
+      {
+        sptr< Dictionary::WordSearchRequest > sr =
+          ( searchType == PrefixMatch || searchType == ExpressionMatch ) ?
+            GroupIndex::prefixMatch( merged, allWordWritings[ y ], requestedMaxResults ) :
+            GroupIndex::stemmedMatch( merged, allWordWritings[ y ], stemmedMinLength, stemmedMaxSuffixVariation, requestedMaxResults );
+
+        connect( sr.get(), SIGNAL( finished() ),
+                 this, SLOT( requestFinished() ), Qt::QueuedConnection );
+
+        queuedRequests.push_back( sr );
+      }
+      catch( std::exception & e )
+      {
+        gdWarning( "Word \"%s\" search error (%s) in the merged group index\n",
+                   inputWord.toUtf8().data(), e.what() );
+      }
+    }
+  }
+
+  // Query each of the other dictionaries for all word writings
 
   for( size_t x = 0; x < inputDicts->size(); ++x )
   {
+    if ( covered[ x ] )
+      continue;
+
     if ( ( (*inputDicts)[ x ]->getFeatures() & requestedFeatures ) != requestedFeatures )
       continue;
 
@@ -154,6 +221,8 @@ void WordFinder::startSearch()
         sptr< Dictionary::WordSearchRequest > sr =
           ( searchType == PrefixMatch || searchType == ExpressionMatch ) ?
             (*inputDicts)[ x ]->prefixMatch( allWordWritings[ y ], requestedMaxResults ) :
+          searchType == FuzzyMatch ?
+            (*inputDicts)[ x ]->fuzzyMatch( allWordWritings[ y ], fuzzyMaxDistance, requestedMaxResults ) :
             (*inputDicts)[ x ]->stemmedMatch( allWordWritings[ y ], stemmedMinLength, stemmedMaxSuffixVariation, requestedMaxResults );
 
         connect( sr.get(), SIGNAL( finished() ),
@@ -358,6 +427,11 @@ void WordFinder::updateResults()
 
         insertResult.first->second = --resultsArray.end();
       }
+
+      // The fuzzy matches are ranked by their distances, which the
+      // dictionaries store negated as the weights
+      if ( searchType == FuzzyMatch && insertResult.first->second->rank > -weight )
+        insertResult.first->second->rank = -weight;
     }
     finishedRequests.erase( i++ );
   }
@@ -484,6 +558,14 @@ void WordFinder::updateResults()
       
       resultsArray.sort( SortByRankAndLength() );
 
+      maxSearchResults = 15;
+    }
+    else
+    if( searchType == FuzzyMatch )
+    {
+      // The closest matches go first, the shorter ones of them first
+      resultsArray.sort( SortByRankAndLength() );
+
       maxSearchResults = 15;
     }
   }
@@ -42,12 +42,14 @@ private:
   {
     PrefixMatch,
     StemmedMatch,
-    ExpressionMatch
+    ExpressionMatch,
+    FuzzyMatch
   } searchType;
   unsigned long requestedMaxResults;
   Dictionary::Features requestedFeatures;
   unsigned stemmedMinLength;
   unsigned stemmedMaxSuffixVariation;
+  unsigned fuzzyMaxDistance;
 
   std::vector< sptr< Dictionary::Class > > const * inputDicts;
 
@@ -95,6 +97,17 @@ public:
                      unsigned long maxResults = 30,
                      Dictionary::Features = Dictionary::NoFeatures );
   
+  /// Do a fuzzy-match search in the given list of dictionaries, finding the
+  /// headwords which are at most maxDistance edits away from the word. The
+  /// distance allowed is lowered for the short words, which would match too
+  /// much otherwise. The results are ordered by their distances. All comments
+  /// from prefixMatch() generally apply as well.
+  void fuzzyMatch( QString const &,
+                   std::vector< sptr< Dictionary::Class > > const &,
+                   unsigned maxDistance = 2,
+                   unsigned long maxResults = 30,
+                   Dictionary::Features = Dictionary::NoFeatures );
+
   /// Do the expression-match search in the given list of dictionaries.
   /// Function find exact matches for one of spelling suggestions.
   void expressionMatch( QString const &,
@@ -72,7 +72,8 @@ DEF_EX_STR( exDictzipError, "DICTZIP error", Dictionary::Ex )
 enum
 {
   Signature = 0x46584458, // XDXF on little-endian, FXDX on big-endian
-  CurrentFormatVersion = 5 + BtreeIndexing::FormatVersion + Folding::Version
+  CurrentFormatVersion = 6 + BtreeIndexing::FormatVersion + Folding::Version +
+                         ChunkedStorage::PreferredCodec
 };
 
 enum ArticleFormat
@@ -132,7 +133,6 @@ class XdxfDictionary: public BtreeIndexing::BtreeDictionary
   File::Class idx;
   IdxHeader idxHeader;
   sptr< ChunkedStorage::Reader > chunks;
-  Mutex dzMutex;
   dictData * dz;
   Mutex resourceZipMutex;
   IndexedZip resourceZip;
@@ -225,7 +225,7 @@ XdxfDictionary::XdxfDictionary( string const & id,
 
   if ( idxHeader.nameSize )
   {
-    vector< char > chunk;
+    QByteArray chunk;
 
     dictionaryName = string( chunks->getBlock( idxHeader.nameAddress, chunk ),
                              idxHeader.nameSize );
@@ -240,13 +240,15 @@ XdxfDictionary::XdxfDictionary( string const & id,
     throw exDictzipError( string( dz_error_str( error ) )
                           + "(" + dictionaryFiles[ 0 ] + ")" );
 
+  dict_data_load_gzip_index( dz, ( indexFile + "_GZIDX" ).c_str() );
+
   // Read the abrv, if any
 
   if ( idxHeader.hasAbrv )
   {
-    vector< char > chunk;
+    QByteArray chunk;
 
-    char * abrvBlock = chunks->getBlock( idxHeader.abrvAddress, chunk );
+    char const * abrvBlock = chunks->getBlock( idxHeader.abrvAddress, chunk );
 
     uint32_t total;
     memcpy( &total, abrvBlock, sizeof( uint32_t ) );
@@ -258,7 +260,7 @@ XdxfDictionary::XdxfDictionary( string const & id,
       memcpy( &keySz, abrvBlock, sizeof( uint32_t ) );
       abrvBlock += sizeof( uint32_t );
 
-      char * key = abrvBlock;
+      char const * key = abrvBlock;
 
       abrvBlock += keySz;
 
@@ -356,8 +358,8 @@ QString const& XdxfDictionary::getDescription()
     {
         try
         {
-            vector< char > chunk;
-            char * descr;
+            QByteArray chunk;
+            char const * descr;
             {
               Mutex::Lock _( idxMutex );
               descr = chunks->getBlock( idxHeader.descriptionAddress, chunk );
@@ -508,16 +510,7 @@ void XdxfArticleRequest::run()
     return;
   }
 
-  vector< WordArticleLink > chain = dict.findArticles( word, ignoreDiacritics );
-
-  for( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-
-    vector< WordArticleLink > altChain = dict.findArticles( alts[ x ], ignoreDiacritics );
-
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
+  vector< WordArticleLink > chain = dict.findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   multimap< wstring, pair< string, string > > mainArticles, alternateArticles;
 
@@ -636,9 +629,9 @@ void XdxfDictionary::loadArticle( uint32_t address,
 {
   // Read the properties
 
-  vector< char > chunk;
+  QByteArray chunk;
 
-  char * propertiesData;
+  char const * propertiesData;
 
   {
     Mutex::Lock _( idxMutex );
@@ -646,7 +639,7 @@ void XdxfDictionary::loadArticle( uint32_t address,
     propertiesData = chunks->getBlock( address, chunk );
   }
 
-  if ( &chunk.front() + chunk.size() - propertiesData < 9 )
+  if ( chunk.constData() + chunk.size() - propertiesData < 9 )
   {
     articleText = string( "<div class=\"xdxf\">Index seems corrupted</div>" );
     return;
@@ -661,19 +654,15 @@ void XdxfDictionary::loadArticle( uint32_t address,
 
   // Load the article
 
-  char * articleBody;
+  char dzError[ DICT_ERROR_STRING_SIZE ];
 
-  {
-    Mutex::Lock _( dzMutex );
-
-    // Note that the function always zero-pads the result.
-    articleBody = dict_data_read_( dz, articleOffset, articleSize, 0, 0 );
-  }
+  // Note that the function always zero-pads the result.
+  char * articleBody = dict_data_read_r( dz, articleOffset, articleSize, dzError );
 
   if ( !articleBody )
   {
 //    throw exCantReadFile( getDictionaryFilenames()[ 0 ] );
-      articleText = string( "<div class=\"xdxf\">DICTZIP error: " ) + dict_error_str( dz ) + "</div>";
+      articleText = string( "<div class=\"xdxf\">DICTZIP error: " ) + dzError + "</div>";
     return;
   }
 
@@ -689,7 +678,8 @@ class GzippedFile: public QIODevice
 
 public:
 
-  GzippedFile( char const * fileName ) THROW_SPEC( exCantReadFile );
+  /// The random access index, if given, is used to read the plain gzip files
+  GzippedFile( char const * fileName, char const * gzipIndexFileName = 0 ) THROW_SPEC( exCantReadFile );
 
   ~GzippedFile();
 
@@ -720,7 +710,7 @@ protected:
   { return -1; }
 };
 
-GzippedFile::GzippedFile( char const * fileName ) THROW_SPEC( exCantReadFile )
+GzippedFile::GzippedFile( char const * fileName, char const * gzipIndexFileName ) THROW_SPEC( exCantReadFile )
 {
   gz = gd_gzopen( fileName );
   if ( !gz )
@@ -728,6 +718,9 @@ GzippedFile::GzippedFile( char const * fileName ) THROW_SPEC( exCantReadFile )
 
   DZ_ERRORS error;
   dz = dict_data_open( fileName, &error, 0 );
+
+  if ( dz && gzipIndexFileName )
+    dict_data_load_gzip_index( dz, gzipIndexFileName );
 }
 
 GzippedFile::~GzippedFile()
@@ -1213,7 +1206,19 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
         IndexedWords indexedWords;
 
-        GzippedFile gzFile( dictFiles[ 0 ].c_str() );
+        // A plain gzip file, not a dictzip one, needs a random access index
+        // for its articles to be read
+
+        string gzipIndexFile = indexFile + "_GZIDX";
+
+        DZ_ERRORS gzipIndexError = dict_gzip_index_make( dictFiles[ 0 ].c_str(),
+                                                         gzipIndexFile.c_str(),
+                                                         DICT_GZIP_INDEX_SPAN );
+        if ( gzipIndexError != DZ_NOERROR )
+          gdWarning( "Xdxf: Failed building the random access index for \"%s\", reason: %s\n",
+                     dictFiles[ 0 ].c_str(), dz_error_str( gzipIndexError ) );
+
+        GzippedFile gzFile( dictFiles[ 0 ].c_str(), gzipIndexFile.c_str() );
 
         if ( !gzFile.open( QIODevice::ReadOnly ) )
           throw exCantReadFile( dictFiles[ 0 ] );
@@ -1222,7 +1227,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
         QString dictionaryName, dictionaryDescription;
 
-        ChunkedStorage::Writer chunks( idx );
+        ChunkedStorage::Writer chunks( idx, ChunkedStorage::PreferredCodec );
 
         // Wait for the first element, which must be xdxf
 
@@ -20,6 +20,7 @@
 #include "ftshelpers.hh"
 #include "htmlescape.hh"
 #include "splitfile.hh"
+#include "sharedcache.hh"
 
 #ifdef _MSC_VER
 #include <stub_msvc.h>
@@ -35,6 +36,8 @@
 #include <QImage>
 #include <QDir>
 #include <QDebug>
+#include <QMutex>
+#include <QMutexLocker>
 
 #if QT_VERSION >= QT_VERSION_CHECK( 5, 0, 0 )
 #include <QRegularExpression>
@@ -47,8 +50,6 @@
 
 namespace Zim {
 
-#define CACHE_SIZE 3
-
 using std::string;
 using std::map;
 using std::vector;
@@ -56,6 +57,7 @@ using std::multimap;
 using std::pair;
 using std::set;
 using gd::wstring;
+using gd::wchar;
 
 using BtreeIndexing::WordArticleLink;
 using BtreeIndexing::IndexedWords;
@@ -129,7 +131,15 @@ __attribute__((packed))
 enum
 {
   Signature = 0x584D495A, // ZIMX on little-endian, XMIZ on big-endian
-  CurrentFormatVersion = 3 + BtreeIndexing::FormatVersion + Folding::Version
+  CurrentFormatVersion = 9 + BtreeIndexing::SearchableFormatVersion + Folding::Version
+};
+
+enum
+{
+  /// The zim files having at least that many directory entries are looked
+  /// up through their own title-ordered lists rather than a btree index,
+  /// which would take too long and too much memory to build for them
+  NativeTitleIndexMinEntries = 1000000
 };
 
 struct IdxHeader
@@ -146,6 +156,10 @@ struct IdxHeader
   quint32 descriptionPtr;
   quint32 langFrom;  // Source language
   quint32 langTo;    // Target language
+  quint32 nativeTitleIndex; // Non-zero if the titles are looked up through
+                            // the title-ordered list of the zim file, and
+                            // the resources by their urls. Both btree
+                            // indices are then empty.
 }
 #ifndef _MSC_VER
 __attribute__((packed))
@@ -154,26 +168,142 @@ __attribute__((packed))
 
 #pragma pack( pop )
 
+/// A directory entry, as read by ZimFile::readEntry()
+struct DirEntry
+{
+  quint16 mimetype; // 0xFFFF for redirects
+  char nameSpace;
+  quint32 redirectIndex; // Only for redirects
+  string url, title;
+
+  /// The title the entry is listed under, which is the url for the entries
+  /// having no title
+  string const & listedTitle() const
+  { return title.empty() ? url : title; }
+};
+
 // Class for support of split zim files
 
-struct Cache
-{
-  char * data;
-  quint32 clusterNumber;
-  int stamp;
-  int count, size;
-  unsigned blobs_offset_size;
-
-  Cache() :
-    data( 0 ),
-    clusterNumber( 0 ),
-    stamp( -1 ),
-    count( 0 ),
-    size( 0 ),
-    blobs_offset_size( 0 )
+/// A cluster of a zim file. It's decompressed lazily, only as far as needed
+/// for the blobs asked for so far, and the decoder state is kept to go on
+/// from there once a later blob is asked for. Each cluster is guarded by its
+/// own mutex, so the threads asking for the same cluster at once wait for a
+/// single decompression.
+class Cluster
+{
+public:
+
+  QMutex mutex; // Guards all the rest
+
+  bool isRead; // Whether the compressed data was read from the file yet
+  unsigned blobsOffsetSize;
+  QByteArray data; // Decompressed so far
+  sptr< IncrementalDecompressor > decompressor; // 0 once all is decompressed
+
+  Cluster(): isRead( false ), blobsOffsetSize( 0 )
   {}
+
+  /// Appends the given blob to the result. Returns false if there's no such
+  /// blob, or if the cluster is broken.
+  bool getBlob( quint32 blobNumber, string & result );
+
+  /// Whether the cluster has more than one blob, or it isn't known yet. The
+  /// clusters holding just one blob are not worth caching.
+  bool isCacheable();
+
+  /// The memory taken by the cluster, used as its cost in the cache
+  int cost() const
+  {
+    return data.size() + sizeof( *this ) +
+           ( decompressor ? decompressor->compressedSize() : 0 );
+  }
+
+private:
+
+  /// Decompresses at least the given amount of data, if there's that much.
+  /// Returns false if there isn't.
+  bool decompressTo( quint64 size );
+
+  quint64 getOffset( quint32 index ) const;
 };
 
+bool Cluster::decompressTo( quint64 size )
+{
+  if( size > INT_MAX )
+    return false;
+
+  if( (quint64) data.size() < size && decompressor )
+  {
+    bool ok = decompressor->decompressTo( data, size );
+
+    if( decompressor->isFinished() )
+      decompressor.reset();
+
+    if( !ok )
+      data.clear();
+  }
+
+  return (quint64) data.size() >= size;
+}
+
+quint64 Cluster::getOffset( quint32 index ) const
+{
+  if( blobsOffsetSize == 8 )
+  {
+    quint64 offset;
+    memcpy( &offset, data.constData() + index * 8, sizeof( offset ) );
+    return offset;
+  }
+
+  quint32 offset32;
+  memcpy( &offset32, data.constData() + index * 4, sizeof( offset32 ) );
+  return offset32;
+}
+
+bool Cluster::getBlob( quint32 blobNumber, string & result )
+{
+  // The table of the blob offsets comes first, its first entry giving its
+  // size
+
+  if( !blobsOffsetSize || !decompressTo( blobsOffsetSize ) )
+    return false;
+
+  quint32 blobCount = ( getOffset( 0 ) - blobsOffsetSize ) / blobsOffsetSize;
+
+  if( blobNumber >= blobCount
+      || !decompressTo( ( (quint64) blobNumber + 2 ) * blobsOffsetSize ) )
+    return false;
+
+  quint64 begin = getOffset( blobNumber );
+  quint64 end = getOffset( blobNumber + 1 );
+
+  if( begin > end || !decompressTo( end ) )
+    return false;
+
+  result.append( data.constData() + begin, end - begin );
+
+  return true;
+}
+
+bool Cluster::isCacheable()
+{
+  if( !isRead )
+    return true;
+
+  if( !blobsOffsetSize || (unsigned) data.size() < blobsOffsetSize )
+    return decompressor.get() != 0; // Broken unless there's more to decompress
+
+  return ( getOffset( 0 ) - blobsOffsetSize ) / blobsOffsetSize > 1;
+}
+
+/// The clusters, shared by all the zim files in the process
+SharedCache< Cluster > clusterCache( 64 * 1024 * 1024, 8 );
+
+void setClusterCacheSize( int bytes )
+{
+  clusterCache.setMaxSize( bytes );
+}
+
 class ZimFile : public SplitFile::SplitFile
 {
 public:
@@ -191,7 +321,13 @@ public:
   const ZIM_header & header() const
   { return zimHeader; }
 
-  string getClusterData( quint32 cluster_nom, unsigned & blob_offset_size );
+  /// Appends the given blob of the given cluster to the result. Returns
+  /// false on failure. The cluster is only decompressed as far as the blob.
+  /// If the file is shared between threads, 'fileMutex' is to be the mutex
+  /// guarding it. It must not be held by the caller, since it's only locked
+  /// to read the file, while the decompression is done with it unlocked.
+  bool getBlob( quint32 cluster_nom, quint32 blob_nom, string & result,
+                Mutex * fileMutex = 0 );
 
   const QString getMimeType( quint16 nom )
   { return mimeTypes.value( nom ); }
@@ -203,10 +339,33 @@ public:
 
   quint16 redirectedMimeType( RedirectEntry const & redEntry );
 
+  /// Reads the directory entry with the given number. Returns false on
+  /// failure.
+  bool readEntry( quint32 entryNumber, DirEntry & entry );
+
+  /// Returns the number of the directory entry at the given position in the
+  /// title-ordered list, or 0xFFFFFFFF on failure
+  quint32 entryAtTitlePosition( quint32 position );
+
+  /// Returns the namespace holding the articles
+  char articleNameSpace() const
+  { return zimHeader.majorVersion >= 6 && zimHeader.minorVersion >= 1 ? 'C' : 'A'; }
+
+  /// Returns true if the file has a title-ordered list of all its entries
+  bool hasTitleList()
+  { return zimHeader.titlePtrPos && zimHeader.titlePtrPos + (quint64)zimHeader.articleCount * 4 <= (quint64)size(); }
+
+  /// Looks the entry up by its namespace and url, using the url-ordered
+  /// list. Returns its number, or 0xFFFFFFFF if there's no such entry.
+  quint32 findEntryByUrl( char nameSpace, string const & url );
+
+  /// Returns the number of the first entry of the given namespace, or of
+  /// the first one following it in the url-ordered list
+  quint32 findNameSpaceStart( char nameSpace );
+
 private:
   ZIM_header zimHeader;
-  Cache cache[ CACHE_SIZE ];
-  int stamp;
+  quint32 cacheId; // Keys the clusters of the file in the cluster cache
   QVector< QPair< quint64, quint32 > > clusterOffsets;
   QStringList mimeTypes;
 
@@ -214,19 +373,19 @@ private:
 };
 
 ZimFile::ZimFile() :
-  stamp( 0 )
+  cacheId( clusterCache.newFileId() )
 {
   memset( &zimHeader, 0, sizeof( zimHeader ) );
 }
 
-ZimFile::ZimFile( const QString & name )
+ZimFile::ZimFile( const QString & name ) :
+  cacheId( clusterCache.newFileId() )
 {
   setFileName( name );
 }
 
 ZimFile::~ZimFile()
 {
-  clearCache();
 }
 
 void ZimFile::setFileName( const QString & name )
@@ -263,19 +422,9 @@ void ZimFile::setFileName( const QString & name )
 
 void ZimFile::clearCache()
 {
-  for( int i = 0; i < CACHE_SIZE; i++ )
-  {
-    if( cache[ i ].data )
-    {
-      free( cache[ i ].data );
-      cache[ i ].data = 0;
-    }
-    cache[ i ].clusterNumber = 0;
-    cache[ i ].stamp = -1;
-    cache[ i ].count = 0;
-    cache[ i ].size = 0;
-  }
-  stamp = 0;
+  // The clusters cached under the old id are never looked up again, and
+  // just get evicted in time
+  cacheId = clusterCache.newFileId();
 }
 
 bool ZimFile::open()
@@ -335,137 +484,86 @@ bool ZimFile::open()
   return true;
 }
 
-string ZimFile::getClusterData( quint32 cluster_nom, unsigned & blobs_offset_size )
+bool ZimFile::getBlob( quint32 cluster_nom, quint32 blob_nom, string & result,
+                      Mutex * fileMutex )
 {
-  // Check cache
-  int target = 0;
-  bool found = false;
-  int lastStamp = INT_MAX;
-
-  for( int i = 0; i < CACHE_SIZE; i++ )
-  {
-    if( cache[ i ].clusterNumber == cluster_nom && cache[ i ].count )
-    {
-      found = true;
-      target = i;
-      break;
-    }
+  SharedCache< Cluster >::Ref cluster = clusterCache.get( cacheId, cluster_nom );
 
-    if( cache[ i ].stamp < lastStamp )
-    {
-      lastStamp = cache[ i ].stamp;
-      target = i;
-    }
-  }
+  QMutexLocker _( &cluster->mutex );
 
-  cache[ target ].stamp = ++stamp;
-  if( stamp < 0 )
+  if( !cluster->isRead )
   {
-     stamp = 0;
-     for (int i = 0; i < CACHE_SIZE; i++)
-       cache[ i ].stamp = -1;
-  }
+    // Cache miss, read data from file
 
-  if( found )
-  {
-    // Cache hit
-    blobs_offset_size = cache[ target ].blobs_offset_size;
-    return string( cache[ target ].data, cache[ target ].count );
-  }
+    cluster->isRead = true;
 
-  // Cache miss, read data from file
+    char compressionType = 0;
+    QByteArray data;
 
-  // Calculate cluster size
-
-  quint64 clusterSize;
-  quint32 nom;
-  for( nom = 0; nom < zimHeader.clusterCount; nom++ )
-    if( clusterOffsets.at( nom ).second == cluster_nom )
-      break;
+    {
+      Mutex::OptionalLock _( fileMutex );
 
-  if( nom >= zimHeader.clusterCount ) // Invalid cluster nom
-    return string();
+      // Calculate cluster size
 
-  if( nom < zimHeader.clusterCount - 1 )
-    clusterSize = clusterOffsets.at( nom + 1 ).first - clusterOffsets.at( nom ).first;
-  else
-    clusterSize = size() - clusterOffsets.at( nom ).first;
+      quint64 clusterSize;
+      quint32 nom;
+      for( nom = 0; nom < zimHeader.clusterCount; nom++ )
+        if( clusterOffsets.at( nom ).second == cluster_nom )
+          break;
 
-  // Read cluster data
+      if( nom < zimHeader.clusterCount ) // Otherwise invalid cluster nom
+      {
+        if( nom < zimHeader.clusterCount - 1 )
+          clusterSize = clusterOffsets.at( nom + 1 ).first - clusterOffsets.at( nom ).first;
+        else
+          clusterSize = size() - clusterOffsets.at( nom ).first;
 
-  seek( clusterOffsets.at( nom ).first );
+        // Read cluster data
 
-  char compressionType, cluster_info;
-  if( !getChar( &cluster_info ) )
-    return string();
-  compressionType = cluster_info & 0x0F;
-  blobs_offset_size = cluster_info & 0x10 && zimHeader.majorVersion >= 6 ? 8 : 4;
+        seek( clusterOffsets.at( nom ).first );
 
-  string decompressedData;
+        char cluster_info;
+        if( getChar( &cluster_info ) )
+        {
+          compressionType = cluster_info & 0x0F;
+          cluster->blobsOffsetSize = cluster_info & 0x10 && zimHeader.majorVersion >= 6 ? 8 : 4;
 
-  QByteArray data = read( clusterSize );
+          data = read( clusterSize );
+        }
+      }
+    }
 
-  if( compressionType == Default || compressionType == None )
-    decompressedData = string( data.data(), data.size() );
-  else
-  if( compressionType == Zlib )
-    decompressedData = decompressZlib( data.constData(), data.size() );
-  else
-  if( compressionType == Bzip2 )
-    decompressedData = decompressBzip2( data.constData(), data.size() );
-  else
-  if( compressionType == Lzma2 )
-    decompressedData = decompressLzma2( data.constData(), data.size() );
-  else
-  if( compressionType == Zstd )
-    decompressedData = decompressZstd( data.constData(), data.size() );
-  else
-    return string();
+    if( data.isEmpty() )
+      cluster->blobsOffsetSize = 0; // Marks it broken
+    else
+    if( compressionType == Default || compressionType == None )
+      cluster->data = data;
+    else
+    if( compressionType == Zlib )
+      cluster->decompressor = new IncrementalDecompressor( IncrementalDecompressor::Zlib, data );
+    else
+    if( compressionType == Bzip2 )
+      cluster->decompressor = new IncrementalDecompressor( IncrementalDecompressor::Bzip2, data );
+    else
+    if( compressionType == Lzma2 )
+      cluster->decompressor = new IncrementalDecompressor( IncrementalDecompressor::Lzma2, data );
+    else
+    if( compressionType == Zstd )
+      cluster->decompressor = new IncrementalDecompressor( IncrementalDecompressor::Zstd, data );
+    else
+      cluster->blobsOffsetSize = 0;
+  }
 
-  if( decompressedData.empty() )
-    return string();
+  // The decompression itself is done with the file unlocked
 
-  // Check BLOBs number in the cluster
-  // We cache multi-element clusters only
+  bool found = cluster->getBlob( blob_nom, result );
 
-  quint32 firstOffset32;
-  quint64 firstOffset;
-  if( blobs_offset_size == 8 )
-    memcpy( &firstOffset, decompressedData.data(), sizeof(firstOffset) );
+  if( cluster->isCacheable() )
+    clusterCache.update( cacheId, cluster_nom, cluster );
   else
-  {
-    memcpy( &firstOffset32, decompressedData.data(), sizeof(firstOffset32) );
-    firstOffset = firstOffset32;
-  }
-  quint32 blobCount = ( firstOffset - blobs_offset_size ) / blobs_offset_size;
-
-  if( blobCount > 1 )
-  {
-    // Fill cache
-    int size = decompressedData.size();
-    if( cache[ target ].count < size )
-    {
-      if( cache[ target ].data )
-        free( cache[ target ].data );
-      cache[ target ].data = ( char * )malloc( size );
-      if( cache[ target ].data )
-        cache[ target ].size = size;
-      else
-      {
-        cache[ target ].size = 0;
-        cache[ target ].count = 0;
-      }
-    }
-    if( cache[ target ].size )
-    {
-      memcpy( cache[ target ].data, decompressedData.c_str(), size );
-      cache[ target ].count = size;
-      cache[ target ].clusterNumber = cluster_nom;
-      cache[ target ].blobs_offset_size = blobs_offset_size;
-    }
-  }
+    clusterCache.remove( cacheId, cluster_nom, cluster );
 
-  return decompressedData;
+  return found;
 }
 
 quint16 ZimFile::redirectedMimeType( RedirectEntry const & redEntry )
@@ -506,6 +604,135 @@ quint16 ZimFile::redirectedMimeType( RedirectEntry const & redEntry )
   return mimetype;
 }
 
+bool ZimFile::readEntry( quint32 entryNumber, DirEntry & entry )
+{
+  if( entryNumber >= zimHeader.articleCount )
+    return false;
+
+  seek( zimHeader.urlPtrPos + (quint64)entryNumber * 8 );
+  quint64 entryPos;
+  if( read( reinterpret_cast< char * >( &entryPos ), sizeof(entryPos) ) != sizeof(entryPos) )
+    return false;
+
+  seek( entryPos );
+
+  // The url and the title are usually short, so a single read gets all of
+  // the entry
+
+  QByteArray data = read( sizeof( ArticleEntry ) + 256 );
+
+  if( data.size() < (int)sizeof( RedirectEntry ) )
+    return false;
+
+  memcpy( &entry.mimetype, data.constData(), sizeof( entry.mimetype ) );
+
+  int namesOffset;
+
+  if( entry.mimetype == 0xFFFF )
+  {
+    RedirectEntry redEntry;
+    memcpy( &redEntry, data.constData(), sizeof( redEntry ) );
+    entry.nameSpace = redEntry.nameSpace;
+    entry.redirectIndex = redEntry.redirectIndex;
+    namesOffset = sizeof( RedirectEntry );
+  }
+  else
+  {
+    if( data.size() < (int)sizeof( ArticleEntry ) )
+      return false;
+
+    ArticleEntry artEntry;
+    memcpy( &artEntry, data.constData(), sizeof( artEntry ) );
+    entry.nameSpace = artEntry.nameSpace;
+    entry.redirectIndex = 0;
+    namesOffset = sizeof( ArticleEntry );
+  }
+
+  for( ; ; )
+  {
+    int urlEnd = data.indexOf( '\0', namesOffset );
+    int titleEnd = urlEnd < 0 ? -1 : data.indexOf( '\0', urlEnd + 1 );
+
+    if( titleEnd >= 0 )
+    {
+      entry.url.assign( data.constData() + namesOffset, urlEnd - namesOffset );
+      entry.title.assign( data.constData() + urlEnd + 1, titleEnd - urlEnd - 1 );
+      return true;
+    }
+
+    QByteArray more = read( 4096 );
+
+    if( more.isEmpty() || data.size() > 65536 )
+      return false;
+
+    data.append( more );
+  }
+}
+
+quint32 ZimFile::entryAtTitlePosition( quint32 position )
+{
+  if( position >= zimHeader.articleCount )
+    return 0xFFFFFFFF;
+
+  seek( zimHeader.titlePtrPos + (quint64)position * 4 );
+  quint32 entryNumber;
+  if( read( reinterpret_cast< char * >( &entryNumber ), sizeof(entryNumber) ) != sizeof(entryNumber) )
+    return 0xFFFFFFFF;
+
+  return entryNumber;
+}
+
+quint32 ZimFile::findEntryByUrl( char nameSpace, string const & url )
+{
+  // The entries are ordered by their namespaces, then by their urls
+
+  quint32 lo = 0, hi = zimHeader.articleCount;
+  DirEntry entry;
+
+  while( lo < hi )
+  {
+    quint32 middle = lo + ( hi - lo ) / 2;
+
+    if( !readEntry( middle, entry ) )
+      return 0xFFFFFFFF;
+
+    int cmp = (unsigned char) entry.nameSpace - (unsigned char) nameSpace;
+    if( !cmp )
+      cmp = entry.url.compare( url );
+
+    if( !cmp )
+      return middle;
+
+    if( cmp < 0 )
+      lo = middle + 1;
+    else
+      hi = middle;
+  }
+
+  return 0xFFFFFFFF;
+}
+
+quint32 ZimFile::findNameSpaceStart( char nameSpace )
+{
+  quint32 lo = 0, hi = zimHeader.articleCount;
+  DirEntry entry;
+
+  while( lo < hi )
+  {
+    quint32 middle = lo + ( hi - lo ) / 2;
+
+    if( !readEntry( middle, entry ) )
+      return hi;
+
+    if( (unsigned char) entry.nameSpace < (unsigned char) nameSpace )
+      lo = middle + 1;
+    else
+      hi = middle;
+  }
+
+  return lo;
+}
+
 
 // Some supporting functions
 
@@ -562,91 +789,498 @@ quint32 getArticleCluster( ZimFile & file, quint32 articleNumber )
   return 0xFFFFFFFF;
 }
 
+/// Reads the article, following the redirects. If the file is shared
+/// between threads, 'fileMutex' is to be the mutex guarding it, and it must
+/// not be held by the caller: it's only locked to read the file, so that the
+/// clusters get decompressed with it unlocked.
 quint32 readArticle( ZimFile & file, quint32 articleNumber, string & result,
-                     set< quint32 > * loadedArticles = NULL )
+                     set< quint32 > * loadedArticles = NULL,
+                     Mutex * fileMutex = NULL )
 {
   result.clear();
 
   while( 1 )
   {
-    ZIM_header const & header = file.header();
-    if( articleNumber >= header.articleCount )
-      break;
+    ArticleEntry artEntry;
 
-    file.seek( header.urlPtrPos + (quint64)articleNumber * 8 );
-    quint64 pos;
-    if( file.read( reinterpret_cast< char * >( &pos ), sizeof(pos) ) != sizeof(pos) )
-      break;
+    {
+      Mutex::OptionalLock _( fileMutex );
 
-    // Read article info
+      ZIM_header const & header = file.header();
+      if( articleNumber >= header.articleCount )
+        break;
 
-    quint16 mimetype;
+      file.seek( header.urlPtrPos + (quint64)articleNumber * 8 );
+      quint64 pos;
+      if( file.read( reinterpret_cast< char * >( &pos ), sizeof(pos) ) != sizeof(pos) )
+        break;
 
-    file.seek( pos );
-    if( file.read( reinterpret_cast< char * >( &mimetype ), sizeof(mimetype) ) != sizeof(mimetype) )
-      break;
+      // Read article info
 
-    if( mimetype == 0xFFFF ) // Redirect to other article
-    {
-      RedirectEntry redEntry;
-      if( file.read( reinterpret_cast< char * >( &redEntry ) + 2, sizeof(redEntry) - 2 ) != sizeof(redEntry) - 2 )
+      quint16 mimetype;
+
+      file.seek( pos );
+      if( file.read( reinterpret_cast< char * >( &mimetype ), sizeof(mimetype) ) != sizeof(mimetype) )
         break;
-      if( articleNumber == redEntry.redirectIndex )
+
+      if( mimetype == 0xFFFF ) // Redirect to other article
+      {
+        RedirectEntry redEntry;
+        if( file.read( reinterpret_cast< char * >( &redEntry ) + 2, sizeof(redEntry) - 2 ) != sizeof(redEntry) - 2 )
+          break;
+        if( articleNumber == redEntry.redirectIndex )
+          break;
+        articleNumber = redEntry.redirectIndex;
+        continue;
+      }
+
+      if( loadedArticles && loadedArticles->find( articleNumber ) != loadedArticles->end() )
+        break;
+
+      artEntry.mimetype = mimetype;
+      if( file.read( reinterpret_cast< char * >( &artEntry ) + 2, sizeof(artEntry) - 2 ) != sizeof(artEntry) - 2 )
         break;
-      articleNumber = redEntry.redirectIndex;
-      continue;
     }
 
-    if( loadedArticles && loadedArticles->find( articleNumber ) != loadedArticles->end() )
-      break;
+    // Take article data from cluster
 
-    ArticleEntry artEntry;
-    artEntry.mimetype = mimetype;
-    if( file.read( reinterpret_cast< char * >( &artEntry ) + 2, sizeof(artEntry) - 2 ) != sizeof(artEntry) - 2 )
+    if( !file.getBlob( artEntry.clusterNumber, artEntry.blobNumber, result, fileMutex ) )
       break;
 
-    // Read cluster data
+    return articleNumber;
+  }
+  return 0xFFFFFFFF;
+}
+
+/// Returns all the characters of the basic multilingual plane whose
+/// foldings, as by Folding::apply(), begin with the given character, or,
+/// for 0, the ones whose foldings are empty. The characters are in
+/// ascending order. The inverse of the folding is built on first use.
+Mutex charsFoldingToMutex;
+
+vector< wchar > const & charsFoldingTo( wchar ch )
+{
+  Mutex::Lock _( charsFoldingToMutex );
+
+  static map< wchar, vector< wchar > > charsByFolding;
+  static vector< wchar > const none;
+
+  if( charsByFolding.empty() )
+  {
+    for( unsigned c = 1; c < 0x10000; ++c )
+    {
+      if( c >= 0xD800 && c < 0xE000 ) // Surrogates
+        continue;
+
+      wstring folded = Folding::apply( wstring( 1, (wchar) c ) );
+
+      charsByFolding[ folded.empty() ? 0 : folded[ 0 ] ].push_back( (wchar) c );
+    }
+  }
+
+  map< wchar, vector< wchar > >::const_iterator i = charsByFolding.find( ch );
+
+  return i == charsByFolding.end() ? none : i->second;
+}
+
+/// Looks the titles up in the title-ordered list of the directory entries
+/// of a zim file, folding them just like the btree index folds its keys
+/// (see Folding::apply()). The list is sorted by the namespaces, then by the
+/// exact titles, so the range of the titles beginning with each character
+/// which folds to the next one of the word is narrowed down separately. The
+/// small ranges have the next characters of their titles enumerated, the
+/// large ones are narrowed down for every character folding to the one
+/// sought and for every character the folding drops, such as the
+/// separators between the words.
+class TitleSearch
+{
+public:
+
+  /// Only the titles in the given range of positions, which is to be
+  /// the range of a namespace, are searched. If the file is shared between
+  /// threads, 'fileMutex' is to be the mutex guarding it. It's only locked
+  /// for each read.
+  TitleSearch( ZimFile & file_, Mutex * fileMutex_, quint32 begin_, quint32 end_ ):
+    file( file_ ), fileMutex( fileMutex_ ), begin( begin_ ), end( end_ )
+  {}
+
+  /// Finds the titles whose folded forms are equal to the folded word or,
+  /// with 'prefix' set, begin with it, up to maxResults of them. The titles
+  /// are appended to the result along with their entry numbers. The entries
+  /// which are not articles are skipped. Without 'prefix', only the titles
+  /// differing from the word in the case and the diacritics are found, the
+  /// separators between the words are to match exactly.
+  void find( wstring const & word, bool prefix, unsigned long maxResults,
+             vector< WordArticleLink > & result );
+
+  /// Returns the first position in the range whose title isn't less than
+  /// the given one, within the given namespace. The file must be locked by
+  /// the caller.
+  static quint32 lowerBound( ZimFile &, quint32 lo, quint32 hi,
+                             char nameSpace, string const & title );
+
+private:
+
+  enum
+  {
+    /// The ranges this small are just scanned rather than narrowed down
+    ScanRangeSize = 32,
+
+    /// The ranges this small have the next characters of their titles
+    /// enumerated rather than guessed
+    EnumerateRangeSize = 4096
+  };
+
+  ZimFile & file;
+  Mutex * fileMutex;
+  quint32 begin, end;
+
+  wstring wordFolded;
+  bool prefix;
+  unsigned long maxResults;
+  vector< WordArticleLink > * result;
+  size_t resultBase; // The size of the result before the search
+
+  bool isFull() const
+  { return result->size() - resultBase >= maxResults; }
+
+  struct Entry
+  {
+    quint32 number;
+    DirEntry entry;
+  };
+
+  /// The entries read so far, by their positions
+  map< quint32, Entry > entries;
+
+  Entry const * entryAt( quint32 position );
+
+  quint32 lowerBound( quint32 lo, quint32 hi, string const & title );
 
-    unsigned offset_size = 0;
-    string decompressedData = file.getClusterData( artEntry.clusterNumber, offset_size );
-    if( decompressedData.empty() )
+  /// Narrows the range down to the titles beginning with the key. Returns
+  /// false if there are none.
+  bool narrow( quint32 & lo, quint32 & hi, string const & key );
+
+  /// Returns the character following the head in the title, which is to be
+  /// longer than the head, or 0 if it can't be decoded. The key is set to
+  /// the head followed by the character.
+  static wchar charAfter( string const & title, size_t headSize, string & key );
+
+  /// Searches the range for the titles matching the rest of the folded
+  /// word, all of them beginning with the head
+  void search( quint32 lo, quint32 hi, string const & head, wstring const & rest );
+
+  /// Goes on with the search in the range of the titles beginning with the
+  /// key, which is the head followed by the given character, if the
+  /// character's folding is either empty or begins the rest of the word
+  void searchAfter( quint32 lo, quint32 hi, string const & key, wchar ch,
+                    wstring const & rest );
+
+  /// Adds the entry at the given position if it's a matching article
+  void addIfMatches( quint32 position );
+};
+
+TitleSearch::Entry const * TitleSearch::entryAt( quint32 position )
+{
+  map< quint32, Entry >::iterator i = entries.find( position );
+
+  if( i != entries.end() )
+    return &i->second;
+
+  Entry entry;
+
+  {
+    Mutex::OptionalLock _( fileMutex );
+
+    entry.number = file.entryAtTitlePosition( position );
+
+    if( entry.number == 0xFFFFFFFF || !file.readEntry( entry.number, entry.entry ) )
+      return 0;
+  }
+
+  return &( entries[ position ] = entry );
+}
+
+quint32 TitleSearch::lowerBound( ZimFile & file, quint32 lo, quint32 hi,
+                                 char nameSpace, string const & title )
+{
+  DirEntry entry;
+
+  while( lo < hi )
+  {
+    quint32 middle = lo + ( hi - lo ) / 2;
+
+    quint32 number = file.entryAtTitlePosition( middle );
+
+    if( number == 0xFFFFFFFF || !file.readEntry( number, entry ) )
+      return hi;
+
+    int cmp = (unsigned char) entry.nameSpace - (unsigned char) nameSpace;
+    if( !cmp )
+      cmp = entry.listedTitle().compare( title );
+
+    if( cmp < 0 )
+      lo = middle + 1;
+    else
+      hi = middle;
+  }
+
+  return lo;
+}
+
+quint32 TitleSearch::lowerBound( quint32 lo, quint32 hi, string const & title )
+{
+  // Same as the static version, but within a namespace range and through
+  // the entries already read
+
+  while( lo < hi )
+  {
+    quint32 middle = lo + ( hi - lo ) / 2;
+
+    Entry const * entry = entryAt( middle );
+
+    if( !entry )
+      return hi;
+
+    if( entry->entry.listedTitle().compare( title ) < 0 )
+      lo = middle + 1;
+    else
+      hi = middle;
+  }
+
+  return lo;
+}
+
+bool TitleSearch::narrow( quint32 & lo, quint32 & hi, string const & key )
+{
+  lo = lowerBound( lo, hi, key );
+
+  if( lo >= hi )
+    return false;
+
+  Entry const * entry = entryAt( lo );
+
+  if( !entry || entry->entry.listedTitle().compare( 0, key.size(), key ) != 0 )
+    return false;
+
+  // The titles beginning with the key are all less than the key with its
+  // last byte incremented. The last byte of a character is never 0xFF in
+  // utf8, so it doesn't overflow.
+  string keyEnd = key;
+  ++keyEnd[ keyEnd.size() - 1 ];
+
+  hi = lowerBound( lo + 1, hi, keyEnd );
+
+  return true;
+}
+
+wchar TitleSearch::charAfter( string const & title, size_t headSize,
+                              string & key )
+{
+  unsigned char lead = title[ headSize ];
+  size_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+
+  key = title.substr( 0, headSize + length );
+
+  wstring ch;
+
+  try
+  {
+    ch = Utf8::decode( key.substr( headSize ) );
+  }
+  catch( Utf8::exCantDecode & )
+  {
+  }
+
+  return ch.size() == 1 ? ch[ 0 ] : 0;
+}
+
+void TitleSearch::addIfMatches( quint32 position )
+{
+  Entry const * entry = entryAt( position );
+
+  if( !entry )
+    return;
+
+  wstring titleFolded;
+
+  try
+  {
+    titleFolded = Folding::apply( Utf8::decode( entry->entry.listedTitle() ) );
+  }
+  catch( Utf8::exCantDecode & )
+  {
+    return;
+  }
+
+  if( prefix ? titleFolded.compare( 0, wordFolded.size(), wordFolded ) != 0
+             : titleFolded != wordFolded )
+    return;
+
+  quint16 mimetype = entry->entry.mimetype;
+
+  if( mimetype == 0xFFFF )
+  {
+    RedirectEntry redEntry;
+    redEntry.redirectIndex = entry->entry.redirectIndex;
+
+    Mutex::OptionalLock _( fileMutex );
+    mimetype = file.redirectedMimeType( redEntry );
+  }
+
+  if( !file.isArticleMime( mimetype ) )
+    return;
+
+  result->push_back( WordArticleLink( entry->entry.listedTitle(), entry->number ) );
+}
+
+void TitleSearch::search( quint32 lo, quint32 hi, string const & head,
+                          wstring const & rest )
+{
+  if( isFull() || lo >= hi )
+    return;
+
+  if( rest.empty() )
+  {
+    // All the titles left begin with the word, as folded. Without 'prefix',
+    // only the one equal to the head, which comes first, can be equal to
+    // the word up to the case and the diacritics.
+
+    quint32 last = prefix ? hi : lo + 1;
+
+    for( quint32 x = lo; x < last && !isFull(); ++x )
+      addIfMatches( x );
+
+    return;
+  }
+
+  if( hi - lo <= ScanRangeSize )
+  {
+    for( quint32 x = lo; x < hi && !isFull(); ++x )
+      addIfMatches( x );
+
+    return;
+  }
+
+  if( hi - lo <= EnumerateRangeSize )
+  {
+    // Jump from the titles beginning with each next character to the ones
+    // beginning with the next one
+
+    for( quint32 x = lo; x < hi && !isFull(); )
+    {
+      Entry const * entry = entryAt( x );
+
+      if( !entry )
+        return;
+
+      string const & title = entry->entry.listedTitle();
+
+      if( title.size() <= head.size() )
+      {
+        // The title equal to the head
+        ++x;
+        continue;
+      }
+
+      string key;
+      wchar ch = charAfter( title, head.size(), key );
+
+      string keyEnd = key;
+      ++keyEnd[ keyEnd.size() - 1 ];
+
+      quint32 next = lowerBound( x + 1, hi, keyEnd );
+
+      if( ch )
+        searchAfter( x, next, key, ch, rest );
+
+      x = next;
+    }
+
+    return;
+  }
+
+  // Narrow the range down for each character folding to the next one of
+  // the word, then for each character the folding drops
+
+  vector< wchar > const & chars = charsFoldingTo( rest[ 0 ] );
+
+  for( size_t x = 0; x < chars.size() && !isFull(); ++x )
+  {
+    string key = head + Utf8::encode( wstring( 1, chars[ x ] ) );
+    quint32 rangeBegin = lo, rangeEnd = hi;
+
+    if( narrow( rangeBegin, rangeEnd, key ) )
+      searchAfter( rangeBegin, rangeEnd, key, chars[ x ], rest );
+  }
+
+  if( head.empty() )
+    return;
+
+  // There are hundreds of those, so only the ones the titles have are
+  // visited. The walk seeks the next dropped character, then goes on past
+  // the character actually found, be it dropped or not.
+
+  vector< wchar > const & dropped = charsFoldingTo( 0 );
+  vector< wchar >::const_iterator next = dropped.begin();
+
+  for( quint32 x = lo; x < hi && next != dropped.end() && !isFull(); )
+  {
+    x = lowerBound( x, hi, head + Utf8::encode( wstring( 1, *next ) ) );
+
+    if( x >= hi )
       break;
 
-    // Take article data from cluster
+    Entry const * entry = entryAt( x );
+
+    if( !entry )
+      return;
+
+    string key;
+    wchar ch = charAfter( entry->entry.listedTitle(), head.size(), key );
+
+    string keyEnd = key;
+    ++keyEnd[ keyEnd.size() - 1 ];
+
+    quint32 rangeEnd = lowerBound( x + 1, hi, keyEnd );
+
+    if( ch && std::binary_search( dropped.begin(), dropped.end(), ch ) )
+      search( x, rangeEnd, key, rest );
+
+    if( ch )
+      next = std::upper_bound( next, dropped.end(), ch );
+
+    x = rangeEnd;
+  }
+}
+
+void TitleSearch::searchAfter( quint32 lo, quint32 hi, string const & key,
+                               wchar ch, wstring const & rest )
+{
+  wstring folded = Folding::apply( wstring( 1, ch ) );
+
+  if( rest.compare( 0, folded.size(), folded ) != 0 )
+    return;
+
+  search( lo, hi, key, rest.substr( folded.size() ) );
+}
 
-    quint32 firstOffset32;
-    quint64 firstOffset;
+void TitleSearch::find( wstring const & word, bool prefix_,
+                        unsigned long maxResults_,
+                        vector< WordArticleLink > & result_ )
+{
+  wordFolded = Folding::apply( word );
 
-    if( offset_size == 8 )
-      memcpy( &firstOffset, decompressedData.data(), sizeof(firstOffset) );
-    else
-    {
-      memcpy( &firstOffset32, decompressedData.data(), sizeof(firstOffset32) );
-      firstOffset = firstOffset32;
-    }
-    quint32 blobCount = ( firstOffset - offset_size ) / offset_size;
-    if( artEntry.blobNumber > blobCount )
-      break;
+  if( wordFolded.empty() )
+    return;
 
-    quint32 size;
-    if( offset_size == 8 )
-    {
-      quint64 offsets[ 2 ];
-      memcpy( offsets, decompressedData.data() + artEntry.blobNumber * 8, sizeof(offsets) );
-      size = offsets[ 1 ] - offsets[ 0 ];
-      result.append( decompressedData, offsets[ 0 ], size );
-    }
-    else
-    {
-      quint32 offsets[ 2 ];
-      memcpy( offsets, decompressedData.data() + artEntry.blobNumber * 4, sizeof(offsets) );
-      size = offsets[ 1 ] - offsets[ 0 ];
-      result.append( decompressedData, offsets[ 0 ], size );
-    }
+  prefix = prefix_;
+  result = &result_;
+  resultBase = result_.size();
+  maxResults = maxResults_;
+  entries.clear();
 
-    return articleNumber;
-  }
-  return 0xFFFFFFFF;
+  search( begin, end, string(), wordFolded );
 }
 
 // ZimDictionary
@@ -664,6 +1298,8 @@ class ZimDictionary: public BtreeIndexing::BtreeDictionary
     ZimFile df;
     set< quint32 > articlesIndexedForFTS;
     LINKS_TYPE linksType;
+    quint32 titlesBegin, titlesEnd; // The range of the articles in the title
+                                    // list, with the native title index
 
   public:
 
@@ -699,6 +1335,21 @@ class ZimDictionary: public BtreeIndexing::BtreeDictionary
     virtual sptr< Dictionary::DataRequest > getResource( string const & name )
       THROW_SPEC( std::exception );
 
+    virtual sptr< Dictionary::WordSearchRequest > prefixMatch( wstring const &,
+                                                               unsigned long maxResults )
+      THROW_SPEC( std::exception );
+
+    virtual sptr< Dictionary::WordSearchRequest > stemmedMatch( wstring const &,
+                                                                unsigned minLength,
+                                                                unsigned maxSuffixVariation,
+                                                                unsigned long maxResults )
+      THROW_SPEC( std::exception );
+
+    /// With the native title index, the titles are all found beyond the
+    /// btree index
+    virtual bool searchesIndexOnly() const
+    { return !idxHeader.nativeTitleIndex; }
+
     virtual QString const& getDescription();
 
     /// Loads the resource.
@@ -725,6 +1376,10 @@ class ZimDictionary: public BtreeIndexing::BtreeDictionary
                 && ( fts.maxDictionarySize == 0 || getArticleCount() <= fts.maxDictionarySize );
     }
 
+    /// With the native title index, lists the articles from the file itself
+    virtual void findArticleOffsetsForFTS( QVector< uint32_t > & offsets,
+                                           QAtomicInt & isCancelled );
+
     virtual void sortArticlesOffsetsForFTS( QVector< uint32_t > & offsets, QAtomicInt & isCancelled );
 
 protected:
@@ -739,9 +1394,20 @@ private:
                          set< quint32 > * loadedArticles,
                          bool rawText = false );
 
+    /// Looks the titles up in the title-ordered list of the zim file, with
+    /// the native title index. See TitleSearch::find().
+    void findTitles( wstring const & word, bool prefix, unsigned long maxResults,
+                     vector< WordArticleLink > & result );
+
+    /// Finds the articles for all the words given, in both the btree index
+    /// and the title list
+    virtual vector< WordArticleLink > findAllArticles( vector< wstring > const & words,
+                                                       bool ignoreDiacritics );
+
     string convert( string const & in_data );
     friend class ZimArticleRequest;
     friend class ZimResourceRequest;
+    friend class ZimWordSearchRequest;
 };
 
 ZimDictionary::ZimDictionary( string const & id,
@@ -751,12 +1417,25 @@ ZimDictionary::ZimDictionary( string const & id,
     idx( indexFile, "rb" ),
     idxHeader( idx.read< IdxHeader >() ),
     df( FsEncoding::decode( dictionaryFiles[ 0 ].c_str() ) ),
-    linksType( UNKNOWN )
+    linksType( UNKNOWN ),
+    titlesBegin( 0 ),
+    titlesEnd( 0 )
 {
     // Open data file
 
     df.open();
 
+    if( idxHeader.nativeTitleIndex )
+    {
+      // Find the articles namespace in the title list
+
+      char nameSpace = df.articleNameSpace();
+      quint32 entries = df.header().articleCount;
+
+      titlesBegin = TitleSearch::lowerBound( df, 0, entries, nameSpace, string() );
+      titlesEnd = TitleSearch::lowerBound( df, titlesBegin, entries, nameSpace + 1, string() );
+    }
+
     // Initialize the indexes
 
     openIndex( IndexInfo( idxHeader.indexBtreeMaxElements,
@@ -821,11 +1500,7 @@ quint32 ZimDictionary::loadArticle( quint32 address,
                                     set< quint32 > * loadedArticles,
                                     bool rawText )
 {
-quint32 ret;
-  {
-    Mutex::Lock _( zimMutex );
-    ret = readArticle( df, address, articleText, loadedArticles );
-  }
+  quint32 ret = readArticle( df, address, articleText, loadedArticles, &zimMutex );
   if( !rawText )
     articleText = convert( articleText );
 
@@ -921,7 +1596,7 @@ string ZimDictionary::convert( const string & in )
            replace( "_", " " );
 
       vector< WordArticleLink > links;
-      links = findArticles( gd::toWString( word ) );
+      links = findAllArticles( vector< wstring >( 1, gd::toWString( word ) ), false );
 
       if( !links.empty() )
       {
@@ -930,7 +1605,7 @@ string ZimDictionary::convert( const string & in )
       else
       {
         word.remove( QRegExp(".*/") );
-        links = findArticles( gd::toWString( word ) );
+        links = findAllArticles( vector< wstring >( 1, gd::toWString( word ) ), false );
         if( !links.empty() )
         {
           linksType = NO_SLASH;
@@ -1043,15 +1718,64 @@ void ZimDictionary::loadResource( std::string & resourceName, string & data )
   vector< WordArticleLink > link;
   string resData;
 
+  if( idxHeader.nativeTitleIndex )
+  {
+    // The resources aren't indexed, they are looked up by their urls
+
+    quint32 entryNumber = 0xFFFFFFFF;
+
+    if( resourceName.size() > 2 && resourceName[ 1 ] == '/' )
+    {
+      Mutex::Lock _( zimMutex );
+      entryNumber = df.findEntryByUrl( resourceName[ 0 ], resourceName.substr( 2 ) );
+    }
+
+    if( entryNumber != 0xFFFFFFFF )
+      readArticle( df, entryNumber, data, NULL, &zimMutex );
+
+    return;
+  }
+
   link = resourceIndex.findArticles( Utf8::decode( resourceName ) );
 
   if( link.empty() )
     return;
 
+  readArticle( df, link[ 0 ].articleOffset, data, NULL, &zimMutex );
+}
+
+void ZimDictionary::findTitles( wstring const & word, bool prefix,
+                                unsigned long maxResults,
+                                vector< WordArticleLink > & result )
+{
+  // The file is only locked for each read, so the search doesn't hold up
+  // the articles being loaded meanwhile
+
+  TitleSearch( df, &zimMutex, titlesBegin, titlesEnd ).find( word, prefix, maxResults, result );
+}
+
+vector< WordArticleLink > ZimDictionary::findAllArticles( vector< wstring > const & words,
+                                                          bool ignoreDiacritics )
+{
+  if( !idxHeader.nativeTitleIndex )
+    return findArticlesBatch( words, ignoreDiacritics );
+
+  // With the native title index, the btree index is empty. The titles found
+  // are narrowed down just like the btree index does it.
+
+  vector< WordArticleLink > links;
+
+  for( size_t x = 0; x < words.size(); ++x )
   {
-    Mutex::Lock _( zimMutex );
-    readArticle( df, link[ 0 ].articleOffset, data );
+    vector< WordArticleLink > found;
+
+    findTitles( words[ x ], false, 64, found );
+    antialias( words[ x ], found, ignoreDiacritics );
+
+    links.insert( links.end(), found.begin(), found.end() );
   }
+
+  return links;
 }
 
 QString const& ZimDictionary::getDescription()
@@ -1060,10 +1784,7 @@ QString const& ZimDictionary::getDescription()
         return dictionaryDescription;
 
     string str;
-    {
-      Mutex::Lock _( zimMutex );
-      readArticle( df, idxHeader.descriptionPtr, str );
-    }
+    readArticle( df, idxHeader.descriptionPtr, str, NULL, &zimMutex );
 
     if( !str.empty() )
       dictionaryDescription = QString::fromUtf8( str.c_str(), str.size() );
@@ -1103,14 +1824,13 @@ void ZimDictionary::makeFTSIndex( QAtomicInt & isCancelled, bool firstIteration
 
     ftsIdx.write( ftsIdxHeader );
 
-    ChunkedStorage::Writer chunks( ftsIdx );
+    ChunkedStorage::Writer chunks( ftsIdx, ChunkedStorage::PreferredCodec );
 
     BtreeIndexing::IndexedWords indexedWords;
 
-    QSet< uint32_t > setOfOffsets;
-    setOfOffsets.reserve( getWordCount() );
+    QVector< uint32_t > articleOffsets;
 
-    findArticleLinks( 0, &setOfOffsets, 0, &isCancelled );
+    findArticleOffsetsForFTS( articleOffsets, isCancelled );
 
     if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
       throw exUserAbort();
@@ -1119,10 +1839,10 @@ void ZimDictionary::makeFTSIndex( QAtomicInt & isCancelled, bool firstIteration
     // to effective use clusters data caching
 
     QVector< QPair< quint32, uint32_t > > offsetsWithClusters;
-    offsetsWithClusters.reserve( setOfOffsets.size() );
+    offsetsWithClusters.reserve( articleOffsets.size() );
 
-    for( QSet< uint32_t >::ConstIterator it = setOfOffsets.constBegin();
-         it != setOfOffsets.constEnd(); ++it )
+    for( QVector< uint32_t >::ConstIterator it = articleOffsets.constBegin();
+         it != articleOffsets.constEnd(); ++it )
     {
       if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
         throw exUserAbort();
@@ -1132,7 +1852,7 @@ void ZimDictionary::makeFTSIndex( QAtomicInt & isCancelled, bool firstIteration
     }
 
     // Free memory
-    setOfOffsets.clear();
+    articleOffsets.clear();
 
     if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
       throw exUserAbort();
@@ -1250,6 +1970,47 @@ void ZimDictionary::sortArticlesOffsetsForFTS( QVector< uint32_t > & offsets,
     offsets[ i ] = offsetsWithClusters.at( i ).second;
 }
 
+void ZimDictionary::findArticleOffsetsForFTS( QVector< uint32_t > & offsets,
+                                              QAtomicInt & isCancelled )
+{
+  if( !idxHeader.nativeTitleIndex )
+  {
+    findArticleOffsets( offsets, &isCancelled );
+    return;
+  }
+
+  // The btree index is empty, so the articles namespace is walked instead.
+  // The redirects are skipped, their targets are listed on their own.
+
+  quint32 begin, end;
+
+  {
+    Mutex::Lock _( zimMutex );
+
+    char nameSpace = df.articleNameSpace();
+    begin = df.findNameSpaceStart( nameSpace );
+    end = df.findNameSpaceStart( nameSpace + 1 );
+  }
+
+  DirEntry entry;
+
+  for( quint32 n = begin; n < end; ++n )
+  {
+    if( Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+      return;
+
+    {
+      Mutex::Lock _( zimMutex );
+
+      if( !df.readEntry( n, entry ) )
+        continue;
+    }
+
+    if( entry.mimetype != 0xFFFF && df.isArticleMime( entry.mimetype ) )
+      offsets.append( n );
+  }
+}
+
 void ZimDictionary::getArticleText( uint32_t articleAddress, QString & headword, QString & text )
 {
   try
@@ -1257,6 +2018,17 @@ void ZimDictionary::getArticleText( uint32_t articleAddress, QString & headword,
     headword.clear();
     string articleText;
 
+    if( idxHeader.nativeTitleIndex )
+    {
+      // The btree index is empty, so the headword is taken from the entry
+
+      DirEntry entry;
+      Mutex::Lock _( zimMutex );
+
+      if( df.readEntry( articleAddress, entry ) )
+        headword = QString::fromUtf8( entry.listedTitle().data(), entry.listedTitle().size() );
+    }
+
     loadArticle( articleAddress, articleText, 0, true );
     text = Html::unescape( QString::fromUtf8( articleText.data(), articleText.size() ) );
   }
@@ -1370,16 +2142,7 @@ void ZimArticleRequest::run()
     return;
   }
 
-  vector< WordArticleLink > chain = dict.findArticles( word, ignoreDiacritics );
-
-  for( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-
-    vector< WordArticleLink > altChain = dict.findArticles( alts[ x ], ignoreDiacritics );
-
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
+  vector< WordArticleLink > chain = dict.findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   multimap< wstring, pair< string, string > > mainArticles, alternateArticles;
 
@@ -1649,8 +2412,332 @@ sptr< Dictionary::DataRequest > ZimDictionary::getResource( string const & name
   return new ZimResourceRequest( *this, name );
 }
 
+//// ZimDictionary::prefixMatch(), stemmedMatch()
+
+class ZimWordSearchRequest;
+
+class ZimWordSearchRunnable: public QRunnable
+{
+  ZimWordSearchRequest & r;
+  QSemaphore & hasExited;
+
+public:
+
+  ZimWordSearchRunnable( ZimWordSearchRequest & r_,
+                         QSemaphore & hasExited_ ): r( r_ ),
+                                                    hasExited( hasExited_ )
+  {}
+
+  ~ZimWordSearchRunnable()
+  {
+    hasExited.release();
+  }
+
+  virtual void run();
+};
+
+/// Searches the title list of the zim file, with the native title index
+class ZimWordSearchRequest: public BtreeIndexing::BtreeWordSearchRequest
+{
+  friend class ZimWordSearchRunnable;
+
+  ZimDictionary & zdict;
+
+public:
+
+  ZimWordSearchRequest( ZimDictionary & dict_,
+                        wstring const & str_,
+                        unsigned minLength_,
+                        int maxSuffixVariation_,
+                        bool allowMiddleMatches_,
+                        unsigned long maxResults_ ):
+    BtreeWordSearchRequest( dict_, str_, minLength_, maxSuffixVariation_, allowMiddleMatches_, maxResults_, false ),
+    zdict( dict_ )
+  {
+    QThreadPool::globalInstance()->start(
+      new ZimWordSearchRunnable( *this, hasExited ) );
+  }
+
+  virtual void findMatches();
+};
+
+void ZimWordSearchRunnable::run()
+{
+  r.run();
+}
+
+void ZimWordSearchRequest::findMatches()
+{
+  // The wildcards are only supported by the btree index, which is empty
+
+  if( allowMiddleMatches &&
+      ( str.find( '*' ) != wstring::npos || str.find( '?' ) != wstring::npos ||
+        str.find( '[' ) != wstring::npos || str.find( ']' ) != wstring::npos ) )
+    return;
+
+  wstring word = Folding::trimWhitespace( str );
+
+  int charsLeftToChop = 0;
+
+  if ( maxSuffixVariation >= 0 )
+  {
+    charsLeftToChop = (int)word.size() - (int)minLength;
+
+    if ( charsLeftToChop < 0 )
+      charsLeftToChop = 0;
+    else
+    if ( charsLeftToChop > maxSuffixVariation )
+      charsLeftToChop = maxSuffixVariation;
+  }
+
+  size_t initialSize = word.size();
+
+  try
+  {
+    while( !word.empty() && !Qt4x5::AtomicInt::loadAcquire( isCancelled ) )
+    {
+      size_t found;
+      {
+        Mutex::Lock _( dataMutex );
+        found = matches.size();
+      }
+
+      if( found >= maxResults )
+        break;
+
+      vector< WordArticleLink > links;
+      zdict.findTitles( word, true, maxResults - found, links );
+
+      {
+        Mutex::Lock _( dataMutex );
+
+        for( size_t x = 0; x < links.size(); ++x )
+        {
+          wstring title = Utf8::decode( links[ x ].word );
+
+          // If suffix variation is specified, make sure the title isn't
+          // larger than requested
+          if( maxSuffixVariation < 0 ||
+              (int)title.size() - (int)initialSize <= maxSuffixVariation )
+            addMatch( title );
+        }
+      }
+
+      if( !charsLeftToChop )
+        break;
+
+      --charsLeftToChop;
+      word.resize( word.size() - 1 );
+    }
+  }
+  catch( std::exception & e )
+  {
+    gdWarning( "Zim: title list searching failed: \"%s\", error: %s\n",
+               zdict.getName().c_str(), e.what() );
+  }
+}
+
+sptr< Dictionary::WordSearchRequest > ZimDictionary::prefixMatch(
+  wstring const & str, unsigned long maxResults )
+  THROW_SPEC( std::exception )
+{
+  if( !idxHeader.nativeTitleIndex )
+    return BtreeDictionary::prefixMatch( str, maxResults );
+
+  return new ZimWordSearchRequest( *this, str, 0, -1, true, maxResults );
+}
+
+sptr< Dictionary::WordSearchRequest > ZimDictionary::stemmedMatch(
+  wstring const & str, unsigned minLength, unsigned maxSuffixVariation,
+  unsigned long maxResults )
+  THROW_SPEC( std::exception )
+{
+  if( !idxHeader.nativeTitleIndex )
+    return BtreeDictionary::stemmedMatch( str, minLength, maxSuffixVariation,
+                                          maxResults );
+
+  return new ZimWordSearchRequest( *this, str, minLength, (int)maxSuffixVariation,
+                                   false, maxResults );
+}
+
 //} // anonymous namespace
 
+/// Collects the headwords and the resources of a zim file, see
+/// BtreeIndexing::ParallelCollector. With several parts, each of them reads
+/// the entries through a file of its own. The metadata entries are skipped.
+class EntryCollector: public BtreeIndexing::ParallelCollector
+{
+public:
+
+  /// The entry offsets are the url pointer list of the file
+  EntryCollector( ZimFile & file_, QString const & fileName_,
+                  string const & dictFileName_, QByteArray const & entryOffsets_,
+                  unsigned maxHeadwordsToExpand_ ):
+    file( file_ ), fileName( fileName_ ), dictFileName( dictFileName_ ),
+    entryOffsets( entryOffsets_ ),
+    maxHeadwordsToExpand( maxHeadwordsToExpand_ ), parts( 0 )
+  {}
+
+  unsigned getArticleCount() const
+  { return sum( articleCounts ); }
+
+  unsigned getWordCount() const
+  { return sum( wordCounts ); }
+
+protected:
+
+  virtual void prepare( size_t parts_ )
+  {
+    parts = parts_;
+    articleCounts.assign( parts, 0 );
+    wordCounts.assign( parts, 0 );
+  }
+
+  virtual void collect( size_t part, uint32_t begin, uint32_t end,
+                        BtreeIndexing::SortedIndexedWords & indexedWords,
+                        BtreeIndexing::SortedIndexedWords & indexedResources );
+
+private:
+
+  ZimFile & file;
+  QString fileName;
+  string dictFileName;
+  QByteArray const & entryOffsets;
+  unsigned maxHeadwordsToExpand;
+
+  size_t parts;
+  vector< unsigned > articleCounts, wordCounts; // By parts
+
+  static unsigned sum( vector< unsigned > const & counts )
+  {
+    unsigned result = 0;
+    for( size_t x = 0; x < counts.size(); ++x )
+      result += counts[ x ];
+    return result;
+  }
+};
+
+void EntryCollector::collect( size_t part, uint32_t begin, uint32_t end,
+                              BtreeIndexing::SortedIndexedWords & indexedWords,
+                              BtreeIndexing::SortedIndexedWords & indexedResources )
+{
+  sptr< ZimFile > ownFile;
+  ZimFile * df = &file;
+
+  if( parts > 1 )
+  {
+    ownFile = new ZimFile( fileName );
+
+    if( !ownFile->open() )
+      throw exCantReadFile( dictFileName );
+
+    df = ownFile.get();
+  }
+
+  ZIM_header const & zh = df->header();
+  bool new_namespaces = ( zh.majorVersion >= 6 && zh.minorVersion >= 1 );
+
+  unsigned articleCount = 0;
+  unsigned wordCount = 0;
+
+  const quint64 * ptr;
+  quint16 mimetype, redirected_mime = 0xFFFF;
+  ArticleEntry artEntry;
+  RedirectEntry redEntry;
+  string url, title;
+  char nameSpace;
+      for( quint32 n = begin; n < end; n++ )
+      {
+        ptr = reinterpret_cast< const quint64 * >( entryOffsets.constData() ) + n;
+        df->seek( *ptr );
+        df->read( reinterpret_cast< char * >( &mimetype ), sizeof(mimetype) );
+        if( mimetype == 0xFFFF )
+        {
+          redEntry.mimetype = mimetype;
+          qint64 ret = df->read( reinterpret_cast< char * >( &redEntry ) + 2, sizeof(RedirectEntry) - 2 );
+          if( ret != sizeof(RedirectEntry) - 2 )
+            throw exCantReadFile( dictFileName );
+
+          redirected_mime = df->redirectedMimeType( redEntry );
+          nameSpace = redEntry.nameSpace;
+        }
+        else
+        {
+          artEntry.mimetype = mimetype;
+          qint64 ret = df->read( reinterpret_cast< char * >( &artEntry ) + 2, sizeof(ArticleEntry) - 2 );
+          if( ret != sizeof(ArticleEntry) - 2 )
+            throw exCantReadFile( dictFileName );
+
+          nameSpace = artEntry.nameSpace;
+
+          if( ( nameSpace == 'A' || ( nameSpace == 'C' && new_namespaces ) ) && df->isArticleMime( mimetype ) )
+            articleCount++;
+        }
+
+        // Read article url and title
+        char ch;
+
+        url.clear();
+        while( df->getChar( &ch ) )
+        {
+          if( ch == 0 )
+            break;
+          url.push_back( ch );
+        }
+
+        title.clear();
+        while( df->getChar( &ch ) )
+        {
+          if( ch == 0 )
+            break;
+          title.push_back( ch );
+        }
+
+        if( nameSpace == 'A' || ( nameSpace == 'C' && new_namespaces && ( df->isArticleMime( mimetype )
+                                                                          || ( mimetype == 0xFFFF && df->isArticleMime( redirected_mime ) ) ) ) )
+        {
+          wstring word;
+          if( !title.empty() )
+            word = Utf8::decode( title );
+          else
+            word = Utf8::decode( url );
+
+          if( df->isArticleMime( mimetype )
+              || ( mimetype == 0xFFFF && df->isArticleMime( redirected_mime ) ) )
+          {
+            if( maxHeadwordsToExpand && zh.articleCount >= maxHeadwordsToExpand )
+              indexedWords.addSingleWord( word, n );
+            else
+              indexedWords.addWord( word, n );
+            wordCount++;
+          }
+          else
+          {
+            url.insert( url.begin(), '/' );
+            url.insert( url.begin(), nameSpace );
+            indexedResources.addSingleWord( Utf8::decode( url ), n );
+          }
+        }
+        else
+        if( nameSpace == 'M' || nameSpace == 'X' )
+        {
+          // The metadata is read beforehand, and the X namespace holds
+          // the own search indices of the file
+          continue;
+        }
+        else
+        {
+          url.insert( url.begin(), '/' );
+          url.insert( url.begin(), nameSpace );
+          indexedResources.addSingleWord( Utf8::decode( url ), n );
+        }
+      }
+
+
+  articleCounts[ part ] = articleCount;
+  wordCounts[ part ] = wordCount;
+}
+
 vector< sptr< Dictionary::Class > > makeDictionaries(
                                       vector< string > const & fileNames,
                                       string const & indicesDir,
@@ -1694,11 +2781,15 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
           df.open();
           ZIM_header const & zh = df.header();
-          bool new_namespaces = ( zh.majorVersion >= 6 && zh.minorVersion >= 1 );
-
           if( zh.magicNumber != 0x44D495A )
             throw exNotZimFile( i->c_str() );
 
+          bool nativeTitleIndex = zh.articleCount >= NativeTitleIndexMinEntries
+                                  && df.hasTitleList();
+
+          if( nativeTitleIndex )
+            gdDebug( "Zim: Using the title list of the file for dictionary: %s\n", i->c_str() );
+
           {
             int n = firstName.lastIndexOf( '/' );
             initializing.indexingDictionary( firstName.mid( n + 1 ).toUtf8().constData() );
@@ -1715,142 +2806,73 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
           idx.write( idxHeader );
 
-          IndexedWords indexedWords, indexedResources;
+          BtreeIndexing::SortedIndexedWords indexedWords, indexedResources;
 
-          QByteArray artEntries;
-          df.seek( zh.urlPtrPos );
-          artEntries = df.read( (quint64)zh.articleCount * 8 );
+          // Read the metadata
 
-          QVector< quint64 > clusters;
-          clusters.reserve( zh.clusterCount );
-          df.seek( zh.clusterPtrPos );
+          quint32 n = df.findEntryByUrl( 'M', "Title" );
+          if( n != 0xFFFFFFFF )
           {
-            QByteArray data = df.read( (quint64)zh.clusterCount * 8 );
-            for( unsigned n = 0; n < zh.clusterCount; n++ )
-              clusters.append( *( reinterpret_cast< const quint64 * >( data.constData() ) + n ) );
+            idxHeader.namePtr = n;
+            string name;
+            readArticle( df, n, name );
+            initializing.indexingDictionary( name );
           }
 
-          const quint64 * ptr;
-          quint16 mimetype, redirected_mime = 0xFFFF;
-          ArticleEntry artEntry;
-          RedirectEntry redEntry;
-          string url, title;
-          char nameSpace;
-          for( unsigned n = 0; n < zh.articleCount; n++ )
+          idxHeader.descriptionPtr = df.findEntryByUrl( 'M', "Description" );
+
+          n = df.findEntryByUrl( 'M', "Language" );
+          if( n != 0xFFFFFFFF )
           {
-            ptr = reinterpret_cast< const quint64 * >( artEntries.constData() ) + n;
-            df.seek( *ptr );
-            df.read( reinterpret_cast< char * >( &mimetype ), sizeof(mimetype) );
-            if( mimetype == 0xFFFF )
-            {
-              redEntry.mimetype = mimetype;
-              qint64 ret = df.read( reinterpret_cast< char * >( &redEntry ) + 2, sizeof(RedirectEntry) - 2 );
-              if( ret != sizeof(RedirectEntry) - 2 )
-                throw exCantReadFile( i->c_str() );
-
-              redirected_mime = df.redirectedMimeType( redEntry );
-              nameSpace = redEntry.nameSpace;
-            }
-            else
-            {
-              artEntry.mimetype = mimetype;
-              qint64 ret = df.read( reinterpret_cast< char * >( &artEntry ) + 2, sizeof(ArticleEntry) - 2 );
-              if( ret != sizeof(ArticleEntry) - 2 )
-                throw exCantReadFile( i->c_str() );
-
-              nameSpace = artEntry.nameSpace;
-
-              if( ( nameSpace == 'A' || ( nameSpace == 'C' && new_namespaces ) ) && df.isArticleMime( mimetype ) )
-                articleCount++;
-            }
-
-            // Read article url and title
-            char ch;
-
-            url.clear();
-            while( df.getChar( &ch ) )
-            {
-              if( ch == 0 )
-                break;
-              url.push_back( ch );
-            }
-
-            title.clear();
-            while( df.getChar( &ch ) )
-            {
-              if( ch == 0 )
-                break;
-              title.push_back( ch );
-            }
-
-            if( nameSpace == 'A' || ( nameSpace == 'C' && new_namespaces && ( df.isArticleMime( mimetype )
-                                                                              || ( mimetype == 0xFFFF && df.isArticleMime( redirected_mime ) ) ) ) )
-            {
-              wstring word;
-              if( !title.empty() )
-                word = Utf8::decode( title );
-              else
-                word = Utf8::decode( url );
-
-              if( df.isArticleMime( mimetype )
-                  || ( mimetype == 0xFFFF && df.isArticleMime( redirected_mime ) ) )
-              {
-                if( maxHeadwordsToExpand && zh.articleCount >= maxHeadwordsToExpand )
-                  indexedWords.addSingleWord( word, n );
-                else
-                  indexedWords.addWord( word, n );
-                wordCount++;
-              }
-              else
-              {
-                url.insert( url.begin(), '/' );
-                url.insert( url.begin(), nameSpace );
-                indexedResources.addSingleWord( Utf8::decode( url ), n );
-              }
-            }
-            else
-            if( nameSpace == 'M' )
-            {
-              if( url.compare( "Title" ) == 0 )
-              {
-                idxHeader.namePtr = n;
-                string name;
-                readArticle( df, n, name );
-                initializing.indexingDictionary( name );
-              }
-              else
-              if( url.compare( "Description" ) == 0 )
-                idxHeader.descriptionPtr = n;
-              else
-              if( url.compare( "Language" ) == 0 )
-              {
-                string lang;
-                readArticle( df, n, lang );
-                if( lang.size() == 2 )
-                  idxHeader.langFrom = LangCoder::code2toInt( lang.c_str() );
-                else
-                if( lang.size() == 3 )
-                  idxHeader.langFrom = LangCoder::findIdForLanguageCode3( lang.c_str() );
-                idxHeader.langTo = idxHeader.langFrom;
-              }
-            }
-            else
-            if( nameSpace == 'X' )
-            {
-              continue;
-            }
+            string lang;
+            readArticle( df, n, lang );
+            if( lang.size() == 2 )
+              idxHeader.langFrom = LangCoder::code2toInt( lang.c_str() );
             else
-            {
-              url.insert( url.begin(), '/' );
-              url.insert( url.begin(), nameSpace );
-              indexedResources.addSingleWord( Utf8::decode( url ), n );
-            }
+            if( lang.size() == 3 )
+              idxHeader.langFrom = LangCoder::findIdForLanguageCode3( lang.c_str() );
+            idxHeader.langTo = idxHeader.langFrom;
+          }
+
+          if( nativeTitleIndex )
+          {
+            // The titles are looked up in the title list and the resources
+            // by their urls, so the entries aren't walked at all, and both
+            // indices are left empty. The counts are those of all the
+            // entries of the articles namespace, the redirects included.
+
+            char nameSpace = df.articleNameSpace();
+
+            articleCount = df.findNameSpaceStart( nameSpace + 1 )
+                           - df.findNameSpaceStart( nameSpace );
+            wordCount = articleCount;
+          }
+          else
+          {
+            // Collect the headwords and the resources
+
+            QByteArray artEntries;
+            df.seek( zh.urlPtrPos );
+            artEntries = df.read( (quint64)zh.articleCount * 8 );
+
+            if( (quint64)artEntries.size() != (quint64)zh.articleCount * 8 )
+              throw exCantReadFile( i->c_str() );
+
+            EntryCollector collector( df, firstName, *i, artEntries,
+                                      maxHeadwordsToExpand );
+
+            collector.run( zh.articleCount, indexedWords, indexedResources );
+
+            articleCount = collector.getArticleCount();
+            wordCount = collector.getWordCount();
           }
 
           // Build index
 
           {
-            IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx );
+            IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx,
+                                                           BtreeIndexing::SearchableFormatVersion,
+                                                           BtreeIndexing::WithOffsetMap );
 
             idxHeader.indexBtreeMaxElements = idxInfo.btreeMaxElements;
             idxHeader.indexRootOffset = idxInfo.rootOffset;
@@ -1859,7 +2881,8 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
           }
 
           {
-            IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedResources, idx );
+            IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedResources, idx,
+                                                           BtreeIndexing::SearchableFormatVersion );
 
             idxHeader.resourceIndexBtreeMaxElements = idxInfo.btreeMaxElements;
             idxHeader.resourceIndexRootOffset = idxInfo.rootOffset;
@@ -1872,6 +2895,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
           idxHeader.articleCount = articleCount;
           idxHeader.wordCount = wordCount;
+          idxHeader.nativeTitleIndex = nativeTitleIndex;
 
           idx.rewind();
 
@@ -18,6 +18,10 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
                                       unsigned maxHeadwordsToExpand )
   THROW_SPEC( std::exception );
 
+/// Sets the memory budget, in bytes, of the cache of decompressed clusters
+/// which is shared by all the zim files. Zero disables the cache.
+void setClusterCacheSize( int bytes );
+
 }
 
 #endif
@@ -180,16 +180,7 @@ sptr< Dictionary::DataRequest > ZipSoundsDictionary::getArticle( wstring const &
                                                                  bool ignoreDiacritics )
   THROW_SPEC( std::exception )
 {
-  vector< WordArticleLink > chain = findArticles( word, ignoreDiacritics );
-
-  for( unsigned x = 0; x < alts.size(); ++x )
-  {
-    /// Make an additional query for each alt
-
-    vector< WordArticleLink > altChain = findArticles( alts[ x ], ignoreDiacritics );
-
-    chain.insert( chain.end(), altChain.begin(), altChain.end() );
-  }
+  vector< WordArticleLink > chain = findArticlesWithAlts( word, alts, ignoreDiacritics );
 
   multimap< wstring, uint32_t > mainArticles, alternateArticles;
 
@@ -235,8 +226,8 @@ sptr< Dictionary::DataRequest > ZipSoundsDictionary::getArticle( wstring const &
 
   result += "<table class=\"lsa_play\">";
 
-  vector< char > chunk;
-  char * nameBlock;
+  QByteArray chunk;
+  char const * nameBlock;
 
   for( i = mainArticles.begin(); i != mainArticles.end(); ++i )
   {
@@ -245,7 +236,7 @@ sptr< Dictionary::DataRequest > ZipSoundsDictionary::getArticle( wstring const &
       Mutex::Lock _( idxMutex );
       nameBlock = chunks->getBlock( i->second, chunk );
 
-      if ( nameBlock >= &chunk.front() + chunk.size() )
+      if ( nameBlock >= chunk.constData() + chunk.size() )
       {
         // chunks reader thinks it's okay since zero-sized records can exist,
         // but we don't allow that.
@@ -291,7 +282,7 @@ sptr< Dictionary::DataRequest > ZipSoundsDictionary::getArticle( wstring const &
       Mutex::Lock _( idxMutex );
       nameBlock = chunks->getBlock( i->second, chunk );
 
-      if ( nameBlock >= &chunk.front() + chunk.size() )
+      if ( nameBlock >= chunk.constData() + chunk.size() )
       {
         // chunks reader thinks it's okay since zero-sized records can exist,
         // but we don't allow that.
@@ -359,8 +350,8 @@ sptr< Dictionary::DataRequest > ZipSoundsDictionary::getResource( string const &
   uint32_t dataOffset = 0;
   for( int x = chain.size() - 1; x >= 0 ; x-- )
   {
-    vector< char > chunk;
-    char * nameBlock = chunks->getBlock( chain[ x ].articleOffset, chunk );
+    QByteArray chunk;
+    char const * nameBlock = chunks->getBlock( chain[ x ].articleOffset, chunk );
 
     uint16_t sz;
     memcpy( &sz, nameBlock, sizeof( uint16_t ) );